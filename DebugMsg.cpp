@@ -24,6 +24,35 @@ void db_setLevel(uint8_t lv) {
   
 }
 
+struct DbStageStats db_stageStats[DB_STAGE_COUNT];
+uint32_t db_stageResetMs;
+
+void db_stageAdd(uint8_t stage, uint32_t startCycles, uint32_t bytes) {
+  struct DbStageStats *st = &db_stageStats[stage];
+  st->cycles += ESP.getCycleCount() - startCycles;
+  st->packets++;
+  st->bytes += bytes;
+}
+
+void db_stageReset() {
+  memset(db_stageStats, 0, sizeof(db_stageStats));
+  db_stageResetMs = millis();
+}
+
+const char *db_stageName(uint8_t stage) {
+  switch (stage) {
+    case DB_STAGE_GRE_RX: return "gre_rx";
+    case DB_STAGE_GRE_TX: return "gre_tx";
+    case DB_STAGE_PPP_RX: return "ppp_rx";
+    case DB_STAGE_PPP_TX: return "ppp_tx";
+    case DB_STAGE_MPPE_TX: return "mppe_tx";
+    case DB_STAGE_MPPE_RX: return "mppe_rx";
+    case DB_STAGE_DEFLATE_TX: return "deflate_tx";
+    case DB_STAGE_DEFLATE_RX: return "deflate_rx";
+  }
+  return "unknown";
+}
+
 #ifndef HEXDUMP_COLS
 #define HEXDUMP_COLS 16
 #endif
@@ -10,4 +10,31 @@ uint8_t db_getLevel();
 void db_setLevel(uint8_t lv);
 void db_printHex(uint8_t level, void *mem, unsigned int len);
 
+// Cost of each stage of the packet path, taken with the CPU cycle counter.
+// A stage includes the stages it calls (e.g. GRE RX answering with GRE TX).
+#define DB_STAGE_GRE_RX   0   // GreReceived(), parse, reorder and delivery
+#define DB_STAGE_GRE_TX   1   // _greSend(), GRE header and raw_sendto()
+#define DB_STAGE_PPP_RX   2   // pptpInterfaceTask(), IPv4 packet into lwIP
+#define DB_STAGE_PPP_TX   3   // PPTPC_interfaceOutput(), lwIP packet out
+#define DB_STAGE_MPPE_TX  4   // PPTPC_writeMppePbuf(), copy and encrypt
+#define DB_STAGE_MPPE_RX  5   // PPTPC_mppeInput(), decrypt in place
+#define DB_STAGE_DEFLATE_TX 6 // PPTPC_writeDeflatePbuf(), copy and compress
+#define DB_STAGE_DEFLATE_RX 7 // PPTPC_deflateInput(), inflate into a new pbuf
+#define DB_STAGE_COUNT    8
+
+struct DbStageStats {
+  uint32_t packets;
+  uint32_t bytes;
+  uint64_t cycles;
+};
+
+// Account one packet of 'bytes' to the stage that began at startCycles
+// (ESP.getCycleCount()).
+void db_stageAdd(uint8_t stage, uint32_t startCycles, uint32_t bytes);
+void db_stageReset();
+const char *db_stageName(uint8_t stage);
+
+extern struct DbStageStats db_stageStats[DB_STAGE_COUNT];
+extern uint32_t db_stageResetMs;   // millis() when the counters started
+
 #endif
@@ -5,6 +5,8 @@
 #include <SPIFFSEditor.h>
 #include "FS.h"
 #include "DeviceConfigWWW.h"
+#include "DebugMsg.h"
+#include "PPTP_Client.h"
 
 extern "C"
 {
@@ -46,6 +48,24 @@ void Web_bindDeviceStatus(struct DeviceStatus *deviceStatus) {
   pStatus->restart_timeout_sec = 0;
   strcpy(pStatus->wifi_mac, WiFi.macAddress().c_str());
   pStatus->free_heap = 0;
+  pStatus->vpn_rtt_us = 0;
+  pStatus->vpn_rtt_var_us = 0;
+  pStatus->vpn_ack_timeout_ms = 0;
+  pStatus->vpn_echo_rtt_us = 0;
+  pStatus->vpn_reconnects = 0;
+  pStatus->vpn_comp_tx_bytes = 0;
+  pStatus->vpn_comp_tx_wire = 0;
+  pStatus->vpn_comp_rx_bytes = 0;
+  pStatus->vpn_comp_rx_wire = 0;
+  pStatus->vpn_link_rtt_us = 0;
+  pStatus->vpn_link_dead = 0;
+  pStatus->vpn_mp_links = 0;
+  pStatus->vpn_mp_lost = 0;
+  pStatus->vpn_rx_drops = 0;
+  pStatus->vpn_rx_high_water = 0;
+  pStatus->vpn_connect_ms = 0;
+  pStatus->vpn_connect_phases = 0;
+  pStatus->vpn_connect_slowest = PPTPC_CT_PHASES;
   
 }
 
@@ -251,12 +271,134 @@ void web_device_status_handle(AsyncWebServerRequest *request) {
   result += "\"uptime_sec\":\"" + String(pStatus->uptime_sec) + "\",";
   result += "\"restart_timeout_sec\":\"" + String(pStatus->restart_timeout_sec) + "\",";
   result += "\"wifi_mac\":\"" + String(pStatus->wifi_mac) + "\",";
-  result += "\"free_heap\":\"" + String(pStatus->free_heap) + "\"";
+  result += "\"free_heap\":\"" + String(pStatus->free_heap) + "\",";
+  result += "\"vpn_rtt_us\":\"" + String(pStatus->vpn_rtt_us) + "\",";
+  result += "\"vpn_rtt_var_us\":\"" + String(pStatus->vpn_rtt_var_us) + "\",";
+  result += "\"vpn_ack_timeout_ms\":\"" + String(pStatus->vpn_ack_timeout_ms) + "\",";
+  result += "\"vpn_echo_rtt_us\":\"" + String(pStatus->vpn_echo_rtt_us) + "\",";
+  result += "\"vpn_reconnects\":\"" + String(pStatus->vpn_reconnects) + "\",";
+  result += "\"vpn_comp_tx_bytes\":\"" + String(pStatus->vpn_comp_tx_bytes) + "\",";
+  result += "\"vpn_comp_tx_wire\":\"" + String(pStatus->vpn_comp_tx_wire) + "\",";
+  result += "\"vpn_comp_rx_bytes\":\"" + String(pStatus->vpn_comp_rx_bytes) + "\",";
+  result += "\"vpn_comp_rx_wire\":\"" + String(pStatus->vpn_comp_rx_wire) + "\",";
+  result += "\"vpn_link_rtt_us\":\"" + String(pStatus->vpn_link_rtt_us) + "\",";
+  result += "\"vpn_link_dead\":\"" + String(pStatus->vpn_link_dead) + "\",";
+  result += "\"vpn_mp_links\":\"" + String(pStatus->vpn_mp_links) + "\",";
+  result += "\"vpn_mp_lost\":\"" + String(pStatus->vpn_mp_lost) + "\",";
+  result += "\"vpn_rx_drops\":\"" + String(pStatus->vpn_rx_drops) + "\",";
+  result += "\"vpn_rx_high_water\":\"" + String(pStatus->vpn_rx_high_water) + "\",";
+  result += "\"vpn_connect_ms\":\"" + String(pStatus->vpn_connect_ms) + "\",";
+  result += "\"vpn_connect_phases\":\"" + String(pStatus->vpn_connect_phases) + "\",";
+  result += "\"vpn_connect_phase_count\":\"" + String(PPTPC_CT_PHASES) + "\",";
+  result += "\"vpn_connect_slowest\":\"" + String(PPTPC_connectPhaseName(pStatus->vpn_connect_slowest)) + "\"";
   result +="}";
 
   request->send(200, "text/html", result);
 }
 
+// Per stage packet path cost since the last reset, /stage_stats?reset=1
+// starts a new measurement.
+void web_stage_stats_handle(AsyncWebServerRequest *request) {
+  String result = "";
+  uint32_t ms = millis() - db_stageResetMs;
+  uint32_t mhz = ESP.getCpuFreqMHz();
+
+  if (ms == 0) {
+    ms = 1;
+  }
+
+  result += "{";
+  result += "\"cpu_mhz\":\"" + String(mhz) + "\",";
+  result += "\"period_ms\":\"" + String(ms) + "\",";
+  result += "\"stages\":[";
+  for (int i = 0; i < DB_STAGE_COUNT; i++) {
+    struct DbStageStats *st = &db_stageStats[i];
+    uint32_t cyclesPerPacket = (st->packets > 0) ? (uint32_t)(st->cycles / st->packets) : 0;
+
+    if (i > 0) {
+      result += ",";
+    }
+    result += "{";
+    result += "\"name\":\"" + String(db_stageName(i)) + "\",";
+    result += "\"packets\":\"" + String(st->packets) + "\",";
+    result += "\"bytes\":\"" + String(st->bytes) + "\",";
+    result += "\"cycles_per_packet\":\"" + String(cyclesPerPacket) + "\",";
+    result += "\"us_per_packet\":\"" + String(cyclesPerPacket / mhz) + "\",";
+    result += "\"packets_per_sec\":\"" + String((uint32_t)((uint64_t)st->packets * 1000 / ms)) + "\",";
+    result += "\"bytes_per_sec\":\"" + String((uint32_t)((uint64_t)st->bytes * 1000 / ms)) + "\"";
+    result += "}";
+  }
+  result += "]}";
+
+  if (request->hasParam("reset")) {
+    db_stageReset();
+  }
+
+  request->send(200, "text/html", result);
+}
+
+// LCP Echo round trips over the tunnel since boot, in log2 buckets. 'below_ms'
+// is the upper bound of each bucket, 0 for the last open one.
+void web_link_echo_handle(AsyncWebServerRequest *request) {
+  const struct LcpEchoStats *st = PPTPC_getLcpEchoStats();
+  String result = "";
+
+  result += "{";
+  result += "\"requests\":\"" + String(st->requests) + "\",";
+  result += "\"replies\":\"" + String(st->replies) + "\",";
+  result += "\"dead_links\":\"" + String(st->deadLinks) + "\",";
+  result += "\"rtt_us\":\"" + String(st->rttUs) + "\",";
+  result += "\"srtt_us\":\"" + String(st->srttUs) + "\",";
+  result += "\"histogram\":[";
+  for (int i = 0; i < PPTPC_LCP_RTT_BUCKETS; i++) {
+    uint32_t below = (i < PPTPC_LCP_RTT_BUCKETS - 1) ? (1 << i) : 0;
+
+    if (i > 0) {
+      result += ",";
+    }
+    result += "{\"below_ms\":\"" + String(below) + "\",\"count\":\"" + String(st->rttHistogram[i]) + "\"}";
+  }
+  result += "]}";
+
+  request->send(200, "text/html", result);
+}
+
+// The last connects newest first, the time of each phase in us. A connect
+// that failed or is still running has fewer than all phases done.
+void web_connect_timing_handle(AsyncWebServerRequest *request) {
+  struct PptpConnectTiming timings[PPTPC_CT_HISTORY];
+  int n = PPTPC_getConnectTimings(timings, PPTPC_CT_HISTORY);
+  String result = "";
+
+  result += "{\"connects\":[";
+  for (int i = 0; i < n; i++) {
+    struct PptpConnectTiming *t = &timings[i];
+    uint32_t totalUs = 0;
+
+    if (i > 0) {
+      result += ",";
+    }
+    result += "{";
+    result += "\"attempt\":\"" + String(t->attempt) + "\",";
+    result += "\"start_ms\":\"" + String(t->startMs) + "\",";
+    result += "\"complete\":\"" + String(t->phases == PPTPC_CT_PHASES) + "\",";
+    result += "\"phases\":[";
+    for (int p = 0; p < t->phases; p++) {
+      totalUs += t->phaseUs[p];
+      if (p > 0) {
+        result += ",";
+      }
+      result += "{\"name\":\"" + String(PPTPC_connectPhaseName(p)) + "\",\"us\":\"" + String(t->phaseUs[p]) + "\"}";
+    }
+    result += "],";
+    result += "\"total_us\":\"" + String(totalUs) + "\"";
+    result += "}";
+  }
+  result += "]}";
+
+  request->send(200, "text/html", result);
+}
+
 const char* http_username = "admin";
 const char* http_password = "admin";
 void Web_init() {
@@ -275,6 +417,9 @@ void Web_init() {
   );
   server.on("/device_config", HTTP_GET, [](AsyncWebServerRequest *request){web_device_config_handle(request);});
   server.on("/device_status", HTTP_GET, [](AsyncWebServerRequest *request){web_device_status_handle(request);});
+  server.on("/stage_stats", HTTP_GET, [](AsyncWebServerRequest *request){web_stage_stats_handle(request);});
+  server.on("/link_echo", HTTP_GET, [](AsyncWebServerRequest *request){web_link_echo_handle(request);});
+  server.on("/connect_timing", HTTP_GET, [](AsyncWebServerRequest *request){web_connect_timing_handle(request);});
   
   server.addHandler(new SPIFFSEditor(http_username,http_password));
   server.on("/heap", HTTP_GET, [](AsyncWebServerRequest *request){
@@ -26,6 +26,30 @@ struct DeviceStatus {
   uint32_t restart_timeout_sec;
   char wifi_mac[18];
   uint32_t free_heap;
+  uint32_t vpn_rtt_us;
+  uint32_t vpn_rtt_var_us;
+  uint32_t vpn_ack_timeout_ms;
+  uint32_t vpn_echo_rtt_us;
+  uint32_t vpn_reconnects;
+  // Deflate, bytes before compression and on the wire
+  uint32_t vpn_comp_tx_bytes;
+  uint32_t vpn_comp_tx_wire;
+  uint32_t vpn_comp_rx_bytes;
+  uint32_t vpn_comp_rx_wire;
+  // LCP Echo over the tunnel
+  uint32_t vpn_link_rtt_us;
+  uint32_t vpn_link_dead;
+  // Multilink, calls in the bundle and fragments that never arrived
+  uint32_t vpn_mp_links;
+  uint32_t vpn_mp_lost;
+  // Packets from the tunnel dropped before lwIP, most waiting at once
+  uint32_t vpn_rx_drops;
+  uint32_t vpn_rx_high_water;
+  // Latest connect: time so far, phases done, the one that took longest
+  // (PPTPC_CT_PHASES while there is none)
+  uint32_t vpn_connect_ms;
+  uint32_t vpn_connect_phases;
+  uint32_t vpn_connect_slowest;
 };
 
 #define WEB_CONFIG_PORT   8555
@@ -3,32 +3,23 @@
 #include <ESP8266WiFi.h>
 
 #include "DebugMsg.h"
+#include "PacketView.h"
+
+static_assert(sizeof(struct GrePacket) == PvGre::size, "GrePacket layout");
+static_assert(sizeof(struct GreAckPacket) == PvGre::size + 4, "GreAckPacket layout");
 
-struct GreSeqPacket *_greHeader;
 char _servername[100];
-ip_addr_t _serverIP;
 int _serverport;
     
-    
-uint16_t _peerCallId;
-uint8_t _readBuffer[1500];
-int _readBufferLength;
-bool _readAvailable;
-
-uint32_t _ackNumber;
-uint32_t _lastAckNumber;
-    
 struct raw_pcb *_greControlBlock;
-
-uint16_t GRE_protocolType;
-uint8_t GRE_payloadLength;
-uint16_t GRE_callId;
-uint32_t GRE_sequenceNumber;
-int (*GRE_recvCallback)(uint8_t *, int);
+struct GreSession _greSessions[GRE_MAX_SESSIONS];
+// Sessions by (peer IP, local call ID), chained through hashNext
+struct GreSession *_greSessionHash[GRE_SESSION_HASH_SIZE];
+    
+struct GreSession *GRE_defaultSession;
+uint32_t GRE_unknownCallPackets;
 
 bool _greSetup();
-bool _pppLcpConfig();
-int _getPppLcpConfigOptions(uint8_t *buf, int bufsize);
 // LWIP callback run when a gre response is received (static wrapper)
 static uint8_t _greReceivedStatic(void *gre, raw_pcb *pcb, pbuf *packetBuffer, const ip_addr_t * addr);
 // LWIP callback run when a gre response is received
@@ -36,103 +27,519 @@ uint8_t GreReceived(pbuf * packetBuffer, const ip_addr_t * addr);
 
 
 void GRE_setProtocolType(uint16_t pro) {
-  GRE_protocolType = pro;
+  if (GRE_defaultSession != nullptr) {
+    GRE_defaultSession->protocolType = pro;
+  }
 }
 
-//void GRE_set
+void GRE_setRecvCallback(GreRecvCallback callback) {
+  if (GRE_defaultSession != nullptr) {
+    GRE_defaultSession->recvCallback = callback;
+  }
+}
 
-void _initVariable() {
-  GRE_sequenceNumber = 0; //0x12345678;
-  _ackNumber = 0xffffffff;
-  _lastAckNumber = 0xffffffff;
-  _readAvailable = false;
-  GRE_recvCallback = nullptr;
+void GRE_sessionSetPeerWindow(struct GreSession *s, uint16_t window) {
+  // Window of 0 means the peer did not advertise one
+  if (window == 0) {
+    window = GRE_DEFAULT_PEER_WINDOW;
+  }
+  s->peerWindow = window;
+  db_printf(DB_DEBUG, "GRE_sessionSetPeerWindow() Call %d peer window = %d\n", s->localCallId, s->peerWindow);
 }
 
-int GRE_write(uint8_t *data, int length) {
-  int packetSize = 0;
+void GRE_setPeerWindow(uint16_t window) {
+  if (GRE_defaultSession != nullptr) {
+    GRE_sessionSetPeerWindow(GRE_defaultSession, window);
+  }
+}
+
+void GRE_setAckDelay(uint32_t ms) {
+  if (GRE_defaultSession != nullptr) {
+    GRE_defaultSession->ackDelayMs = ms;
+  }
+}
+
+uint32_t GRE_getRttUs() {
+  return (GRE_defaultSession != nullptr) ? GRE_defaultSession->srttUs : 0;
+}
+
+uint32_t GRE_getRttVarUs() {
+  return (GRE_defaultSession != nullptr) ? GRE_defaultSession->rttVarUs : 0;
+}
+
+uint32_t GRE_getAckTimeoutMs() {
+  return (GRE_defaultSession != nullptr) ? GRE_defaultSession->ackTimeoutMs : 0;
+}
+
+// Feed one RTT sample into the estimator (RFC 6298 gains) and derive the
+// ack timeout from it, as RFC 2637 section 4.4 suggests.
+static void _greRttSample(struct GreSession *s, uint32_t rttUs) {
+  if (s->srttUs == 0) {
+    s->srttUs = rttUs;
+    s->rttVarUs = rttUs / 2;
+  } else {
+    uint32_t err = (s->srttUs > rttUs) ? s->srttUs - rttUs : rttUs - s->srttUs;
+    s->rttVarUs = s->rttVarUs - (s->rttVarUs >> 2) + (err >> 2);
+    s->srttUs = s->srttUs - (s->srttUs >> 3) + (rttUs >> 3);
+  }
+
+  s->ackTimeoutMs = (s->srttUs + 4 * s->rttVarUs) / 1000;
+  if (s->ackTimeoutMs < GRE_ACK_TIMEOUT_MIN_MS) s->ackTimeoutMs = GRE_ACK_TIMEOUT_MIN_MS;
+  if (s->ackTimeoutMs > GRE_WINDOW_STALL_MS) s->ackTimeoutMs = GRE_WINDOW_STALL_MS;
+}
+
+// Our ack delay must stay well below the time the peer waits for it
+static uint32_t _greAckDelay(struct GreSession *s) {
+  uint32_t ms = s->srttUs / 4000;
+  if (s->srttUs == 0 || ms >= s->ackDelayMs) {
+    return s->ackDelayMs;
+  }
+  return (ms > 0) ? ms : 1;
+}
+
+static int _greHash(const ip_addr_t *peer, uint16_t callId) {
+  uint32_t h = ip_addr_get_ip4_u32(peer) ^ callId;
+  h ^= h >> 16;
+  h ^= h >> 8;
+  return h & (GRE_SESSION_HASH_SIZE - 1);
+}
+
+static void _greWindowTimeout(void *arg);
+static void _greAckTimeout(void *arg);
+static void _greReorderTimeout(void *arg);
+
+static void _greSessionInit(struct GreSession *s) {
+  // The memset would unlink armed timers from under the SDK timer list
+  os_timer_disarm(&s->windowTimer);
+  os_timer_disarm(&s->ackTimer);
+  os_timer_disarm(&s->reorderTimer);
+  memset(s, 0, sizeof(struct GreSession));
+
+  s->sequenceNumber = 0; //0x12345678;
+  s->ackNumber = 0xffffffff;
+  s->lastAckNumber = 0xffffffff;
+
+  os_timer_setfn(&s->windowTimer, _greWindowTimeout, s);
+  s->peerWindow = GRE_DEFAULT_PEER_WINDOW;
+  s->peerAckNumber = s->sequenceNumber - 1;
+  s->peerAckMs = millis();
+
+  s->ackTimeoutMs = GRE_WINDOW_STALL_MS;
+
+  os_timer_setfn(&s->ackTimer, _greAckTimeout, s);
+  s->ackDelayMs = GRE_ACK_DELAY_MS;
+
+  os_timer_setfn(&s->reorderTimer, _greReorderTimeout, s);
+}
+
+// Stop the timers and drop every pbuf the session still holds. It may run
+// from a receive callback of the same session, the reorder and ack code
+// check inUse after each delivery and find nothing left to do.
+static void _greSessionRelease(struct GreSession *s) {
+  os_timer_disarm(&s->windowTimer);
+  os_timer_disarm(&s->ackTimer);
+  os_timer_disarm(&s->reorderTimer);
+  s->ackTimerArmed = false;
+  s->ackPending = 0;
+
+  while (s->txQueueCount > 0) {
+    pbuf_free(s->txQueue[s->txQueueHead]);
+    s->txQueueHead = (s->txQueueHead + 1) % GRE_TX_QUEUE_SIZE;
+    s->txQueueCount--;
+  }
+  s->txQueueHead = 0;
+  for (int i = 0; i < GRE_REORDER_SLOTS; i++) {
+    if (s->reorderSlot[i] != nullptr) {
+      pbuf_free(s->reorderSlot[i]);
+      s->reorderSlot[i] = nullptr;
+    }
+  }
+  s->reorderCount = 0;
+  if (s->readPbuf != nullptr) {
+    pbuf_free(s->readPbuf);
+    s->readPbuf = nullptr;
+  }
+}
+
+struct GreSession *GRE_find(const ip_addr_t *peer, uint16_t localCallId) {
+  struct GreSession *s = _greSessionHash[_greHash(peer, localCallId)];
+  while (s != nullptr) {
+    if (s->localCallId == localCallId && ip_addr_cmp(&s->peerIP, peer)) {
+      return s;
+    }
+    s = s->hashNext;
+  }
+  return nullptr;
+}
+
+struct GreSession *GRE_open(const ip_addr_t *peer, uint16_t localCallId, uint16_t peerCallId) {
+  struct GreSession *s = nullptr;
+
+  if (GRE_find(peer, localCallId) != nullptr) {
+    db_printf(DB_DEBUG, "GRE_open() Call %d already open\n", localCallId);
+    return nullptr;
+  }
+
+  for (int i = 0; i < GRE_MAX_SESSIONS; i++) {
+    if (_greSessions[i].inUse == false) {
+      s = &_greSessions[i];
+      break;
+    }
+  }
+  if (s == nullptr) {
+    db_printf(DB_DEBUG, "GRE_open() No free session\n");
+    return nullptr;
+  }
+
+  _greSessionInit(s);
+  s->inUse = true;
+  ip_addr_copy(s->peerIP, *peer);
+  s->localCallId = localCallId;
+  s->peerCallId = peerCallId;
+
+  int bucket = _greHash(peer, localCallId);
+  s->hashNext = _greSessionHash[bucket];
+  _greSessionHash[bucket] = s;
+
+  db_printf(DB_DEBUG, "GRE_open() Call %d/%d open\n", localCallId, peerCallId);
+  return s;
+}
+
+void GRE_close(struct GreSession *s) {
+  if (s == nullptr || s->inUse == false) {
+    return;
+  }
+
+  struct GreSession **link = &_greSessionHash[_greHash(&s->peerIP, s->localCallId)];
+  while (*link != nullptr) {
+    if (*link == s) {
+      *link = s->hashNext;
+      break;
+    }
+    link = &(*link)->hashNext;
+  }
+
+  _greSessionRelease(s);
+  s->inUse = false;
+  if (GRE_defaultSession == s) {
+    GRE_defaultSession = nullptr;
+  }
+  db_printf(DB_DEBUG, "GRE_close() Call %d closed\n", s->localCallId);
+}
+
+// Reserve 'size' bytes in front of the payload of p, keeping the headroom
+// lwIP still needs for the outer IPv4 and link headers (PBUF_IP) intact.
+// Fails for PBUF_REF/PBUF_ROM and for pbufs allocated without enough room.
+// Also fails when the header would not be word aligned: the GRE header is
+// written byte by byte, but lwIP puts the outer IPv4 header right in front
+// of it with word stores, which fault on unaligned addresses.
+static bool _greReserveHeader(struct pbuf *p, int size) {
+  if ((((uintptr_t)p->payload - size) & 3) != 0) {
+    return false;
+  }
+  if (pbuf_header(p, size + PBUF_IP) != 0) {
+    return false;
+  }
+  pbuf_header(p, -PBUF_IP);
+  return true;
+}
+
+// An ack went out, standalone or piggybacked on data
+static void _greAckSent(struct GreSession *s) {
+  s->lastAckNumber = s->ackNumber;
+  s->ackPending = 0;
+  if (s->ackTimerArmed == true) {
+    os_timer_disarm(&s->ackTimer);
+    s->ackTimerArmed = false;
+  }
+}
+
+static void _greAckTimeout(void *arg) {
+  struct GreSession *s = (struct GreSession *)arg;
+  s->ackTimerArmed = false;
+  if (s->inUse == false) {
+    return;
+  }
+  GRE_sessionWriteAck(s);
+}
+
+// Acks wait up to ackDelayMs for outgoing data to ride on. Only a timer
+// expiry, or too many unacknowledged packets, sends a standalone ack.
+static void _greScheduleAck(struct GreSession *s) {
+  s->ackPending++;
+  if (s->ackDelayMs == 0 || s->ackPending >= GRE_ACK_MAX_PENDING) {
+    GRE_sessionWriteAck(s);
+    return;
+  }
+
+  if (s->ackTimerArmed == false) {
+    os_timer_arm(&s->ackTimer, _greAckDelay(s), false);
+    s->ackTimerArmed = true;
+  }
+}
+
+// Number of sent packets the peer has not acknowledged yet
+static uint32_t _greInFlight(struct GreSession *s) {
+  return s->sequenceNumber - 1 - s->peerAckNumber;
+}
+
+static bool _greWindowOpen(struct GreSession *s) {
+  if (_greInFlight(s) < s->peerWindow) {
+    return true;
+  }
+
+  // A peer that stopped acknowledging must not stall the tunnel for ever,
+  // assume the acks were lost and start over with an empty window.
+  if (millis() - s->peerAckMs > s->ackTimeoutMs) {
+    db_printf(DB_DEBUG, "_greWindowOpen() No ack for %d ms, reopen window\n", s->ackTimeoutMs);
+    s->peerAckNumber = s->sequenceNumber - 1;
+    s->peerAckMs = millis();
+    s->stats.txWindowStalls++;
+    return true;
+  }
+
+  return false;
+}
+
+static int _greSend(struct GreSession *s, struct pbuf *p, const uint8_t *prefix, int prefixLength) {
   int greSize;
+  int headerSize;
+  int length;
   bool actField = false;
   uint16_t flag = 0;
-  uint32_t *pSeqNumber;
-  uint32_t *pAckNumber;
-  uint8_t *pPayload;
+  uint8_t *field;
+  uint8_t *header;
+  struct pbuf *headerBuffer = nullptr;
+  uint32_t cycles = ESP.getCycleCount();
+
+  db_printf(DB_DEBUG, "_greSend() Begin\n");
 
-  db_printf(DB_DEBUG, "GRE_write() Begin\n");
-  
   flag = 0x3001;
-  if (_ackNumber != _lastAckNumber) {
+  if (s->ackNumber != s->lastAckNumber) {
     actField = true;
     flag = 0x3081;
   }
-  greSize = sizeof(struct GrePacket);
+  greSize = PvGre::size;
   greSize += 4;  //Write Packet need Sequence number field
   if (actField) greSize += 4; // Need for act number field
-    
-  packetSize = greSize + length;
-  db_printf(DB_DEBUG, "GRE_write() Length = %d\n", packetSize);
 
-  // Allocate packet buffer structure. Buffer memory is allocated as one 
-  // large chunk. This includes protocol headers as well.
-  struct pbuf * packetBuffer = pbuf_alloc( PBUF_IP, packetSize, PBUF_RAM);
-  if(packetBuffer == nullptr) {
-    db_printf(DB_DEBUG, "GRE_write() pbuf alloc fail\n");
-    return -1;
-  }
-  
-  // Check if packet buffer correctly created
-  if((packetBuffer->len != packetBuffer->tot_len) ||
-    (packetBuffer->next != nullptr)) {
-    
-    // Free packet buffer memory and exit
-    db_printf(DB_DEBUG, "GRE_write() pbuf alloc not valid\n");
-    pbuf_free(packetBuffer);
-    return  -2;
+  headerSize = greSize + prefixLength;
+  length = prefixLength + p->tot_len;
+  db_printf(DB_DEBUG, "_greSend() Length = %d\n", headerSize + p->tot_len);
+
+  // Build the GRE header (and prefix) in the headroom of p. Only when there
+  // is not enough of it, chain a small header pbuf in front instead; the
+  // payload itself is never copied.
+  if (_greReserveHeader(p, headerSize) == true) {
+    header = (uint8_t*)p->payload;
+  } else {
+    headerBuffer = pbuf_alloc(PBUF_IP, headerSize, PBUF_RAM);
+    if (headerBuffer == nullptr) {
+      db_printf(DB_DEBUG, "_greSend() pbuf alloc fail\n");
+      return -1;
+    }
+    pbuf_chain(headerBuffer, p);
+    header = (uint8_t*)headerBuffer->payload;
   }
 
-  struct GrePacket *gre = (struct GrePacket *)packetBuffer->payload;
-  gre->flagsAndVersion = htons(flag);
-  gre->protocolType = htons(GRE_protocolType);
-  gre->payloadLength = htons(length);
-  gre->callId = htons(GRE_callId);
-  
-  pSeqNumber = (uint32_t *)packetBuffer->payload;
-  pSeqNumber += sizeof(struct GrePacket)/4;
-  *pSeqNumber = htonl(GRE_sequenceNumber++);
-  pAckNumber = pSeqNumber;
+  // The header lands wherever the headroom ends, written byte by byte
+  PV_set<PvGre::flags>(header, flag);
+  PV_set<PvGre::protocol>(header, s->protocolType);
+  PV_set<PvGre::payloadLength>(header, length);
+  PV_set<PvGre::callId>(header, s->peerCallId);
+
+  field = header + PvGre::size;
+  s->sendTime[s->sequenceNumber % GRE_RTT_RING].seq = s->sequenceNumber;
+  s->sendTime[s->sequenceNumber % GRE_RTT_RING].us = micros();
+  PV_set<PvBe32>(field, s->sequenceNumber++);
+  field += 4;
   if (actField == true) {
-    pAckNumber += 1;
-    *pAckNumber = htonl(_ackNumber);
-    _lastAckNumber = _ackNumber;
+    PV_set<PvBe32>(field, s->ackNumber);
+    field += 4;
+    _greAckSent(s);
+    s->stats.txAcksPiggybacked++;
+  }
+
+  if (prefixLength > 0) {
+    memcpy(field, prefix, prefixLength);
   }
 
-  pPayload = (uint8_t*)(pAckNumber + 1);
-  memcpy(pPayload, data, length);  
-  
   // Finally, send the packet and register timestamp
-  raw_sendto(_greControlBlock, packetBuffer, &_serverIP);
-  
+  if (headerBuffer != nullptr) {
+    raw_sendto(_greControlBlock, headerBuffer, &s->peerIP);
+    // Also drops the reference pbuf_chain() took on p
+    pbuf_free(headerBuffer);
+  } else {
+    raw_sendto(_greControlBlock, p, &s->peerIP);
+    // Give the headroom back, p still belongs to the caller
+    pbuf_header(p, -headerSize);
+  }
+
+  s->stats.txPackets++;
+  db_stageAdd(DB_STAGE_GRE_TX, cycles, length);
+  db_printf(DB_DEBUG, "_greSend() Success\n");
+  return length;
+}
+
+// Send queued packets for as long as the peer window allows
+static void _greFlushQueue(struct GreSession *s) {
+  while (s->txQueueCount > 0 && _greWindowOpen(s) == true) {
+    struct pbuf *q = s->txQueue[s->txQueueHead];
+    s->txQueueHead = (s->txQueueHead + 1) % GRE_TX_QUEUE_SIZE;
+    s->txQueueCount--;
+    _greSend(s, q, nullptr, 0);
+    pbuf_free(q);
+  }
+
+  if (s->txQueueCount > 0) {
+    os_timer_arm(&s->windowTimer, s->ackTimeoutMs, false);
+  } else {
+    os_timer_disarm(&s->windowTimer);
+  }
+}
+
+static void _greWindowTimeout(void *arg) {
+  struct GreSession *s = (struct GreSession *)arg;
+  if (s->inUse == true) {
+    _greFlushQueue(s);
+  }
+}
+
+// Hold a packet until the peer window opens. The caller keeps ownership of
+// p (lwIP may still retransmit from it), so the frame is copied together
+// with its prefix; this only happens while the window is full.
+static int _greEnqueue(struct GreSession *s, struct pbuf *p, const uint8_t *prefix, int prefixLength) {
+  struct pbuf *q;
+
+  if (s->txQueueCount >= GRE_TX_QUEUE_SIZE) {
+    db_printf(DB_DEBUG, "_greEnqueue() Queue full, drop\n");
+    s->stats.txDropped++;
+    return -1;
+  }
+
+  q = pbuf_alloc(PBUF_TRANSPORT, prefixLength + p->tot_len, PBUF_RAM);
+  if (q == nullptr) {
+    db_printf(DB_DEBUG, "_greEnqueue() pbuf alloc fail\n");
+    s->stats.txDropped++;
+    return -1;
+  }
+
+  if (prefixLength > 0) {
+    memcpy(q->payload, prefix, prefixLength);
+  }
+  pbuf_copy_partial(p, (uint8_t*)q->payload + prefixLength, p->tot_len, 0);
+
+  s->txQueue[(s->txQueueHead + s->txQueueCount) % GRE_TX_QUEUE_SIZE] = q;
+  s->txQueueCount++;
+  s->stats.txQueued++;
+  if (s->txQueueCount == 1) {
+    os_timer_arm(&s->windowTimer, s->ackTimeoutMs, false);
+  }
+  return 0;
+}
+
+int GRE_sessionWritePbuf(struct GreSession *s, struct pbuf *p, const uint8_t *prefix, int prefixLength) {
+  // Keep packet order: nothing overtakes what is already queued
+  if (s->txQueueCount > 0 || _greWindowOpen(s) == false) {
+    db_printf(DB_DEBUG, "GRE_sessionWritePbuf() Window full (%d in flight), queue\n", _greInFlight(s));
+    return _greEnqueue(s, p, prefix, prefixLength);
+  }
+
+  return _greSend(s, p, prefix, prefixLength);
+}
+
+int GRE_writePbuf(struct pbuf *p, const uint8_t *prefix, int prefixLength) {
+  if (GRE_defaultSession == nullptr) {
+    return -1;
+  }
+  return GRE_sessionWritePbuf(GRE_defaultSession, p, prefix, prefixLength);
+}
+
+int GRE_sessionWritev(struct GreSession *s, const struct GreIovec *iov, int count) {
+  struct pbuf *chain = nullptr;
+  int ret;
+
+  db_printf(DB_DEBUG, "GRE_sessionWritev() Begin %d segments\n", count);
+
+  // Wrap every segment in a PBUF_REF pbuf, nothing is copied. The GRE
+  // header is built once in front of the chain by GRE_sessionWritePbuf().
+  for (int i = 0; i < count; i++) {
+    if (iov[i].length <= 0) {
+      continue;
+    }
+
+    struct pbuf *seg = pbuf_alloc(PBUF_RAW, iov[i].length, PBUF_REF);
+    if (seg == nullptr) {
+      db_printf(DB_DEBUG, "GRE_sessionWritev() pbuf alloc fail\n");
+      if (chain != nullptr) {
+        pbuf_free(chain);
+      }
+      return -1;
+    }
+    seg->payload = (void*)iov[i].data;
+
+    if (chain == nullptr) {
+      chain = seg;
+    } else {
+      pbuf_cat(chain, seg);
+    }
+  }
+
+  if (chain == nullptr) {
+    return 0;
+  }
+
+  ret = GRE_sessionWritePbuf(s, chain, nullptr, 0);
+  pbuf_free(chain);
+
+  db_printf(DB_DEBUG, "GRE_sessionWritev() End\n");
+  return ret;
+}
+
+int GRE_writev(const struct GreIovec *iov, int count) {
+  if (GRE_defaultSession == nullptr) {
+    return -1;
+  }
+  return GRE_sessionWritev(GRE_defaultSession, iov, count);
+}
+
+int GRE_sessionWrite(struct GreSession *s, uint8_t *data, int length) {
+
+  db_printf(DB_DEBUG, "GRE_sessionWrite() Begin\n");
+
+  // PBUF_TRANSPORT leaves room for the GRE header in front of the data,
+  // so GRE_sessionWritePbuf() does not need a second allocation.
+  struct pbuf * packetBuffer = pbuf_alloc( PBUF_TRANSPORT, length, PBUF_RAM);
+  if(packetBuffer == nullptr) {
+    db_printf(DB_DEBUG, "GRE_sessionWrite() pbuf alloc fail\n");
+    return -1;
+  }
+
+  pbuf_take(packetBuffer, data, length);
+  int ret = GRE_sessionWritePbuf(s, packetBuffer, nullptr, 0);
+
   // Free packet buffer memory
   pbuf_free(packetBuffer);
 
-  db_printf(DB_DEBUG, "GRE_write() Success\n");
-  return length;
+  db_printf(DB_DEBUG, "GRE_sessionWrite() End\n");
+  return ret;
 }
 
-int GRE_writeAck() {
-  int packetSize = 0;
-  int greSize;
-  bool actField = false;
+int GRE_write(uint8_t *data, int length) {
+  if (GRE_defaultSession == nullptr) {
+    return -1;
+  }
+  return GRE_sessionWrite(GRE_defaultSession, data, length);
+}
+
+int GRE_sessionWriteAck(struct GreSession *s) {
   uint16_t flag = 0;
-  uint32_t *pSeqNumber;
-  uint32_t *pAckNumber;
-  uint8_t *pPayload;
-  struct GreAckPacket *gre;
+  uint8_t *gre;
 
-  db_printf(DB_DEBUG, "GRE_writeAck() Begin\n");
+  db_printf(DB_DEBUG, "GRE_sessionWriteAck() Begin\n");
   
   flag = 0x2081;
-  if (_ackNumber == _lastAckNumber) {
+  if (s->ackNumber == s->lastAckNumber) {
     return 0;
   }
 
@@ -140,7 +547,7 @@ int GRE_writeAck() {
   // large chunk. This includes protocol headers as well.
   struct pbuf * packetBuffer = pbuf_alloc( PBUF_IP, 12, PBUF_RAM);
   if(packetBuffer == nullptr) {
-    db_printf(DB_DEBUG, "GRE_writeAck() pbuf alloc fail\n");
+    db_printf(DB_DEBUG, "GRE_sessionWriteAck() pbuf alloc fail\n");
     return -1;
   }
   
@@ -149,46 +556,54 @@ int GRE_writeAck() {
     (packetBuffer->next != nullptr)) {
     
     // Free packet buffer memory and exit
-    db_printf(DB_DEBUG, "GRE_writeAck() pbuf alloc not valid\n");
+    db_printf(DB_DEBUG, "GRE_sessionWriteAck() pbuf alloc not valid\n");
     pbuf_free(packetBuffer);
     return  -2;
   }
 
-  gre = (struct GreAckPacket *)packetBuffer->payload;
-  gre->flagsAndVersion = htons(flag);
-  gre->protocolType = htons(GRE_protocolType);
-  gre->payloadLength = htons(0);
-  gre->callId = htons(GRE_callId);
-  gre->acknowledgmentNumber = htonl(_ackNumber);
+  gre = (uint8_t *)packetBuffer->payload;
+  PV_set<PvGre::flags>(gre, flag);
+  PV_set<PvGre::protocol>(gre, s->protocolType);
+  PV_set<PvGre::payloadLength>(gre, 0);
+  PV_set<PvGre::callId>(gre, s->peerCallId);
+  PV_set<PvBe32>(gre + PvGre::size, s->ackNumber);
 
-  _lastAckNumber = _ackNumber;
+  _greAckSent(s);
+  s->stats.txAcksStandalone++;
 
   // Finally, send the packet and register timestamp
-  raw_sendto(_greControlBlock, packetBuffer, &_serverIP);
+  raw_sendto(_greControlBlock, packetBuffer, &s->peerIP);
   
   // Free packet buffer memory
   pbuf_free(packetBuffer);
 
-  db_printf(DB_DEBUG, "GRE_writeAck() Success\n");
+  db_printf(DB_DEBUG, "GRE_sessionWriteAck() Success\n");
   return 12;
 }
 
+int GRE_writeAck() {
+  if (GRE_defaultSession == nullptr) {
+    return -1;
+  }
+  return GRE_sessionWriteAck(GRE_defaultSession);
+}
+
 int GRE_read(uint8_t *data, int length) {
-  if (_readAvailable == false) {
+  struct GreSession *s = GRE_defaultSession;
+  if (s == nullptr || s->readPbuf == nullptr) {
     return 0;
   }
 
-  memcpy(data, _readBuffer, _readBufferLength);
-  _readAvailable = false;
-  int ret = _readBufferLength;
-  _readBufferLength = 0;
+  // The only copy of the payload, made when somebody actually asks for it
+  int ret = pbuf_copy_partial(s->readPbuf, data, length, 0);
+  pbuf_free(s->readPbuf);
+  s->readPbuf = nullptr;
   return ret;
 }
 
-bool GRE_init(const char *servername, int port) {
+bool GRE_init(const char *servername, int port, uint16_t localCallId, uint16_t peerCallId) {
 
   db_printf(DB_DEBUG, "GRE_init() Begin\n");
-  _initVariable();
   
   strcpy(_servername, servername);
   _serverport = port;
@@ -199,14 +614,29 @@ bool GRE_init(const char *servername, int port) {
     db_printf(DB_DEBUG, "GRE_init() Resolve Server name fail\n");
     return false;
   }
-  _serverIP = ip;
+  ip_addr_t serverIP = ip;
+
+  return GRE_initAddr(&serverIP, localCallId, peerCallId);
+}
+
+bool GRE_initAddr(const ip_addr_t *server, uint16_t localCallId, uint16_t peerCallId) {
+
+  db_printf(DB_DEBUG, "GRE_initAddr() Begin\n");
+  // A new call replaces the one from before a reconnect
+  GRE_close(GRE_defaultSession);
 
   if (_greSetup() != true) {
-    db_printf(DB_DEBUG, "GRE_init() _greSetup Failed\n");
+    db_printf(DB_DEBUG, "GRE_initAddr() _greSetup Failed\n");
     return false;
   }
 
-  db_printf(DB_DEBUG, "GRE_init() Success\n");
+  GRE_defaultSession = GRE_open(server, localCallId, peerCallId);
+  if (GRE_defaultSession == nullptr) {
+    db_printf(DB_DEBUG, "GRE_initAddr() GRE_open Failed\n");
+    return false;
+  }
+
+  db_printf(DB_DEBUG, "GRE_initAddr() Success\n");
   return true;
 }
 
@@ -215,6 +645,11 @@ bool GRE_init(const char *servername, int port) {
 bool _greSetup() {
 
   db_printf(DB_DEBUG, "_greSetup() Begin\n");
+
+  // One PCB serves all sessions
+  if (_greControlBlock != nullptr) {
+    return true;
+  }
   
   // Create new GRE detection data
   _greControlBlock = raw_new(IP_PROTO_GRE);
@@ -235,6 +670,155 @@ bool _greSetup() {
   return true;
 }
 
+// Pass one PPP frame up to the callback, or keep it for GRE_read()
+static void _greDeliver(struct GreSession *s, struct pbuf *p) {
+  if (p->tot_len == 0) {
+    return;
+  }
+
+  if (s->recvCallback != nullptr) {
+
+      // The callback may keep its own reference to the pbuf (pbuf_ref)
+      int cbRet = (*s->recvCallback)(s, p);
+      if (cbRet == 1 && s->inUse == true) {
+        // Answer was built in place, send the same pbuf back
+        GRE_sessionWritePbuf(s, p, nullptr, 0);
+      }
+
+  } else {
+    db_printf(DB_DEBUG, "_greDeliver() recvCallback is nullptr\n");
+
+    // Hold the packet for GRE_read(), it is copied out only on demand
+    if (s->readPbuf != nullptr) {
+      pbuf_free(s->readPbuf);
+    }
+    pbuf_ref(p);
+    s->readPbuf = p;
+  }
+}
+
+// Deliver held packets up to sequence number 'last' in order. Numbers that
+// never arrived are given up as lost. 'last' is at most GRE_REORDER_SLOTS
+// ahead of ackNumber.
+static void _greReorderRelease(struct GreSession *s, uint32_t last) {
+  while ((int32_t)(last - s->ackNumber) > 0) {
+    uint32_t next = s->ackNumber + 1;
+    int slot = next % GRE_REORDER_SLOTS;
+
+    s->ackNumber = next;
+    if (s->reorderSlot[slot] != nullptr) {
+      struct pbuf *q = s->reorderSlot[slot];
+      s->reorderSlot[slot] = nullptr;
+      s->reorderCount--;
+      _greDeliver(s, q);
+      pbuf_free(q);
+      if (s->inUse == false) {
+        return;
+      }
+    } else {
+      s->stats.rxGaps++;
+    }
+  }
+}
+
+// Deliver held packets for as long as they follow on without a gap
+static void _greReorderContinue(struct GreSession *s) {
+  while (s->reorderCount > 0) {
+    int slot = (s->ackNumber + 1) % GRE_REORDER_SLOTS;
+    if (s->reorderSlot[slot] == nullptr) {
+      break;
+    }
+    _greReorderRelease(s, s->ackNumber + 1);
+    if (s->inUse == false) {
+      return;
+    }
+  }
+
+  // Whatever is still held waits behind a new gap, give it a fresh timeout
+  if (s->reorderCount > 0) {
+    os_timer_disarm(&s->reorderTimer);
+    os_timer_arm(&s->reorderTimer, GRE_REORDER_TIMEOUT_MS, false);
+  } else {
+    os_timer_disarm(&s->reorderTimer);
+  }
+}
+
+static void _greReorderTimeout(void *arg) {
+  struct GreSession *s = (struct GreSession *)arg;
+  if (s->inUse == false) {
+    return;
+  }
+  db_printf(DB_DEBUG, "_greReorderTimeout() Give up gap before %u\n", s->reorderHighest);
+  _greReorderRelease(s, s->reorderHighest);
+  if (s->inUse == true && s->ackNumber != s->lastAckNumber) {
+    _greScheduleAck(s);
+  }
+}
+
+static void _greReorderInput(struct GreSession *s, struct pbuf *p, uint32_t seq) {
+  int32_t diff;
+
+  if (s->rxStarted == false) {
+    s->rxStarted = true;
+    s->ackNumber = seq - 1;
+  }
+
+  // Serial number arithmetic (RFC 1982): negative means already delivered
+  diff = (int32_t)(seq - (s->ackNumber + 1));
+  if (diff < 0) {
+    db_printf(DB_DEBUG, "_greReorderInput() Duplicate or late %u\n", seq);
+    s->stats.rxDuplicates++;
+    return;
+  }
+
+  // Too far ahead to wait for the gap: give it up and catch up with seq
+  if (diff >= GRE_REORDER_SLOTS) {
+    if (s->reorderCount > 0) {
+      _greReorderRelease(s, s->reorderHighest);
+      if (s->inUse == false) {
+        return;
+      }
+    }
+    diff = (int32_t)(seq - (s->ackNumber + 1));
+    if (diff > 0) {
+      s->stats.rxGaps += diff;
+      s->ackNumber = seq - 1;
+    }
+    diff = 0;
+  }
+
+  if (diff == 0) {
+    if (s->reorderCount > 0) {
+      // Late packet filling a gap
+      s->stats.rxReordered++;
+    }
+    s->ackNumber = seq;
+    _greDeliver(s, p);
+    if (s->inUse == true && s->reorderCount > 0) {
+      _greReorderContinue(s);
+    }
+    return;
+  }
+
+  // Arrived ahead of a gap, hold it for a few ms
+  int slot = seq % GRE_REORDER_SLOTS;
+  if (s->reorderSlot[slot] != nullptr) {
+    db_printf(DB_DEBUG, "_greReorderInput() Duplicate %u\n", seq);
+    s->stats.rxDuplicates++;
+    return;
+  }
+
+  pbuf_ref(p);
+  s->reorderSlot[slot] = p;
+  if (s->reorderCount == 0 || (int32_t)(seq - s->reorderHighest) > 0) {
+    s->reorderHighest = seq;
+  }
+  s->reorderCount++;
+  if (s->reorderCount == 1) {
+    os_timer_arm(&s->reorderTimer, GRE_REORDER_TIMEOUT_MS, false);
+  }
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // LWIP callback run when a gre response is received (static wrapper)
 static uint8_t _greReceivedStatic(void *gre, raw_pcb *pcb, pbuf *packetBuffer, const ip_addr_t * addr) {
@@ -260,6 +844,7 @@ static uint8_t _greReceivedStatic(void *gre, raw_pcb *pcb, pbuf *packetBuffer, c
 //////////////////////////////////////////////////////////////////////////////
 // LWIP callback run when a gre response is received
 uint8_t GreReceived(pbuf * packetBuffer, const ip_addr_t * addr) {
+  uint32_t cycles = ESP.getCycleCount();
   db_printf(DB_DEBUG, "GreReceived() Begin\n");
   
   // Check parameters
@@ -271,9 +856,8 @@ uint8_t GreReceived(pbuf * packetBuffer, const ip_addr_t * addr) {
     return 0;
   }
   
-  // Save IPv4 header structure to read ttl value
-  struct ip_hdr * ip = (struct ip_hdr *)packetBuffer->payload;
-  if(ip == nullptr)
+  uint8_t *ip = (uint8_t *)packetBuffer->payload;
+  if(ip == nullptr || packetBuffer->len < PvIp4::size)
   {
     // Not free the packet, and return zero. The packet will be matched against
     // further PCBs and/or forwarded to other protocol layers.
@@ -283,7 +867,8 @@ uint8_t GreReceived(pbuf * packetBuffer, const ip_addr_t * addr) {
 
   // Move the ->payload pointer skipping the IPv4 header of the packet with 
   // pbuf_header function. If such function fails, it returns nonzero
-  if (pbuf_header(packetBuffer, -PBUF_IP_HLEN) != 0)
+  int ipHeaderSize = PV_ip4HeaderLength(ip);
+  if (pbuf_header(packetBuffer, -ipHeaderSize) != 0)
   {  
     // Not free the packet, and return zero. The packet will be matched against
     // further PCBs and/or forwarded to other protocol layers.
@@ -291,11 +876,11 @@ uint8_t GreReceived(pbuf * packetBuffer, const ip_addr_t * addr) {
     return 0;
   }
 
-  struct GrePacket *greHeader =   (struct GrePacket *)packetBuffer->payload;
-  if(greHeader == nullptr)
+  uint8_t *greHeader = (uint8_t *)packetBuffer->payload;
+  if(greHeader == nullptr || packetBuffer->len < PvGre::size)
   {
     // Restore original position of ->payload pointer
-    pbuf_header(packetBuffer, PBUF_IP_HLEN);
+    pbuf_header(packetBuffer, ipHeaderSize);
   
     // Not free the packet, and return zero. The packet will be matched against
     // further PCBs and/or forwarded to other protocol layers.
@@ -304,60 +889,100 @@ uint8_t GreReceived(pbuf * packetBuffer, const ip_addr_t * addr) {
   }
 
   db_printf(DB_DEBUG, "GreReceived() Process Header\n");
-  int greHeaderSize = sizeof(GrePacket);
-  bool seqField = false;
-  bool ackField = false;
-  uint16_t flag = ntohs(greHeader->flagsAndVersion);
+  int greHeaderSize = PvGre::size;
+  uint16_t flag = PV_get<PvGre::flags>(greHeader);
   int payloadSize = 0;
+  uint8_t *pack = greHeader;
 
-  payloadSize = ntohs(greHeader->payloadLength);
-  
-  pbuf_header(packetBuffer, -greHeaderSize);
+  payloadSize = PV_get<PvGre::payloadLength>(greHeader);
   
+  // Dispatch on (source address, call ID), the peer sends our call ID
+  struct GreSession *s = GRE_find(addr, PV_get<PvGre::callId>(greHeader));
+  if (s == nullptr) {
+    db_printf(DB_DEBUG, "GreReceived() Unknown call %d\n", PV_get<PvGre::callId>(greHeader));
+    GRE_unknownCallPackets++;
+    pbuf_free(packetBuffer);
+    return 1;
+  }
+
   // flag seq number present
   if ( flag & 0x1000) {
-    char * pack = (char *)packetBuffer->payload;
-    _ackNumber = (pack[0] << 24) | (pack[1] << 16) | (pack[2] << 8) | pack[3];
-    pbuf_header(packetBuffer, -4);
+    greHeaderSize += 4;
   }
 
   // flag ack number present
   if ( flag & 0x0080) {
-    pbuf_header(packetBuffer, -4);
+    greHeaderSize += 4;
   }
 
-  _readAvailable = false;
-  memcpy(_readBuffer, (uint8_t*)packetBuffer->payload, payloadSize);
-  _readBufferLength = payloadSize;
-  _readAvailable = true;
+  if (packetBuffer->len < greHeaderSize) {
+    pbuf_header(packetBuffer, ipHeaderSize);
+    db_printf(DB_DEBUG, "GreReceived() error 5\n");
+    return 0;
+  }
 
-  uint8_t *cbData = nullptr;
-  if (GRE_recvCallback != nullptr) {
+  uint32_t seq = 0;
+  pack += PvGre::size;
+  if ( flag & 0x1000) {
+    seq = PV_get<PvBe32>(pack);
+    pack += 4;
+  }
 
-      int cbRet = (*GRE_recvCallback)((uint8_t*)packetBuffer->payload, payloadSize);
-      if (cbRet == 1) {
-        GRE_write((uint8_t*)packetBuffer->payload, payloadSize);
+  if ( flag & 0x0080) {
+    uint32_t peerAck = PV_get<PvBe32>(pack);
+
+    // Only move forward, and never past what was actually sent
+    if ((int32_t)(peerAck - s->peerAckNumber) > 0 &&
+        (int32_t)(peerAck - (s->sequenceNumber - 1)) <= 0) {
+      struct GreSendTime *st = &s->sendTime[peerAck % GRE_RTT_RING];
+      if (st->seq == peerAck) {
+        _greRttSample(s, micros() - st->us);
       }
-      // Just send GRE Ack
-      if (cbRet == 2) {
-        GRE_writeAck();
+
+      s->peerAckNumber = peerAck;
+      s->peerAckMs = millis();
+      if (s->txQueueCount > 0) {
+        _greFlushQueue(s);
       }
+    }
+  }
 
-  } else {
-    db_printf(DB_DEBUG, "GreReceived() GRE_recvCallback is nullptr\n");
+  // From here on the pbuf holds exactly the PPP frame
+  pbuf_header(packetBuffer, -greHeaderSize);
+  if (packetBuffer->tot_len < payloadSize) {
+    db_printf(DB_DEBUG, "GreReceived() Truncated payload %d < %d\n", packetBuffer->tot_len, payloadSize);
+    pbuf_free(packetBuffer);
+    return 1;
+  }
+  if (packetBuffer->tot_len > payloadSize) {
+    pbuf_realloc(packetBuffer, payloadSize);
+  }
+
+  if ( flag & 0x1000) {
+    s->stats.rxPackets++;
+    _greReorderInput(s, packetBuffer, seq);
+  } else if (payloadSize > 0) {
+    _greDeliver(s, packetBuffer);
+  }
+
+  // Unless an answer above already carried it, the ack waits for data.
+  // The callback may have closed the session meanwhile.
+  if (s->inUse == true && s->ackNumber != s->lastAckNumber) {
+    _greScheduleAck(s);
   }
 
   // Eat the packet by calling pbuf_free() and returning non-zero.
   // The packet will not be passed to other raw PCBs or other protocol layers.
   pbuf_free(packetBuffer);
+  db_stageAdd(DB_STAGE_GRE_RX, cycles, payloadSize);
   db_printf(DB_DEBUG, "GreReceived() End\n");
   return 1;
 
 }
 
 int GRE_available() {
-  if (_readAvailable == false)
+  if (GRE_defaultSession == nullptr || GRE_defaultSession->readPbuf == nullptr)
     return 0;
     
-  return _readBufferLength;
+  return GRE_defaultSession->readPbuf->tot_len;
 }
@@ -23,18 +23,150 @@ struct GreAckPacket {
   uint32_t acknowledgmentNumber;
 };
 
-bool GRE_init(const char *servername, int port);
+// Peer receive window used until the call reply tells otherwise
+#define GRE_DEFAULT_PEER_WINDOW 64
+// Packets held back while the peer window is full
+#define GRE_TX_QUEUE_SIZE 8
+// Reopen a full window when the peer sent no ack for the ack timeout.
+// The timeout follows the measured RTT within these bounds.
+#define GRE_WINDOW_STALL_MS 1000
+#define GRE_ACK_TIMEOUT_MIN_MS 100
+// Send timestamps kept for RTT measurement (power of two)
+#define GRE_RTT_RING 16
+
+// Longest time an ack waits for outgoing data to piggyback on
+#define GRE_ACK_DELAY_MS 20
+// Send an ack right away after this many unacknowledged packets
+#define GRE_ACK_MAX_PENDING 16
+
+// Out of order packets held back, and for how long
+#define GRE_REORDER_SLOTS 8
+#define GRE_REORDER_TIMEOUT_MS 5
+
+struct GreStats {
+  uint32_t txPackets;
+  uint32_t txAcksPiggybacked;
+  uint32_t txAcksStandalone;
+  uint32_t txQueued;
+  uint32_t txDropped;
+  uint32_t txWindowStalls;
+  uint32_t rxPackets;
+  uint32_t rxDuplicates;      // already delivered, or given up on before
+  uint32_t rxReordered;       // arrived late and were put back in order
+  uint32_t rxGaps;            // sequence numbers that never arrived
+};
+
+// Concurrent calls, each with its own sequence numbers, window and timers
+#define GRE_MAX_SESSIONS 2
+// Buckets of the (peer IP, call ID) lookup table (power of two)
+#define GRE_SESSION_HASH_SIZE 8
+
+// One segment of a frame for GRE_writev()
+struct GreIovec {
+  const uint8_t *data;
+  int length;
+};
+
+struct GreSession;
+// Called with a pbuf trimmed to the PPP frame. Return 1 to send the (in place
+// modified) frame back, 0 or 2 otherwise. Every sequenced packet is
+// acknowledged by the GRE layer, piggybacked or after GRE_ACK_DELAY_MS.
+typedef int (*GreRecvCallback)(struct GreSession *session, struct pbuf *p);
+
+// Round trip time, from send time of a sequence number to its ack
+struct GreSendTime {
+  uint32_t seq;
+  uint32_t us;
+};
+
+// State of one GRE call (RFC 2637 section 4.1)
+struct GreSession {
+  bool inUse;
+  ip_addr_t peerIP;
+  uint16_t localCallId;       // carried by packets the peer sends us
+  uint16_t peerCallId;        // carried by packets we send
+  uint16_t protocolType;
+  GreRecvCallback recvCallback;
+  struct GreSession *hashNext;
+
+  // Last received payload, only kept for GRE_read() when no callback is set
+  struct pbuf *readPbuf;
+
+  uint32_t sequenceNumber;    // next one to send
+  uint32_t ackNumber;         // last sequence number delivered in order
+  uint32_t lastAckNumber;     // last one acknowledged to the peer
+
+  // Receive reordering, a packet with sequence number s waits in slot
+  // s % GRE_REORDER_SLOTS until the ones before it arrived.
+  struct pbuf *reorderSlot[GRE_REORDER_SLOTS];
+  uint32_t reorderHighest;
+  int reorderCount;
+  bool rxStarted;
+  os_timer_t reorderTimer;
+
+  // Transmit window (RFC 2637 section 4.2), in packets
+  uint16_t peerWindow;
+  uint32_t peerAckNumber;     // highest sequence number the peer acknowledged
+  uint32_t peerAckMs;         // millis() of the last window progress
+  struct pbuf *txQueue[GRE_TX_QUEUE_SIZE];
+  int txQueueHead;
+  int txQueueCount;
+  os_timer_t windowTimer;
+
+  struct GreSendTime sendTime[GRE_RTT_RING];
+  uint32_t srttUs;            // smoothed RTT, 0 until the first sample
+  uint32_t rttVarUs;
+  uint32_t ackTimeoutMs;
+
+  // Delayed acknowledgments
+  uint32_t ackDelayMs;
+  uint16_t ackPending;        // received packets not acknowledged yet
+  bool ackTimerArmed;
+  os_timer_t ackTimer;
+
+  struct GreStats stats;
+};
+
+// Sessions share one raw PCB. Inbound packets are dispatched by the source
+// address and the call ID in the GRE header, which is our localCallId.
+struct GreSession *GRE_open(const ip_addr_t *peer, uint16_t localCallId, uint16_t peerCallId);
+void GRE_close(struct GreSession *s);
+struct GreSession *GRE_find(const ip_addr_t *peer, uint16_t localCallId);
+
+int GRE_sessionWrite(struct GreSession *s, uint8_t *data, int length);
+int GRE_sessionWritePbuf(struct GreSession *s, struct pbuf *p, const uint8_t *prefix, int prefixLength);
+int GRE_sessionWritev(struct GreSession *s, const struct GreIovec *iov, int count);
+int GRE_sessionWriteAck(struct GreSession *s);
+void GRE_sessionSetPeerWindow(struct GreSession *s, uint16_t window);
+
+// The calls below work on the default session opened by GRE_init()
+bool GRE_init(const char *servername, int port, uint16_t localCallId, uint16_t peerCallId);
+// Same with the server address already resolved, safe from lwIP callbacks
+bool GRE_initAddr(const ip_addr_t *server, uint16_t localCallId, uint16_t peerCallId);
 int GRE_write(uint8_t *data, int length);
+// Send the pbuf chain p with 'prefix' placed between the GRE header and the
+// payload. Chains (e.g. lwIP TCP header and data pbufs) go out as they are.
+// p is left unmodified and still owned by the caller.
+// Returns 0 when the peer window is full and the packet was queued, -1 when
+// it could not be sent or queued.
+int GRE_writePbuf(struct pbuf *p, const uint8_t *prefix, int prefixLength);
+// Send the segments as one GRE packet without flattening them first. The
+// segments need to stay valid only until the call returns.
+int GRE_writev(const struct GreIovec *iov, int count);
 int GRE_writeAck();
 int GRE_read(uint8_t *data, int length);
 int GRE_available();
 void GRE_setProtocolType(uint16_t pro);
+void GRE_setRecvCallback(GreRecvCallback callback);
+void GRE_setPeerWindow(uint16_t window);
+void GRE_setAckDelay(uint32_t ms);  // 0 acks every packet right away
+uint32_t GRE_getRttUs();
+uint32_t GRE_getRttVarUs();
+uint32_t GRE_getAckTimeoutMs();
 
-extern uint16_t GRE_protocolType;
-extern uint8_t GRE_payloadLength;
-extern uint16_t GRE_callId;
-extern uint32_t GRE_sequenceNumber;
-extern int (*GRE_recvCallback)(uint8_t *, int);
+extern struct GreSession *GRE_defaultSession;
+// Packets no session matched
+extern uint32_t GRE_unknownCallPackets;
 
 
 
@@ -75,10 +75,20 @@ int ChallengeHash( uint8_t PeerChallenge[16], uint8_t AuthenticatorChallenge[16]
 
 
 
+// The hash of the last password, a reconnect authenticates again without
+// running MD4 over it
+static char _ntHashPassword[256];
+static uint8_t _ntHashValue[16];
+static bool _ntHashValid = false;
+
 int NtPasswordHash(char *PasswordASCII, uint8_t PasswordHash[16] ) {
   char passUnicode[256 * 2];
   int i;
 
+  if (_ntHashValid && strcmp(_ntHashPassword, PasswordASCII) == 0) {
+    memcpy(PasswordHash, _ntHashValue, 16);
+    return 1;
+  }
   
   db_printf(DB_DEBUG, "Password ASCII\n");
   db_printHex(DB_DEBUG, PasswordASCII, strlen(PasswordASCII));
@@ -99,6 +109,10 @@ int NtPasswordHash(char *PasswordASCII, uint8_t PasswordHash[16] ) {
        */
     
   auth_md4Sum(PasswordHash, (const unsigned char *)passUnicode, strlen(PasswordASCII) * 2 );
+
+  strncpy(_ntHashPassword, PasswordASCII, sizeof(_ntHashPassword) - 1);
+  memcpy(_ntHashValue, PasswordHash, 16);
+  _ntHashValid = true;
     
   db_printf(DB_DEBUG, "NtPasswordHash: ");
   db_printHex(DB_DEBUG, PasswordHash, 16);
@@ -178,6 +192,7 @@ int DesKey56BitTo64Bit(uint8_t key64[8], uint8_t key56[7]) {
     
     
   }
+  return 1;
 }
 
 
@@ -479,3 +494,78 @@ bool MSCHAP_CheckAuthenticatorResponse(MSCHAP_CTX *ctx, uint8_t ReceivedResponse
   db_printf(DB_DEBUG, "MSCHAP_CheckAuthenticatorResponse() Result = %s\n", ret==0?"false":"true");
   return ret;
 }
+
+//////////////////////////////////////////////////////////////////////////////////
+// MPPE keys (RFC 3079 section 3)
+
+static const uint8_t _shsPad1[40] = { 0 };
+static const uint8_t _shsPad2[40] = {
+  0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2,
+  0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2,
+  0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2,
+  0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2
+};
+
+static void GetMasterKey(uint8_t PasswordHashHash[16], uint8_t NtResponse[24], uint8_t MasterKey[16]) {
+  static const char Magic1[] = "This is the MPPE Master Key";
+  uint8_t Digest[20];
+  SHA1_CTX ctx;
+
+  sha1_init(&ctx);
+  sha1_update(&ctx, PasswordHashHash, 16);
+  sha1_update(&ctx, NtResponse, 24);
+  sha1_update(&ctx, (const BYTE*)Magic1, sizeof(Magic1) - 1);
+  sha1_final(&ctx, Digest);
+  memcpy(MasterKey, Digest, 16);
+}
+
+static void GetAsymetricStartKey(uint8_t MasterKey[16], uint8_t SessionKey[16], bool IsSend) {
+  static const char Magic2[] = "On the client side, this is the send key; on the server side, it is the receive key.";
+  static const char Magic3[] = "On the client side, this is the receive key; on the server side, it is the send key.";
+  const char *s = IsSend ? Magic2 : Magic3;
+  uint8_t Digest[20];
+  SHA1_CTX ctx;
+
+  sha1_init(&ctx);
+  sha1_update(&ctx, MasterKey, 16);
+  sha1_update(&ctx, _shsPad1, 40);
+  sha1_update(&ctx, (const BYTE*)s, sizeof(Magic2) - 1);
+  sha1_update(&ctx, _shsPad2, 40);
+  sha1_final(&ctx, Digest);
+  memcpy(SessionKey, Digest, 16);
+}
+
+// 128-bit start keys of both directions, seen from the client. Only valid
+// after MSCHAP_GetResponse().
+bool MSCHAP_GetMppeKeys(MSCHAP_CTX *ctx, uint8_t sendKey[16], uint8_t recvKey[16]) {
+  uint8_t PasswordHash[16];
+  uint8_t PasswordHashHash[16];
+
+  NtPasswordHash(ctx->password, PasswordHash);
+  HashNtPasswordHash(PasswordHash, PasswordHashHash);
+
+  if (ctx->version == 2) {
+    uint8_t MasterKey[16];
+
+    GetMasterKey(PasswordHashHash, ctx->NtResponse, MasterKey);
+    GetAsymetricStartKey(MasterKey, sendKey, true);
+    GetAsymetricStartKey(MasterKey, recvKey, false);
+    return true;
+  } else if (ctx->version == 1) {
+    // RFC 3079 section 2.3, the same key in both directions
+    uint8_t Digest[20];
+    SHA1_CTX sha;
+
+    sha1_init(&sha);
+    sha1_update(&sha, PasswordHashHash, 16);
+    sha1_update(&sha, PasswordHashHash, 16);
+    sha1_update(&sha, ctx->AuthenticatorChallenge, 8);
+    sha1_final(&sha, Digest);
+    memcpy(sendKey, Digest, 16);
+    memcpy(recvKey, Digest, 16);
+    return true;
+  }
+
+  db_printf(DB_DEBUG, "MSCHAP_GetMppeKeys() Unknown CHAP Version %d\n", ctx->version);
+  return false;
+}
@@ -15,6 +15,7 @@ typedef struct {
 void MSCHAP_Init(MSCHAP_CTX *ctx, uint8_t mschapVersion, uint8_t AuthenticatorChallenge[16]);
 bool MSCHAP_GetResponse(MSCHAP_CTX *ctx, char *username, char *password, uint8_t response[49]);
 bool MSCHAP_CheckAuthenticatorResponse(MSCHAP_CTX *ctx, uint8_t ReceivedResponse[42]);
+bool MSCHAP_GetMppeKeys(MSCHAP_CTX *ctx, uint8_t sendKey[16], uint8_t recvKey[16]);
 void MSCHAP_Test();
 
 #endif
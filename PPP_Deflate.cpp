@@ -0,0 +1,571 @@
+#include "Arduino.h"
+#include "PPP_Deflate.h"
+#include "PacketView.h"
+
+// Length and distance codes (RFC 1951 section 3.2.5)
+static const uint16_t _lengthBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t _lengthExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t _distBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t _distExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+#define PPPDEF_MIN_MATCH  3
+#define PPPDEF_MAX_MATCH  258
+
+//////////////////////////////////////////////////////////////////////////////////
+// Compressor: LZ77 over the history with one hash entry per 3 byte prefix,
+// coded with the fixed Huffman codes. No tables to build or send, which
+// suits short frames.
+
+struct PppDefOut {
+  uint8_t *out;
+  int size;
+  int pos;
+  uint32_t bitBuf;
+  int bitCount;
+  bool full;
+};
+
+static void _pppdefPutBits(struct PppDefOut *o, uint32_t value, int n) {
+  o->bitBuf |= value << o->bitCount;
+  o->bitCount += n;
+  while (o->bitCount >= 8) {
+    if (o->pos < o->size) {
+      o->out[o->pos++] = o->bitBuf & 0xff;
+    } else {
+      o->full = true;
+    }
+    o->bitBuf >>= 8;
+    o->bitCount -= 8;
+  }
+}
+
+// Huffman codes go out most significant bit first
+static void _pppdefPutCode(struct PppDefOut *o, uint32_t code, int n) {
+  uint32_t reversed = 0;
+
+  for (int i = 0; i < n; i++) {
+    reversed = (reversed << 1) | (code & 1);
+    code >>= 1;
+  }
+  _pppdefPutBits(o, reversed, n);
+}
+
+static void _pppdefPutSymbol(struct PppDefOut *o, int symbol) {
+  if (symbol < 144) {
+    _pppdefPutCode(o, 0x30 + symbol, 8);
+  } else if (symbol < 256) {
+    _pppdefPutCode(o, 0x190 + symbol - 144, 9);
+  } else if (symbol < 280) {
+    _pppdefPutCode(o, symbol - 256, 7);
+  } else {
+    _pppdefPutCode(o, 0xc0 + symbol - 280, 8);
+  }
+}
+
+static void _pppdefPutMatch(struct PppDefOut *o, int length, int distance) {
+  int code = 28;
+
+  while (_lengthBase[code] > length) {
+    code--;
+  }
+  _pppdefPutSymbol(o, 257 + code);
+  _pppdefPutBits(o, length - _lengthBase[code], _lengthExtra[code]);
+
+  code = 29;
+  while (_distBase[code] > distance) {
+    code--;
+  }
+  _pppdefPutCode(o, code, 5);
+  _pppdefPutBits(o, distance - _distBase[code], _distExtra[code]);
+}
+
+static uint32_t _pppdefHash(const uint8_t *p) {
+  return ((p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16)) * 2654435761u) >> (32 - PPPDEF_HASH_BITS);
+}
+
+void PPPDEF_initCompressor(struct PppDeflate *c, uint8_t windowBits) {
+  c->maxDistance = windowBits < PPPDEF_WINDOW_BITS ? (1 << windowBits) : PPPDEF_WINDOW;
+  PPPDEF_resetCompressor(c);
+}
+
+void PPPDEF_resetCompressor(struct PppDeflate *c) {
+  memset(c->head, 0, sizeof(c->head));
+  c->historyLength = 0;
+  c->frameLength = 0;
+  c->seq = 0;
+}
+
+uint8_t *PPPDEF_frame(struct PppDeflate *c) {
+  int total = c->historyLength + c->frameLength;
+  int keep = total < PPPDEF_WINDOW ? total : PPPDEF_WINDOW;
+  int shift = total - keep;
+
+  // Slide the last frame into the history, positions move along
+  if (shift > 0) {
+    memmove(c->buf, c->buf + shift, keep);
+    for (int i = 0; i < (1 << PPPDEF_HASH_BITS); i++) {
+      c->head[i] = c->head[i] > shift ? c->head[i] - shift : 0;
+    }
+  }
+  c->historyLength = keep;
+  c->frameLength = 0;
+  return c->buf + keep;
+}
+
+int PPPDEF_compress(struct PppDeflate *c, int length, uint8_t *out, int outSize) {
+  uint8_t *buf = c->buf;
+  int i = c->historyLength;
+  int end = i + length;
+  struct PppDefOut o;
+
+  c->frameLength = length;
+  c->stats.packets++;
+  c->stats.bytes += length;
+
+  // Worth sending only if it ends up shorter than the frame itself
+  o.size = outSize < length ? outSize : length;
+  o.size -= PPPDEF_HEADER_LENGTH + 1;
+  if (out == nullptr || o.size <= 0) {
+    c->seq++;
+    c->stats.plainPackets++;
+    c->stats.wireBytes += length;
+    return 0;
+  }
+
+  PV_set<PvBe16>(out, c->seq);
+  c->seq++;
+  o.out = out + PPPDEF_HEADER_LENGTH;
+  o.pos = 0;
+  o.bitBuf = 0;
+  o.bitCount = 0;
+  o.full = false;
+
+  _pppdefPutBits(&o, 1 << 1, 3);   // not final, fixed Huffman
+  while (i < end && !o.full) {
+    int best = 0;
+    int distance = 0;
+
+    if (end - i >= PPPDEF_MIN_MATCH) {
+      uint32_t h = _pppdefHash(buf + i);
+      int candidate = c->head[h] - 1;
+
+      c->head[h] = i + 1;
+      if (candidate >= 0 && i - candidate <= c->maxDistance) {
+        int limit = end - i < PPPDEF_MAX_MATCH ? end - i : PPPDEF_MAX_MATCH;
+        while (best < limit && buf[candidate + best] == buf[i + best]) {
+          best++;
+        }
+        distance = i - candidate;
+      }
+    }
+
+    if (best >= PPPDEF_MIN_MATCH) {
+      _pppdefPutMatch(&o, best, distance);
+      for (int k = 1; k < best && i + k + PPPDEF_MIN_MATCH <= end; k++) {
+        c->head[_pppdefHash(buf + i + k)] = i + k + 1;
+      }
+      i += best;
+    } else {
+      _pppdefPutSymbol(&o, buf[i]);
+      i++;
+    }
+  }
+  _pppdefPutSymbol(&o, 256);
+  // Empty stored block without its length, the frame ends byte aligned
+  // (Z_PACKET_FLUSH of the Linux zlib)
+  _pppdefPutBits(&o, 0, 3);
+  _pppdefPutBits(&o, 0, (8 - o.bitCount) & 7);
+
+  if (o.full) {
+    c->stats.plainPackets++;
+    c->stats.wireBytes += length;
+    return 0;
+  }
+  c->stats.wireBytes += PPPDEF_HEADER_LENGTH + o.pos;
+  return PPPDEF_HEADER_LENGTH + o.pos;
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// Decompressor, after Mark Adler's puff: canonical Huffman codes decoded a
+// bit at a time from per length counts, the tables stay small.
+
+struct PppDefIn {
+  const uint8_t *in;
+  int length;
+  int pos;
+  uint32_t bitBuf;
+  int bitCount;
+  uint8_t *out;
+  int outSize;
+  int outPos;
+};
+
+// -1 when the frame ends first
+static int _pppdefBits(struct PppDefIn *s, int n) {
+  int value;
+
+  while (s->bitCount < n) {
+    if (s->pos == s->length) {
+      return -1;
+    }
+    s->bitBuf |= (uint32_t)s->in[s->pos++] << s->bitCount;
+    s->bitCount += 8;
+  }
+  value = s->bitBuf & ((1 << n) - 1);
+  s->bitBuf >>= n;
+  s->bitCount -= n;
+  return value;
+}
+
+static bool _pppdefOutput(struct PppInflate *d, struct PppDefIn *s, uint8_t b) {
+  if (s->outPos == s->outSize) {
+    return false;
+  }
+  s->out[s->outPos++] = b;
+  d->window[d->windowPos] = b;
+  d->windowPos = (d->windowPos + 1) & (PPPDEF_WINDOW - 1);
+  if (d->windowFill < PPPDEF_WINDOW) {
+    d->windowFill++;
+  }
+  return true;
+}
+
+static int _pppdefDecode(struct PppDefIn *s, const uint16_t *count, const uint16_t *symbol) {
+  int code = 0;
+  int first = 0;
+  int index = 0;
+
+  for (int len = 1; len < 16; len++) {
+    int b = _pppdefBits(s, 1);
+    if (b < 0) {
+      return -1;
+    }
+    code |= b;
+    if (code - count[len] < first) {
+      return symbol[index + (code - first)];
+    }
+    index += count[len];
+    first += count[len];
+    first <<= 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+// Returns 0 for a complete code, > 0 for an incomplete one, < 0 when
+// over-subscribed
+static int _pppdefConstruct(uint16_t *count, uint16_t *symbol, const uint8_t *length, int n) {
+  uint16_t offs[16];
+  int left = 1;
+
+  memset(count, 0, 16 * sizeof(uint16_t));
+  for (int i = 0; i < n; i++) {
+    count[length[i]]++;
+  }
+  if (count[0] == n) {
+    return 0;
+  }
+  for (int len = 1; len < 16; len++) {
+    left <<= 1;
+    left -= count[len];
+    if (left < 0) {
+      return left;
+    }
+  }
+  offs[1] = 0;
+  for (int len = 1; len < 15; len++) {
+    offs[len + 1] = offs[len] + count[len];
+  }
+  for (int i = 0; i < n; i++) {
+    if (length[i] != 0) {
+      symbol[offs[length[i]]++] = i;
+    }
+  }
+  return left;
+}
+
+static bool _pppdefCodes(struct PppInflate *d, struct PppDefIn *s) {
+  for (;;) {
+    int symbol = _pppdefDecode(s, d->lenCount, d->lenSymbol);
+    int length;
+    int distance;
+    int extra;
+
+    if (symbol < 0) {
+      return false;
+    }
+    if (symbol < 256) {
+      if (!_pppdefOutput(d, s, symbol)) {
+        return false;
+      }
+      continue;
+    }
+    if (symbol == 256) {
+      return true;
+    }
+
+    symbol -= 257;
+    if (symbol >= 29) {
+      return false;
+    }
+    extra = _pppdefBits(s, _lengthExtra[symbol]);
+    if (extra < 0) {
+      return false;
+    }
+    length = _lengthBase[symbol] + extra;
+
+    symbol = _pppdefDecode(s, d->distCount, d->distSymbol);
+    if (symbol < 0 || symbol >= 30) {
+      return false;
+    }
+    extra = _pppdefBits(s, _distExtra[symbol]);
+    if (extra < 0) {
+      return false;
+    }
+    distance = _distBase[symbol] + extra;
+    if (distance > d->windowFill) {
+      return false;
+    }
+
+    while (length-- > 0) {
+      if (!_pppdefOutput(d, s, d->window[(d->windowPos - distance) & (PPPDEF_WINDOW - 1)])) {
+        return false;
+      }
+    }
+  }
+}
+
+static bool _pppdefFixed(struct PppInflate *d, struct PppDefIn *s) {
+  uint8_t lengths[288];
+  int i;
+
+  for (i = 0; i < 144; i++) {
+    lengths[i] = 8;
+  }
+  for (; i < 256; i++) {
+    lengths[i] = 9;
+  }
+  for (; i < 280; i++) {
+    lengths[i] = 7;
+  }
+  for (; i < 288; i++) {
+    lengths[i] = 8;
+  }
+  _pppdefConstruct(d->lenCount, d->lenSymbol, lengths, 288);
+  for (i = 0; i < 30; i++) {
+    lengths[i] = 5;
+  }
+  _pppdefConstruct(d->distCount, d->distSymbol, lengths, 30);
+  return _pppdefCodes(d, s);
+}
+
+static bool _pppdefDynamic(struct PppInflate *d, struct PppDefIn *s) {
+  static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+  uint8_t lengths[286 + 30];
+  int nlen = _pppdefBits(s, 5) + 257;
+  int ndist = _pppdefBits(s, 5) + 1;
+  int ncode = _pppdefBits(s, 4) + 4;
+  int index;
+  int err;
+
+  if (ncode < 4 || nlen > 286 || ndist > 30) {
+    return false;
+  }
+
+  // Code length code, in the literal/length tables for the moment
+  memset(lengths, 0, 19);
+  for (index = 0; index < ncode; index++) {
+    int len = _pppdefBits(s, 3);
+    if (len < 0) {
+      return false;
+    }
+    lengths[order[index]] = len;
+  }
+  if (_pppdefConstruct(d->lenCount, d->lenSymbol, lengths, 19) != 0) {
+    return false;
+  }
+
+  index = 0;
+  while (index < nlen + ndist) {
+    int symbol = _pppdefDecode(s, d->lenCount, d->lenSymbol);
+    int len = 0;
+    int repeat;
+
+    if (symbol < 0) {
+      return false;
+    }
+    if (symbol < 16) {
+      lengths[index++] = symbol;
+      continue;
+    }
+    if (symbol == 16) {
+      if (index == 0) {
+        return false;
+      }
+      len = lengths[index - 1];
+      repeat = _pppdefBits(s, 2) + 3;
+    } else if (symbol == 17) {
+      repeat = _pppdefBits(s, 3) + 3;
+    } else {
+      repeat = _pppdefBits(s, 7) + 11;
+    }
+    if (repeat < 3 || index + repeat > nlen + ndist) {
+      return false;
+    }
+    while (repeat-- > 0) {
+      lengths[index++] = len;
+    }
+  }
+
+  if (lengths[256] == 0) {
+    return false;
+  }
+  // Incomplete codes are only allowed for a single length
+  err = _pppdefConstruct(d->lenCount, d->lenSymbol, lengths, nlen);
+  if (err < 0 || (err > 0 && nlen - d->lenCount[0] != 1)) {
+    return false;
+  }
+  err = _pppdefConstruct(d->distCount, d->distSymbol, lengths + nlen, ndist);
+  if (err < 0 || (err > 0 && ndist - d->distCount[0] != 1)) {
+    return false;
+  }
+  return _pppdefCodes(d, s);
+}
+
+// A stored block. The Linux compressor ends every frame with the 3 bit
+// header of one and nothing after it.
+static bool _pppdefStored(struct PppInflate *d, struct PppDefIn *s, bool *end) {
+  int len;
+  int nlen;
+
+  s->bitBuf >>= s->bitCount & 7;
+  s->bitCount &= ~7;
+  if (s->bitCount == 0 && s->pos == s->length) {
+    *end = true;
+    return true;
+  }
+
+  len = _pppdefBits(s, 16);
+  nlen = _pppdefBits(s, 16);
+  if (len < 0 || nlen < 0 || len != (~nlen & 0xffff)) {
+    return false;
+  }
+  while (len-- > 0) {
+    int b = _pppdefBits(s, 8);
+    if (b < 0 || !_pppdefOutput(d, s, b)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void PPPDEF_initDecompressor(struct PppInflate *d) {
+  PPPDEF_resetDecompressor(d);
+}
+
+void PPPDEF_resetDecompressor(struct PppInflate *d) {
+  d->windowPos = 0;
+  d->windowFill = 0;
+  d->seq = 0;
+  d->discard = false;
+}
+
+int PPPDEF_decompress(struct PppInflate *d, const uint8_t *data, int length, uint8_t *out, int outSize) {
+  struct PppDefIn s;
+  bool end = false;
+
+  if (d->discard) {
+    return PPPDEF_DROP;
+  }
+  if (length < PPPDEF_HEADER_LENGTH || PV_get<PvBe16>(data) != d->seq) {
+    d->discard = true;
+    return PPPDEF_RESYNC;
+  }
+  d->seq++;
+
+  s.in = data + PPPDEF_HEADER_LENGTH;
+  s.length = length - PPPDEF_HEADER_LENGTH;
+  s.pos = 0;
+  s.bitBuf = 0;
+  s.bitCount = 0;
+  s.out = out;
+  s.outSize = outSize;
+  s.outPos = 0;
+
+  while (!end) {
+    int last;
+    int type;
+    bool ok;
+
+    // Padding after the last block
+    if (s.pos == s.length && s.bitCount < 3) {
+      break;
+    }
+    last = _pppdefBits(&s, 1);
+    type = _pppdefBits(&s, 2);
+    if (type == 0) {
+      ok = _pppdefStored(d, &s, &end);
+    } else if (type == 1) {
+      ok = _pppdefFixed(d, &s);
+    } else if (type == 2) {
+      ok = _pppdefDynamic(d, &s);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      d->discard = true;
+      return PPPDEF_RESYNC;
+    }
+    if (last == 1) {
+      break;
+    }
+  }
+
+  d->stats.packets++;
+  d->stats.bytes += s.outPos;
+  d->stats.wireBytes += length;
+  return s.outPos;
+}
+
+void PPPDEF_incompressible(struct PppInflate *d, uint16_t protocol) {
+  uint8_t field[2];
+  int n = 0;
+
+  if (d->discard) {
+    return;
+  }
+  // The protocol field as the compressor saw it, one byte when it can be
+  if (protocol > 0xff) {
+    field[n++] = protocol >> 8;
+  }
+  field[n++] = protocol & 0xff;
+  d->seq++;
+  d->stats.packets++;
+  d->stats.plainPackets++;
+  PPPDEF_history(d, field, n);
+}
+
+void PPPDEF_history(struct PppInflate *d, const uint8_t *data, int length) {
+  if (d->discard) {
+    return;
+  }
+  d->stats.bytes += length;
+  d->stats.wireBytes += length;
+  for (int i = 0; i < length; i++) {
+    d->window[d->windowPos] = data[i];
+    d->windowPos = (d->windowPos + 1) & (PPPDEF_WINDOW - 1);
+  }
+  d->windowFill = d->windowFill + length < PPPDEF_WINDOW ? d->windowFill + length : PPPDEF_WINDOW;
+}
@@ -0,0 +1,92 @@
+#ifndef PPP_Deflate_h
+#define PPP_Deflate_h
+
+#include <stdint.h>
+
+// PPP Deflate compression (RFC 1979) as negotiated by CCP. Every frame is
+// raw deflate data that ends on a byte boundary, the LZ77 history carries
+// over from frame to frame. The windows are far smaller than the 32 KB
+// zlib uses, RAM is short. Compressed frames travel as PPP_COMP like MPPE
+// ones do, CCP never turns on both.
+
+#define PPP_COMP             0x00fd    // PPP protocol of compressed datagrams (RFC 1962)
+#define PPP_DEFLATE_OPT      26
+#define PPP_DEFLATE_DRAFT_OPT 24        // pre-RFC option number, same format
+#define PPP_DEFLATE_METHOD    8
+
+// log2 of our compressor's window and of the one we ask the peer to use.
+// The Linux compressor does not go below 9.
+#ifndef PPPDEF_WINDOW_BITS
+#define PPPDEF_WINDOW_BITS    10
+#endif
+#define PPPDEF_WINDOW         (1 << PPPDEF_WINDOW_BITS)
+// Largest frame before compression, protocol field included. The tail of
+// a longer one has to fill the whole window.
+#define PPPDEF_FRAME_MAX      1502
+#if PPPDEF_WINDOW > PPPDEF_FRAME_MAX
+#error "PPPDEF_WINDOW must not exceed PPPDEF_FRAME_MAX"
+#endif
+// Sequence number in front of the compressed data
+#define PPPDEF_HEADER_LENGTH  2
+#define PPPDEF_HASH_BITS      9
+
+struct PppDeflateStats {
+  uint32_t packets;
+  uint32_t plainPackets;    // did not get smaller, went as they were
+  uint32_t bytes;           // frames before compression
+  uint32_t wireBytes;       // the same frames as sent or received
+};
+
+struct PppDeflate {
+  // History followed by the frame being compressed
+  uint8_t buf[PPPDEF_WINDOW + PPPDEF_FRAME_MAX];
+  uint16_t head[1 << PPPDEF_HASH_BITS];   // last position + 1 of each hash
+  uint16_t historyLength;
+  uint16_t frameLength;
+  uint16_t maxDistance;
+  uint16_t seq;
+  struct PppDeflateStats stats;
+};
+
+struct PppInflate {
+  uint8_t window[PPPDEF_WINDOW];
+  uint16_t windowPos;
+  uint16_t windowFill;
+  uint16_t seq;
+  bool discard;             // lost sync, waiting for the Reset-Ack
+  // Huffman tables of the block being decoded
+  uint16_t lenCount[16];
+  uint16_t lenSymbol[288];
+  uint16_t distCount[16];
+  uint16_t distSymbol[30];
+  struct PppDeflateStats stats;
+};
+
+// windowBits is what the peer's decompressor takes (its CCP option)
+void PPPDEF_initCompressor(struct PppDeflate *c, uint8_t windowBits);
+// CCP Reset-Request: history and sequence number start over
+void PPPDEF_resetCompressor(struct PppDeflate *c);
+// Where to copy the next frame, protocol field first, at most
+// PPPDEF_FRAME_MAX bytes
+uint8_t *PPPDEF_frame(struct PppDeflate *c);
+// Compress the frame of 'length' bytes to 'out'. Returns the length of the
+// compressed frame, sequence number included, or 0 when it would not get
+// smaller: the frame then goes out uncompressed, it is in the history all
+// the same. 'out' may be null to only take the frame into the history.
+int PPPDEF_compress(struct PppDeflate *c, int length, uint8_t *out, int outSize);
+
+#define PPPDEF_DROP     -1
+#define PPPDEF_RESYNC   -2   // drop, and send the peer a Reset-Request
+
+void PPPDEF_initDecompressor(struct PppInflate *d);
+// CCP Reset-Ack: the peer's compressor started over
+void PPPDEF_resetDecompressor(struct PppInflate *d);
+// A compressed frame, sequence number first. The frame is written to 'out'
+// protocol field first, returns its length or one of the codes above.
+int PPPDEF_decompress(struct PppInflate *d, const uint8_t *data, int length, uint8_t *out, int outSize);
+// A data frame the peer sent uncompressed joins the history too: its
+// protocol first, then PPPDEF_history() for each piece of the rest
+void PPPDEF_incompressible(struct PppInflate *d, uint16_t protocol);
+void PPPDEF_history(struct PppInflate *d, const uint8_t *data, int length);
+
+#endif
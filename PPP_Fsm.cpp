@@ -0,0 +1,497 @@
+#include "PPP_Fsm.h"
+#include "DebugMsg.h"
+
+static const char *_pppfsmStateNames[] = {
+  "Initial", "Starting", "Closed", "Stopped", "Closing",
+  "Stopping", "Req-Sent", "Ack-Rcvd", "Ack-Sent", "Opened"
+};
+
+static void _pppfsmTimeout(void *arg);
+
+const char *PPPFSM_stateName(uint8_t state) {
+  if (state > PPPFSM_OPENED) {
+    return "Unknown";
+  }
+  return _pppfsmStateNames[state];
+}
+
+static void _pppfsmSetState(struct PppFsm *f, uint8_t state) {
+  db_printf(DB_DEBUG, "PPPFSM %s: %s -> %s\n", f->name, PPPFSM_stateName(f->state), PPPFSM_stateName(state));
+  f->state = state;
+
+  // Only the states waiting for an answer run the restart timer
+  if (state < PPPFSM_CLOSING || state == PPPFSM_OPENED) {
+    os_timer_disarm(&f->timer);
+  }
+}
+
+void PPPFSM_init(struct PppFsm *f, const char *name, uint16_t protocol,
+                 const struct PppFsmCallbacks *cb, int (*output)(struct PppFsm *, uint8_t *, int)) {
+  os_timer_disarm(&f->timer);
+  f->name = name;
+  f->protocol = protocol;
+  f->state = PPPFSM_INITIAL;
+  f->id = 0;
+  f->reqId = 0;
+  f->restartCount = 0;
+  f->cb = cb;
+  f->output = output;
+  f->arg = nullptr;
+  os_timer_setfn(&f->timer, _pppfsmTimeout, f);
+}
+
+int PPPFSM_send(struct PppFsm *f, uint8_t code, uint8_t id, const uint8_t *data, int length) {
+  uint8_t frame[PPPFSM_FRAME_MAX];
+
+  if (length < 0 || length > PPPFSM_OPTIONS_MAX) {
+    db_printf(DB_DEBUG, "PPPFSM_send() %s packet too long %d\n", f->name, length);
+    return -1;
+  }
+
+  frame[0] = 0xff;
+  frame[1] = 0x03;
+  frame[2] = f->protocol >> 8;
+  frame[3] = f->protocol & 0xff;
+  frame[4] = code;
+  frame[5] = id;
+  frame[6] = (length + 4) >> 8;
+  frame[7] = (length + 4) & 0xff;
+  if (length > 0) {
+    memcpy(&frame[8], data, length);
+  }
+
+  return f->output(f, frame, length + 8);
+}
+
+// irc: Initialize-Restart-Count
+static void _pppfsmIrc(struct PppFsm *f, bool configure) {
+  f->restartCount = configure ? PPPFSM_MAX_CONFIGURE : PPPFSM_MAX_TERMINATE;
+}
+
+static void _pppfsmArmTimer(struct PppFsm *f) {
+  os_timer_disarm(&f->timer);
+  os_timer_arm(&f->timer, PPPFSM_RESTART_MS, false);
+}
+
+// zrc: Zero-Restart-Count, the timer still runs once so the peer gets
+// time to see our Terminate-Ack
+static void _pppfsmZrc(struct PppFsm *f) {
+  f->restartCount = 0;
+  _pppfsmArmTimer(f);
+}
+
+// scr: Send-Configure-Request
+static void _pppfsmScr(struct PppFsm *f) {
+  uint8_t options[PPPFSM_OPTIONS_MAX];
+  int length = 0;
+
+  if (f->cb->buildOptions != nullptr) {
+    length = f->cb->buildOptions(f, options, sizeof(options));
+  }
+
+  f->reqId = ++f->id;
+  PPPFSM_send(f, PPP_CONFREQ, f->reqId, options, length);
+  if (f->restartCount > 0) {
+    f->restartCount--;
+  }
+  _pppfsmArmTimer(f);
+}
+
+// str: Send-Terminate-Request
+static void _pppfsmStr(struct PppFsm *f) {
+  f->reqId = ++f->id;
+  PPPFSM_send(f, PPP_TERMREQ, f->reqId, nullptr, 0);
+  if (f->restartCount > 0) {
+    f->restartCount--;
+  }
+  _pppfsmArmTimer(f);
+}
+
+// sta: Send-Terminate-Ack
+static void _pppfsmSta(struct PppFsm *f, uint8_t id) {
+  PPPFSM_send(f, PPP_TERMACK, id, nullptr, 0);
+}
+
+static void _pppfsmTlu(struct PppFsm *f) {
+  if (f->cb->up != nullptr) {
+    f->cb->up(f);
+  }
+}
+
+static void _pppfsmTld(struct PppFsm *f) {
+  if (f->cb->down != nullptr) {
+    f->cb->down(f);
+  }
+}
+
+static void _pppfsmTlf(struct PppFsm *f) {
+  if (f->cb->finished != nullptr) {
+    f->cb->finished(f);
+  }
+}
+
+void PPPFSM_lowerUp(struct PppFsm *f) {
+  switch (f->state) {
+    case PPPFSM_INITIAL:
+      _pppfsmSetState(f, PPPFSM_CLOSED);
+      break;
+    case PPPFSM_STARTING:
+      _pppfsmIrc(f, true);
+      _pppfsmScr(f);
+      _pppfsmSetState(f, PPPFSM_REQSENT);
+      break;
+  }
+}
+
+void PPPFSM_lowerDown(struct PppFsm *f) {
+  switch (f->state) {
+    case PPPFSM_CLOSED:
+    case PPPFSM_CLOSING:
+      _pppfsmSetState(f, PPPFSM_INITIAL);
+      break;
+    case PPPFSM_STOPPED:
+    case PPPFSM_STOPPING:
+    case PPPFSM_REQSENT:
+    case PPPFSM_ACKRCVD:
+    case PPPFSM_ACKSENT:
+      _pppfsmSetState(f, PPPFSM_STARTING);
+      break;
+    case PPPFSM_OPENED:
+      _pppfsmTld(f);
+      _pppfsmSetState(f, PPPFSM_STARTING);
+      break;
+  }
+}
+
+void PPPFSM_open(struct PppFsm *f) {
+  switch (f->state) {
+    case PPPFSM_INITIAL:
+      _pppfsmSetState(f, PPPFSM_STARTING);
+      break;
+    case PPPFSM_CLOSED:
+      _pppfsmIrc(f, true);
+      _pppfsmScr(f);
+      _pppfsmSetState(f, PPPFSM_REQSENT);
+      break;
+    case PPPFSM_CLOSING:
+      _pppfsmSetState(f, PPPFSM_STOPPING);
+      break;
+  }
+}
+
+void PPPFSM_close(struct PppFsm *f) {
+  switch (f->state) {
+    case PPPFSM_STARTING:
+      _pppfsmSetState(f, PPPFSM_INITIAL);
+      _pppfsmTlf(f);
+      break;
+    case PPPFSM_STOPPED:
+      _pppfsmSetState(f, PPPFSM_CLOSED);
+      break;
+    case PPPFSM_STOPPING:
+      _pppfsmSetState(f, PPPFSM_CLOSING);
+      break;
+    case PPPFSM_OPENED:
+      _pppfsmTld(f);
+      // fall through
+    case PPPFSM_REQSENT:
+    case PPPFSM_ACKRCVD:
+    case PPPFSM_ACKSENT:
+      _pppfsmIrc(f, false);
+      _pppfsmStr(f);
+      _pppfsmSetState(f, PPPFSM_CLOSING);
+      break;
+  }
+}
+
+static void _pppfsmTimeout(void *arg) {
+  struct PppFsm *f = (struct PppFsm *)arg;
+
+  // TO+ event
+  if (f->restartCount > 0) {
+    switch (f->state) {
+      case PPPFSM_CLOSING:
+      case PPPFSM_STOPPING:
+        _pppfsmStr(f);
+        break;
+      case PPPFSM_ACKRCVD:
+        _pppfsmScr(f);
+        _pppfsmSetState(f, PPPFSM_REQSENT);
+        break;
+      case PPPFSM_REQSENT:
+      case PPPFSM_ACKSENT:
+        _pppfsmScr(f);
+        break;
+    }
+    return;
+  }
+
+  // TO- event, the peer does not answer
+  db_printf(DB_DEBUG, "_pppfsmTimeout() %s gave up in %s\n", f->name, PPPFSM_stateName(f->state));
+  switch (f->state) {
+    case PPPFSM_CLOSING:
+      _pppfsmSetState(f, PPPFSM_CLOSED);
+      _pppfsmTlf(f);
+      break;
+    case PPPFSM_STOPPING:
+    case PPPFSM_REQSENT:
+    case PPPFSM_ACKRCVD:
+    case PPPFSM_ACKSENT:
+      _pppfsmSetState(f, PPPFSM_STOPPED);
+      _pppfsmTlf(f);
+      break;
+  }
+}
+
+// RCR+ / RCR- events
+static void _pppfsmRcvConfReq(struct PppFsm *f, uint8_t id, uint8_t *packet, int length) {
+  uint8_t options[PPPFSM_OPTIONS_MAX];
+  uint8_t code = PPP_CONFACK;
+
+  // The answer is built in place and may be longer than the request
+  if (length > (int)sizeof(options)) {
+    db_printf(DB_DEBUG, "_pppfsmRcvConfReq() %s request too long %d\n", f->name, length);
+    return;
+  }
+  memcpy(options, packet, length);
+
+  switch (f->state) {
+    case PPPFSM_CLOSED:
+      _pppfsmSta(f, id);
+      return;
+    case PPPFSM_CLOSING:
+    case PPPFSM_STOPPING:
+      return;
+    case PPPFSM_OPENED:
+      _pppfsmTld(f);
+      _pppfsmScr(f);
+      break;
+    case PPPFSM_STOPPED:
+      _pppfsmIrc(f, true);
+      _pppfsmScr(f);
+      break;
+  }
+
+  if (f->cb->checkOptions != nullptr) {
+    code = f->cb->checkOptions(f, options, &length);
+  }
+  PPPFSM_send(f, code, id, options, length);
+
+  if (code == PPP_CONFACK) {
+    if (f->state == PPPFSM_ACKRCVD) {
+      _pppfsmSetState(f, PPPFSM_OPENED);
+      _pppfsmTlu(f);
+    } else {
+      _pppfsmSetState(f, PPPFSM_ACKSENT);
+    }
+  } else if (f->state != PPPFSM_ACKRCVD) {
+    _pppfsmSetState(f, PPPFSM_REQSENT);
+  }
+}
+
+// RCA event
+static void _pppfsmRcvConfAck(struct PppFsm *f, uint8_t id) {
+  switch (f->state) {
+    case PPPFSM_CLOSED:
+    case PPPFSM_STOPPED:
+      _pppfsmSta(f, id);
+      break;
+    case PPPFSM_REQSENT:
+      _pppfsmIrc(f, true);
+      _pppfsmSetState(f, PPPFSM_ACKRCVD);
+      break;
+    case PPPFSM_ACKRCVD:
+      // Crossed connection
+      _pppfsmScr(f);
+      _pppfsmSetState(f, PPPFSM_REQSENT);
+      break;
+    case PPPFSM_ACKSENT:
+      _pppfsmIrc(f, true);
+      _pppfsmSetState(f, PPPFSM_OPENED);
+      _pppfsmTlu(f);
+      break;
+    case PPPFSM_OPENED:
+      _pppfsmTld(f);
+      _pppfsmScr(f);
+      _pppfsmSetState(f, PPPFSM_REQSENT);
+      break;
+  }
+}
+
+// RCN event, for Configure-Nak and Configure-Reject
+static void _pppfsmRcvConfNak(struct PppFsm *f, uint8_t code, uint8_t id, uint8_t *options, int length) {
+  if (f->state == PPPFSM_CLOSED || f->state == PPPFSM_STOPPED) {
+    _pppfsmSta(f, id);
+    return;
+  }
+  if (f->state < PPPFSM_REQSENT) {
+    return;
+  }
+
+  if (code == PPP_CONFNAK && f->cb->nakOptions != nullptr) {
+    f->cb->nakOptions(f, options, length);
+  }
+  if (code == PPP_CONFREJ && f->cb->rejectOptions != nullptr) {
+    f->cb->rejectOptions(f, options, length);
+  }
+
+  switch (f->state) {
+    case PPPFSM_REQSENT:
+    case PPPFSM_ACKSENT:
+      _pppfsmIrc(f, true);
+      _pppfsmScr(f);
+      break;
+    case PPPFSM_ACKRCVD:
+      _pppfsmScr(f);
+      _pppfsmSetState(f, PPPFSM_REQSENT);
+      break;
+    case PPPFSM_OPENED:
+      _pppfsmTld(f);
+      _pppfsmScr(f);
+      _pppfsmSetState(f, PPPFSM_REQSENT);
+      break;
+  }
+}
+
+// RTR event
+static void _pppfsmRcvTermReq(struct PppFsm *f, uint8_t id) {
+  switch (f->state) {
+    case PPPFSM_ACKRCVD:
+    case PPPFSM_ACKSENT:
+      _pppfsmSta(f, id);
+      _pppfsmSetState(f, PPPFSM_REQSENT);
+      break;
+    case PPPFSM_OPENED:
+      db_printf(DB_INFO, "PPPFSM %s terminated by peer\n", f->name);
+      _pppfsmTld(f);
+      _pppfsmZrc(f);
+      _pppfsmSta(f, id);
+      _pppfsmSetState(f, PPPFSM_STOPPING);
+      break;
+    default:
+      _pppfsmSta(f, id);
+      break;
+  }
+}
+
+// RTA event
+static void _pppfsmRcvTermAck(struct PppFsm *f) {
+  switch (f->state) {
+    case PPPFSM_CLOSING:
+      _pppfsmSetState(f, PPPFSM_CLOSED);
+      _pppfsmTlf(f);
+      break;
+    case PPPFSM_STOPPING:
+      _pppfsmSetState(f, PPPFSM_STOPPED);
+      _pppfsmTlf(f);
+      break;
+    case PPPFSM_ACKRCVD:
+      _pppfsmSetState(f, PPPFSM_REQSENT);
+      break;
+    case PPPFSM_OPENED:
+      _pppfsmTld(f);
+      _pppfsmScr(f);
+      _pppfsmSetState(f, PPPFSM_REQSENT);
+      break;
+  }
+}
+
+// RXJ event. A rejected code the automaton depends on is catastrophic.
+static void _pppfsmRcvCodeRej(struct PppFsm *f, uint8_t *data, int length) {
+  if (length < 1 || data[0] < PPP_CONFREQ || data[0] > PPP_CODEREJ) {
+    return;
+  }
+
+  db_printf(DB_INFO, "PPPFSM %s peer rejected code %d\n", f->name, data[0]);
+  switch (f->state) {
+    case PPPFSM_CLOSED:
+    case PPPFSM_STOPPED:
+      _pppfsmTlf(f);
+      break;
+    case PPPFSM_CLOSING:
+      _pppfsmSetState(f, PPPFSM_CLOSED);
+      _pppfsmTlf(f);
+      break;
+    case PPPFSM_STOPPING:
+    case PPPFSM_REQSENT:
+    case PPPFSM_ACKRCVD:
+    case PPPFSM_ACKSENT:
+      _pppfsmSetState(f, PPPFSM_STOPPED);
+      _pppfsmTlf(f);
+      break;
+    case PPPFSM_OPENED:
+      _pppfsmTld(f);
+      _pppfsmIrc(f, false);
+      _pppfsmStr(f);
+      _pppfsmSetState(f, PPPFSM_STOPPING);
+      break;
+  }
+}
+
+void PPPFSM_input(struct PppFsm *f, uint8_t *packet, int length) {
+  uint8_t code;
+  uint8_t id;
+  int len;
+
+  if (length < 4) {
+    db_printf(DB_DEBUG, "PPPFSM_input() %s short packet %d\n", f->name, length);
+    return;
+  }
+
+  code = packet[0];
+  id = packet[1];
+  len = (packet[2] << 8) | packet[3];
+  if (len < 4 || len > length) {
+    db_printf(DB_DEBUG, "PPPFSM_input() %s bad length %d of %d\n", f->name, len, length);
+    return;
+  }
+
+  // Not negotiating yet, the packet has nowhere to go
+  if (f->state == PPPFSM_INITIAL || f->state == PPPFSM_STARTING) {
+    db_printf(DB_DEBUG, "PPPFSM_input() %s code %d in %s, drop\n", f->name, code, PPPFSM_stateName(f->state));
+    return;
+  }
+
+  db_printf(DB_DEBUG, "PPPFSM_input() %s code %d id %d in %s\n", f->name, code, id, PPPFSM_stateName(f->state));
+  packet += 4;
+  len -= 4;
+
+  switch (code) {
+    case PPP_CONFREQ:
+      _pppfsmRcvConfReq(f, id, packet, len);
+      break;
+    case PPP_CONFACK:
+      if (id == f->reqId) {
+        _pppfsmRcvConfAck(f, id);
+      }
+      break;
+    case PPP_CONFNAK:
+    case PPP_CONFREJ:
+      if (id == f->reqId) {
+        _pppfsmRcvConfNak(f, code, id, packet, len);
+      }
+      break;
+    case PPP_TERMREQ:
+      _pppfsmRcvTermReq(f, id);
+      break;
+    case PPP_TERMACK:
+      _pppfsmRcvTermAck(f);
+      break;
+    case PPP_CODEREJ:
+      _pppfsmRcvCodeRej(f, packet, len);
+      break;
+    default:
+      if (f->cb->extCode != nullptr && f->cb->extCode(f, code, id, packet, len) == true) {
+        break;
+      }
+      // RUC event: Code-Reject carries the rejected packet
+      db_printf(DB_DEBUG, "PPPFSM_input() %s unknown code %d, reject\n", f->name, code);
+      packet -= 4;
+      len += 4;
+      if (len > PPPFSM_OPTIONS_MAX) {
+        len = PPPFSM_OPTIONS_MAX;
+      }
+      PPPFSM_send(f, PPP_CODEREJ, ++f->id, packet, len);
+      break;
+  }
+}
@@ -0,0 +1,93 @@
+#ifndef PPP_Fsm_h
+#define PPP_Fsm_h
+
+#include "Arduino.h"
+
+extern "C"
+{
+  #include <user_interface.h>
+}
+
+// Option negotiation automaton of RFC 1661 section 4, shared by LCP and the
+// network control protocols. Everything is driven by received packets and
+// the restart timer, nothing blocks.
+
+// States (RFC 1661 section 4.2)
+#define PPPFSM_INITIAL    0
+#define PPPFSM_STARTING   1
+#define PPPFSM_CLOSED     2
+#define PPPFSM_STOPPED    3
+#define PPPFSM_CLOSING    4
+#define PPPFSM_STOPPING   5
+#define PPPFSM_REQSENT    6
+#define PPPFSM_ACKRCVD    7
+#define PPPFSM_ACKSENT    8
+#define PPPFSM_OPENED     9
+
+// Packet codes (RFC 1661 section 5)
+#define PPP_CONFREQ   0x01
+#define PPP_CONFACK   0x02
+#define PPP_CONFNAK   0x03
+#define PPP_CONFREJ   0x04
+#define PPP_TERMREQ   0x05
+#define PPP_TERMACK   0x06
+#define PPP_CODEREJ   0x07
+
+// Restart timer and counters (RFC 1661 section 4.6). The timer is shorter
+// than the suggested 3 s, a lost request costs less bring-up time that way.
+#define PPPFSM_RESTART_MS     1000
+#define PPPFSM_MAX_TERMINATE  2
+#define PPPFSM_MAX_CONFIGURE  10
+
+// Largest frame the automaton builds, PPP header included
+#define PPPFSM_FRAME_MAX      256
+#define PPPFSM_OPTIONS_MAX    (PPPFSM_FRAME_MAX - 8)
+
+struct PppFsm;
+
+struct PppFsmCallbacks {
+  // Write the options of our Configure-Request to buf, return their length
+  int (*buildOptions)(struct PppFsm *f, uint8_t *buf, int size);
+  // Check the options of a peer Configure-Request. Rewrite them in place to
+  // the list to send back and return PPP_CONFACK, PPP_CONFNAK or PPP_CONFREJ.
+  // The buffer holds PPPFSM_OPTIONS_MAX bytes.
+  uint8_t (*checkOptions)(struct PppFsm *f, uint8_t *options, int *length);
+  // The peer sent a Configure-Nak or Configure-Reject for our request
+  void (*nakOptions)(struct PppFsm *f, uint8_t *options, int length);
+  void (*rejectOptions)(struct PppFsm *f, uint8_t *options, int length);
+  // Codes beyond Code-Reject (LCP Echo, Protocol-Reject...). Return false
+  // to have the packet answered with a Code-Reject.
+  bool (*extCode)(struct PppFsm *f, uint8_t code, uint8_t id, uint8_t *data, int length);
+  void (*up)(struct PppFsm *f);         // This-Layer-Up
+  void (*down)(struct PppFsm *f);       // This-Layer-Down
+  void (*finished)(struct PppFsm *f);   // This-Layer-Finished
+};
+
+struct PppFsm {
+  const char *name;
+  uint16_t protocol;
+  uint8_t state;
+  uint8_t id;                 // last identifier used
+  uint8_t reqId;              // identifier of the outstanding request
+  uint8_t restartCount;
+  const struct PppFsmCallbacks *cb;
+  // Send a complete PPP frame, header included
+  int (*output)(struct PppFsm *f, uint8_t *frame, int length);
+  void *arg;                  // the owner's, e.g. the link it runs on
+  os_timer_t timer;
+};
+
+void PPPFSM_init(struct PppFsm *f, const char *name, uint16_t protocol,
+                 const struct PppFsmCallbacks *cb, int (*output)(struct PppFsm *, uint8_t *, int));
+// Administrative Open/Close and lower layer Up/Down events
+void PPPFSM_open(struct PppFsm *f);
+void PPPFSM_close(struct PppFsm *f);
+void PPPFSM_lowerUp(struct PppFsm *f);
+void PPPFSM_lowerDown(struct PppFsm *f);
+// A received packet of this protocol, starting at the Code field
+void PPPFSM_input(struct PppFsm *f, uint8_t *packet, int length);
+// Send one packet of this protocol with the given code and identifier
+int PPPFSM_send(struct PppFsm *f, uint8_t code, uint8_t id, const uint8_t *data, int length);
+const char *PPPFSM_stateName(uint8_t state);
+
+#endif
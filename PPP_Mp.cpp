@@ -0,0 +1,273 @@
+#include "PPP_Mp.h"
+#include <string.h>
+#include "DebugMsg.h"
+
+// Sequence numbers are 24 bit, compared in serial number arithmetic
+static int32_t _pppmpDiff(uint32_t a, uint32_t b) {
+  return (int32_t)((a - b) << 8) >> 8;
+}
+
+static void _pppmpDrop(struct PppMpReassembly *r, int s) {
+  pbuf_free(r->slot[s]);
+  r->slot[s] = nullptr;
+  r->count--;
+}
+
+// Give up on everything before 'seq': held fragments are dropped, missing
+// ones counted as lost
+static void _pppmpAdvance(struct PppMpReassembly *r, uint32_t seq) {
+  while (_pppmpDiff(seq, r->nextSeq) > 0) {
+    int s = r->nextSeq & (PPPMP_SLOTS - 1);
+    if (r->slot[s] != nullptr) {
+      _pppmpDrop(r, s);
+      r->stats.rxDropped++;
+    } else {
+      r->stats.rxLost++;
+    }
+    r->nextSeq = (r->nextSeq + 1) & PPPMP_SEQ_MASK;
+    r->synced = true;
+  }
+}
+
+// Whether the fragments held still fit the slots with nextSeq 'back' lower
+static bool _pppmpFitsBack(struct PppMpReassembly *r, int32_t back) {
+  if (back >= PPPMP_SLOTS) {
+    return false;
+  }
+  for (int i = PPPMP_SLOTS - back; i < PPPMP_SLOTS; i++) {
+    if (r->slot[(r->nextSeq + i) & (PPPMP_SLOTS - 1)] != nullptr) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// A missing fragment is lost once every link sent something after it. A
+// link the peer leaves idle holds this back, the slot count still bounds
+// how long.
+static bool _pppmpIsLost(struct PppMpReassembly *r, uint32_t seq) {
+  if (r->links == 0) {
+    return false;
+  }
+  for (int i = 0; i < PPPMP_MAX_LINKS; i++) {
+    if ((r->links & (1 << i)) && _pppmpDiff(r->linkSeq[i], seq) <= 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void PPPMP_init(struct PppMpReassembly *r, uint16_t mrru) {
+  memset(r, 0, sizeof(struct PppMpReassembly));
+  r->mrru = mrru;
+}
+
+void PPPMP_reset(struct PppMpReassembly *r) {
+  for (int s = 0; s < PPPMP_SLOTS; s++) {
+    if (r->slot[s] != nullptr) {
+      _pppmpDrop(r, s);
+    }
+  }
+  r->started = false;
+  r->synced = false;
+  r->links = 0;
+}
+
+void PPPMP_linkDown(struct PppMpReassembly *r, int link) {
+  if (link >= 0 && link < PPPMP_MAX_LINKS) {
+    r->links &= ~(1 << link);
+  }
+}
+
+int PPPMP_input(struct PppMpReassembly *r, int link, struct pbuf *p, int offset) {
+  uint8_t header[PPPMP_HEADER_LENGTH];
+  uint32_t seq;
+  uint8_t flags;
+  int32_t diff;
+  int s;
+
+  if (p->tot_len < offset + PPPMP_HEADER_LENGTH) {
+    db_printf(DB_DEBUG, "PPPMP_input() Short fragment %d\n", p->tot_len);
+    return PPPMP_HELD;
+  }
+  pbuf_copy_partial(p, header, PPPMP_HEADER_LENGTH, offset);
+  flags = header[0] & (PPPMP_BEGIN | PPPMP_END);
+  seq = ((uint32_t)header[1] << 16) | (header[2] << 8) | header[3];
+  r->stats.rxFragments++;
+
+  if (link >= 0 && link < PPPMP_MAX_LINKS) {
+    if ((r->links & (1 << link)) == 0 || _pppmpDiff(seq, r->linkSeq[link]) > 0) {
+      r->linkSeq[link] = seq;
+    }
+    r->links |= 1 << link;
+  }
+
+  if (r->started == false) {
+    r->started = true;
+    r->nextSeq = seq;
+  }
+
+  diff = _pppmpDiff(seq, r->nextSeq);
+  if (diff < 0 && !r->synced && _pppmpFitsBack(r, -diff)) {
+    r->nextSeq = seq;
+    diff = 0;
+  }
+  if (diff < 0) {
+    db_printf(DB_DEBUG, "PPPMP_input() Late or duplicate %u\n", seq);
+    r->stats.rxDropped++;
+    return PPPMP_HELD;
+  }
+
+  // Nearly all frames: not fragmented and in order, nothing to copy
+  if (diff == 0 && r->count == 0 && flags == (PPPMP_BEGIN | PPPMP_END)) {
+    r->nextSeq = (seq + 1) & PPPMP_SEQ_MASK;
+    r->synced = true;
+    if (p->tot_len - offset - PPPMP_HEADER_LENGTH > r->mrru + 2) {
+      db_printf(DB_DEBUG, "PPPMP_input() Frame above MRRU\n");
+      r->stats.rxDropped++;
+      return PPPMP_HELD;
+    }
+    r->stats.rxFrames++;
+    return PPPMP_WHOLE;
+  }
+
+  // Too far ahead to wait for the ones before it
+  if (diff >= PPPMP_SLOTS) {
+    _pppmpAdvance(r, (seq - PPPMP_SLOTS + 1) & PPPMP_SEQ_MASK);
+  }
+
+  s = seq & (PPPMP_SLOTS - 1);
+  if (r->slot[s] != nullptr) {
+    db_printf(DB_DEBUG, "PPPMP_input() Duplicate %u\n", seq);
+    r->stats.rxDropped++;
+    return PPPMP_HELD;
+  }
+  pbuf_ref(p);
+  r->slot[s] = p;
+  r->offset[s] = offset + PPPMP_HEADER_LENGTH;
+  r->flags[s] = flags;
+  r->count++;
+  return PPPMP_HELD;
+}
+
+// Copy the fragments of the frame in the n slots from nextSeq on into one
+// pbuf. It starts two or three bytes in, whatever leaves the IPv4 header
+// behind the protocol field word aligned.
+static struct pbuf *_pppmpJoin(struct PppMpReassembly *r, int n, int length) {
+  struct pbuf *q = nullptr;
+  uint8_t *out;
+  uint8_t first;
+  int align;
+
+  if (length <= r->mrru + 2) {
+    pbuf_copy_partial(r->slot[r->nextSeq & (PPPMP_SLOTS - 1)], &first, 1, r->offset[r->nextSeq & (PPPMP_SLOTS - 1)]);
+    align = (first & 0x01) ? 3 : 2;
+    q = pbuf_alloc(PBUF_RAW, align + length, PBUF_RAM);
+    if (q != nullptr) {
+      pbuf_header(q, -align);
+    } else {
+      db_printf(DB_DEBUG, "_pppmpJoin() pbuf alloc fail\n");
+    }
+  } else {
+    db_printf(DB_DEBUG, "_pppmpJoin() Frame above MRRU %d\n", length);
+  }
+
+  out = q != nullptr ? (uint8_t *)q->payload : nullptr;
+  for (int i = 0; i < n; i++) {
+    int s = r->nextSeq & (PPPMP_SLOTS - 1);
+    struct pbuf *f = r->slot[s];
+    if (out != nullptr) {
+      out += pbuf_copy_partial(f, out, f->tot_len - r->offset[s], r->offset[s]);
+    } else {
+      r->stats.rxDropped++;
+    }
+    _pppmpDrop(r, s);
+    r->nextSeq = (r->nextSeq + 1) & PPPMP_SEQ_MASK;
+  }
+  r->synced = true;
+  return q;
+}
+
+struct pbuf *PPPMP_next(struct PppMpReassembly *r) {
+  while (r->count > 0) {
+    uint32_t seq = r->nextSeq;
+    int length = 0;
+    int n;
+
+    for (n = 0; n < PPPMP_SLOTS; n++) {
+      int s = (seq + n) & (PPPMP_SLOTS - 1);
+      if (r->slot[s] == nullptr || (n > 0 && (r->flags[s] & PPPMP_BEGIN))) {
+        break;
+      }
+      if (n == 0 && (r->flags[s] & PPPMP_BEGIN) == 0) {
+        break;
+      }
+      length += r->slot[s]->tot_len - r->offset[s];
+      if (r->flags[s] & PPPMP_END) {
+        struct pbuf *q = _pppmpJoin(r, n + 1, length);
+        if (q != nullptr) {
+          r->stats.rxFrames++;
+          return q;
+        }
+        break;
+      }
+    }
+    if (_pppmpDiff(r->nextSeq, seq) > 0) {
+      // Joined, or dropped for want of memory or the MRRU
+      continue;
+    }
+
+    int s = (seq + n) & (PPPMP_SLOTS - 1);
+    if (n < PPPMP_SLOTS && r->slot[s] == nullptr) {
+      // A gap: wait for it, unless no link is going to fill it
+      if (!_pppmpIsLost(r, (seq + n) & PPPMP_SEQ_MASK)) {
+        return nullptr;
+      }
+      _pppmpAdvance(r, (seq + n + 1) & PPPMP_SEQ_MASK);
+    } else if (n == 0) {
+      // The middle or end of a frame whose start was lost, or is still on
+      // its way on another link when nothing went up yet
+      if (!r->synced) {
+        return nullptr;
+      }
+      _pppmpAdvance(r, (seq + 1) & PPPMP_SEQ_MASK);
+    } else if (n < PPPMP_SLOTS) {
+      // A new frame begins before this one ended
+      _pppmpAdvance(r, (seq + n) & PPPMP_SEQ_MASK);
+    } else {
+      return nullptr;
+    }
+  }
+  return nullptr;
+}
+
+void PPPMP_buildHeader(uint8_t *buf, uint8_t flags, uint32_t seq) {
+  buf[0] = flags;
+  buf[1] = (seq >> 16) & 0xff;
+  buf[2] = (seq >> 8) & 0xff;
+  buf[3] = seq & 0xff;
+}
+
+int PPPMP_slice(const struct GreIovec *iov, int count, int offset, int length, struct GreIovec *out, int size) {
+  int n = 0;
+
+  for (int i = 0; i < count && length > 0; i++) {
+    if (offset >= iov[i].length) {
+      offset -= iov[i].length;
+      continue;
+    }
+    if (n == size) {
+      return -1;
+    }
+    int take = iov[i].length - offset;
+    if (take > length) {
+      take = length;
+    }
+    out[n].data = iov[i].data + offset;
+    out[n].length = take;
+    n++;
+    length -= take;
+    offset = 0;
+  }
+  return n;
+}
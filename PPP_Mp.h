@@ -0,0 +1,91 @@
+#ifndef PPP_Mp_h
+#define PPP_Mp_h
+
+#include "GRE.h"
+
+// PPP Multilink (RFC 1990). Frames of the bundle travel as fragments with
+// a sequence number in front, spread over the member links and put back
+// together here. Only the long (24 bit) sequence number format is spoken,
+// the short one is rejected in LCP.
+
+#define PPP_MP                0x003d
+
+// LCP options (RFC 1990 section 5.1)
+#define PPP_LCP_MRRU          17
+#define PPP_LCP_SHORT_SEQ     18
+#define PPP_LCP_ENDPOINT      19
+// Endpoint discriminator classes (section 5.1.3)
+#define PPPMP_ED_NULL         0
+#define PPPMP_ED_MAC          3
+#define PPPMP_ED_MAX          20
+
+// Flags in front of the sequence number
+#define PPPMP_BEGIN           0x80
+#define PPPMP_END             0x40
+#define PPPMP_HEADER_LENGTH   4
+#define PPPMP_SEQ_MASK        0xffffff
+
+// Largest reassembled frame we take, protocol field excluded
+#ifndef PPPMP_MRRU
+#define PPPMP_MRRU            1500
+#endif
+#ifndef PPPMP_MAX_LINKS
+#define PPPMP_MAX_LINKS       4
+#endif
+// Fragments held for reassembly (power of two). They are the pbufs the
+// links received, the slot count bounds the RAM they take.
+#define PPPMP_SLOTS           8
+
+struct PppMpStats {
+  uint32_t txFrames;
+  uint32_t txFragments;
+  uint32_t rxFrames;
+  uint32_t rxFragments;
+  uint32_t rxLost;          // sequence numbers that never arrived
+  uint32_t rxDropped;       // fragments thrown away: late, duplicate, or of
+                            // a frame that could not be completed
+};
+
+struct PppMpReassembly {
+  // The fragment with sequence number s waits in slot s % PPPMP_SLOTS
+  struct pbuf *slot[PPPMP_SLOTS];
+  uint16_t offset[PPPMP_SLOTS];   // of the data after the MP header
+  uint8_t flags[PPPMP_SLOTS];
+  int count;
+  uint32_t nextSeq;         // oldest sequence number not delivered yet
+  bool started;
+  // Links deliver out of order from the start, nextSeq moves back to the
+  // first fragments until a frame went up
+  bool synced;
+  // Latest sequence number seen on each link. Every link sends in order,
+  // a fragment below the lowest of them is not coming any more.
+  uint32_t linkSeq[PPPMP_MAX_LINKS];
+  uint8_t links;            // mask of the links that sent fragments
+  uint16_t mrru;
+  struct PppMpStats stats;
+};
+
+void PPPMP_init(struct PppMpReassembly *r, uint16_t mrru);
+// Release the fragments held, the bundle went down
+void PPPMP_reset(struct PppMpReassembly *r);
+// A link left the bundle, its sequence numbers hold nothing back any more
+void PPPMP_linkDown(struct PppMpReassembly *r, int link);
+
+#define PPPMP_HELD      0
+#define PPPMP_WHOLE     1   // a complete frame next in line, nothing held
+
+// A fragment from 'link', its MP header at 'offset' in p. p stays the
+// caller's, a fragment that has to wait takes a reference. PPPMP_WHOLE
+// leaves the frame to the caller: it starts at offset + PPPMP_HEADER_LENGTH.
+int PPPMP_input(struct PppMpReassembly *r, int link, struct pbuf *p, int offset);
+// The next reassembled frame, protocol field first, or null. The pbuf is
+// the caller's to free.
+struct pbuf *PPPMP_next(struct PppMpReassembly *r);
+
+// MP header of a fragment, PPPMP_HEADER_LENGTH bytes
+void PPPMP_buildHeader(uint8_t *buf, uint8_t flags, uint32_t seq);
+// The 'length' bytes at 'offset' of the segments in 'iov', as at most
+// 'size' segments in 'out'. Returns their number, -1 when 'out' is short.
+int PPPMP_slice(const struct GreIovec *iov, int count, int offset, int length, struct GreIovec *out, int size);
+
+#endif
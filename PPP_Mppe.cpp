@@ -0,0 +1,171 @@
+#include "Arduino.h"
+#include "PPP_Mppe.h"
+#include "sha1.h"
+
+#define PPPMPPE_BIT_FLUSHED     0x8000
+#define PPPMPPE_BIT_COMPRESSED  0x2000
+#define PPPMPPE_BIT_ENCRYPTED   0x1000
+#define PPPMPPE_CCOUNT_MASK     0x0fff
+
+void PPPMPPE_rc4Init(struct PppRc4 *rc4, const uint8_t *key, int length) {
+  uint8_t *s = rc4->s;
+  uint8_t j = 0;
+
+  for (int i = 0; i < 256; i++) {
+    s[i] = i;
+  }
+  for (int i = 0, k = 0; i < 256; i++) {
+    uint8_t t = s[i];
+    j += t + key[k];
+    s[i] = s[j];
+    s[j] = t;
+    if (++k == length) {
+      k = 0;
+    }
+  }
+  rc4->i = 0;
+  rc4->j = 0;
+}
+
+// Runs over every encrypted byte, so it lives in IRAM. Indices are kept in
+// registers and the loop is unrolled four times.
+#define PPPMPPE_RC4_ROUND(n) \
+  i = (i + 1) & 0xff; \
+  si = s[i]; \
+  j = (j + si) & 0xff; \
+  sj = s[j]; \
+  s[i] = sj; \
+  s[j] = si; \
+  out[n] = in[n] ^ s[(si + sj) & 0xff];
+
+void ICACHE_RAM_ATTR PPPMPPE_rc4(struct PppRc4 *rc4, const uint8_t *in, uint8_t *out, int length) {
+  uint8_t *s = rc4->s;
+  uint32_t i = rc4->i;
+  uint32_t j = rc4->j;
+  uint32_t si;
+  uint32_t sj;
+
+  while (length >= 4) {
+    PPPMPPE_RC4_ROUND(0)
+    PPPMPPE_RC4_ROUND(1)
+    PPPMPPE_RC4_ROUND(2)
+    PPPMPPE_RC4_ROUND(3)
+    in += 4;
+    out += 4;
+    length -= 4;
+  }
+  while (length > 0) {
+    PPPMPPE_RC4_ROUND(0)
+    in++;
+    out++;
+    length--;
+  }
+
+  rc4->i = i;
+  rc4->j = j;
+}
+
+// GetNewKeyFromSHA() of RFC 3079 section 7.3, followed by the RC4 step of
+// RFC 3078 section 7.3. The initial key skips the RC4 step.
+static void _pppmppeRekey(struct PppMppe *m, bool initial) {
+  static const uint8_t pad1[40] = { 0 };
+  static const uint8_t pad2[40] = {
+    0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2,
+    0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2,
+    0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2,
+    0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2, 0xf2
+  };
+  uint8_t digest[SHA1_BLOCK_SIZE];
+  SHA1_CTX ctx;
+
+  sha1_init(&ctx);
+  sha1_update(&ctx, m->startKey, PPPMPPE_KEY_LENGTH);
+  sha1_update(&ctx, pad1, sizeof(pad1));
+  sha1_update(&ctx, m->sessionKey, PPPMPPE_KEY_LENGTH);
+  sha1_update(&ctx, pad2, sizeof(pad2));
+  sha1_final(&ctx, digest);
+
+  if (initial) {
+    memcpy(m->sessionKey, digest, PPPMPPE_KEY_LENGTH);
+  } else {
+    PPPMPPE_rc4Init(&m->rc4, digest, PPPMPPE_KEY_LENGTH);
+    PPPMPPE_rc4(&m->rc4, digest, m->sessionKey, PPPMPPE_KEY_LENGTH);
+  }
+  PPPMPPE_rc4Init(&m->rc4, m->sessionKey, PPPMPPE_KEY_LENGTH);
+  m->rekeys++;
+}
+
+void PPPMPPE_init(struct PppMppe *m, const uint8_t startKey[PPPMPPE_KEY_LENGTH], bool stateful) {
+  memcpy(m->startKey, startKey, PPPMPPE_KEY_LENGTH);
+  memcpy(m->sessionKey, startKey, PPPMPPE_KEY_LENGTH);
+  m->rekeys = 0;
+  _pppmppeRekey(m, true);
+  // The first packet carries coherency count 0
+  m->ccount = PPPMPPE_CCOUNT_MASK;
+  m->stateful = stateful;
+  m->flush = false;
+  m->discard = false;
+}
+
+uint16_t PPPMPPE_encryptBegin(struct PppMppe *m) {
+  uint16_t header;
+
+  m->ccount = (m->ccount + 1) & PPPMPPE_CCOUNT_MASK;
+  header = m->ccount | PPPMPPE_BIT_ENCRYPTED;
+
+  // Stateless mode changes keys for every packet, stateful mode every 256
+  // packets and when the peer lost sync. The receiver follows the A bit.
+  if (!m->stateful || (m->ccount & 0xff) == 0xff || m->flush) {
+    _pppmppeRekey(m, false);
+    m->flush = false;
+    header |= PPPMPPE_BIT_FLUSHED;
+  }
+  return header;
+}
+
+int PPPMPPE_decryptBegin(struct PppMppe *m, uint16_t header) {
+  uint16_t ccount = header & PPPMPPE_CCOUNT_MASK;
+  bool flushed = (header & PPPMPPE_BIT_FLUSHED) != 0;
+
+  if ((header & (PPPMPPE_BIT_ENCRYPTED | PPPMPPE_BIT_COMPRESSED)) != PPPMPPE_BIT_ENCRYPTED) {
+    return PPPMPPE_DROP;
+  }
+
+  if (!m->stateful) {
+    // Late or repeated packets, their key is gone (RFC 3078 section 8.1)
+    uint16_t ahead = (ccount - m->ccount) & PPPMPPE_CCOUNT_MASK;
+    if (ahead == 0 || ahead > PPPMPPE_CCOUNT_MASK / 2) {
+      return PPPMPPE_DROP;
+    }
+    while (m->ccount != ccount) {
+      _pppmppeRekey(m, false);
+      m->ccount = (m->ccount + 1) & PPPMPPE_CCOUNT_MASK;
+    }
+    return PPPMPPE_OK;
+  }
+
+  // Stateful (RFC 3078 section 8.2): a gap breaks the RC4 stream until the
+  // peer answers our Reset-Request with a flushed packet
+  if (!m->discard) {
+    m->ccount = (m->ccount + 1) & PPPMPPE_CCOUNT_MASK;
+    if (ccount != m->ccount) {
+      m->discard = true;
+      return PPPMPPE_RESYNC;
+    }
+  } else {
+    if (!flushed) {
+      return PPPMPPE_DROP;
+    }
+    // Catch up with the key changes of the flag packets we missed
+    while ((ccount & ~0xff) != (m->ccount & ~0xff)) {
+      _pppmppeRekey(m, false);
+      m->ccount = (m->ccount + 0x100) & PPPMPPE_CCOUNT_MASK;
+    }
+    m->discard = false;
+    m->ccount = ccount;
+  }
+  if (flushed) {
+    _pppmppeRekey(m, false);
+  }
+  return PPPMPPE_OK;
+}
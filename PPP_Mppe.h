@@ -0,0 +1,57 @@
+#ifndef PPP_Mppe_h
+#define PPP_Mppe_h
+
+#include <stdint.h>
+
+// Microsoft Point-to-Point Encryption (RFC 3078), 128-bit keys only. One
+// PppMppe per direction, keyed from the MS-CHAP start keys (RFC 3079).
+
+#define PPP_MPPE          0x00fd    // PPP protocol of encrypted frames
+#define PPP_CCP           0x80fd
+
+// CCP option 18 (MPPE/MPPC) supported bits
+#define PPP_MPPE_OPT      18
+#define PPP_MPPE_H        0x01000000  // stateless, new key for every packet
+#define PPP_MPPE_M        0x00000080  // 56-bit
+#define PPP_MPPE_S        0x00000040  // 128-bit
+#define PPP_MPPE_L        0x00000020  // 40-bit
+#define PPP_MPPE_D        0x00000010  // obsolete
+#define PPP_MPPC_C        0x00000001  // MPPC compression
+
+#define PPPMPPE_KEY_LENGTH  16
+// MPPE header (flags and coherency count) in front of the encrypted data
+#define PPPMPPE_HEADER_LENGTH  2
+
+struct PppRc4 {
+  uint8_t i;
+  uint8_t j;
+  uint8_t s[256];
+};
+
+struct PppMppe {
+  uint8_t startKey[PPPMPPE_KEY_LENGTH];
+  uint8_t sessionKey[PPPMPPE_KEY_LENGTH];
+  struct PppRc4 rc4;
+  uint16_t ccount;
+  bool stateful;
+  bool flush;               // TX: the peer sent a Reset-Request
+  bool discard;             // RX: lost sync, waiting for a flushed packet
+  uint32_t rekeys;
+};
+
+void PPPMPPE_rc4Init(struct PppRc4 *rc4, const uint8_t *key, int length);
+// Encrypt or decrypt, 'in' and 'out' may be the same buffer
+void PPPMPPE_rc4(struct PppRc4 *rc4, const uint8_t *in, uint8_t *out, int length);
+
+void PPPMPPE_init(struct PppMppe *m, const uint8_t startKey[PPPMPPE_KEY_LENGTH], bool stateful);
+// Start an outgoing packet: returns its MPPE header, the RC4 state is
+// ready for the protocol field and data that follow it
+uint16_t PPPMPPE_encryptBegin(struct PppMppe *m);
+
+#define PPPMPPE_OK       0
+#define PPPMPPE_DROP     -1
+#define PPPMPPE_RESYNC   -2   // drop, and ask the peer for a flushed packet
+// Start a received packet with the given MPPE header
+int PPPMPPE_decryptBegin(struct PppMppe *m, uint16_t header);
+
+#endif
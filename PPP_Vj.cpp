@@ -0,0 +1,413 @@
+#include "PPP_Vj.h"
+#include "PacketView.h"
+#include <string.h>
+
+// Bits of the change mask (RFC 1144 section 3.2.2)
+#define PPPVJ_NEW_C       0x40
+#define PPPVJ_NEW_I       0x20
+#define PPPVJ_PUSH        0x10
+#define PPPVJ_NEW_S       0x08
+#define PPPVJ_NEW_A       0x04
+#define PPPVJ_NEW_W       0x02
+#define PPPVJ_NEW_U       0x01
+// Combinations no real change produces, used for the common cases of
+// echoed interactive data and unidirectional data
+#define PPPVJ_SPECIAL_I   (PPPVJ_NEW_S | PPPVJ_NEW_W | PPPVJ_NEW_U)
+#define PPPVJ_SPECIAL_D   (PPPVJ_NEW_S | PPPVJ_NEW_A | PPPVJ_NEW_W | PPPVJ_NEW_U)
+#define PPPVJ_SPECIALS    PPPVJ_SPECIAL_D
+
+#define TCP_FIN   0x01
+#define TCP_SYN   0x02
+#define TCP_RST   0x04
+#define TCP_PSH   0x08
+#define TCP_ACK   0x10
+#define TCP_URG   0x20
+
+static int _pppvjIpHeaderLength(const uint8_t *ip) {
+  return (PV_get<PvIp4::versionIhl>(ip) & 0x0f) * 4;
+}
+
+// Deltas take one byte, or three when zero or above 255
+static uint8_t *_pppvjEncode(uint8_t *cp, uint16_t n) {
+  if (n >= 256 || n == 0) {
+    *cp++ = 0;
+    PV_set<PvBe16>(cp, n);
+    cp += 2;
+  } else {
+    *cp++ = n;
+  }
+  return cp;
+}
+
+static const uint8_t *_pppvjDecode(const uint8_t *cp, const uint8_t *end, uint16_t *n) {
+  if (cp >= end) {
+    return nullptr;
+  }
+  if (*cp != 0) {
+    *n = *cp;
+    return cp + 1;
+  }
+  if (cp + 3 > end) {
+    return nullptr;
+  }
+  *n = PV_get<PvBe16>(cp + 1);
+  return cp + 3;
+}
+
+// Length of the IPv4 and TCP headers of a packet we can compress, 0 if not
+static int _pppvjHeaderLength(const uint8_t *ip, int length) {
+  int ipHl;
+  int tcpHl;
+  int hl;
+
+  if (length < (int)(PvIp4::size + PvTcp::size) || (PV_get<PvIp4::versionIhl>(ip) >> 4) != 4 ||
+      PV_get<PvIp4::protocol>(ip) != 6) {
+    return 0;
+  }
+  ipHl = _pppvjIpHeaderLength(ip);
+  if (ipHl < (int)PvIp4::size || length < ipHl + (int)PvTcp::size) {
+    return 0;
+  }
+  tcpHl = (PV_get<PvTcp::dataOffset>(ip + ipHl) >> 4) * 4;
+  hl = ipHl + tcpHl;
+  if (tcpHl < (int)PvTcp::size || hl > length || hl > PPPVJ_HEADER_MAX) {
+    return 0;
+  }
+  return hl;
+}
+
+static void _pppvjIpChecksum(uint8_t *ip) {
+  int ipHl = _pppvjIpHeaderLength(ip);
+  uint32_t sum = 0;
+
+  PV_set<PvIp4::checksum>(ip, 0);
+  for (int i = 0; i < ipHl; i += 2) {
+    sum += PV_get<PvBe16>(ip + i);
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  PV_set<PvIp4::checksum>(ip, ~sum);
+}
+
+void PPPVJ_initCompressor(struct PppVjCompressor *c, uint8_t maxSlotId, bool compressSlotId) {
+  memset(c, 0, sizeof(*c));
+  c->slotCount = maxSlotId < PPPVJ_MAX_SLOTS ? maxSlotId + 1 : PPPVJ_MAX_SLOTS;
+  c->compressSlotId = compressSlotId;
+  c->lastSlot = 0xff;
+}
+
+void PPPVJ_initDecompressor(struct PppVjDecompressor *d, uint8_t maxSlotId) {
+  memset(d, 0, sizeof(*d));
+  d->slotCount = maxSlotId < PPPVJ_MAX_SLOTS ? maxSlotId + 1 : PPPVJ_MAX_SLOTS;
+  d->lastSlot = 0xff;
+  d->toss = true;
+}
+
+void PPPVJ_toss(struct PppVjDecompressor *d) {
+  d->toss = true;
+}
+
+// Slot of the connection the packet belongs to, or the least recently
+// used one with *found cleared
+static struct PppVjSlot *_pppvjFindSlot(struct PppVjCompressor *c, const uint8_t *ip, bool *found) {
+  const uint8_t *th = ip + _pppvjIpHeaderLength(ip);
+  struct PppVjSlot *victim = &c->slots[0];
+
+  for (int i = 0; i < c->slotCount; i++) {
+    struct PppVjSlot *s = &c->slots[i];
+    if (!s->valid) {
+      victim = s;
+      continue;
+    }
+    const uint8_t *oth = s->header + _pppvjIpHeaderLength(s->header);
+    if (memcmp(s->header + PvIp4::src::offset, ip + PvIp4::src::offset, 8) == 0 &&
+        memcmp(oth, th, PvTcp::destPort::end) == 0) {
+      *found = true;
+      return s;
+    }
+    if (victim->valid && s->lastUsed < victim->lastUsed) {
+      victim = s;
+    }
+  }
+  *found = false;
+  return victim;
+}
+
+uint16_t PPPVJ_compress(struct PppVjCompressor *c, const uint8_t *packet, int length,
+                        uint8_t *out, int *outLength, int *headerLength) {
+  const uint8_t *ip = packet;
+  int hl = _pppvjHeaderLength(ip, length);
+  struct PppVjSlot *s;
+  bool found;
+  uint8_t slotId;
+
+  // Fragments and connection setup or teardown go as plain IPv4
+  if (hl == 0 || c->slotCount == 0 || (PV_get<PvIp4::fragment>(ip) & 0x3fff) != 0) {
+    return 0x0021;
+  }
+  int ipHl = _pppvjIpHeaderLength(ip);
+  const uint8_t *th = ip + ipHl;
+  uint8_t flags = PV_get<PvTcp::flags>(th);
+  if ((flags & (TCP_SYN | TCP_FIN | TCP_RST | TCP_ACK)) != TCP_ACK) {
+    return 0x0021;
+  }
+
+  c->clock++;
+  s = _pppvjFindSlot(c, ip, &found);
+  slotId = s - c->slots;
+
+  if (found) {
+    const uint8_t *oip = s->header;
+    const uint8_t *oth = oip + ipHl;
+    uint8_t deltas[5 * 3];
+    uint8_t *cp = deltas;
+    uint8_t changes = 0;
+    uint16_t oldLength = PV_get<PvIp4::totalLength>(oip);
+    uint32_t deltaA;
+    uint32_t deltaS;
+    uint16_t delta;
+    int n;
+
+    // Everything but the fields with deltas has to be unchanged, options
+    // included
+    if (s->length != hl || PV_get<PvIp4::versionIhl>(oip) != PV_get<PvIp4::versionIhl>(ip) ||
+        PV_get<PvIp4::tos>(oip) != PV_get<PvIp4::tos>(ip) ||
+        PV_get<PvIp4::fragment>(oip) != PV_get<PvIp4::fragment>(ip) ||
+        PV_get<PvIp4::ttl>(oip) != PV_get<PvIp4::ttl>(ip) ||
+        PV_get<PvTcp::dataOffset>(oth) != PV_get<PvTcp::dataOffset>(th) ||
+        memcmp(oip + PvIp4::size, ip + PvIp4::size, ipHl - PvIp4::size) != 0 ||
+        memcmp(oth + PvTcp::size, th + PvTcp::size, hl - ipHl - PvTcp::size) != 0) {
+      goto uncompressed;
+    }
+
+    if (flags & TCP_URG) {
+      cp = _pppvjEncode(cp, PV_get<PvTcp::urgent>(th));
+      changes |= PPPVJ_NEW_U;
+    } else if (PV_get<PvTcp::urgent>(th) != PV_get<PvTcp::urgent>(oth)) {
+      goto uncompressed;
+    }
+
+    delta = PV_get<PvTcp::window>(th) - PV_get<PvTcp::window>(oth);
+    if (delta != 0) {
+      cp = _pppvjEncode(cp, delta);
+      changes |= PPPVJ_NEW_W;
+    }
+
+    deltaA = PV_get<PvTcp::ack>(th) - PV_get<PvTcp::ack>(oth);
+    if (deltaA != 0) {
+      if (deltaA > 0xffff) {
+        goto uncompressed;
+      }
+      cp = _pppvjEncode(cp, deltaA);
+      changes |= PPPVJ_NEW_A;
+    }
+
+    // A sequence number going back is a retransmission, the peer may have
+    // missed the frame that set its state
+    deltaS = PV_get<PvTcp::seq>(th) - PV_get<PvTcp::seq>(oth);
+    if (deltaS != 0) {
+      if (deltaS > 0xffff) {
+        goto uncompressed;
+      }
+      cp = _pppvjEncode(cp, deltaS);
+      changes |= PPPVJ_NEW_S;
+    }
+
+    switch (changes) {
+      case 0:
+        // Data after a pure ack is normal on an interactive connection.
+        // Anything else unchanged is a retransmission or a window probe.
+        if (PV_get<PvIp4::totalLength>(ip) != oldLength && oldLength == hl) {
+          break;
+        }
+        goto uncompressed;
+
+      case PPPVJ_SPECIAL_I:
+      case PPPVJ_SPECIAL_D:
+        // The real change would read as one of the special cases
+        goto uncompressed;
+
+      case PPPVJ_NEW_S | PPPVJ_NEW_A:
+        if (deltaS == deltaA && deltaS == (uint32_t)(oldLength - hl)) {
+          changes = PPPVJ_SPECIAL_I;
+          cp = deltas;
+        }
+        break;
+
+      case PPPVJ_NEW_S:
+        if (deltaS == (uint32_t)(oldLength - hl)) {
+          changes = PPPVJ_SPECIAL_D;
+          cp = deltas;
+        }
+        break;
+    }
+
+    delta = PV_get<PvIp4::id>(ip) - PV_get<PvIp4::id>(oip);
+    if (delta != 1) {
+      cp = _pppvjEncode(cp, delta);
+      changes |= PPPVJ_NEW_I;
+    }
+    if (flags & TCP_PSH) {
+      changes |= PPPVJ_PUSH;
+    }
+
+    memcpy(s->header, ip, hl);
+    s->lastUsed = c->clock;
+
+    n = 0;
+    if (c->compressSlotId && c->lastSlot == slotId) {
+      out[n++] = changes;
+    } else {
+      out[n++] = changes | PPPVJ_NEW_C;
+      out[n++] = slotId;
+      c->lastSlot = slotId;
+    }
+    PV_set<PvBe16>(out + n, PV_get<PvTcp::checksum>(th));  // TCP checksum goes as is
+    n += 2;
+    memcpy(out + n, deltas, cp - deltas);
+    n += cp - deltas;
+
+    *outLength = n;
+    *headerLength = hl;
+    return PPP_VJ_COMP;
+  }
+
+uncompressed:
+  // Full header, it (re)sets the peer's copy of the slot
+  memcpy(s->header, ip, hl);
+  s->length = hl;
+  s->valid = true;
+  s->lastUsed = c->clock;
+  c->lastSlot = slotId;
+
+  memcpy(out, ip, hl);
+  PV_set<PvIp4::protocol>(out, slotId);
+  *outLength = hl;
+  *headerLength = hl;
+  return PPP_VJ_UNCOMP;
+}
+
+bool PPPVJ_uncompressTcp(struct PppVjDecompressor *d, uint8_t *packet, int length) {
+  uint8_t slotId = length >= (int)PvIp4::size ? PV_get<PvIp4::protocol>(packet) : 0xff;
+  int hl;
+
+  if (slotId >= d->slotCount) {
+    d->toss = true;
+    return false;
+  }
+  PV_set<PvIp4::protocol>(packet, 6);
+  hl = _pppvjHeaderLength(packet, length);
+  if (hl == 0) {
+    d->toss = true;
+    return false;
+  }
+
+  struct PppVjSlot *s = &d->slots[slotId];
+  memcpy(s->header, packet, hl);
+  s->length = hl;
+  s->valid = true;
+  d->lastSlot = slotId;
+  d->toss = false;
+  return true;
+}
+
+int PPPVJ_uncompress(struct PppVjDecompressor *d, const uint8_t *data, int length, int frameLength,
+                     uint8_t *header, int *consumed) {
+  const uint8_t *cp = data;
+  const uint8_t *end = data + length;
+  uint16_t deltaU = 0;
+  uint16_t deltaW = 0;
+  uint16_t deltaA = 0;
+  uint16_t deltaS = 0;
+  uint16_t deltaI = 1;
+  uint8_t changes;
+  uint16_t checksum;
+
+  if (length < 3) {
+    goto bad;
+  }
+  changes = *cp++;
+  if (changes & PPPVJ_NEW_C) {
+    if (*cp >= d->slotCount) {
+      goto bad;
+    }
+    d->lastSlot = *cp++;
+    d->toss = false;
+  } else if (d->toss) {
+    return -1;
+  }
+  if (d->lastSlot >= d->slotCount || !d->slots[d->lastSlot].valid || cp + 2 > end) {
+    goto bad;
+  }
+  checksum = PV_get<PvBe16>(cp);
+  cp += 2;
+
+  // Decode everything before touching the slot, a short packet leaves it
+  // as it was
+  if ((changes & PPPVJ_SPECIALS) != PPPVJ_SPECIAL_I && (changes & PPPVJ_SPECIALS) != PPPVJ_SPECIAL_D) {
+    if ((changes & PPPVJ_NEW_U) && (cp = _pppvjDecode(cp, end, &deltaU)) == nullptr) {
+      goto bad;
+    }
+    if ((changes & PPPVJ_NEW_W) && (cp = _pppvjDecode(cp, end, &deltaW)) == nullptr) {
+      goto bad;
+    }
+    if ((changes & PPPVJ_NEW_A) && (cp = _pppvjDecode(cp, end, &deltaA)) == nullptr) {
+      goto bad;
+    }
+    if ((changes & PPPVJ_NEW_S) && (cp = _pppvjDecode(cp, end, &deltaS)) == nullptr) {
+      goto bad;
+    }
+  }
+  if ((changes & PPPVJ_NEW_I) && (cp = _pppvjDecode(cp, end, &deltaI)) == nullptr) {
+    goto bad;
+  }
+
+  {
+    struct PppVjSlot *s = &d->slots[d->lastSlot];
+    uint8_t *ip = s->header;
+    uint8_t *th = ip + _pppvjIpHeaderLength(ip);
+    int hl = s->length;
+    uint32_t lastData = PV_get<PvIp4::totalLength>(ip) - hl;
+    // The special cases are only sent without urgent data
+    uint8_t flags = PV_get<PvTcp::flags>(th) & ~(TCP_PSH | TCP_URG);
+
+    PV_set<PvTcp::checksum>(th, checksum);
+    if (changes & PPPVJ_PUSH) {
+      flags |= TCP_PSH;
+    }
+
+    switch (changes & PPPVJ_SPECIALS) {
+      case PPPVJ_SPECIAL_I:
+        PV_set<PvTcp::ack>(th, PV_get<PvTcp::ack>(th) + lastData);
+        PV_set<PvTcp::seq>(th, PV_get<PvTcp::seq>(th) + lastData);
+        break;
+
+      case PPPVJ_SPECIAL_D:
+        PV_set<PvTcp::seq>(th, PV_get<PvTcp::seq>(th) + lastData);
+        break;
+
+      default:
+        if (changes & PPPVJ_NEW_U) {
+          flags |= TCP_URG;
+          PV_set<PvTcp::urgent>(th, deltaU);
+        }
+        PV_set<PvTcp::window>(th, PV_get<PvTcp::window>(th) + deltaW);
+        PV_set<PvTcp::ack>(th, PV_get<PvTcp::ack>(th) + deltaA);
+        PV_set<PvTcp::seq>(th, PV_get<PvTcp::seq>(th) + deltaS);
+        break;
+    }
+    PV_set<PvTcp::flags>(th, flags);
+    PV_set<PvIp4::id>(ip, PV_get<PvIp4::id>(ip) + deltaI);
+
+    *consumed = cp - data;
+    PV_set<PvIp4::totalLength>(ip, hl + frameLength - *consumed);
+    _pppvjIpChecksum(ip);
+    memcpy(header, ip, hl);
+    return hl;
+  }
+
+bad:
+  d->toss = true;
+  return -1;
+}
@@ -0,0 +1,71 @@
+#ifndef PPP_Vj_h
+#define PPP_Vj_h
+
+#include <stdint.h>
+
+// Van Jacobson TCP/IP header compression (RFC 1144) as negotiated by IPCP
+// option 2. The compressor and decompressor are independent, each keeps
+// the last header of every connection in a slot.
+
+#define PPP_VJ_COMP       0x002d    // TYPE_COMPRESSED_TCP
+#define PPP_VJ_UNCOMP     0x002f    // TYPE_UNCOMPRESSED_TCP
+
+// Fewer slots than the 16 RFC 1144 allows, RAM is short and the proxy
+// only carries a handful of connections at a time
+#define PPPVJ_MAX_SLOTS   8
+// IPv4 and TCP headers, options included
+#define PPPVJ_HEADER_MAX  120
+// Longest compressed header: change mask, slot, checksum and five deltas
+#define PPPVJ_COMP_MAX    (4 + 5 * 3)
+
+struct PppVjSlot {
+  uint8_t header[PPPVJ_HEADER_MAX];
+  uint8_t length;
+  bool valid;
+  uint32_t lastUsed;
+};
+
+struct PppVjCompressor {
+  struct PppVjSlot slots[PPPVJ_MAX_SLOTS];
+  uint8_t slotCount;
+  bool compressSlotId;
+  uint8_t lastSlot;
+  uint32_t clock;
+};
+
+struct PppVjDecompressor {
+  struct PppVjSlot slots[PPPVJ_MAX_SLOTS];
+  uint8_t slotCount;
+  uint8_t lastSlot;
+  bool toss;                // lost sync, wait for an explicit slot id
+};
+
+void PPPVJ_initCompressor(struct PppVjCompressor *c, uint8_t maxSlotId, bool compressSlotId);
+void PPPVJ_initDecompressor(struct PppVjDecompressor *d, uint8_t maxSlotId);
+
+// Look at the IPv4 packet at 'packet', of which 'length' bytes are
+// contiguous. Returns the PPP protocol to send it with:
+//  0x0021  unchanged
+//  0x002f  'out' holds the first *headerLength bytes with the slot id in
+//          the protocol field
+//  0x002d  'out' holds the compressed header that replaces the first
+//          *headerLength bytes
+// 'out' takes PPPVJ_HEADER_MAX bytes.
+uint16_t PPPVJ_compress(struct PppVjCompressor *c, const uint8_t *packet, int length,
+                        uint8_t *out, int *outLength, int *headerLength);
+
+// A received TYPE_UNCOMPRESSED_TCP packet, restored in place to IPv4
+bool PPPVJ_uncompressTcp(struct PppVjDecompressor *d, uint8_t *packet, int length);
+// A received TYPE_COMPRESSED_TCP packet of frameLength bytes, the first
+// 'length' of them at 'data' (PPPVJ_COMP_MAX are always enough). The
+// rebuilt IPv4 and TCP headers are written to 'header' (PPPVJ_HEADER_MAX
+// bytes), *consumed is the length of the compressed header in front of
+// the TCP data. Returns the header length, or -1 when the packet has to
+// be dropped.
+int PPPVJ_uncompress(struct PppVjDecompressor *d, const uint8_t *data, int length, int frameLength,
+                     uint8_t *header, int *consumed);
+// Frames were lost, compressed packets are dropped until the peer names
+// a slot again
+void PPPVJ_toss(struct PppVjDecompressor *d);
+
+#endif
@@ -2,10 +2,15 @@
 #include "PPTP_Client.h"
 #include <ESP8266WiFi.h>
 #include "ESPAsyncTCP.h"
-#include "SyncClient.h"
 #include "md5.h"
 #include "DebugMsg.h"
+#include "PPP_Fsm.h"
 #include "MSCHAP.h"
+#include "PPP_Vj.h"
+#include "PPP_Mppe.h"
+#include "PPP_Deflate.h"
+#include "PPP_Mp.h"
+#include "PacketView.h"
 
 void printIP(ip_addr_t ip) {
   printf("%d.", ip.addr &0xff);
@@ -20,13 +25,14 @@ void printIP(ip_addr_t ip) {
 
 #define PPTPC_printHexDB(level, mem, len) db_printHex(level, mem, len)
 
-struct StartControlConnection _pptpStartConn;
-struct OutGoingCallRequest _pptpOutCallReq;
+uint8_t _pptpStartConn[PvPptpStartControl::size];
+uint8_t _pptpOutCallReq[PvPptpOutCallRequest::size];
 struct OutGoingCallReply _pptpOutCallReply;
-struct SetLinkInfo _pptpSetLinkInfo;
+uint8_t _pptpSetLinkInfo[PvPptpSetLinkInfo::size];
     
-SyncClient _syncClient;
+AsyncClient _pptpClient;
 bool _pptpConnected;
+static bool _pptpFailed;
 char PPTPC_servername[100];
 ip_addr_t PPTPC_serverIP;
 int PPTPC_serverport;
@@ -40,54 +46,266 @@ uint16_t PPTPC_authenProtocol;
 uint8_t PPTPC_authenChapMode;
 uint16_t PPTPC_callId;
 uint16_t PPTPC_peerCallId;
+uint16_t PPTPC_peerRecvWindow;
 uint8_t PPTPC_chapIdentifier;
 uint8_t PPTPC_chapChallenge[256];
 int PPTPC_chapChallengeSize;
-bool PPTPC_chapAuthenStatus;
-bool PPTPC_chapAuthenResponse;
 md5_context_t PPTPC_md5Context;
 MSCHAP_CTX mschap_ctx;
 
-static bool lcpComplete;
-static bool papComplete;
-static bool papLoginState;
-static bool cbcpComplete;
-static int mplsIdentifier;
+// PPP link phases (RFC 1661 section 3.2)
+#define PPTPC_PHASE_DEAD          0
+#define PPTPC_PHASE_ESTABLISH     1
+#define PPTPC_PHASE_AUTHENTICATE  2
+#define PPTPC_PHASE_CALLBACK      3
+#define PPTPC_PHASE_NETWORK       4
+
+// Authentication and callback have no restart timer of their own
+#define PPTPC_PHASE_TIMEOUT_MS    10000
+#define PPTPC_PAP_RESTART_MS      2000
+
+// Frames leave as outer IPv4 + GRE (sequence and ack) + PPP header, the MRU
+// we ask for and the netif MTU are what fits the path after that overhead
+#define PPTPC_PATH_MTU          1500
+#define PPTPC_GRE_OVERHEAD      (20 + 16)
+#define PPTPC_PPP_HEADER_MAX    4
+#define PPTPC_LCP_DEFAULT_MRU   1500
+#define PPTPC_LCP_MIN_MRU       576
+
+// Ask the peer for PFC and ACFC, and use them when it asks for them. A 1 to
+// 3 byte PPP header is off the word alignment lwIP needs for its IPv4
+// headers: frames we build are placed so that the GRE and outer IPv4
+// headers still land aligned in the headroom, received ones are moved back
+// within their own pbuf.
+#ifndef PPTPC_PPP_HEADER_COMPRESSION
+#define PPTPC_PPP_HEADER_COMPRESSION  1
+#endif
+
+// Probe the path with DF-flagged ICMP echoes to the server before the first
+// connect. Off by default, servers that ignore pings are common.
+#ifndef PPTPC_MTU_PROBE
+#define PPTPC_MTU_PROBE         0
+#endif
+#define PPTPC_MTU_PROBE_MIN     576
+#define PPTPC_MTU_PROBE_TIMEOUT_MS  1000
+
+// Ask for MPPE (CCP option 18) after MS-CHAP logins. The keys come from the
+// MS-CHAP exchange, other logins stay unencrypted.
+#ifndef PPTPC_MPPE
+#define PPTPC_MPPE              1
+#endif
+// Refuse to run the link in the clear (require-mppe of pppd): logins that
+// give no MPPE keys and a CCP without MPPE both ways fail it, data waits
+// for MPPE in both directions
+#ifndef PPTPC_MPPE_REQUIRED
+#define PPTPC_MPPE_REQUIRED     0
+#endif
+#if PPTPC_MPPE_REQUIRED && !PPTPC_MPPE
+#error PPTPC_MPPE_REQUIRED needs PPTPC_MPPE
+#endif
+// Encrypted frames carry the MPPE header and the protocol inside
+#define PPTPC_MPPE_OVERHEAD     (PPPMPPE_HEADER_LENGTH + 2)
+// Offer Deflate compression (CCP option 26). MPPE wins when both are on
+// offer, its frames cannot be compressed any more.
+#ifndef PPTPC_DEFLATE
+#define PPTPC_DEFLATE           1
+#endif
+// Repeat a lost Reset-Request while frames are discarded
+#define PPTPC_CCP_RESET_MS      1000
+// Bond more calls to the first one as a Multilink bundle (RFC 1990) when
+// the server takes the MRRU option. Each call is a session of its own on
+// the server, shaped on its own. Off unless asked for, a bundle takes more
+// than one call of the account.
+#ifndef PPTPC_MULTILINK
+#define PPTPC_MULTILINK         0
+#endif
+// Calls in the bundle, the first one included
+#ifndef PPTPC_MP_LINKS
+#define PPTPC_MP_LINKS          GRE_MAX_SESSIONS
+#endif
+#if PPTPC_MP_LINKS > PPPMP_MAX_LINKS
+#error PPTPC_MP_LINKS above PPPMP_MAX_LINKS
+#endif
+// Shorter frames go whole over the least loaded link, longer ones are
+// split over all of them
+#define PPTPC_MP_SPLIT_MIN      256
+// Fragments carry the full PPP header and the MP header
+#define PPTPC_MP_OVERHEAD       (4 + PPPMP_HEADER_LENGTH)
+// Segments of one fragment, its header included
+#define PPTPC_MP_IOV_MAX        6
+
+static uint16_t _pathMtu = PPTPC_PATH_MTU;
+
+struct PppFsm PPTPC_lcp;
+struct PppFsm PPTPC_ipcp;
+struct PppFsm PPTPC_ccp;
+static uint8_t _pppPhase;
+static os_timer_t _pppPhaseTimer;
+static uint32_t _pppPhaseStartMs;
+static uint8_t _papIdentifier;
+static bool _pptpNetifAdded;
+
+// Backoff between reconnect attempts, reset once the link comes up
+#define PPTPC_RECONNECT_MIN_MS  1000
+#define PPTPC_RECONNECT_MAX_MS  60000
+
+static uint32_t _reconnectDelayMs = PPTPC_RECONNECT_MIN_MS;
+static uint32_t _reconnectAtMs;
+static bool _reconnectPending;
+static uint32_t _reconnectCount;
+
+// Our LCP options, cleared when the peer rejects them
+static bool _lcpWantMru;
+static bool _lcpWantMagic;
+static bool _lcpWantCallback;
+static bool _lcpWantPfc;
+static bool _lcpWantAcfc;
+// Compression the peer asked for, applied to the IPv4 frames we send
+static bool _lcpPeerPfc;
+static bool _lcpPeerAcfc;
+static uint16_t _lcpPeerMru = PPTPC_LCP_DEFAULT_MRU;
+static uint16_t _lcpMru;
+static uint32_t _lcpMagic;
+
+// Multilink: our MRRU and endpoint discriminator (the station MAC), and
+// the peer's. The bundle is on once both sides sent an MRRU.
+static bool _lcpWantMrru;
+static bool _lcpWantEndpoint;
+static uint16_t _lcpPeerMrru;
+static uint8_t _lcpPeerEndpoint[1 + PPPMP_ED_MAX];
+static uint8_t _lcpPeerEndpointLength;
+static uint16_t _mpMrru;
+static uint8_t _mpEndpoint[7];
+static bool _mpEnabled;
+static uint32_t _mpTxSeq;
+static uint32_t _mpTxFrames;
+static uint32_t _mpTxFragments;
+static uint32_t _mpRxLost;
+static struct PppMpReassembly _mpRx;
+
+// The other calls of the bundle. They only run LCP and authentication,
+// the network protocols run once, over the bundle.
+#define PPTPC_MP_LINK_IDLE          0
+#define PPTPC_MP_LINK_CALLING       1
+#define PPTPC_MP_LINK_ESTABLISH     2
+#define PPTPC_MP_LINK_AUTHENTICATE  3
+#define PPTPC_MP_LINK_JOINED        4
+
+struct PptpMpLink {
+  uint8_t state;
+  uint8_t index;            // in the bundle, the first call is 0
+  uint16_t callId;
+  uint16_t peerCallId;
+  struct GreSession *session;
+  struct PppFsm lcp;
+  os_timer_t timer;         // call reply, authentication, PAP restart
+  uint32_t startMs;
+  bool wantMru;
+  bool wantMagic;
+  uint32_t magic;
+  uint16_t peerMru;
+  uint16_t peerMrru;
+  bool peerEndpointMatch;   // the server put the call in our bundle
+  uint16_t authenProtocol;
+  uint8_t chapMode;
+  uint8_t papIdentifier;
+};
+
+static struct PptpMpLink _mpLinks[PPTPC_MP_LINKS > 1 ? PPTPC_MP_LINKS - 1 : 1];
+static MSCHAP_CTX _mpMschapCtx;
+
+// LCP Echo keepalive over the tunnel itself. The PPTP Echo only proves the
+// TCP control connection, a black-holed GRE path shows up here. A request
+// goes out when no frame arrived for an interval, the link is declared dead
+// after PPTPC_LCP_ECHO_FAILURE intervals without an answer.
+#ifndef PPTPC_LCP_ECHO_INTERVAL_MS
+#define PPTPC_LCP_ECHO_INTERVAL_MS  5000
+#endif
+#ifndef PPTPC_LCP_ECHO_FAILURE
+#define PPTPC_LCP_ECHO_FAILURE      3
+#endif
+
+static os_timer_t _lcpEchoTimer;
+static uint8_t _lcpEchoId;
+static bool _lcpEchoPending;
+static uint8_t _lcpEchoMisses;
+static uint32_t _lcpEchoSentUs;
+static uint32_t _lcpEchoRxPackets;
+static struct LcpEchoStats _lcpEchoStats;
+
+// VJ header compression (IPCP option 2), negotiated for each direction
+static bool _ipcpWantVj;
+static uint8_t _ipcpVjMaxSlot;
+static bool _ipcpVjCompSlot;
+static bool _ipcpPeerVj;
+static uint8_t _ipcpPeerVjMaxSlot;
+static bool _ipcpPeerVjCompSlot;
+static bool _vjTxEnabled;
+static bool _vjRxEnabled;
+static uint32_t _vjRxGaps;
+static struct PppVjCompressor _vjTx;
+static struct PppVjDecompressor _vjRx;
+
+// MPPE (CCP option 18) and Deflate (option 26). Our request sets how the
+// peer sends to us, the peer's request how we send to it.
+static bool _ccpStarted;
+static bool _ccpCanMppe;
+static bool _ccpWantMppe;
+static uint32_t _ccpMppeBits;
+static uint32_t _ccpPeerMppeBits;
+static bool _ccpWantDeflate;
+static uint8_t _ccpDeflateBits;
+static uint8_t _ccpPeerDeflateBits;
+static uint32_t _ccpResetMs;
+static uint8_t _ccpResetId;
+static bool _mppeTxEnabled;
+static bool _mppeRxEnabled;
+static struct PppMppe _mppeTx;
+static struct PppMppe _mppeRx;
+// Data frames that came in the clear while they had to be encrypted
+static uint32_t _mppeRxCleartext;
+static bool _deflateTxEnabled;
+static bool _deflateRxEnabled;
+static struct PppDeflate _deflateTx;
+static struct PppInflate _deflateRx;
+
 ip_addr_t localIP;
 ip_addr_t remoteIP;
 ip_addr_t netmask;
-
-uint32_t waitTimeoutMs = 5000;
     
-void PPTPC_buildStartControlConnectionRequest(struct StartControlConnection *req);
-void PPTPC_buildOutGoingCallRequest(struct OutGoingCallRequest *req);
-void PPTPC_buildSetLinkInfoRequest(struct SetLinkInfo *req);
+void PPTPC_buildStartControlConnectionRequest(uint8_t *msg);
+void PPTPC_buildOutGoingCallRequest(uint8_t *msg, uint16_t callId);
+void PPTPC_buildSetLinkInfoRequest(uint8_t *msg, uint16_t peerCallId);
 bool PPTPC_startControlConnection();
-bool PPTPC_outGoingCall();
+bool PPTPC_outGoingCall(uint16_t callId);
     
-bool PPTPC_pppLcpConfig();
-bool PPTPC_pppPap();
-bool PPTPC_pppCbcp();
-bool PPTPC_pppIpcp();
-bool PPTPC_pppMplscp();
+bool PPTPC_pppPap(struct GreSession *session, uint8_t identifier);
 int PPTPC_pppPapOptions(uint8_t *buff, char *username, char *password);
 int PPTPC_getPppLcpConfigOptions(uint8_t *buf, int bufsize);
 
 bool PPTPC_pptpInterfaceInit();
-
-static int PPTPC_receiveCallback(uint8_t *data, int length);
+static void PPTPC_interfaceTaskInit();
+extern struct netif pptpLwip_netif;
+
+static void PPTPC_pppStart();
+static void PPTPC_pppSetTxCompression(bool acfc, bool pfc);
+static uint16_t PPTPC_pppMaxMru();
+static uint16_t PPTPC_pppLinkMtu();
+static int PPTPC_receiveCallback(struct GreSession *session, struct pbuf *p);
+static int PPTPC_receiveControl(uint8_t *data, int length);
+static bool PPTPC_mpCallReply(uint8_t *msg);
+static bool PPTPC_mpCallDisconnect(uint16_t callId);
+static void PPTPC_mpCloseLinks(bool clearCalls);
+static void PPTPC_mpOpenLinks();
  
 void PPTPC_init(const char *server, int port, const char *user, const char *password) {
   _pptpConnected = false;
-  papComplete = false;
-  lcpComplete = false;
-  papLoginState = false;
-  cbcpComplete = false;
-  mplsIdentifier = -1;
+  _pptpFailed = false;
+  _pppPhase = PPTPC_PHASE_DEAD;
   PPTPC_chapChallengeSize = 0;
-  PPTPC_chapAuthenStatus = false;
-  PPTPC_chapAuthenResponse = false;
+  PPTPC_authenProtocol = 0;
   PPTPC_authenChapMode = 0;
+  PPTPC_interfaceTaskInit();
 
   localIP.addr = 0x00000000;
   remoteIP.addr = 0x0000000;
@@ -109,1056 +327,3622 @@ void PPTPC_init(const char *server, int port, const char *user, const char *pass
 
 void PPTPC_reinit() {
   _pptpConnected = false;
-  papComplete = false;
-  lcpComplete = false;
-  papLoginState = false;
-  cbcpComplete = false;
-  mplsIdentifier = -1;
+  _pptpFailed = false;
+  _pppPhase = PPTPC_PHASE_DEAD;
   PPTPC_chapChallengeSize = 0;
-  PPTPC_chapAuthenStatus = false;
-  PPTPC_chapAuthenResponse = false;
+  PPTPC_authenProtocol = 0;
   PPTPC_authenChapMode = 0;
   
-  localIP.addr = 0x00000000;
+  // The last local address is asked for again, the server usually agrees
   remoteIP.addr = 0x0000000;
   netmask.addr = 0xffffffff;
   
 }
 
-bool PPTPC_startControlConnection() {
-  struct StartControlConnection *conn;
+// PPTP control message types (RFC 2637 section 2)
+#define PPTP_START_CTRL_CONN_RQST   1
+#define PPTP_START_CTRL_CONN_RPLY   2
+#define PPTP_STOP_CTRL_CONN_RQST    3
+#define PPTP_STOP_CTRL_CONN_RPLY    4
+#define PPTP_ECHO_RQST              5
+#define PPTP_ECHO_RPLY              6
+#define PPTP_OUT_CALL_RQST          7
+#define PPTP_OUT_CALL_RPLY          8
+#define PPTP_CALL_CLEAR_RQST        12
+#define PPTP_CALL_DISCONNECT_NOTIFY 13
+#define PPTP_WAN_ERROR_NOTIFY       14
+#define PPTP_SET_LINK_INFO          15
+
+#define PPTP_MAGIC_COOKIE           0x1a2b3c4d
+
+// Messages are built and read through the PacketView.h layouts, the
+// structs of PPTP_Client.h have to agree with them
+static_assert(sizeof(struct PptpControlHeader) == PvPptp::size, "PptpControlHeader layout");
+static_assert(sizeof(struct StartControlConnection) == PvPptpStartControl::size, "StartControlConnection layout");
+static_assert(sizeof(struct StopControlConnection) == PvPptpStopControl::size, "StopControlConnection layout");
+static_assert(sizeof(struct EchoRequest) == PvPptpEcho::requestSize, "EchoRequest layout");
+static_assert(sizeof(struct EchoReply) == PvPptpEcho::replySize, "EchoReply layout");
+static_assert(sizeof(struct OutGoingCallRequest) == PvPptpOutCallRequest::size, "OutGoingCallRequest layout");
+static_assert(sizeof(struct OutGoingCallReply) == PvPptpOutCallReply::size, "OutGoingCallReply layout");
+static_assert(sizeof(struct CallClearRequest) == PvPptpCallClear::size, "CallClearRequest layout");
+static_assert(sizeof(struct CallDisconnectNotify) == PvPptpCallDisconnect::size, "CallDisconnectNotify layout");
+static_assert(sizeof(struct SetLinkInfo) == PvPptpSetLinkInfo::size, "SetLinkInfo layout");
+
+// Control channel states
+#define PPTPC_CTRL_IDLE         0
+#define PPTPC_CTRL_CONNECTING   1
+#define PPTPC_CTRL_WAIT_SCCRP   2
+#define PPTPC_CTRL_WAIT_OCRP    3
+#define PPTPC_CTRL_ESTABLISHED  4
+#define PPTPC_CTRL_CLOSED       5
+
+// Longest control message is Call-Disconnect-Notify (148 bytes)
+#define PPTPC_CTRL_MSG_MAX      256
+#define PPTPC_CTRL_TIMEOUT_MS   10000
+
+// Echo-Request is sent after this long without any control message, the
+// peer is declared dead after PPTPC_ECHO_MAX_MISSES unanswered ones
+#define PPTPC_ECHO_IDLE_MS      15000
+#define PPTPC_ECHO_MAX_MISSES   3
+
+struct PptpControlHandler {
+  uint16_t type;
+  uint16_t minLength;
+  void (*handler)(uint8_t *msg, int length);
+};
+
+static uint8_t _ctrlState;
+static uint8_t _ctrlMsg[PPTPC_CTRL_MSG_MAX];
+static int _ctrlMsgLength;
+static os_timer_t _ctrlTimer;
+
+static os_timer_t _echoTimer;
+static uint32_t _echoIdentifier;
+static uint32_t _echoSentUs;
+static bool _echoPending;
+static uint8_t _echoMisses;
+static uint32_t _echoRttUs;
+static uint32_t _echoSrttUs;
+
+// Connect timing, the attempt in progress is _ctRing[_ctHead] while
+// _ctActive. Reconnects of PPP alone are not timed.
+static struct PptpConnectTiming _ctRing[PPTPC_CT_HISTORY];
+static int _ctHead;
+static uint32_t _ctAttempts;
+static uint32_t _ctMarkUs;
+static bool _ctActive;
+
+static const char *_ctNames[PPTPC_CT_PHASES] = {
+  "tcp", "start_control", "call", "link_info", "gre", "lcp", "auth", "cbcp", "ipcp", "netif"
+};
+
+static void PPTPC_connectBegin() {
+  _ctHead = (_ctHead + 1) % PPTPC_CT_HISTORY;
+  memset(&_ctRing[_ctHead], 0, sizeof(struct PptpConnectTiming));
+  _ctRing[_ctHead].attempt = ++_ctAttempts;
+  _ctRing[_ctHead].startMs = millis();
+  _ctMarkUs = micros();
+  _ctActive = true;
+}
 
-  db_printf(DB_DEBUG, "PPTPC_startControlConnection() Begin\n");
-  conn = &_pptpStartConn;
-  PPTPC_buildStartControlConnectionRequest(conn);
-  
-  if(_syncClient.write((uint8_t*)conn, sizeof(struct StartControlConnection)) <= 0){
-    db_printf(DB_DEBUG, "PPTPC_startControlConnection() Write state 1 fail\n");
-    return false;
-    
+// End of 'phase', phases passed over (CBCP without callback) take 0
+static void PPTPC_connectMark(int phase) {
+  struct PptpConnectTiming *t = &_ctRing[_ctHead];
+  uint32_t now = micros();
+
+  if (!_ctActive || phase < t->phases) {
+    return;
+  }
+  t->phaseUs[phase] = now - _ctMarkUs;
+  t->phases = phase + 1;
+  _ctMarkUs = now;
+  if (phase == PPTPC_CT_NETIF) {
+    uint32_t totalUs = 0;
+    for (int i = 0; i < PPTPC_CT_PHASES; i++) {
+      totalUs += t->phaseUs[i];
+    }
+    _ctActive = false;
+    db_printf(DB_INFO, "PPTPC_connectMark() Connect %u took %u ms\n", t->attempt, totalUs / 1000);
   }
+}
+
+int PPTPC_getConnectTimings(struct PptpConnectTiming *timings, int size) {
+  int n = 0;
 
-  while(_syncClient.connected() && _syncClient.available() < 156){
-      delay(10);
+  while (n < size && n < PPTPC_CT_HISTORY && (uint32_t)n < _ctAttempts) {
+    timings[n] = _ctRing[(_ctHead + PPTPC_CT_HISTORY - n) % PPTPC_CT_HISTORY];
+    n++;
   }
+  return n;
+}
+
+const char *PPTPC_connectPhaseName(int phase) {
+  return (phase >= 0 && phase < PPTPC_CT_PHASES) ? _ctNames[phase] : "";
+}
+
+static void PPTPC_controlFail(const char *reason) {
+  db_printf(DB_INFO, "PPTPC_controlFail() %s\n", reason);
+  os_timer_disarm(&_ctrlTimer);
+  os_timer_disarm(&_echoTimer);
+  _ctrlState = PPTPC_CTRL_CLOSED;
+  _pptpFailed = true;
+  _pptpClient.close(true);
+}
+
+static void PPTPC_controlTimeout(void *arg) {
+  PPTPC_controlFail("Control connection timeout");
+}
+
+static void PPTPC_controlWait(uint8_t state) {
+  _ctrlState = state;
+  os_timer_disarm(&_ctrlTimer);
+  os_timer_arm(&_ctrlTimer, PPTPC_CTRL_TIMEOUT_MS, false);
+}
 
-  if (_syncClient.available() != 156) {
-    db_printf(DB_DEBUG, "PPTPC_startControlConnection() Expect 156 returnn but %d\n", _syncClient.available());
+static bool PPTPC_controlWrite(const void *msg, int length) {
+  if (_pptpClient.space() < (size_t)length) {
+    db_printf(DB_DEBUG, "PPTPC_controlWrite() No space for %d bytes\n", length);
+    return false;
+  }
+  if (_pptpClient.write((const char *)msg, length) != (size_t)length) {
+    db_printf(DB_DEBUG, "PPTPC_controlWrite() Write fail\n");
     return false;
   }
+  return true;
+}
 
-  memset(conn, 0, sizeof(struct StartControlConnection));
-  _syncClient.read((uint8_t*)conn, sizeof(_pptpStartConn));
-  
-  db_printf(DB_DEBUG, "Server Hostname: %s\n", conn->hostname);
-  db_printf(DB_DEBUG, "Server Vender: %s\n", conn->venderString);
+// Header of a control message of 'length' bytes, the rest zeroed
+static void PPTPC_buildControlHeader(uint8_t *msg, int length, uint16_t controlType) {
+  memset(msg, 0, length);
+  PV_set<PvPptp::length>(msg, length);
+  PV_set<PvPptp::messageType>(msg, 1);  // Control Message
+  PV_set<PvPptp::magic>(msg, PPTP_MAGIC_COOKIE);
+  PV_set<PvPptp::controlType>(msg, controlType);
+}
+
+bool PPTPC_startControlConnection() {
+  uint8_t *conn;
 
-  if (conn->resultCode != 1) {
-    db_printf(DB_DEBUG, "PPTPC_startControlConnection() result code error %d\n", conn->resultCode);
+  db_printf(DB_DEBUG, "PPTPC_startControlConnection() Begin\n");
+  conn = _pptpStartConn;
+  PPTPC_buildStartControlConnectionRequest(conn);
+  
+  if (PPTPC_controlWrite(conn, PvPptpStartControl::size) != true) {
+    db_printf(DB_DEBUG, "PPTPC_startControlConnection() Write state 1 fail\n");
     return false;
   }
 
-  db_printf(DB_DEBUG, "PPTPC_startControlConnection() Success\n");
+  PPTPC_controlWait(PPTPC_CTRL_WAIT_SCCRP);
   return true;
 }
 
-bool PPTPC_outGoingCall() {
-  struct OutGoingCallRequest *conn;
-  struct OutGoingCallReply *resp;
+bool PPTPC_outGoingCall(uint16_t callId) {
+  uint8_t *conn;
 
   db_printf(DB_DEBUG, "PPTPC_outGoingCall() Begin\n");
   
-  conn = &_pptpOutCallReq;
-  resp = &_pptpOutCallReply;
+  conn = _pptpOutCallReq;
   
-  PPTPC_buildOutGoingCallRequest(conn);
-  db_printf(DB_DEBUG, "PPTPC_outGoingCall() Use Call ID: %d\n", ntohs(conn->callId));
+  PPTPC_buildOutGoingCallRequest(conn, callId);
+  db_printf(DB_DEBUG, "PPTPC_outGoingCall() Use Call ID: %d\n", PV_get<PvPptpOutCallRequest::callId>(conn));
   
-  if(_syncClient.write((uint8_t*)conn, sizeof(struct OutGoingCallRequest)) <= 0){
+  if (PPTPC_controlWrite(conn, PvPptpOutCallRequest::size) != true) {
     db_printf(DB_DEBUG, "PPTPC_outGoingCall() Write state 1 fail\n");
     return false;
-    
   }
 
-  while(_syncClient.connected() && _syncClient.available() < 32){
-      delay(10);
+  // Calls of a Multilink bundle go out on the established connection and
+  // time out on their own
+  if (_ctrlState != PPTPC_CTRL_ESTABLISHED) {
+    PPTPC_controlWait(PPTPC_CTRL_WAIT_OCRP);
   }
+  return true;
+}
 
-  if (_syncClient.available() != 32) {
-    db_printf(DB_DEBUG, "PPTPC_outGoingCall() Expect 32 returnn but %d\n", _syncClient.available());
-    return false;
-  }
+// Call-Clear-Request for one of our calls, while the connection is up
+static void PPTPC_callClear(uint16_t callId) {
+  uint8_t req[PvPptpCallClear::size];
 
-   memset(resp, 0, sizeof(struct OutGoingCallReply));
-  _syncClient.read((uint8_t*)resp, sizeof(OutGoingCallReply));
-  
-  if (resp->resultCode != 1) {
-    db_printf(DB_DEBUG, "PPTPC_outGoingCall() result code error %d\n", resp->resultCode);
-    return false;
+  if (_ctrlState != PPTPC_CTRL_ESTABLISHED) {
+    return;
   }
-
-  PPTPC_peerCallId = ntohs(resp->callId);
-  db_printf(DB_DEBUG, "PPTPC_outGoingCall() Server(peer) Call ID: %d\n", PPTPC_peerCallId);
-  db_printf(DB_DEBUG, "PPTPC_outGoingCall() Success\n");
-  return true;
+  PPTPC_buildControlHeader(req, sizeof(req), PPTP_CALL_CLEAR_RQST);
+  PV_set<PvPptpCallClear::callId>(req, callId);
+  PPTPC_controlWrite(req, sizeof(req));
 }
 
 bool PPTPC_setLinkInfo() {
-  struct SetLinkInfo *conn;
-  struct SetLinkInfo *resp;
+  uint8_t *conn;
 
   db_printf(DB_DEBUG, "PPTPC_setLinkInfo() Begin\n");
   
-  conn = &_pptpSetLinkInfo;
-  resp = &_pptpSetLinkInfo;
+  conn = _pptpSetLinkInfo;
   
-  PPTPC_buildSetLinkInfoRequest(conn);
+  PPTPC_buildSetLinkInfoRequest(conn, PPTPC_peerCallId);
   
-  if(_syncClient.write((uint8_t*)conn, sizeof(struct SetLinkInfo)) <= 0){
+  if (PPTPC_controlWrite(conn, PvPptpSetLinkInfo::size) != true) {
     db_printf(DB_DEBUG, "PPTPC_setLinkInfo() Write state 1 fail\n");
     return false;
-    
-  }
-
-  while(_syncClient.connected() && _syncClient.available() < 24){
-      delay(10);
-  }
-
-  if (_syncClient.available() != 24) {
-    db_printf(DB_DEBUG, "PPTPC_setLinkInfo() Expect 24 returnn but %d\n", _syncClient.available());
-    return false;
-  }
-
-   memset(resp, 0, sizeof(struct SetLinkInfo));
-  _syncClient.read((uint8_t*)resp, sizeof(SetLinkInfo));
-  
-  if (ntohs(resp->peerCallId) != PPTPC_callId) {
-    db_printf(DB_DEBUG, "PPTPC_setLinkInfo() callId error %d\n", ntohs(resp->peerCallId));
-    return false;
   }
 
   db_printf(DB_DEBUG, "PPTPC_setLinkInfo() Success\n");
   return true;
 }
 
-int PPTPC_getPppLcpConfigOptions(uint8_t *buf, int bufsize) {
-  buf[0] = 0x01;  // Max Receive Unit
-  buf[1] = 0x04;  // length = 4
-  buf[2] = 0x05;  // |
-  buf[3] = 0x78;  // |- 1400
-
-  buf[4] = 0x05;  // Magic Number
-  buf[5] = 0x06;  // length = 6
-  buf[6] = 0x1c;  // |
-  buf[7] = 0xb4;  // |
-  buf[8] = 0x54;  // |
-  buf[9] = 0x69;  // | - 0x1cb45469
-
-  buf[10] = 0x0d; // Callback
-  buf[11] = 0x03; // length = 3
-  buf[12] = 0x06; // Operation: Location is determined during CBCP negotiation(6)
-
-  return 13;
-}
-
-bool PPTPC_pppLcpConfig() {
-  int greSize;
-  int packetSize = 0;
-  uint8_t lcpOptions[30];
-  int lcpOptionsLength;
-  struct PtpPacket *ptp;
-  struct PppLcpPacket *lcp;
-
-  db_printf(DB_DEBUG, "PPTPC_pppLcpConfig() Begin\n");
-  memset(lcpOptions, 0, 30);
-  
-  ptp = (struct PtpPacket*)lcpOptions;
-  ptp->address = 0xff;
-  ptp->control = 0x03;
-  ptp->protocol = htons(0xc021);  // LCP Protocol
+// Control traffic of any kind shows the peer is alive, the keepalive
+// only speaks up when the channel has been quiet
+static void PPTPC_echoRestart() {
+  if (_ctrlState != PPTPC_CTRL_ESTABLISHED || _echoPending) {
+    return;
+  }
+  os_timer_disarm(&_echoTimer);
+  os_timer_arm(&_echoTimer, PPTPC_ECHO_IDLE_MS, false);
+}
 
-  lcpOptionsLength = PPTPC_getPppLcpConfigOptions(&lcpOptions[8], 30);
-  
-  lcp = (struct PppLcpPacket*)&lcpOptions[4];
-  lcp->code = 0x01; // config request
-  lcp->identifier = 0x00; //id
-  lcp->length = htons(lcpOptionsLength + 4);
-  
-  int ret = GRE_write(lcpOptions, lcpOptionsLength + 4 + 4);
-  db_printf(DB_DEBUG, "PPTPC_pppLcpConfig() GRE_write Length = %d\n", ret);
-
-  uint32_t tm = millis();
-  while (lcpComplete != true) {
-    delay(100);
-    db_printf(DB_DEBUG, ". ");
-    if (millis() - tm > waitTimeoutMs) {
-      db_printf(DB_DEBUG, "PPTPC_pppLcpConfig() lcpComplete Wait timeout!!!\n");
-      break;
+static void PPTPC_echoTimeout(void *arg) {
+  uint8_t req[PvPptpEcho::requestSize];
+
+  if (_echoPending) {
+    _echoMisses++;
+    db_printf(DB_INFO, "PPTPC_echoTimeout() No Echo-Reply, miss %d\n", _echoMisses);
+    if (_echoMisses >= PPTPC_ECHO_MAX_MISSES) {
+      PPPFSM_lowerDown(&PPTPC_ccp);
+      PPPFSM_lowerDown(&PPTPC_ipcp);
+      PPPFSM_lowerDown(&PPTPC_lcp);
+      PPTPC_controlFail("Peer dead, Echo-Request unanswered");
+      return;
     }
   }
 
-  if (lcpComplete == true) {
-    db_printf(DB_DEBUG, "PPTPC_pppLcpConfig() Success\n");
-    return true;
-  }
+  PPTPC_buildControlHeader(req, sizeof(req), PPTP_ECHO_RQST);
+  PV_set<PvPptpEcho::identifier>(req, ++_echoIdentifier);
 
-  db_printf(DB_DEBUG, "PPTPC_pppLcpConfig() Fail\n");
-  return false;  
-}
+  _echoPending = true;
+  _echoSentUs = system_get_time();
+  PPTPC_controlWrite(req, sizeof(req));
 
-int PPTPC_pppPapOptions(uint8_t *buff, char *username, char *password) {
-  int len;
-  len = 1 + strlen(username) + 1 + strlen(password);
-  buff[0] = strlen(username);
-  buff++;
-  memcpy(buff, username, strlen(username));
-  buff += strlen(username);
-  buff[0] = strlen(password);
-  buff++;
-  memcpy(buff, password, strlen(password));
- 
-  return len;
+  // Unanswered requests are repeated at the same interval
+  os_timer_disarm(&_echoTimer);
+  os_timer_arm(&_echoTimer, PPTPC_ECHO_IDLE_MS, false);
 }
 
-bool PPTPC_pppChapMd5() {
-  uint8_t md5Result[16];
-  int pppSize;
-  int chapSize;
-  uint8_t buff[50];
-  struct PtpPacket *ptp;
-
-  db_printf(DB_DEBUG, "PPTPC_pppChapMd5() Begin\n");
-  memset(buff, 0, 50);
-  
-  db_printf(DB_DEBUG, "PPTPC_pppChapMd5() Wait for chap challenge\n");
-  while (PPTPC_chapChallengeSize <= 0) {
-    db_printf(DB_DEBUG, "+ ");
-    delay(100);
-  }
-
-  db_printf(DB_DEBUG, "PPTPC_pppChapMd5() Calc MD5\n");
-  MD5Init(&PPTPC_md5Context);
-  MD5Update(&PPTPC_md5Context, (uint8_t*)&PPTPC_chapIdentifier, 1);
-  MD5Update(&PPTPC_md5Context, (uint8_t*)PPTPC_password, strlen(PPTPC_password));
-  MD5Update(&PPTPC_md5Context, (uint8_t*)PPTPC_chapChallenge, PPTPC_chapChallengeSize);
-  MD5Final(md5Result, &PPTPC_md5Context);
+static void PPTPC_echoStart() {
+  _echoPending = false;
+  _echoMisses = 0;
+  os_timer_disarm(&_echoTimer);
+  os_timer_setfn(&_echoTimer, PPTPC_echoTimeout, nullptr);
+  PPTPC_echoRestart();
+}
 
-  db_printf(DB_DEBUG, "PPTPC_pppChapMd5() CHAP response...\n");
-  PPTPC_printHexDB(DB_DEBUG, md5Result, 16);
-  chapSize = 1+1+2+1+16+strlen(PPTPC_username);
-  pppSize = 4 + chapSize;
-  buff[0] = 0xff;
-  
-  buff[1] = 0x03;
-  
-  buff[2] = 0xc2;
-  buff[3] = 0x23;
+uint32_t PPTPC_getEchoRttUs() {
+  return _echoRttUs;
+}
 
-  buff[4] = 0x02;
+uint32_t PPTPC_getEchoSrttUs() {
+  return _echoSrttUs;
+}
 
-  buff[5] = PPTPC_chapIdentifier;
+uint32_t PPTPC_getMppeCleartextDrops() {
+  return _mppeRxCleartext;
+}
 
-  buff[6] = chapSize >> 8;
-  buff[7] = chapSize & 0xff;
+void PPTPC_getCompressionStats(struct PppDeflateStats *tx, struct PppDeflateStats *rx) {
+  *tx = _deflateTx.stats;
+  *rx = _deflateRx.stats;
+}
 
-  buff[8] = 16;
+static void PPTPC_handleStartControlConnectionReply(uint8_t *msg, int length) {
+  char *hostname = (char *)&msg[PvPptpStartControl::hostname];
+  char *vendor = (char *)&msg[PvPptpStartControl::vendor];
+  uint8_t resultCode = PV_get<PvPptpStartControl::resultCode>(msg);
 
-  int i;
-  for (i=0; i< 16; i++) {
-    buff[i+9] = md5Result[i];
+  if (_ctrlState != PPTPC_CTRL_WAIT_SCCRP) {
+    db_printf(DB_DEBUG, "PPTPC_handleStartControlConnectionReply() Unexpected, drop\n");
+    return;
   }
-  
-  memcpy(&buff[i +9], PPTPC_username, strlen(PPTPC_username));
 
-  int ret = GRE_write(buff, pppSize);
-  db_printf(DB_DEBUG, "PPTPC_pppChapMd5() GRE_write length = %d\n", ret);
+  hostname[PvPptpStartControl::stringLength - 1] = 0;
+  vendor[PvPptpStartControl::stringLength - 1] = 0;
+  db_printf(DB_DEBUG, "Server Hostname: %s\n", hostname);
+  db_printf(DB_DEBUG, "Server Vender: %s\n", vendor);
 
-  uint32_t tm = millis();
-  while (PPTPC_chapAuthenResponse != true) {
-    delay(100);
-    db_printf(DB_DEBUG, "+ ");
-    if (millis() - tm > 10000) {
-      db_printf(DB_DEBUG, "Timout!!! ");
-      break;
-    }
+  if (resultCode != 1) {
+    db_printf(DB_DEBUG, "PPTPC_handleStartControlConnectionReply() result code error %d\n", resultCode);
+    PPTPC_controlFail("Start-Control-Connection refused");
+    return;
   }
 
-  if (PPTPC_chapAuthenStatus == true) {
-    db_printf(DB_DEBUG, "PPTPC_pppChapMd5() Login Complete\n");
-    return true;
+  db_printf(DB_DEBUG, "PPTPC_handleStartControlConnectionReply() Success\n");
+  PPTPC_connectMark(PPTPC_CT_START_CONTROL);
+  PPTPC_callId = random(0x10000); // 16 bit random
+  if (PPTPC_outGoingCall(PPTPC_callId) != true) {
+    PPTPC_controlFail("PPTPC_outGoingCall() Fail");
   }
-
-  db_printf(DB_DEBUG, "PPTPC_pppChapMd5() Login Fail\n");
-  return false;
 }
 
-bool PPTPC_pppChapMsChap() {
-  uint8_t chapResponse[100];
-  int pppSize;
-  int chapSize;
-  uint8_t buff[100];
-  struct PtpPacket *ptp;
+static void PPTPC_handleOutGoingCallReply(uint8_t *msg, int length) {
+  uint8_t resultCode = PV_get<PvPptpOutCallReply::resultCode>(msg);
 
-  db_printf(DB_DEBUG, "PPTPC_pppChapMsChap() Begin\n");
-  memset(buff, 0, 200);
-  
-  db_printf(DB_DEBUG, "PPTPC_pppChapMsChap() Wait for chap challenge\n");
-  while (PPTPC_chapChallengeSize <= 0) {
-    db_printf(DB_DEBUG, "+ ");
-    delay(100);
+  if (PPTPC_mpCallReply(msg)) {
+    return;
+  }
+  if (_ctrlState != PPTPC_CTRL_WAIT_OCRP || PV_get<PvPptpOutCallReply::peerCallId>(msg) != PPTPC_callId) {
+    db_printf(DB_DEBUG, "PPTPC_handleOutGoingCallReply() Unexpected, drop\n");
+    return;
   }
-  
-  db_printf(DB_DEBUG, "PPTPC_pppChapMsChap() Calc MSCHAP2\n");
-  MSCHAP_GetResponse(&mschap_ctx, PPTPC_username, PPTPC_password, chapResponse);
-  db_printf(DB_DEBUG, "PPTPC_pppChapMsChap() CHAP response...\n");
-  PPTPC_printHexDB(DB_DEBUG, chapResponse, 49);
-  chapSize = 1+1+2+1+49+strlen(PPTPC_username);
-  pppSize = 4 + chapSize;
-  buff[0] = 0xff;
-  
-  buff[1] = 0x03;
-  
-  buff[2] = 0xc2;
-  buff[3] = 0x23;
-
-  buff[4] = 0x02;
 
-  buff[5] = PPTPC_chapIdentifier;
+  if (resultCode != 1) {
+    db_printf(DB_DEBUG, "PPTPC_handleOutGoingCallReply() result code error %d\n", resultCode);
+    PPTPC_controlFail("Outgoing-Call refused");
+    return;
+  }
 
-  buff[6] = chapSize >> 8;
-  buff[7] = chapSize & 0xff;
+  memcpy(&_pptpOutCallReply, msg, sizeof(struct OutGoingCallReply));
+  PPTPC_peerCallId = PV_get<PvPptpOutCallReply::callId>(msg);
+  PPTPC_peerRecvWindow = PV_get<PvPptpOutCallReply::recvWindowSize>(msg);
+  db_printf(DB_DEBUG, "PPTPC_handleOutGoingCallReply() Server(peer) Call ID: %d\n", PPTPC_peerCallId);
+  db_printf(DB_DEBUG, "PPTPC_handleOutGoingCallReply() Server(peer) Receive Window: %d\n", PPTPC_peerRecvWindow);
 
-  buff[8] = 49;
+  os_timer_disarm(&_ctrlTimer);
+  _ctrlState = PPTPC_CTRL_ESTABLISHED;
+  PPTPC_connectMark(PPTPC_CT_CALL);
+  PPTPC_echoStart();
 
-  int i;
-  for (i=0; i< 49; i++) {
-    buff[i+9] = chapResponse[i];
+  if (PPTPC_setLinkInfo() != true) {
+    PPTPC_controlFail("PPTPC_setLinkInfo() Fail");
+    return;
   }
-  
-  memcpy(&buff[i +9], PPTPC_username, strlen(PPTPC_username));
+  PPTPC_connectMark(PPTPC_CT_LINK_INFO);
 
-  int ret = GRE_write(buff, pppSize);
-  db_printf(DB_DEBUG, "PPTPC_pppChapMsChap() GRE_write length = %d\n", ret);
-
-  uint32_t tm = millis();
-  while (PPTPC_chapAuthenResponse != true) {
-    delay(100);
-    db_printf(DB_DEBUG, "+ ");
-    if (millis() - tm > 10000) {
-      db_printf(DB_DEBUG, "Timout!!! ");
-      break;
-    }
+  // Begin GRE, the server address was resolved by PPTPC_init()
+  if (GRE_initAddr(&PPTPC_serverIP, PPTPC_callId, PPTPC_peerCallId) != true) {
+    PPTPC_controlFail("GRE_initAddr() Fail");
+    return;
   }
+  GRE_setPeerWindow(PPTPC_peerRecvWindow);
+  GRE_setProtocolType(0x880b);  // PPP
+  GRE_setRecvCallback(&PPTPC_receiveCallback);
+  PPTPC_connectMark(PPTPC_CT_GRE);
+
+  // LCP, authentication, CBCP and IPCP run from received packets and
+  // timers from here on, PPTPC_isConnected() tells when the link is up
+  PPTPC_pppStart();
+}
 
-  if (PPTPC_chapAuthenStatus == true) {
-    db_printf(DB_DEBUG, "PPTPC_pppChapMsChap() Login Complete\n");
-    return true;
-  }
+static void PPTPC_handleSetLinkInfo(uint8_t *msg, int length) {
+  uint16_t peerCallId = PV_get<PvPptpSetLinkInfo::peerCallId>(msg);
 
-  db_printf(DB_DEBUG, "PPTPC_pppChapMsChap() Login Fail\n");
-  return false;
+  if (peerCallId != PPTPC_callId) {
+    db_printf(DB_DEBUG, "PPTPC_handleSetLinkInfo() callId error %d\n", peerCallId);
+    return;
+  }
+  db_printf(DB_DEBUG, "PPTPC_handleSetLinkInfo() ACCM send 0x%08X receive 0x%08X\n",
+            PV_get<PvPptpSetLinkInfo::sendAccm>(msg), PV_get<PvPptpSetLinkInfo::receiveAccm>(msg));
 }
 
-bool PPTPC_pppPap() {
-  int pppSize;
-  int papSize;
-  uint8_t buff[50];
-  struct PtpPacket *ptp;
-  struct PppPapPacket *pap;
-
-  db_printf(DB_DEBUG, "PPTPC_pppPap() Begin\n");
-  
-  memset(buff, 0, 50);
+static void PPTPC_handleEchoRequest(uint8_t *msg, int length) {
+  uint32_t identifier = PV_get<PvPptpEcho::identifier>(msg);
+  uint8_t reply[PvPptpEcho::replySize];
 
-  papSize = 4 + PPTPC_pppPapOptions(&buff[8], PPTPC_username, PPTPC_password);
-  pppSize = 4 + papSize;
-  
-  ptp = (struct PtpPacket*)buff;
-  ptp->address = 0xff;
-  ptp->control = 0x03;
-  ptp->protocol = htons(0xc023);  // PPP PAP Protocol
+  PPTPC_buildControlHeader(reply, sizeof(reply), PPTP_ECHO_RPLY);
+  PV_set<PvPptpEcho::identifier>(reply, identifier);
+  PV_set<PvPptpEcho::resultCode>(reply, 1);
 
-  pap = (struct PppPapPacket*)&buff[4];
-  pap->code = 0x01; // authen request
-  pap->identifier = 0x00; //id
-  pap->length = htons(papSize);
+  db_printf(DB_DEBUG, "PPTPC_handleEchoRequest() Identifier 0x%08X\n", identifier);
+  PPTPC_controlWrite(reply, sizeof(reply));
+}
 
-  int ret = GRE_write(buff, pppSize);
-  db_printf(DB_DEBUG, "PPTPC_pppPap() GRE_write length = %d\n", ret);
+static void PPTPC_handleEchoReply(uint8_t *msg, int length) {
+  uint32_t identifier = PV_get<PvPptpEcho::identifier>(msg);
 
-  while (papComplete != true) {
-    delay(100);
-    db_printf(DB_DEBUG, ". ");
+  db_printf(DB_DEBUG, "PPTPC_handleEchoReply() Identifier 0x%08X\n", identifier);
+  if (_echoPending == false || identifier != _echoIdentifier) {
+    return;
   }
 
-  if (papLoginState == true) {
-    db_printf(DB_DEBUG, "PPTPC_pppPap() Login Complete\n");
-    return true;
-
+  _echoRttUs = system_get_time() - _echoSentUs;
+  if (_echoSrttUs == 0) {
+    _echoSrttUs = _echoRttUs;
+  } else {
+    _echoSrttUs += ((int32_t)_echoRttUs - (int32_t)_echoSrttUs) / 8;
   }
+  db_printf(DB_DEBUG, "PPTPC_handleEchoReply() RTT %d us, smoothed %d us\n", _echoRttUs, _echoSrttUs);
 
-  db_printf(DB_DEBUG, "PPTPC_pppPap() Login Fail (user/pass Wrong)\n");
-  return false;
+  _echoPending = false;
+  _echoMisses = 0;
 }
 
+static void PPTPC_handleCallDisconnect(uint8_t *msg, int length) {
+  uint16_t callId = PV_get<PvPptpCallDisconnect::callId>(msg);
 
-bool PPTPC_pppCbcp() {
-  db_printf(DB_DEBUG, "PPTPC_pppCbcp() Begin\n");
-  while (cbcpComplete != true) {
-    delay(100);
-    db_printf(DB_DEBUG, ". ");
+  if (PPTPC_mpCallDisconnect(callId)) {
+    return;
+  }
+  if (callId != PPTPC_peerCallId) {
+    db_printf(DB_DEBUG, "PPTPC_handleCallDisconnect() callId error %d\n", callId);
+    return;
   }
 
-  db_printf(DB_DEBUG, "PPTPC_pppCbcp() Complete\n");
-  return true;
+  db_printf(DB_INFO, "PPTPC_handleCallDisconnect() Call cleared by server, result %d\n",
+            PV_get<PvPptpCallDisconnect::resultCode>(msg));
+  PPPFSM_lowerDown(&PPTPC_ccp);
+  PPPFSM_lowerDown(&PPTPC_ipcp);
+  PPPFSM_lowerDown(&PPTPC_lcp);
+  PPTPC_controlFail("Call disconnected");
 }
 
-bool PPTPC_pppIpcp() {
-  int pppSize;
-  int ipcpSize;
-  uint8_t buff[50], *options;
-  struct PtpPacket *ptp;
-  struct PppPapPacket *ipcp;
-  int ret;
+static void PPTPC_handleStopControlConnection(uint8_t *msg, int length) {
+  uint8_t reply[PvPptpStopControl::size];
 
-  db_printf(DB_DEBUG, "PPTPC_pppIpcp() Begin\n");
-  
-  while (remoteIP.addr == 0x00000000) {
-    delay(100);
-    db_printf(DB_DEBUG, ". ");
-  }
+  PPTPC_buildControlHeader(reply, sizeof(reply), PPTP_STOP_CTRL_CONN_RPLY);
+  PV_set<PvPptpStopControl::reason>(reply, 1);   // OK
 
-  db_printf(DB_DEBUG, "PPTPC_pppIpcp() Remote IP Address: %d.%d.%d.%d\n", remoteIP.addr & 0xff, (remoteIP.addr >> 8) & 0xff, (remoteIP.addr >> 16) & 0xff, (remoteIP.addr >> 24) & 0xff);
-  db_printf(DB_DEBUG, "PPTPC_pppIpcp() Get Remote IP Complete\n");
+  db_printf(DB_INFO, "PPTPC_handleStopControlConnection() Stop requested by server\n");
+  PPTPC_controlWrite(reply, sizeof(reply));
+  PPPFSM_lowerDown(&PPTPC_ccp);
+  PPPFSM_lowerDown(&PPTPC_ipcp);
+  PPPFSM_lowerDown(&PPTPC_lcp);
+  PPTPC_controlFail("Control connection stopped");
+}
 
-  memset(buff, 0, 50);
+static const struct PptpControlHandler _ctrlHandlers[] = {
+  { PPTP_START_CTRL_CONN_RPLY,    PvPptpStartControl::size,          PPTPC_handleStartControlConnectionReply },
+  { PPTP_STOP_CTRL_CONN_RQST,     PvPptpStopControl::size,           PPTPC_handleStopControlConnection },
+  { PPTP_ECHO_RQST,               PvPptpEcho::requestSize,           PPTPC_handleEchoRequest },
+  { PPTP_ECHO_RPLY,               PvPptpEcho::replySize,             PPTPC_handleEchoReply },
+  { PPTP_OUT_CALL_RPLY,           PvPptpOutCallReply::size,          PPTPC_handleOutGoingCallReply },
+  { PPTP_CALL_DISCONNECT_NOTIFY,  PvPptpCallDisconnect::headerSize,  PPTPC_handleCallDisconnect },
+  { PPTP_SET_LINK_INFO,           PvPptpSetLinkInfo::size,           PPTPC_handleSetLinkInfo },
+};
+
+static void PPTPC_controlDispatch(uint8_t *msg, int length) {
+  uint16_t type = PV_get<PvPptp::controlType>(msg);
+
+  if (PV_get<PvPptp::messageType>(msg) != 1 || PV_get<PvPptp::magic>(msg) != PPTP_MAGIC_COOKIE) {
+    PPTPC_controlFail("Bad control message header");
+    return;
+  }
 
-  options = &buff[8];
-  *options++ = 0x03;  // type ip
-  *options++ = 6;     // ip option length
-  
+  for (unsigned int i = 0; i < sizeof(_ctrlHandlers) / sizeof(_ctrlHandlers[0]); i++) {
+    if (_ctrlHandlers[i].type != type) {
+      continue;
+    }
+    if (length < _ctrlHandlers[i].minLength) {
+      db_printf(DB_DEBUG, "PPTPC_controlDispatch() Type %d too short %d\n", type, length);
+      return;
+    }
+    _ctrlHandlers[i].handler(msg, length);
+    PPTPC_echoRestart();
+    return;
+  }
 
-  ipcpSize = 4 + 6;
-  pppSize = 4 + ipcpSize;
-  
-  ptp = (struct PtpPacket*)buff;
-  ptp->address = 0xff;
-  ptp->control = 0x03;
-  ptp->protocol = htons(0x8021);  // PPP IPCP Protocol
+  db_printf(DB_DEBUG, "PPTPC_controlDispatch() Type %d ignored\n", type);
+}
 
-  ipcp = (struct PppPapPacket*)&buff[4];
-  ipcp->code = 0x01; // authen request
-  ipcp->identifier = 0x00; //id
-  ipcp->length = htons(ipcpSize);
+// Messages may arrive split over several segments or several in one, they
+// are framed by the length field at their start
+static void PPTPC_controlData(void *arg, AsyncClient *client, void *data, size_t len) {
+  uint8_t *src = (uint8_t *)data;
 
-  ret = GRE_write(buff, pppSize);
-  db_printf(DB_DEBUG, "PPTPC_pppIpcp() GRE_write length=%d\n", ret);
+  while (len > 0 && _ctrlState != PPTPC_CTRL_CLOSED) {
+    int need = (_ctrlMsgLength < 2) ? 2 : PV_get<PvPptp::length>(_ctrlMsg);
+    int n = need - _ctrlMsgLength;
+    if (n > (int)len) {
+      n = len;
+    }
+    memcpy(&_ctrlMsg[_ctrlMsgLength], src, n);
+    _ctrlMsgLength += n;
+    src += n;
+    len -= n;
+
+    if (_ctrlMsgLength == 2) {
+      need = PV_get<PvPptp::length>(_ctrlMsg);
+      if (need < (int)PvPptp::size || need > PPTPC_CTRL_MSG_MAX) {
+        PPTPC_controlFail("Bad control message length");
+        return;
+      }
+      continue;
+    }
 
-  while (localIP.addr == 0x00000000) {
-    delay(100);
-    db_printf(DB_DEBUG, ". ");
+    if (_ctrlMsgLength >= 2 && _ctrlMsgLength == need) {
+      PPTPC_controlDispatch(_ctrlMsg, _ctrlMsgLength);
+      _ctrlMsgLength = 0;
+    }
   }
+}
 
-  db_printf(DB_DEBUG, "PPTPC_pppIpcp() Local IP Address: %d.%d.%d.%d\n", localIP.addr & 0xff, (localIP.addr >> 8) & 0xff, (localIP.addr >> 16) & 0xff, (localIP.addr >> 24) & 0xff);
-  db_printf(DB_DEBUG, "PPTPC_pppIpcp() Success\n");
-  return true;
+static void PPTPC_controlConnected(void *arg, AsyncClient *client) {
+  db_printf(DB_DEBUG, "PPTPC_controlConnected() Connected\n");
+  PPTPC_connectMark(PPTPC_CT_TCP);
+  _pptpClient.setNoDelay(true);
+  if (PPTPC_startControlConnection() != true) {
+    PPTPC_controlFail("PPTPC_startControlConnection() Fail");
+  }
 }
 
-bool PPTPC_pppMplscp() {
-  int pppSize;
-  int mplscpSize;
-  uint8_t buff[50], *options;
-  struct PtpPacket *ptp;
-  struct PppPapPacket *mplscp;
-  int ret;
+static void PPTPC_controlDisconnected(void *arg, AsyncClient *client) {
+  db_printf(DB_INFO, "PPTPC_controlDisconnected() Control connection closed\n");
+  os_timer_disarm(&_ctrlTimer);
+  os_timer_disarm(&_echoTimer);
+  _ctrlState = PPTPC_CTRL_CLOSED;
+  _pptpFailed = true;
+}
 
-  db_printf(DB_DEBUG, "PPTPC_pppMplscp() Begin\n");
-  
-  while (mplsIdentifier < 0) {
-    delay(100);
-    db_printf(DB_DEBUG, ". ");
-  }
+static void PPTPC_controlError(void *arg, AsyncClient *client, int8_t error) {
+  db_printf(DB_INFO, "PPTPC_controlError() %s\n", AsyncClient::errorToString(error));
+}
 
-  db_printf(DB_DEBUG, "PPTPC_pppMplscp() Receive MPLSCP ID: %d\n", mplsIdentifier);
+// Multilink options, sent on every call of the bundle
+static int PPTPC_mpLcpOptions(uint8_t *buf, bool mrru, bool endpoint) {
+  int n = 0;
 
-  //Next sent Protocol reject for MPLS
-  memset(buff, 0, 50);
+  if (mrru) {
+    buf[n++] = PPP_LCP_MRRU;
+    buf[n++] = 0x04;  // length = 4
+    PV_set<PvBe16>(&buf[n], _mpMrru);
+    n += 2;
+  }
 
-  options = &buff[10];
-  *options++ = 0x01;  // Config request
-  *options++ = mplsIdentifier;     // id
-  *options++ = 0x00;  // |
-  *options++ = 0x04;  // |- length
-  
+  if (endpoint) {
+    buf[n++] = PPP_LCP_ENDPOINT;
+    buf[n++] = 2 + sizeof(_mpEndpoint);
+    memcpy(&buf[n], _mpEndpoint, sizeof(_mpEndpoint));
+    n += sizeof(_mpEndpoint);
+  }
 
-  mplscpSize = 6 + 4;
-  pppSize = 4 + mplscpSize;
-  
-  ptp = (struct PtpPacket*)buff;
-  ptp->address = 0xff;
-  ptp->control = 0x03;
-  ptp->protocol = htons(0xc021);  // PPP LCP Protocol
-
-  mplscp = (struct PppPapPacket*)&buff[4];
-  mplscp->code = 0x08; // Protocol reject
-  mplscp->identifier = 0x10; //id
-  mplscp->length = htons(mplscpSize);
-  buff[8] = 0x82; // |
-  buff[9] = 0x81; // |- mplscp
-
-  ret = GRE_write(buff, pppSize);
-  db_printf(DB_DEBUG, "PPTPC_pppMplscp() GRE_write length=%d\n", ret);
-  
-  db_printf(DB_DEBUG, "PPTPC_pppMplscp() Success\n");
-  return true;
+  return n;
 }
 
-int PPTPC_writeData(uint8_t *data, int length) {
-  int pppSize;
-  int ipv4Size;
-  uint8_t buff[1450], *p;
-  struct PtpPacket *ptp;
-  int ret;
-  
-  db_printf(DB_DEBUG, "PPTPC_writeData() Begin\n");
-  
-  memset(buff, 0, 1450);  
+int PPTPC_getPppLcpConfigOptions(uint8_t *buf, int bufsize) {
+  int n = 0;
 
-  ipv4Size = length;
-  pppSize = 4 + ipv4Size;
-  
-  ptp = (struct PtpPacket*)buff;
-  ptp->address = 0xff;
-  ptp->control = 0x03;
-  ptp->protocol = htons(0x0021);  // PPP IPv4 Protocol
+  if (_lcpWantMru) {
+    buf[n++] = 0x01;  // Max Receive Unit
+    buf[n++] = 0x04;  // length = 4
+    PV_set<PvBe16>(&buf[n], _lcpMru);
+    n += 2;
+  }
 
-  p = &buff[4];
-  memcpy(p, data, length);
+  if (_lcpWantMagic) {
+    buf[n++] = 0x05;  // Magic Number
+    buf[n++] = 0x06;  // length = 6
+    PV_set<PvBe32>(&buf[n], _lcpMagic);
+    n += 4;
+  }
 
-  ret = GRE_write(buff, pppSize);
-  db_printf(DB_DEBUG, "PPTPC_writeData() GRE_write len = %d Success\n", ret);
+  if (_lcpWantCallback) {
+    buf[n++] = 0x0d; // Callback
+    buf[n++] = 0x03; // length = 3
+    buf[n++] = 0x06; // Operation: Location is determined during CBCP negotiation(6)
+  }
 
-  
-  return length;
+  if (_lcpWantPfc) {
+    buf[n++] = 0x07; // Protocol Field Compression
+    buf[n++] = 0x02; // length = 2
+  }
+
+  if (_lcpWantAcfc) {
+    buf[n++] = 0x08; // Address and Control Field Compression
+    buf[n++] = 0x02; // length = 2
+  }
+
+  n += PPTPC_mpLcpOptions(&buf[n], _lcpWantMrru, _lcpWantMrru && _lcpWantEndpoint);
+  return n;
 }
 
-#define PPTP_IF_TASK_PRIO 1
-#define PPTP_IF_TASK_QUEUE_SIZE 2
-os_event_t pptpInterfaceTaskQueue[PPTP_IF_TASK_QUEUE_SIZE];
+static int PPTPC_pppOutput(struct PppFsm *f, uint8_t *frame, int length) {
+  return GRE_write(frame, length);
+}
 
-struct netif pptpLwip_netif;
+static int PPTPC_mpWritev(const struct GreIovec *iov, int count);
 
-//ESP stack -> GRE
-err_t ICACHE_FLASH_ATTR PPTPC_interfaceOutput(struct netif *netif, struct pbuf *p, const ip_addr_t *ipaddr) {
-  uint8_t *data = (uint8_t*)p->payload;
+// IPCP and CCP run over the bundle, their frames are fragments like the
+// data once Multilink is on
+static int PPTPC_ncpOutput(struct PppFsm *f, uint8_t *frame, int length) {
+  struct GreIovec iov;
 
-  db_printf(DB_DEBUG, "PPTPC_interfaceOutput() ESP->VPN Length=%d Begin\n", p->len);
-  
-  if (data[9] == 0x2f) {
-    db_printf(DB_DEBUG, "PPTPC_interfaceOutput() skip GRE\n");
-    return 0;
+  if (!_mpEnabled) {
+    return GRE_write(frame, length);
   }
-  
-  PPTPC_printHexDB( DB_DEBUG, (uint8_t*)p->payload, p->len); 
-  db_printf(DB_DEBUG, "\n");
-    
-  PPTPC_writeData((uint8_t*)p->payload, p->len);
-  db_printf(DB_DEBUG, "PPTPC_interfaceOutput() Success\n");
-  return 0;
+  iov.data = frame + 2;   // no address and control field
+  iov.length = length - 2;
+  return PPTPC_mpWritev(&iov, 1);
 }
 
-// GRE -> ESP Stack
-void ICACHE_FLASH_ATTR PPTPC_interfaceInput(uint8_t *data, uint32_t len) {
-
-  db_printf(DB_DEBUG, "PPTPC_interfaceInput() VPN->ESP Length=%d Begin\n", len);
+// Give up on the link, LCP terminates it and reports back through
+// PPTPC_lcpFinished()
+static void PPTPC_pppFail(const char *reason) {
+  db_printf(DB_INFO, "PPTPC_pppFail() %s\n", reason);
+  os_timer_disarm(&_pppPhaseTimer);
+  PPPFSM_close(&PPTPC_lcp);
+}
 
-  struct pbuf *pb;
+static void PPTPC_pppArmPhaseTimer(uint32_t ms) {
+  os_timer_disarm(&_pppPhaseTimer);
+  os_timer_arm(&_pppPhaseTimer, ms, false);
+}
 
-  pb = pbuf_alloc(PBUF_LINK, len, PBUF_RAM);
-  if (pb == NULL) {
-    db_printf(DB_DEBUG, "PPTPC_interfaceInput() pbuf_alloc is null\n");
+static void PPTPC_pppNetwork() {
+  db_printf(DB_DEBUG, "PPTPC_pppNetwork() Begin\n");
+  PPTPC_connectMark(PPTPC_CT_CBCP);
+  os_timer_disarm(&_pppPhaseTimer);
+
+#if PPTPC_MPPE || PPTPC_DEFLATE
+  // MPPE keys only come out of MS-CHAP
+  _ccpCanMppe = PPTPC_MPPE && PPTPC_authenProtocol == 0xc223 &&
+                (PPTPC_authenChapMode == CHAP_MSCHAP1 || PPTPC_authenChapMode == CHAP_MSCHAP2);
+  _ccpWantMppe = _ccpCanMppe;
+  if (PPTPC_MPPE_REQUIRED && !_ccpCanMppe) {
+    PPTPC_pppFail("MPPE required, the login gave no keys");
     return;
   }
+#endif
 
-  PPTPC_printHexDB( DB_DEBUG, data, len); 
-    
-  pbuf_take(pb, data, len);
-  // Post it to the send task
-  system_os_post(PPTP_IF_TASK_PRIO, 0, (os_param_t)pb);
-  db_printf(DB_DEBUG, "PPTPC_interfaceInput() Success\n");
-}
-
-err_t ICACHE_FLASH_ATTR PPTPC_pptpLwipInit(struct netif *netif) {
-  db_printf(DB_DEBUG, "PPTPC_pptpLwipInit() Begin\n");
-  //NETIF_INIT_SNMP(netif, snmp_ifType_other, 0);
-  netif->name[0] = 'p';
-  netif->name[1] = 't';
+  _pppPhase = PPTPC_PHASE_NETWORK;
+  PPPFSM_lowerUp(&PPTPC_ipcp);
+  PPPFSM_open(&PPTPC_ipcp);
 
-  netif->output = PPTPC_interfaceOutput;
-  netif->mtu = 1400;
-  netif->flags = NETIF_FLAG_LINK_UP;
+#if PPTPC_MPPE || PPTPC_DEFLATE
+  if (_ccpWantMppe || _ccpWantDeflate) {
+    _ccpStarted = true;
+    PPPFSM_lowerUp(&PPTPC_ccp);
+    PPPFSM_open(&PPTPC_ccp);
+  }
+#endif
 
-  db_printf(DB_DEBUG, "PPTPC_pptpLwipInit() Success\n");
-  return 0;
+  if (_mpEnabled) {
+    PPTPC_mpOpenLinks();
+  }
 }
 
-static void ICACHE_FLASH_ATTR pptpInterfaceTask(os_event_t *e) {
-  db_printf(DB_DEBUG, "pptpInterfaceTask() Begin\n");
-  struct pbuf *pb = (struct pbuf *)e->par;
-  if (pb == NULL) {
-    db_printf(DB_DEBUG, "pptpInterfaceTask()  pb us null\n");
+static void PPTPC_pppAuthenticated() {
+  db_printf(DB_DEBUG, "PPTPC_pppAuthenticated() Login Complete\n");
+  PPTPC_connectMark(PPTPC_CT_AUTH);
+
+  // The peer acknowledged our Callback option, CBCP comes next
+  if (_lcpWantCallback) {
+    _pppPhase = PPTPC_PHASE_CALLBACK;
+    _pppPhaseStartMs = millis();
+    PPTPC_pppArmPhaseTimer(PPTPC_PHASE_TIMEOUT_MS);
     return;
   }
-  
-  if (pptpLwip_netif.input(pb, &pptpLwip_netif) != ERR_OK) {
-    db_printf(DB_DEBUG, "pptpInterfaceTask() pptpLwip_netif.input != OK\n");
-    pbuf_free(pb);
-  }
 
-  db_printf(DB_DEBUG, "pptpInterfaceTask() End\n");
+  PPTPC_pppNetwork();
 }
 
-bool PPTPC_pptpInterfaceInit() {
-
-  system_os_task(pptpInterfaceTask, PPTP_IF_TASK_PRIO, pptpInterfaceTaskQueue, PPTP_IF_TASK_QUEUE_SIZE);
-
-  netif_add(&pptpLwip_netif, &localIP, &netmask, &remoteIP, NULL, PPTPC_pptpLwipInit, ip_input);
-  netif_set_up(&pptpLwip_netif);
+int PPTPC_pppPapOptions(uint8_t *buff, char *username, char *password) {
+  int len;
+  len = 1 + strlen(username) + 1 + strlen(password);
+  buff[0] = strlen(username);
+  buff++;
+  memcpy(buff, username, strlen(username));
+  buff += strlen(username);
+  buff[0] = strlen(password);
+  buff++;
+  memcpy(buff, password, strlen(password));
+ 
+  return len;
+}
+
+bool PPTPC_pppChapMd5(struct GreSession *session, uint8_t identifier, const uint8_t *challenge, int challengeSize) {
+  uint8_t md5Result[16];
+  int pppSize;
+  int chapSize;
+  uint8_t buff[50 + sizeof(PPTPC_username)];
+
+  db_printf(DB_DEBUG, "PPTPC_pppChapMd5() Begin\n");
+  memset(buff, 0, sizeof(buff));
+
+  db_printf(DB_DEBUG, "PPTPC_pppChapMd5() Calc MD5\n");
+  MD5Init(&PPTPC_md5Context);
+  MD5Update(&PPTPC_md5Context, &identifier, 1);
+  MD5Update(&PPTPC_md5Context, (uint8_t*)PPTPC_password, strlen(PPTPC_password));
+  MD5Update(&PPTPC_md5Context, challenge, challengeSize);
+  MD5Final(md5Result, &PPTPC_md5Context);
+
+  db_printf(DB_DEBUG, "PPTPC_pppChapMd5() CHAP response...\n");
+  PPTPC_printHexDB(DB_DEBUG, md5Result, 16);
+  chapSize = PvChap::value + 16 + strlen(PPTPC_username);
+  pppSize = PvPpp::size + chapSize;
+  PV_set<PvPpp::address>(buff, 0xff);
+  PV_set<PvPpp::control>(buff, 0x03);
+  PV_set<PvPpp::protocol>(buff, 0xc223);  // PPP CHAP Protocol
+
+  uint8_t *chap = &buff[PvPpp::size];
+  PV_set<PvPppCp::code>(chap, 0x02);      // response
+  PV_set<PvPppCp::identifier>(chap, identifier);
+  PV_set<PvPppCp::length>(chap, chapSize);
+  PV_set<PvChap::valueSize>(chap, 16);
+  memcpy(&chap[PvChap::value], md5Result, 16);
+  memcpy(&chap[PvChap::value + 16], PPTPC_username, strlen(PPTPC_username));
+
+  int ret = GRE_sessionWrite(session, buff, pppSize);
+  db_printf(DB_DEBUG, "PPTPC_pppChapMd5() GRE_sessionWrite length = %d\n", ret);
+  return ret >= 0;
+}
+
+bool PPTPC_pppChapMsChap(struct GreSession *session, MSCHAP_CTX *ctx, uint8_t identifier) {
+  uint8_t chapResponse[100];
+  int pppSize;
+  int chapSize;
+  uint8_t buff[100 + sizeof(PPTPC_username)];
+
+  db_printf(DB_DEBUG, "PPTPC_pppChapMsChap() Begin\n");
+  memset(buff, 0, sizeof(buff));
+
+  db_printf(DB_DEBUG, "PPTPC_pppChapMsChap() Calc MSCHAP2\n");
+  MSCHAP_GetResponse(ctx, PPTPC_username, PPTPC_password, chapResponse);
+  db_printf(DB_DEBUG, "PPTPC_pppChapMsChap() CHAP response...\n");
+  PPTPC_printHexDB(DB_DEBUG, chapResponse, 49);
+  chapSize = PvChap::value + 49 + strlen(PPTPC_username);
+  pppSize = PvPpp::size + chapSize;
+  PV_set<PvPpp::address>(buff, 0xff);
+  PV_set<PvPpp::control>(buff, 0x03);
+  PV_set<PvPpp::protocol>(buff, 0xc223);  // PPP CHAP Protocol
+
+  uint8_t *chap = &buff[PvPpp::size];
+  PV_set<PvPppCp::code>(chap, 0x02);      // response
+  PV_set<PvPppCp::identifier>(chap, identifier);
+  PV_set<PvPppCp::length>(chap, chapSize);
+  PV_set<PvChap::valueSize>(chap, 49);
+  memcpy(&chap[PvChap::value], chapResponse, 49);
+  memcpy(&chap[PvChap::value + 49], PPTPC_username, strlen(PPTPC_username));
+
+  int ret = GRE_sessionWrite(session, buff, pppSize);
+  db_printf(DB_DEBUG, "PPTPC_pppChapMsChap() GRE_sessionWrite length = %d\n", ret);
+  return ret >= 0;
+}
+
+bool PPTPC_pppPap(struct GreSession *session, uint8_t identifier) {
+  int pppSize;
+  int papSize;
+  uint8_t buff[12 + sizeof(PPTPC_username) + sizeof(PPTPC_password)];
+  uint8_t *pap = &buff[PvPpp::size];
+
+  db_printf(DB_DEBUG, "PPTPC_pppPap() Begin\n");
+  
+  memset(buff, 0, sizeof(buff));
+
+  papSize = PvPppCp::size + PPTPC_pppPapOptions(&pap[PvPppCp::size], PPTPC_username, PPTPC_password);
+  pppSize = PvPpp::size + papSize;
+  
+  PV_set<PvPpp::address>(buff, 0xff);
+  PV_set<PvPpp::control>(buff, 0x03);
+  PV_set<PvPpp::protocol>(buff, 0xc023);  // PPP PAP Protocol
+
+  PV_set<PvPppCp::code>(pap, 0x01); // authen request
+  PV_set<PvPppCp::identifier>(pap, identifier);
+  PV_set<PvPppCp::length>(pap, papSize);
+
+  int ret = GRE_sessionWrite(session, buff, pppSize);
+  db_printf(DB_DEBUG, "PPTPC_pppPap() GRE_sessionWrite length = %d\n", ret);
+  return ret >= 0;
+}
+
+// LCP is up, authenticate with the protocol the peer asked for
+static void PPTPC_pppAuthenticate() {
+  _pppPhase = PPTPC_PHASE_AUTHENTICATE;
+  _pppPhaseStartMs = millis();
+
+  if (PPTPC_authenProtocol == 0xc023) {     // PAP Authen
+    // The peer only answers, requests are repeated until it does
+    PPTPC_pppPap(GRE_defaultSession, ++_papIdentifier);
+    PPTPC_pppArmPhaseTimer(PPTPC_PAP_RESTART_MS);
+  } else if (PPTPC_authenProtocol == 0xc223) {  // CHAP Authen
+    // Answered as soon as the challenge arrives
+    db_printf(DB_DEBUG, "PPTPC_pppAuthenticate() Wait for chap challenge\n");
+    PPTPC_pppArmPhaseTimer(PPTPC_PHASE_TIMEOUT_MS);
+  } else {
+    PPTPC_pppAuthenticated();
+  }
+}
+
+static void PPTPC_pppPhaseTimeout(void *arg) {
+  if (millis() - _pppPhaseStartMs < PPTPC_PHASE_TIMEOUT_MS &&
+      _pppPhase == PPTPC_PHASE_AUTHENTICATE && PPTPC_authenProtocol == 0xc023) {
+    PPTPC_pppPap(GRE_defaultSession, ++_papIdentifier);
+    PPTPC_pppArmPhaseTimer(PPTPC_PAP_RESTART_MS);
+    return;
+  }
+
+  PPTPC_pppFail("Authentication/Callback timeout");
+}
+
+static uint32_t PPTPC_lcpEchoRxPackets() {
+  return GRE_defaultSession != nullptr ? GRE_defaultSession->stats.rxPackets : 0;
+}
+
+static void PPTPC_lcpEchoTimeout(void *arg) {
+  uint32_t rxPackets = PPTPC_lcpEchoRxPackets();
+  uint32_t magic = _lcpWantMagic ? _lcpMagic : 0;
+  uint8_t data[4];
+
+  if (PPTPC_lcp.state != PPPFSM_OPENED) {
+    return;
+  }
+
+  if (rxPackets != _lcpEchoRxPackets) {
+    // Frames keep arriving, the path works without asking
+    _lcpEchoRxPackets = rxPackets;
+    _lcpEchoPending = false;
+    _lcpEchoMisses = 0;
+    os_timer_arm(&_lcpEchoTimer, PPTPC_LCP_ECHO_INTERVAL_MS, false);
+    return;
+  }
+
+  if (_lcpEchoPending) {
+    _lcpEchoMisses++;
+    db_printf(DB_INFO, "PPTPC_lcpEchoTimeout() No Echo-Reply, miss %d\n", _lcpEchoMisses);
+    if (_lcpEchoMisses >= PPTPC_LCP_ECHO_FAILURE) {
+      _lcpEchoStats.deadLinks++;
+      PPPFSM_lowerDown(&PPTPC_ccp);
+      PPPFSM_lowerDown(&PPTPC_ipcp);
+      PPPFSM_lowerDown(&PPTPC_lcp);
+      PPTPC_controlFail("Link dead, LCP Echo-Request unanswered");
+      return;
+    }
+  }
+
+  PV_set<PvBe32>(data, magic);
+  _lcpEchoId = ++PPTPC_lcp.id;
+  _lcpEchoPending = true;
+  _lcpEchoSentUs = system_get_time();
+  _lcpEchoStats.requests++;
+  PPPFSM_send(&PPTPC_lcp, 0x09, _lcpEchoId, data, 4);  // Echo Request
+  os_timer_arm(&_lcpEchoTimer, PPTPC_LCP_ECHO_INTERVAL_MS, false);
+}
+
+static void PPTPC_lcpEchoReply(uint8_t id, const uint8_t *data, int length) {
+  uint32_t rttUs;
+  uint32_t ms;
+  int bucket = 0;
+
+  if (!_lcpEchoPending || id != _lcpEchoId || length < 4) {
+    return;
+  }
+  // Our own request came back, the link is looped
+  if (_lcpWantMagic && _lcpMagic != 0 &&
+      PV_get<PvBe32>(data) == _lcpMagic) {
+    db_printf(DB_INFO, "PPTPC_lcpEchoReply() Own magic number, looped back\n");
+    return;
+  }
+
+  rttUs = system_get_time() - _lcpEchoSentUs;
+  _lcpEchoPending = false;
+  _lcpEchoMisses = 0;
+  _lcpEchoRxPackets = PPTPC_lcpEchoRxPackets();
+
+  _lcpEchoStats.replies++;
+  _lcpEchoStats.rttUs = rttUs;
+  if (_lcpEchoStats.srttUs == 0) {
+    _lcpEchoStats.srttUs = rttUs;
+  } else {
+    _lcpEchoStats.srttUs += ((int32_t)rttUs - (int32_t)_lcpEchoStats.srttUs) / 8;
+  }
+  // Bucket n > 0 holds [2^(n-1), 2^n) ms, the last one everything above
+  for (ms = rttUs / 1000; ms > 0 && bucket < PPTPC_LCP_RTT_BUCKETS - 1; ms >>= 1) {
+    bucket++;
+  }
+  _lcpEchoStats.rttHistogram[bucket]++;
+  db_printf(DB_DEBUG, "PPTPC_lcpEchoReply() RTT %d us, smoothed %d us\n", rttUs, _lcpEchoStats.srttUs);
+}
+
+static void PPTPC_lcpEchoStart() {
+  _lcpEchoPending = false;
+  _lcpEchoMisses = 0;
+  _lcpEchoRxPackets = PPTPC_lcpEchoRxPackets();
+  os_timer_disarm(&_lcpEchoTimer);
+  os_timer_setfn(&_lcpEchoTimer, PPTPC_lcpEchoTimeout, nullptr);
+  os_timer_arm(&_lcpEchoTimer, PPTPC_LCP_ECHO_INTERVAL_MS, false);
+}
+
+const struct LcpEchoStats *PPTPC_getLcpEchoStats() {
+  return &_lcpEchoStats;
+}
+
+static void PPTPC_lcpUp(struct PppFsm *f) {
+  // Both sides sent an MRRU, the frames of the bundle go out as MP
+  // fragments from now on. They never carry address and control.
+  _mpEnabled = _lcpWantMrru && _lcpPeerMrru != 0;
+  if (_mpEnabled) {
+    PPPMP_reset(&_mpRx);
+    PPPMP_init(&_mpRx, _mpMrru);
+    _mpTxSeq = 0;
+    _mpTxFrames = 0;
+    _mpTxFragments = 0;
+    _mpRxLost = 0;
+  }
+
+  db_printf(DB_DEBUG, "PPTPC_lcpUp() LCP Opened, peer ACFC=%d PFC=%d MP=%d\n", _lcpPeerAcfc, _lcpPeerPfc, _mpEnabled);
+  PPTPC_connectMark(PPTPC_CT_LCP);
+  PPTPC_pppSetTxCompression((PPTPC_PPP_HEADER_COMPRESSION && _lcpPeerAcfc) || _mpEnabled,
+                            PPTPC_PPP_HEADER_COMPRESSION && _lcpPeerPfc);
+  PPTPC_lcpEchoStart();
+  PPTPC_pppAuthenticate();
+}
+
+static void PPTPC_lcpDown(struct PppFsm *f) {
+  db_printf(DB_DEBUG, "PPTPC_lcpDown() LCP Down\n");
+  os_timer_disarm(&_pppPhaseTimer);
+  os_timer_disarm(&_lcpEchoTimer);
+  PPPFSM_lowerDown(&PPTPC_ccp);
+  PPPFSM_lowerDown(&PPTPC_ipcp);
+  PPTPC_mpCloseLinks(true);
+  PPPMP_reset(&_mpRx);
+  _mpEnabled = false;
+  PPTPC_pppSetTxCompression(false, false);
+  _pppPhase = PPTPC_PHASE_ESTABLISH;
+}
+
+static void PPTPC_lcpFinished(struct PppFsm *f) {
+  db_printf(DB_INFO, "PPTPC_lcpFinished() PPP link Dead\n");
+  os_timer_disarm(&_pppPhaseTimer);
+  _pppPhase = PPTPC_PHASE_DEAD;
+  _pptpFailed = true;
+}
+
+// Append one option to a Nak or Reject list
+static void PPTPC_pppAddOption(uint8_t *list, int *listLength, int size, const uint8_t *option, int length) {
+  if (*listLength + length > size) {
+    return;
+  }
+  memcpy(list + *listLength, option, length);
+  *listLength += length;
+}
+
+// Authentication protocol option of a peer request, false when we cannot
+// do it. _lcpAuthNak is what we suggest instead.
+static const uint8_t _lcpAuthNak[5] = { 0x03, 0x05, 0xc2, 0x23, CHAP_MSCHAP2 };
+
+static bool PPTPC_lcpCheckAuth(const uint8_t *p, uint16_t *protocol, uint8_t *chapMode) {
+  uint16_t ds = PV_get<PvLcpAuth::protocol>(p);
+
+  if (ds == 0xc023 && p[1] == 4) {          // PAP
+    db_printf(DB_DEBUG, "PPTPC_lcpCheckAuth() Authen mode = PAP\n");
+    *protocol = ds;
+    return true;
+  }
+  if (ds == 0xc223 && p[1] == 5 &&
+      (PV_get<PvLcpAuth::algorithm>(p) == CHAP_MD5 || PV_get<PvLcpAuth::algorithm>(p) == CHAP_MSCHAP1 || PV_get<PvLcpAuth::algorithm>(p) == CHAP_MSCHAP2)) {  // CHAP
+    db_printf(DB_DEBUG, "PPTPC_lcpCheckAuth() Authen mode = CHAP 0x%02X\n", PV_get<PvLcpAuth::algorithm>(p));
+    *protocol = ds;
+    *chapMode = PV_get<PvLcpAuth::algorithm>(p);
+    return true;
+  }
+  db_printf(DB_DEBUG, "PPTPC_lcpCheckAuth() Authen mode = Unknown 0x%04X\n", ds);
+  return false;
+}
+
+static uint8_t PPTPC_lcpCheckOptions(struct PppFsm *f, uint8_t *options, int *length) {
+  uint8_t nak[PPPFSM_OPTIONS_MAX];
+  uint8_t rej[PPPFSM_OPTIONS_MAX];
+  int nakLength = 0;
+  int rejLength = 0;
+  uint8_t *p = options;
+  int remain = *length;
+  uint16_t ds;
+  bool pfc = false;
+  bool acfc = false;
+  uint16_t peerMru = PPTPC_LCP_DEFAULT_MRU;
+  uint16_t peerMrru = 0;
+  const uint8_t *endpoint = nullptr;
+
+  db_printf(DB_DEBUG, "PPTPC_lcpCheckOptions() Begin\n");
+  PPTPC_authenProtocol = 0;
+
+  while (remain >= 2) {
+    uint8_t type = p[0];
+    uint8_t len = p[1];
+    if (len < 2 || len > remain) {
+      db_printf(DB_DEBUG, "PPTPC_lcpCheckOptions() Malformed option type=%d\n", type);
+      PPTPC_pppAddOption(rej, &rejLength, sizeof(rej), p, remain);
+      break;
+    }
+
+    if (type == 0x01 && len == 4) {   // Type: Maximum MRU
+      ds = PV_get<PvPppOption::value16>(p);
+      db_printf(DB_DEBUG, "PPTPC_lcpCheckOptions() Max MRU=%d\n", ds);
+      if (ds < PPTPC_LCP_MIN_MRU) {
+        uint8_t opt[4] = { 0x01, 0x04 };
+        PV_set<PvPppOption::value16>(opt, PPTPC_LCP_MIN_MRU);
+        PPTPC_pppAddOption(nak, &nakLength, sizeof(nak), opt, 4);
+      } else {
+        peerMru = ds;
+      }
+
+    } else if (type == 0x02 && len == 6) {  // Type: Async Control Character Map
+      db_printf(DB_DEBUG, "PPTPC_lcpCheckOptions() ACCM, ignored on a sync link\n");
+
+    } else if (type == 0x03 && len >= 4) {  // type: Authen protocol
+      if (!PPTPC_lcpCheckAuth(p, &PPTPC_authenProtocol, &PPTPC_authenChapMode)) {
+        // Suggest what we can do instead
+        PPTPC_pppAddOption(nak, &nakLength, sizeof(nak), _lcpAuthNak, sizeof(_lcpAuthNak));
+      }
+
+    } else if (type == 0x05 && len == 6) {  //type: Magic number
+      db_printf(DB_DEBUG, "PPTPC_lcpCheckOptions() Magic Number = 0x%08X\n", PV_get<PvPppOption::value32>(p));
+
+    } else if (type == 0x07 && len == 2) {  // Protocol Field Compression
+      pfc = true;
+
+    } else if (type == 0x08 && len == 2) {  // Address and Control Field Compression
+      acfc = true;
+
+    } else if (type == PPP_LCP_MRRU && len == 4 && _lcpWantMrru) {
+      peerMrru = PV_get<PvPppOption::value16>(p);
+      db_printf(DB_DEBUG, "PPTPC_lcpCheckOptions() MRRU=%d\n", peerMrru);
+      if (peerMrru < PPTPC_LCP_MIN_MRU) {
+        uint8_t opt[4] = { PPP_LCP_MRRU, 0x04 };
+        PV_set<PvPppOption::value16>(opt, PPTPC_LCP_MIN_MRU);
+        PPTPC_pppAddOption(nak, &nakLength, sizeof(nak), opt, 4);
+      }
+
+    } else if (type == PPP_LCP_ENDPOINT && len >= 3 && len <= 3 + PPPMP_ED_MAX) {
+      db_printf(DB_DEBUG, "PPTPC_lcpCheckOptions() Endpoint discriminator class %d\n", PV_get<PvPppOption::value8>(p));
+      endpoint = p;
+
+    } else {
+      // Short sequence numbers too, they would cut the bundle to 4096
+      // fragments in flight
+      db_printf(DB_DEBUG, "PPTPC_lcpCheckOptions() Reject option type=%d\n", type);
+      PPTPC_pppAddOption(rej, &rejLength, sizeof(rej), p, len);
+    }
+
+    p += len;
+    remain -= len;
+  }
+
+  if (rejLength > 0) {
+    memcpy(options, rej, rejLength);
+    *length = rejLength;
+    return PPP_CONFREJ;
+  }
+  if (nakLength > 0) {
+    memcpy(options, nak, nakLength);
+    *length = nakLength;
+    return PPP_CONFNAK;
+  }
+
+  _lcpPeerPfc = pfc;
+  _lcpPeerAcfc = acfc;
+  _lcpPeerMru = peerMru;
+  _lcpPeerMrru = peerMrru;
+  _lcpPeerEndpointLength = 0;
+  if (endpoint != nullptr) {
+    _lcpPeerEndpointLength = endpoint[1] - 2;
+    memcpy(_lcpPeerEndpoint, endpoint + 2, _lcpPeerEndpointLength);
+  }
+  return PPP_CONFACK;
+}
+
+static int PPTPC_lcpBuildOptions(struct PppFsm *f, uint8_t *buf, int size) {
+  return PPTPC_getPppLcpConfigOptions(buf, size);
+}
+
+static void PPTPC_lcpNakOptions(struct PppFsm *f, uint8_t *options, int length) {
+  while (length >= 2 && options[1] >= 2 && options[1] <= length) {
+    if (options[0] == 0x01 && options[1] == 4) {
+      uint16_t mru = PV_get<PvPppOption::value16>(options);
+      db_printf(DB_DEBUG, "PPTPC_lcpNakOptions() Peer wants MRU %d\n", mru);
+      if (mru >= PPTPC_LCP_MIN_MRU && mru <= PPTPC_pppMaxMru()) {
+        _lcpMru = mru;
+      } else {
+        // Leave it to the default rather than loop on a value we can't take
+        _lcpWantMru = false;
+      }
+    } else if (options[0] == 0x05) {
+      _lcpMagic = os_random();
+    } else if (options[0] == 0x0d) {
+      _lcpWantCallback = false;
+    } else if (options[0] == PPP_LCP_MRRU && options[1] == 4) {
+      uint16_t mrru = PV_get<PvPppOption::value16>(options);
+      db_printf(DB_DEBUG, "PPTPC_lcpNakOptions() Peer wants MRRU %d\n", mrru);
+      if (mrru >= PPTPC_LCP_MIN_MRU && mrru <= PPPMP_MRRU) {
+        _mpMrru = mrru;
+      } else {
+        _lcpWantMrru = false;
+      }
+    }
+    length -= options[1];
+    options += options[1];
+  }
+}
+
+static void PPTPC_lcpRejectOptions(struct PppFsm *f, uint8_t *options, int length) {
+  while (length >= 2 && options[1] >= 2 && options[1] <= length) {
+    db_printf(DB_DEBUG, "PPTPC_lcpRejectOptions() Peer rejected option %d\n", options[0]);
+    if (options[0] == 0x01) {
+      _lcpWantMru = false;
+    } else if (options[0] == 0x05) {
+      _lcpWantMagic = false;
+    } else if (options[0] == 0x0d) {
+      _lcpWantCallback = false;
+    } else if (options[0] == 0x07) {
+      _lcpWantPfc = false;
+    } else if (options[0] == 0x08) {
+      _lcpWantAcfc = false;
+    } else if (options[0] == PPP_LCP_MRRU) {
+      _lcpWantMrru = false;
+    } else if (options[0] == PPP_LCP_ENDPOINT) {
+      _lcpWantEndpoint = false;
+    }
+    length -= options[1];
+    options += options[1];
+  }
+}
+
+// Echo Request, answered with our magic number only while LCP is open
+static void PPTPC_lcpEchoAnswer(struct PppFsm *f, uint32_t magic, uint8_t id, uint8_t *data, int length) {
+  uint8_t reply[PPPFSM_OPTIONS_MAX];
+
+  if (f->state != PPPFSM_OPENED || length < 4) {
+    return;
+  }
+  if (length > (int)sizeof(reply)) {
+    length = sizeof(reply);
+  }
+  memcpy(reply, data, length);
+  PV_set<PvBe32>(reply, magic);
+  PPPFSM_send(f, 0x0a, id, reply, length);  // Echo Reply
+}
+
+static bool PPTPC_lcpExtCode(struct PppFsm *f, uint8_t code, uint8_t id, uint8_t *data, int length) {
+  uint32_t magic = _lcpWantMagic ? _lcpMagic : 0;
+
+  switch (code) {
+    case 0x08:  // Protocol Reject
+      if (length >= 2) {
+        uint16_t protocol = PV_get<PvBe16>(data);
+        db_printf(DB_INFO, "PPTPC_lcpExtCode() Peer rejected protocol 0x%04X\n", protocol);
+        if (protocol == 0x8021) {
+          PPTPC_pppFail("IPCP rejected");
+        } else if (protocol == PPP_CCP) {
+          PPPFSM_lowerDown(&PPTPC_ccp);
+        }
+      }
+      return true;
+
+    case 0x09:  // Echo Request
+      PPTPC_lcpEchoAnswer(f, magic, id, data, length);
+      return true;
+
+    case 0x0a:  // Echo Reply
+      PPTPC_lcpEchoReply(id, data, length);
+      return true;
+
+    case 0x0b:  // Discard Request
+      return true;
+  }
+  return false;
+}
+
+static int PPTPC_ipcpBuildOptions(struct PppFsm *f, uint8_t *buf, int size) {
+  int n = 0;
+
+  if (_ipcpWantVj) {
+    buf[n] = 0x02;  // IP-Compression-Protocol
+    buf[n + 1] = PvIpcpVj::size;
+    PV_set<PvIpcpVj::protocol>(&buf[n], PPP_VJ_COMP);
+    PV_set<PvIpcpVj::maxSlotId>(&buf[n], _ipcpVjMaxSlot);
+    PV_set<PvIpcpVj::compSlotId>(&buf[n], _ipcpVjCompSlot);
+    n += PvIpcpVj::size;
+  }
+
+  buf[n++] = 0x03;  // type ip
+  buf[n++] = 6;     // ip option length
+  memcpy(&buf[n], &localIP.addr, 4);  // 0.0.0.0 until the peer assigns one
+  return n + 4;
+}
+
+static uint8_t PPTPC_ipcpCheckOptions(struct PppFsm *f, uint8_t *options, int *length) {
+  uint8_t nak[PPPFSM_OPTIONS_MAX];
+  uint8_t rej[PPPFSM_OPTIONS_MAX];
+  int nakLength = 0;
+  int rejLength = 0;
+  uint8_t *p = options;
+  int remain = *length;
+  bool vj = false;
+  uint8_t vjMaxSlot = 0;
+  bool vjCompSlot = false;
+
+  while (remain >= 2) {
+    uint8_t len = p[1];
+    if (len < 2 || len > remain) {
+      PPTPC_pppAddOption(rej, &rejLength, sizeof(rej), p, remain);
+      break;
+    }
+
+    if (p[0] == 0x03 && len == 6) { // IP Address of the server
+      memcpy(&remoteIP.addr, p + PvPppOption::value, 4);
+    } else if (p[0] == 0x02 && len >= 4) {  // IP-Compression-Protocol
+      if (len == PvIpcpVj::size && PV_get<PvIpcpVj::protocol>(p) == PPP_VJ_COMP) {
+        vj = true;
+        vjMaxSlot = PV_get<PvIpcpVj::maxSlotId>(p);
+        vjCompSlot = PV_get<PvIpcpVj::compSlotId>(p) != 0;
+      } else {
+        uint8_t opt[PvIpcpVj::size] = { 0x02, PvIpcpVj::size };
+        PV_set<PvIpcpVj::protocol>(opt, PPP_VJ_COMP);
+        PV_set<PvIpcpVj::maxSlotId>(opt, PPPVJ_MAX_SLOTS - 1);
+        PV_set<PvIpcpVj::compSlotId>(opt, 1);
+        PPTPC_pppAddOption(nak, &nakLength, sizeof(nak), opt, sizeof(opt));
+      }
+    } else {
+      db_printf(DB_DEBUG, "PPTPC_ipcpCheckOptions() Reject option type=%d\n", p[0]);
+      PPTPC_pppAddOption(rej, &rejLength, sizeof(rej), p, len);
+    }
+
+    p += len;
+    remain -= len;
+  }
+
+  if (rejLength > 0) {
+    memcpy(options, rej, rejLength);
+    *length = rejLength;
+    return PPP_CONFREJ;
+  }
+  if (nakLength > 0) {
+    memcpy(options, nak, nakLength);
+    *length = nakLength;
+    return PPP_CONFNAK;
+  }
+
+  _ipcpPeerVj = vj;
+  _ipcpPeerVjMaxSlot = vjMaxSlot;
+  _ipcpPeerVjCompSlot = vjCompSlot;
+  return PPP_CONFACK;
+}
+
+static void PPTPC_ipcpNakOptions(struct PppFsm *f, uint8_t *options, int length) {
+  while (length >= 2 && options[1] >= 2 && options[1] <= length) {
+    // Server assigned IP to client
+    if (options[0] == 0x03 && options[1] == 6) {
+      memcpy(&localIP.addr, options + PvPppOption::value, 4);
+    } else if (options[0] == 0x02) {
+      // Fewer slots or no slot id compression is fine, anything else is
+      // not something we can decompress
+      if (options[1] == PvIpcpVj::size && PV_get<PvIpcpVj::protocol>(options) == PPP_VJ_COMP) {
+        if (PV_get<PvIpcpVj::maxSlotId>(options) < _ipcpVjMaxSlot) {
+          _ipcpVjMaxSlot = PV_get<PvIpcpVj::maxSlotId>(options);
+        }
+        _ipcpVjCompSlot = _ipcpVjCompSlot && PV_get<PvIpcpVj::compSlotId>(options) != 0;
+      } else {
+        _ipcpWantVj = false;
+      }
+    }
+    length -= options[1];
+    options += options[1];
+  }
+}
+
+static void PPTPC_ipcpRejectOptions(struct PppFsm *f, uint8_t *options, int length) {
+  while (length >= 2 && options[1] >= 2 && options[1] <= length) {
+    db_printf(DB_DEBUG, "PPTPC_ipcpRejectOptions() Peer rejected option %d\n", options[0]);
+    if (options[0] == 0x02) {
+      _ipcpWantVj = false;
+    }
+    length -= options[1];
+    options += options[1];
+  }
+}
+
+static void PPTPC_ipcpUp(struct PppFsm *f) {
+  db_printf(DB_DEBUG, "PPTPC_ipcpUp() Local IP Address: %d.%d.%d.%d\n", localIP.addr & 0xff, (localIP.addr >> 8) & 0xff, (localIP.addr >> 16) & 0xff, (localIP.addr >> 24) & 0xff);
+  db_printf(DB_DEBUG, "PPTPC_ipcpUp() Remote IP Address: %d.%d.%d.%d\n", remoteIP.addr & 0xff, (remoteIP.addr >> 8) & 0xff, (remoteIP.addr >> 16) & 0xff, (remoteIP.addr >> 24) & 0xff);
+
+  PPTPC_connectMark(PPTPC_CT_IPCP);
+
+  // Begin to link pptp tunel to lwip
+  if (PPTPC_pptpInterfaceInit() != true) {
+    PPTPC_pppFail("PPTPC_pptpInterfaceInit() Failed");
+    return;
+  }
+
+  // Each direction compresses only if its receiver asked for it
+  _vjTxEnabled = _ipcpPeerVj;
+  if (_vjTxEnabled) {
+    PPPVJ_initCompressor(&_vjTx, _ipcpPeerVjMaxSlot, _ipcpPeerVjCompSlot);
+  }
+  _vjRxEnabled = _ipcpWantVj;
+  if (_vjRxEnabled) {
+    PPPVJ_initDecompressor(&_vjRx, _ipcpVjMaxSlot);
+    _vjRxGaps = GRE_defaultSession != nullptr ? GRE_defaultSession->stats.rxGaps : 0;
+  }
+
+  db_printf(DB_INFO, "PPTPC_ipcpUp() PPP link up, MTU %d, VJ TX=%d RX=%d\n", pptpLwip_netif.mtu, _vjTxEnabled, _vjRxEnabled);
+  _pptpConnected = true;
+  _reconnectDelayMs = PPTPC_RECONNECT_MIN_MS;
+  PPTPC_connectMark(PPTPC_CT_NETIF);
+}
+
+static void PPTPC_ipcpDown(struct PppFsm *f) {
+  db_printf(DB_DEBUG, "PPTPC_ipcpDown() IPCP Down\n");
+  _pptpConnected = false;
+  _vjTxEnabled = false;
+  _vjRxEnabled = false;
+  netif_set_down(&pptpLwip_netif);
+}
+
+static void PPTPC_ipcpFinished(struct PppFsm *f) {
+  if (_pppPhase == PPTPC_PHASE_NETWORK) {
+    PPTPC_pppFail("IPCP failed");
+  }
+}
+
+static bool PPTPC_ccpIsDeflate(const uint8_t *p) {
+  return (p[0] == PPP_DEFLATE_OPT || p[0] == PPP_DEFLATE_DRAFT_OPT) && p[1] == 4;
+}
+
+// One of MPPE or Deflate, MPPE first
+static int PPTPC_ccpBuildOptions(struct PppFsm *f, uint8_t *buf, int size) {
+  if (_ccpWantMppe) {
+    buf[0] = PPP_MPPE_OPT;
+    buf[1] = 6;
+    PV_set<PvPppOption::value32>(buf, _ccpMppeBits);
+    return 6;
+  }
+  if (_ccpWantDeflate) {
+    buf[0] = PPP_DEFLATE_OPT;
+    buf[1] = PvCcpDeflate::size;
+    PV_set<PvCcpDeflate::windowMethod>(buf, ((_ccpDeflateBits - 8) << 4) | PPP_DEFLATE_METHOD);
+    PV_set<PvCcpDeflate::check>(buf, 0);
+    return PvCcpDeflate::size;
+  }
+  return 0;
+}
+
+// MPPE with 128-bit keys only, stateless (H) if the peer wants it. Any
+// Deflate window will do, ours is never larger.
+static uint8_t PPTPC_ccpCheckOptions(struct PppFsm *f, uint8_t *options, int *length) {
+  uint8_t nak[PPPFSM_OPTIONS_MAX];
+  uint8_t rej[PPPFSM_OPTIONS_MAX];
+  int nakLength = 0;
+  int rejLength = 0;
+  uint8_t *p = options;
+  int remain = *length;
+  uint32_t bits = 0;
+  uint8_t deflateBits = 0;
+  bool peerMppe = false;
+
+  for (int i = 0; i + 2 <= remain && p[i + 1] >= 2; i += p[i + 1]) {
+    peerMppe |= p[i] == PPP_MPPE_OPT;
+  }
+
+  while (remain >= 2) {
+    uint8_t len = p[1];
+    if (len < 2 || len > remain) {
+      PPTPC_pppAddOption(rej, &rejLength, sizeof(rej), p, remain);
+      break;
+    }
+
+    if (p[0] == PPP_MPPE_OPT && len == 6 && _ccpCanMppe) {
+      bits = PV_get<PvPppOption::value32>(p);
+      if ((bits & ~PPP_MPPE_H) != PPP_MPPE_S) {
+        uint8_t opt[6] = { PPP_MPPE_OPT, 6 };
+        PV_set<PvPppOption::value32>(opt, PPP_MPPE_S | (bits & PPP_MPPE_H));
+        PPTPC_pppAddOption(nak, &nakLength, sizeof(nak), opt, 6);
+      }
+    } else if (PPTPC_ccpIsDeflate(p) && PPTPC_DEFLATE && !(peerMppe && _ccpCanMppe)) {
+      uint8_t windowMethod = PV_get<PvCcpDeflate::windowMethod>(p);
+      if ((windowMethod & 0x0f) != PPP_DEFLATE_METHOD || PV_get<PvCcpDeflate::check>(p) != 0) {
+        uint8_t opt[PvCcpDeflate::size] = { p[0], PvCcpDeflate::size };
+        PV_set<PvCcpDeflate::windowMethod>(opt, ((PPPDEF_WINDOW_BITS - 8) << 4) | PPP_DEFLATE_METHOD);
+        PPTPC_pppAddOption(nak, &nakLength, sizeof(nak), opt, sizeof(opt));
+      } else {
+        deflateBits = (windowMethod >> 4) + 8;
+      }
+    } else {
+      db_printf(DB_DEBUG, "PPTPC_ccpCheckOptions() Reject option type=%d\n", p[0]);
+      PPTPC_pppAddOption(rej, &rejLength, sizeof(rej), p, len);
+    }
+
+    p += len;
+    remain -= len;
+  }
+
+  if (rejLength > 0) {
+    memcpy(options, rej, rejLength);
+    *length = rejLength;
+    return PPP_CONFREJ;
+  }
+  if (nakLength > 0) {
+    memcpy(options, nak, nakLength);
+    *length = nakLength;
+    return PPP_CONFNAK;
+  }
+
+  _ccpPeerMppeBits = bits;
+  _ccpPeerDeflateBits = deflateBits;
+  return PPP_CONFACK;
+}
+
+static void PPTPC_ccpNakOptions(struct PppFsm *f, uint8_t *options, int length) {
+  while (length >= 2 && options[1] >= 2 && options[1] <= length) {
+    if (options[0] == PPP_MPPE_OPT && options[1] == 6) {
+      uint32_t bits = PV_get<PvPppOption::value32>(options);
+      if (bits & PPP_MPPE_S) {
+        _ccpMppeBits = PPP_MPPE_S | (bits & PPP_MPPE_H);
+      } else {
+        db_printf(DB_INFO, "PPTPC_ccpNakOptions() Peer wants MPPE 0x%08X, no 128-bit\n", bits);
+        _ccpWantMppe = false;
+      }
+    } else if (PPTPC_ccpIsDeflate(options)) {
+      // A smaller window is fine, anything else is not
+      uint8_t windowMethod = PV_get<PvCcpDeflate::windowMethod>(options);
+      uint8_t windowBits = (windowMethod >> 4) + 8;
+      if ((windowMethod & 0x0f) == PPP_DEFLATE_METHOD && windowBits <= _ccpDeflateBits) {
+        _ccpDeflateBits = windowBits;
+      } else {
+        db_printf(DB_INFO, "PPTPC_ccpNakOptions() Peer wants Deflate 0x%02X\n", windowMethod);
+        _ccpWantDeflate = false;
+      }
+    }
+    length -= options[1];
+    options += options[1];
+  }
+}
+
+static void PPTPC_ccpRejectOptions(struct PppFsm *f, uint8_t *options, int length) {
+  while (length >= 2 && options[1] >= 2 && options[1] <= length) {
+    db_printf(DB_DEBUG, "PPTPC_ccpRejectOptions() Peer rejected option %d\n", options[0]);
+    if (options[0] == PPP_MPPE_OPT) {
+      _ccpWantMppe = false;
+    } else if (PPTPC_ccpIsDeflate(options)) {
+      _ccpWantDeflate = false;
+    }
+    length -= options[1];
+    options += options[1];
+  }
+}
+
+static void PPTPC_ccpResetRequest() {
+  uint8_t none[1];
+
+  _ccpResetMs = millis();
+  _ccpResetId = ++PPTPC_ccp.id;
+  PPPFSM_send(&PPTPC_ccp, 0x0e, _ccpResetId, none, 0);
+}
+
+static bool PPTPC_ccpExtCode(struct PppFsm *f, uint8_t code, uint8_t id, uint8_t *data, int length) {
+  switch (code) {
+    case 0x0e:  // Reset-Request, the peer lost sync with what we send
+      if (f->state == PPPFSM_OPENED) {
+        if (_mppeTxEnabled) {
+          _mppeTx.flush = true;
+        }
+        // Deflate starts over before the Reset-Ack goes out
+        if (_deflateTxEnabled) {
+          PPPDEF_resetCompressor(&_deflateTx);
+        }
+        PPPFSM_send(f, 0x0f, id, data, length);  // Reset-Ack
+      }
+      return true;
+
+    case 0x0f:  // Reset-Ack, frames after it come from a fresh compressor
+      if (_deflateRxEnabled && id == _ccpResetId) {
+        PPPDEF_resetDecompressor(&_deflateRx);
+      }
+      return true;
+  }
+  return false;
+}
+
+static void PPTPC_ccpUp(struct PppFsm *f) {
+  uint8_t sendKey[PPPMPPE_KEY_LENGTH];
+  uint8_t recvKey[PPPMPPE_KEY_LENGTH];
+  bool keys = false;
+
+  if (_ccpPeerMppeBits != 0 || _ccpWantMppe) {
+    keys = MSCHAP_GetMppeKeys(&mschap_ctx, sendKey, recvKey);
+  }
+
+  _mppeTxEnabled = keys && (_ccpPeerMppeBits & PPP_MPPE_S) != 0;
+  if (_mppeTxEnabled) {
+    PPPMPPE_init(&_mppeTx, sendKey, (_ccpPeerMppeBits & PPP_MPPE_H) == 0);
+  }
+  _mppeRxEnabled = keys && _ccpWantMppe;
+  if (_mppeRxEnabled) {
+    PPPMPPE_init(&_mppeRx, recvKey, (_ccpMppeBits & PPP_MPPE_H) == 0);
+  }
+  memset(sendKey, 0, sizeof(sendKey));
+  memset(recvKey, 0, sizeof(recvKey));
+
+  _deflateTxEnabled = !_mppeTxEnabled && _ccpPeerDeflateBits != 0;
+  if (_deflateTxEnabled) {
+    PPPDEF_initCompressor(&_deflateTx, _ccpPeerDeflateBits);
+  }
+  _deflateRxEnabled = !_ccpWantMppe && _ccpWantDeflate;
+  if (_deflateRxEnabled) {
+    PPPDEF_initDecompressor(&_deflateRx);
+  }
+
+  // Encrypted frames are longer by the MPPE header and inner protocol
+  if (_pptpNetifAdded) {
+    pptpLwip_netif.mtu = PPTPC_pppLinkMtu();
+  }
+  db_printf(DB_INFO, "PPTPC_ccpUp() MPPE TX=%d%s RX=%d%s\n",
+            _mppeTxEnabled, _mppeTx.stateful ? " stateful" : "",
+            _mppeRxEnabled, _mppeRx.stateful ? " stateful" : "");
+  db_printf(DB_INFO, "PPTPC_ccpUp() Deflate TX=%d/%d RX=%d/%d\n",
+            _deflateTxEnabled, _ccpPeerDeflateBits, _deflateRxEnabled, _ccpDeflateBits);
+
+  if (PPTPC_MPPE_REQUIRED && !(_mppeTxEnabled && _mppeRxEnabled)) {
+    PPTPC_pppFail("MPPE required, CCP agreed on less");
+  }
+}
+
+static void PPTPC_ccpDown(struct PppFsm *f) {
+  db_printf(DB_DEBUG, "PPTPC_ccpDown() CCP Down\n");
+  _mppeTxEnabled = false;
+  _mppeRxEnabled = false;
+  _deflateTxEnabled = false;
+  _deflateRxEnabled = false;
+  if (_pptpNetifAdded) {
+    pptpLwip_netif.mtu = PPTPC_pppLinkMtu();
+  }
+}
+
+static void PPTPC_ccpFinished(struct PppFsm *f) {
+  if (PPTPC_MPPE_REQUIRED) {
+    PPTPC_pppFail("MPPE required, CCP failed");
+    return;
+  }
+  db_printf(DB_INFO, "PPTPC_ccpFinished() No MPPE or Deflate, link is not encrypted or compressed\n");
+}
+
+static const struct PppFsmCallbacks _lcpCallbacks = {
+  PPTPC_lcpBuildOptions,
+  PPTPC_lcpCheckOptions,
+  PPTPC_lcpNakOptions,
+  PPTPC_lcpRejectOptions,
+  PPTPC_lcpExtCode,
+  PPTPC_lcpUp,
+  PPTPC_lcpDown,
+  PPTPC_lcpFinished
+};
+
+static const struct PppFsmCallbacks _ipcpCallbacks = {
+  PPTPC_ipcpBuildOptions,
+  PPTPC_ipcpCheckOptions,
+  PPTPC_ipcpNakOptions,
+  PPTPC_ipcpRejectOptions,
+  nullptr,
+  PPTPC_ipcpUp,
+  PPTPC_ipcpDown,
+  PPTPC_ipcpFinished
+};
+
+static const struct PppFsmCallbacks _ccpCallbacks = {
+  PPTPC_ccpBuildOptions,
+  PPTPC_ccpCheckOptions,
+  PPTPC_ccpNakOptions,
+  PPTPC_ccpRejectOptions,
+  PPTPC_ccpExtCode,
+  PPTPC_ccpUp,
+  PPTPC_ccpDown,
+  PPTPC_ccpFinished
+};
+
+// Start PPP negotiation on the new call, the link comes up from
+// PPTPC_receiveControl() as the answers arrive
+static void PPTPC_pppStart() {
+  db_printf(DB_DEBUG, "PPTPC_pppStart() Begin\n");
+
+  _lcpWantMru = true;
+  _lcpWantMagic = true;
+  _lcpWantCallback = true;
+  _lcpWantPfc = PPTPC_PPP_HEADER_COMPRESSION;
+  _lcpWantAcfc = PPTPC_PPP_HEADER_COMPRESSION;
+  _lcpPeerPfc = false;
+  _lcpPeerAcfc = false;
+  PPTPC_pppSetTxCompression(false, false);
+  _lcpPeerMru = PPTPC_LCP_DEFAULT_MRU;
+  _lcpMru = PPTPC_pppMaxMru();
+  _ipcpWantVj = true;
+  _ipcpVjMaxSlot = PPPVJ_MAX_SLOTS - 1;
+  _ipcpVjCompSlot = true;
+  _ipcpPeerVj = false;
+  _vjTxEnabled = false;
+  _vjRxEnabled = false;
+  _ccpStarted = false;
+  _ccpCanMppe = false;
+  _ccpWantMppe = false;
+  _ccpMppeBits = PPP_MPPE_S | PPP_MPPE_H;
+  _ccpPeerMppeBits = 0;
+  _ccpWantDeflate = PPTPC_DEFLATE;
+  _ccpDeflateBits = PPPDEF_WINDOW_BITS;
+  _ccpPeerDeflateBits = 0;
+  _mppeTxEnabled = false;
+  _mppeRxEnabled = false;
+  _deflateTxEnabled = false;
+  _deflateRxEnabled = false;
+  _lcpMagic = os_random();
+  _lcpWantMrru = PPTPC_MULTILINK;
+  _lcpWantEndpoint = PPTPC_MULTILINK;
+  _lcpPeerMrru = 0;
+  _lcpPeerEndpointLength = 0;
+  _mpMrru = PPPMP_MRRU;
+  _mpEndpoint[0] = PPPMP_ED_MAC;
+  wifi_get_macaddr(STATION_IF, &_mpEndpoint[1]);
+  _mpEnabled = false;
+  PPPMP_reset(&_mpRx);
+  for (int i = 0; i < PPTPC_MP_LINKS - 1; i++) {
+    _mpLinks[i].index = i + 1;
+  }
+
+  PPPFSM_init(&PPTPC_lcp, "LCP", 0xc021, &_lcpCallbacks, PPTPC_pppOutput);
+  PPPFSM_init(&PPTPC_ipcp, "IPCP", 0x8021, &_ipcpCallbacks, PPTPC_ncpOutput);
+  PPPFSM_init(&PPTPC_ccp, "CCP", PPP_CCP, &_ccpCallbacks, PPTPC_ncpOutput);
+  os_timer_disarm(&_pppPhaseTimer);
+  os_timer_setfn(&_pppPhaseTimer, PPTPC_pppPhaseTimeout, nullptr);
+
+  _pppPhase = PPTPC_PHASE_ESTABLISH;
+  PPPFSM_open(&PPTPC_lcp);
+  PPPFSM_lowerUp(&PPTPC_lcp);
+}
+
+// LCP Protocol-Reject for a protocol we do not run, 'info' is the packet
+// after the PPP header
+static void PPTPC_pppProtocolReject(struct PppFsm *lcp, uint16_t protocol, uint8_t *info, int length) {
+  uint8_t buff[PPPFSM_OPTIONS_MAX];
+
+  if (lcp->state != PPPFSM_OPENED) {
+    return;
+  }
+
+  db_printf(DB_DEBUG, "PPTPC_pppProtocolReject() Protocol 0x%04X\n", protocol);
+  if (length > PPPFSM_OPTIONS_MAX - 2) {
+    length = PPPFSM_OPTIONS_MAX - 2;
+  }
+  PV_set<PvBe16>(buff, protocol);
+  memcpy(&buff[2], info, length);
+  PPPFSM_send(lcp, 0x08, ++lcp->id, buff, length + 2);
+}
+
+// Length of the PPP header at 'data'. Address and Control may be left out
+// (ACFC) and a protocol below 0x100 may take a single byte (PFC), the first
+// byte of a two byte protocol is always even.
+static int PPTPC_pppParseHeader(const uint8_t *data, int length, uint16_t *protocol) {
+  int n = 0;
+
+  if (length >= 2 && data[0] == 0xff && data[1] == 0x03) {
+    n = 2;
+  }
+  if (length < n + 1) {
+    return -1;
+  }
+  if (data[n] & 0x01) {
+    *protocol = data[n];
+    return n + 1;
+  }
+  if (length < n + 2) {
+    return -1;
+  }
+  *protocol = PV_get<PvBe16>(data + n);
+  return n + 2;
+}
+
+// Send a control packet with the full PPP header, LCP never compresses it
+static int PPTPC_pppWriteControl(uint16_t protocol, const uint8_t *packet, int length) {
+  uint8_t header[4] = { 0xff, 0x03, (uint8_t)(protocol >> 8), (uint8_t)(protocol & 0xff) };
+  struct GreIovec iov[2];
+
+  iov[0].data = header;
+  iov[0].length = sizeof(header);
+  iov[1].data = packet;
+  iov[1].length = length;
+  return GRE_writev(iov, 2);
+}
+
+// PPP header of an IPv4 data frame, in full and with PFC only. With ACFC
+// the ff 03 at the front is skipped.
+static const uint8_t _pppIpv4Header[4] = { 0xff, 0x03, 0x00, 0x21 };
+static const uint8_t _pppIpv4HeaderPfc[3] = { 0xff, 0x03, 0x21 };
+static const uint8_t *_pppTxHeader = _pppIpv4Header;
+static int _pppTxHeaderLength = sizeof(_pppIpv4Header);
+static bool _pppTxAcfc;
+static bool _pppTxPfc;
+
+static void PPTPC_pppSetTxCompression(bool acfc, bool pfc) {
+  _pppTxAcfc = acfc;
+  _pppTxPfc = pfc;
+  _pppTxHeader = pfc ? _pppIpv4HeaderPfc : _pppIpv4Header;
+  _pppTxHeaderLength = pfc ? sizeof(_pppIpv4HeaderPfc) : sizeof(_pppIpv4Header);
+  if (acfc) {
+    _pppTxHeader += 2;
+    _pppTxHeaderLength -= 2;
+  }
+}
+
+// Largest frame the peer can send us without the outer packet fragmenting
+static uint16_t PPTPC_pppMaxMru() {
+  return _pathMtu - PPTPC_GRE_OVERHEAD - PPTPC_PPP_HEADER_MAX;
+}
+
+// IPv4 MTU of the tunnel: the peer's MRU, capped by what fits the path.
+// A bundle fragments what does not fit, its frames go up to the MRRU.
+static uint16_t PPTPC_pppLinkMtu() {
+  uint16_t mtu = _pathMtu - PPTPC_GRE_OVERHEAD - _pppTxHeaderLength;
+  uint16_t mru = _lcpPeerMru;
+
+  if (_mpEnabled) {
+    mtu = PPTPC_PATH_MTU;
+    mru = _lcpPeerMrru;
+  }
+
+  if (_mppeTxEnabled) {
+    mtu -= PPTPC_MPPE_OVERHEAD;
+    mru -= PPTPC_MPPE_OVERHEAD;
+  }
+  return mru < mtu ? mru : mtu;
+}
+
+// PPP header of a data frame of any other protocol, with the same
+// compression as the IPv4 one
+static int PPTPC_pppBuildHeader(uint16_t protocol, uint8_t *header) {
+  int n = 0;
+
+  if (!_pppTxAcfc) {
+    header[n++] = 0xff;
+    header[n++] = 0x03;
+  }
+  if (!_pppTxPfc || protocol > 0xff) {
+    header[n++] = protocol >> 8;
+  }
+  header[n++] = protocol & 0xff;
+  return n;
+}
+
+// A frame of our own for a PPP header of prefixLength bytes. The payload
+// starts as far past a word boundary as the header is long, so the GRE and
+// outer IPv4 headers in front of it stay word aligned in the headroom.
+static struct pbuf *PPTPC_pppAllocFrame(int length, int prefixLength) {
+  int pad = prefixLength & 3;
+  struct pbuf *q = pbuf_alloc(PBUF_TRANSPORT, length + pad, PBUF_RAM);
+
+  if (q != nullptr) {
+    pbuf_header(q, -pad);
+  }
+  return q;
+}
+
+// In-flight and queued packets of a call, the least loaded link of the
+// bundle gets the next frame
+static uint32_t PPTPC_mpLoad(struct GreSession *s) {
+  return s->sequenceNumber - 1 - s->peerAckNumber + s->txQueueCount;
+}
+
+// Send a frame of the bundle, protocol field first, as MP fragments. Short
+// frames go whole, longer ones are cut in one piece per link, or more when
+// a piece would not fit a link.
+static int PPTPC_mpWritev(const struct GreIovec *iov, int count) {
+  struct GreSession *links[PPTPC_MP_LINKS];
+  struct GreIovec out[PPTPC_MP_IOV_MAX];
+  uint8_t header[PPTPC_MP_OVERHEAD] = { 0xff, 0x03, PPP_MP >> 8, PPP_MP & 0xff };
+  int fragmentMax = PPTPC_pppMaxMru() - PPPMP_HEADER_LENGTH;
+  int linkCount = 0;
+  int first = 0;
+  int length = 0;
+  int pieces = 1;
+  int size;
+  int offset = 0;
+  int ret = 0;
+
+  links[linkCount++] = GRE_defaultSession;
+  if (links[0] == nullptr) {
+    return -1;
+  }
+  if (_lcpPeerMru - PPPMP_HEADER_LENGTH < fragmentMax) {
+    fragmentMax = _lcpPeerMru - PPPMP_HEADER_LENGTH;
+  }
+  for (int i = 0; i < PPTPC_MP_LINKS - 1; i++) {
+    struct PptpMpLink *link = &_mpLinks[i];
+    if (link->state != PPTPC_MP_LINK_JOINED) {
+      continue;
+    }
+    if (PPTPC_mpLoad(link->session) < PPTPC_mpLoad(links[first])) {
+      first = linkCount;
+    }
+    links[linkCount++] = link->session;
+    if (link->peerMru - PPPMP_HEADER_LENGTH < fragmentMax) {
+      fragmentMax = link->peerMru - PPPMP_HEADER_LENGTH;
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    length += iov[i].length;
+  }
+  if (length >= PPTPC_MP_SPLIT_MIN) {
+    pieces = linkCount;
+  }
+  while ((length + pieces - 1) / pieces > fragmentMax) {
+    pieces++;
+  }
+  size = (length + pieces - 1) / pieces;
+
+  // Every piece has to be cut before the first one takes a sequence number,
+  // a frame that stops half way would leave a gap in the bundle
+  for (offset = 0; offset < length; offset += size) {
+    int n = size < length - offset ? size : length - offset;
+    if (PPPMP_slice(iov, count, offset, n, &out[1], PPTPC_MP_IOV_MAX - 1) < 0) {
+      db_printf(DB_DEBUG, "PPTPC_mpWritev() Too many segments\n");
+      return -1;
+    }
+  }
+
+  offset = 0;
+  for (int i = 0; i < pieces && offset < length; i++) {
+    int n = size < length - offset ? size : length - offset;
+    uint8_t flags = (i == 0 ? PPPMP_BEGIN : 0) | (offset + n == length ? PPPMP_END : 0);
+    int segments = PPPMP_slice(iov, count, offset, n, &out[1], PPTPC_MP_IOV_MAX - 1);
+
+    PPPMP_buildHeader(&header[4], flags, _mpTxSeq);
+    _mpTxSeq = (_mpTxSeq + 1) & PPPMP_SEQ_MASK;
+    out[0].data = header;
+    out[0].length = sizeof(header);
+    if (GRE_sessionWritev(links[(first + i) % linkCount], out, segments + 1) < 0) {
+      ret = -1;
+    }
+    _mpTxFragments++;
+    offset += n;
+  }
+  _mpTxFrames++;
+  return ret < 0 ? ret : length;
+}
+
+// Data and NCP frames leave through here: straight to the first call, or
+// over the bundle. A bundle frame's PPP header has no address and control,
+// PPTPC_lcpUp() turns ACFC on.
+static int PPTPC_pppWritev(const struct GreIovec *iov, int count) {
+  if (!_mpEnabled) {
+    return GRE_writev(iov, count);
+  }
+  return PPTPC_mpWritev(iov, count);
+}
+
+static int PPTPC_pppWritePbuf(struct pbuf *p, const uint8_t *prefix, int prefixLength) {
+  struct GreIovec iov[PPTPC_MP_IOV_MAX - 1];
+  struct pbuf *linear = nullptr;
+  int n = 0;
+  int ret;
+
+  if (!_mpEnabled) {
+    return GRE_writePbuf(p, prefix, prefixLength);
+  }
+
+  iov[n].data = prefix;
+  iov[n++].length = prefixLength;
+  if (pbuf_clen(p) > PPTPC_MP_IOV_MAX - 2) {
+    // Longer chains than lwIP's usual header and data pbufs are copied
+    linear = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
+    if (linear == nullptr) {
+      db_printf(DB_DEBUG, "PPTPC_pppWritePbuf() pbuf alloc fail\n");
+      return -1;
+    }
+    pbuf_copy_partial(p, linear->payload, p->tot_len, 0);
+    p = linear;
+  }
+  for (struct pbuf *q = p; q != nullptr; q = q->next) {
+    iov[n].data = (const uint8_t *)q->payload;
+    iov[n++].length = q->len;
+  }
+
+  ret = PPTPC_mpWritev(iov, n);
+  if (linear != nullptr) {
+    pbuf_free(linear);
+  }
+  return ret;
+}
+
+// Send a VJ frame: 'vj' replaces the first headerLength bytes of p. lwIP
+// keeps p's headers for retransmissions and the WiFi driver may still hold
+// the frame after we return, so the rest of the first pbuf is copied
+// behind the new header; later pbufs are chained as they are.
+static int PPTPC_writeVjPbuf(struct pbuf *p, uint16_t protocol, const uint8_t *vj, int vjLength, int headerLength) {
+  uint8_t pppHeader[4];
+  int pppHeaderLength = PPTPC_pppBuildHeader(protocol, pppHeader);
+  int dataLength = p->len - headerLength;
+  struct pbuf *q;
+  int ret;
+
+  q = PPTPC_pppAllocFrame(vjLength + dataLength, pppHeaderLength);
+  if (q == nullptr) {
+    db_printf(DB_DEBUG, "PPTPC_writeVjPbuf() pbuf alloc fail\n");
+    return -1;
+  }
+  memcpy(q->payload, vj, vjLength);
+  memcpy((uint8_t *)q->payload + vjLength, (uint8_t *)p->payload + headerLength, dataLength);
+  if (p->next != nullptr) {
+    pbuf_chain(q, p->next);
+  }
+
+  ret = PPTPC_pppWritePbuf(q, pppHeader, pppHeaderLength);
+  pbuf_free(q);
+  return ret;
+}
+
+// Send an MPPE frame: the protocol, 'vj' and p after its first headerLength
+// bytes are encrypted on the way into a new pbuf. lwIP's pbufs are never
+// written to, they may be sent again on a retransmission.
+static int PPTPC_writeMppePbuf(struct pbuf *p, uint16_t protocol, const uint8_t *vj, int vjLength, int headerLength) {
+  uint32_t cycles = ESP.getCycleCount();
+  uint8_t pppHeader[4];
+  int pppHeaderLength = PPTPC_pppBuildHeader(PPP_MPPE, pppHeader);
+  int length = PPTPC_MPPE_OVERHEAD + vjLength + p->tot_len - headerLength;
+  int offset = headerLength;
+  uint16_t mppe;
+  uint8_t *out;
+  struct pbuf *q;
+  int ret;
+
+  q = PPTPC_pppAllocFrame(length, pppHeaderLength);
+  if (q == nullptr) {
+    db_printf(DB_DEBUG, "PPTPC_writeMppePbuf() pbuf alloc fail\n");
+    return -1;
+  }
+
+  out = (uint8_t *)q->payload;
+  mppe = PPPMPPE_encryptBegin(&_mppeTx);
+  PV_set<PvBe16>(out, mppe);
+  PV_set<PvBe16>(out + 2, protocol);
+  PPPMPPE_rc4(&_mppeTx.rc4, out + 2, out + 2, 2);
+  out += PPTPC_MPPE_OVERHEAD;
+  PPPMPPE_rc4(&_mppeTx.rc4, vj, out, vjLength);
+  out += vjLength;
+  for (struct pbuf *r = p; r != nullptr; r = r->next) {
+    if (offset >= r->len) {
+      offset -= r->len;
+      continue;
+    }
+    PPPMPPE_rc4(&_mppeTx.rc4, (uint8_t *)r->payload + offset, out, r->len - offset);
+    out += r->len - offset;
+    offset = 0;
+  }
+  db_stageAdd(DB_STAGE_MPPE_TX, cycles, length);
+
+  ret = PPTPC_pppWritePbuf(q, pppHeader, pppHeaderLength);
+  pbuf_free(q);
+  return ret;
+}
+
+// Send a Deflate frame: the protocol, 'vj' and p after its first
+// headerLength bytes are copied behind the compressor's history and
+// compressed into a new pbuf. Frames that do not get smaller go out as they
+// are, the peer takes them into its history all the same. So do frames too
+// long for the compressor, only their last PPPDEF_FRAME_MAX bytes go into
+// our history: no match reaches back further than that.
+static int PPTPC_writeDeflatePbuf(struct pbuf *p, uint16_t protocol, const uint8_t *vj, int vjLength, int headerLength) {
+  uint32_t cycles = ESP.getCycleCount();
+  uint8_t pppHeader[4];
+  int pppHeaderLength = PPTPC_pppBuildHeader(PPP_COMP, pppHeader);
+  uint8_t head[2 + PPPVJ_HEADER_MAX];
+  int headLength = 0;
+  int length;
+  int skip;
+  uint8_t *frame;
+  struct pbuf *q;
+  int n = 0;
+  int ret;
+
+  if (protocol > 0xff) {
+    head[headLength++] = protocol >> 8;
+  }
+  head[headLength++] = protocol & 0xff;
+  memcpy(head + headLength, vj, vjLength);
+  headLength += vjLength;
+  length = headLength + p->tot_len - headerLength;
+  skip = length > PPPDEF_FRAME_MAX ? length - PPPDEF_FRAME_MAX : 0;
+
+  frame = PPPDEF_frame(&_deflateTx);
+  if (skip < headLength) {
+    memcpy(frame, head + skip, headLength - skip);
+    pbuf_copy_partial(p, frame + headLength - skip, p->tot_len - headerLength, headerLength);
+  } else {
+    pbuf_copy_partial(p, frame, length - skip, headerLength + skip - headLength);
+  }
+
+  if (skip > 0) {
+    db_printf(DB_DEBUG, "PPTPC_writeDeflatePbuf() Frame too long %d, sent plain\n", length);
+    q = nullptr;
+    n = PPPDEF_compress(&_deflateTx, length - skip, nullptr, 0);
+  } else {
+    q = PPTPC_pppAllocFrame(length, pppHeaderLength);
+    n = PPPDEF_compress(&_deflateTx, length, q != nullptr ? (uint8_t *)q->payload : nullptr, length);
+  }
+  db_stageAdd(DB_STAGE_DEFLATE_TX, cycles, length);
+
+  if (n == 0) {
+    if (q != nullptr) {
+      pbuf_free(q);
+    }
+    if (protocol != 0x0021) {
+      return PPTPC_writeVjPbuf(p, protocol, vj, vjLength, headerLength);
+    }
+    return PPTPC_pppWritePbuf(p, _pppTxHeader, _pppTxHeaderLength);
+  }
+
+  pbuf_realloc(q, n);
+  ret = PPTPC_pppWritePbuf(q, pppHeader, pppHeaderLength);
+  pbuf_free(q);
+  return ret;
+}
+
+int PPTPC_writeDataPbuf(struct pbuf *p) {
+  uint8_t vj[PPPVJ_HEADER_MAX];
+  int vjLength = 0;
+  int headerLength = 0;
+  uint16_t protocol = 0x0021;
+  int ret;
+
+  db_printf(DB_DEBUG, "PPTPC_writeDataPbuf() Begin\n");
+
+  if (PPTPC_MPPE_REQUIRED && !_mppeTxEnabled) {
+    return -1;
+  }
+
+  if (_vjTxEnabled) {
+    protocol = PPPVJ_compress(&_vjTx, (uint8_t *)p->payload, p->len, vj, &vjLength, &headerLength);
+    if (protocol == 0x0021) {
+      vjLength = 0;
+      headerLength = 0;
+    } else {
+      db_printf(DB_DEBUG, "PPTPC_writeDataPbuf() VJ 0x%04X header %d -> %d\n", protocol, headerLength, vjLength);
+    }
+  }
+
+  if (_mppeTxEnabled) {
+    return PPTPC_writeMppePbuf(p, protocol, vj, vjLength, headerLength);
+  }
+  if (_deflateTxEnabled) {
+    return PPTPC_writeDeflatePbuf(p, protocol, vj, vjLength, headerLength);
+  }
+  if (protocol != 0x0021) {
+    return PPTPC_writeVjPbuf(p, protocol, vj, vjLength, headerLength);
+  }
+
+  // PPP header goes in front of the IPv4 packet together with the GRE header
+  ret = PPTPC_pppWritePbuf(p, _pppTxHeader, _pppTxHeaderLength);
+  db_printf(DB_DEBUG, "PPTPC_writeDataPbuf() PPTPC_pppWritePbuf len = %d\n", ret);
+
+  return ret;
+}
+
+int PPTPC_writeData(uint8_t *data, int length) {
+  int ret;
+  struct GreIovec iov[3];
+  uint8_t pppHeader[4];
+  uint8_t vj[PPPVJ_HEADER_MAX];
+  int vjLength = 0;
+  int headerLength = 0;
+  uint16_t protocol = 0x0021;
+  
+  db_printf(DB_DEBUG, "PPTPC_writeData() Begin\n");
+
+  if (PPTPC_MPPE_REQUIRED && !_mppeTxEnabled) {
+    return -1;
+  }
+
+  // MPPE and Deflate copy on their way, the buffer only has to be wrapped
+  if (_mppeTxEnabled || _deflateTxEnabled) {
+    struct pbuf *p = pbuf_alloc(PBUF_RAW, length, PBUF_REF);
+    if (p == nullptr) {
+      return -1;
+    }
+    p->payload = data;
+    ret = PPTPC_writeDataPbuf(p);
+    pbuf_free(p);
+    return ret < 0 ? ret : length;
+  }
+
+  if (_vjTxEnabled) {
+    protocol = PPPVJ_compress(&_vjTx, data, length, vj, &vjLength, &headerLength);
+  }
+
+  if (protocol == 0x0021) {
+    iov[0].data = _pppTxHeader;
+    iov[0].length = _pppTxHeaderLength;
+  } else {
+    iov[0].data = pppHeader;
+    iov[0].length = PPTPC_pppBuildHeader(protocol, pppHeader);
+  }
+  iov[1].data = vj;
+  iov[1].length = vjLength;
+  iov[2].data = data + headerLength;
+  iov[2].length = length - headerLength;
+
+  ret = PPTPC_pppWritev(iov, 3);
+  if (ret < 0) {
+    return ret;
+  }
+
+  db_printf(DB_DEBUG, "PPTPC_writeData() GRE_write len = %d Success\n", ret);
+  return length;
+}
+
+#define PPTP_IF_TASK_PRIO 1
+#define PPTP_IF_TASK_QUEUE_SIZE 2
+os_event_t pptpInterfaceTaskQueue[PPTP_IF_TASK_QUEUE_SIZE];
+
+// Received packets wait here for pptpInterfaceTask(). The GRE receive
+// callback only moves the head, the task only the tail; one event is
+// posted when the ring stops being empty and the task takes the whole
+// batch. The task queue alone held two packets.
+#ifndef PPTP_IF_RING_SIZE
+#define PPTP_IF_RING_SIZE 16    // power of two
+#endif
+#if (PPTP_IF_RING_SIZE & (PPTP_IF_RING_SIZE - 1)) != 0
+#error "PPTP_IF_RING_SIZE must be a power of two"
+#endif
+
+static struct pbuf *_ifRing[PPTP_IF_RING_SIZE];
+static volatile uint32_t _ifRingHead;   // next slot the producer fills
+static volatile uint32_t _ifRingTail;   // next slot the task takes
+static bool _ifRingKick;                // producer's, the last post failed
+// The task queue had no room: the ring is drained from a timer instead, on
+// a quiet link no further packet may come to post again
+#define PPTP_IF_REPOST_MS 2
+static os_timer_t _ifRingTimer;
+static bool _ifRingTimerArmed;
+static bool _ifRingTaskAdded;
+static struct PptpRxRingStats _ifRingStats;
+
+struct netif pptpLwip_netif;
+
+//ESP stack -> GRE
+err_t ICACHE_FLASH_ATTR PPTPC_interfaceOutput(struct netif *netif, struct pbuf *p, const ip_addr_t *ipaddr) {
+  uint8_t *data = (uint8_t*)p->payload;
+  uint32_t cycles = ESP.getCycleCount();
+
+  db_printf(DB_DEBUG, "PPTPC_interfaceOutput() ESP->VPN Length=%d (%d pbufs) Begin\n", p->tot_len, pbuf_clen(p));
+  
+  if (PV_get<PvIp4::protocol>(data) == IP_PROTO_GRE) {
+    db_printf(DB_DEBUG, "PPTPC_interfaceOutput() skip GRE\n");
+    return 0;
+  }
+  
+  PPTPC_printHexDB( DB_DEBUG, (uint8_t*)p->payload, p->len); 
+  db_printf(DB_DEBUG, "\n");
+    
+  // Headers are prepended to p itself and a chain is sent as a whole,
+  // no copy of the IPv4 packet
+  if (PPTPC_writeDataPbuf(p) < 0) {
+    db_printf(DB_DEBUG, "PPTPC_interfaceOutput() PPTPC_writeDataPbuf() Fail\n");
+    return ERR_MEM;
+  }
+  db_stageAdd(DB_STAGE_PPP_TX, cycles, p->tot_len);
+  db_printf(DB_DEBUG, "PPTPC_interfaceOutput() Success\n");
+  return 0;
+}
+
+// Hand a pbuf we own to lwIP from the interface task
+static void PPTPC_interfacePost(struct pbuf *p) {
+  uint32_t head = _ifRingHead;
+  uint32_t used = head - _ifRingTail;
+
+  if (used >= PPTP_IF_RING_SIZE) {
+    db_printf(DB_DEBUG, "PPTPC_interfacePost() Ring full, drop\n");
+    _ifRingStats.drops++;
+    pbuf_free(p);
+    return;
+  }
+
+  _ifRing[head & (PPTP_IF_RING_SIZE - 1)] = p;
+  __sync_synchronize();   // the slot is written before the task can see it
+  _ifRingHead = head + 1;
+  if (used + 1 > _ifRingStats.highWater) {
+    _ifRingStats.highWater = used + 1;
+  }
+
+  if (used == 0 || _ifRingKick) {
+    _ifRingKick = system_os_post(PPTP_IF_TASK_PRIO, 0, 0) != true;
+    if (_ifRingKick) {
+      db_printf(DB_DEBUG, "PPTPC_interfacePost() system_os_post fail\n");
+      if (!_ifRingTimerArmed) {
+        _ifRingTimerArmed = true;
+        os_timer_arm(&_ifRingTimer, PPTP_IF_REPOST_MS, false);
+      }
+    }
+  }
+  db_printf(DB_DEBUG, "PPTPC_interfacePost() Success\n");
+}
+
+// GRE -> ESP Stack
+void ICACHE_FLASH_ATTR PPTPC_interfaceInput(struct pbuf *p, int headerLength) {
+
+  db_printf(DB_DEBUG, "PPTPC_interfaceInput() VPN->ESP Length=%d Begin\n", p->tot_len - headerLength);
+
+  // Nowhere to go before IPCP has given the netif its addresses
+  if (!_pptpNetifAdded || PPTPC_ipcp.state != PPPFSM_OPENED) {
+    db_printf(DB_DEBUG, "PPTPC_interfaceInput() IPCP not opened, drop\n");
+    return;
+  }
+
+  // Skip the PPP header, payload now starts at the IPv4 header
+  if (pbuf_header(p, -headerLength) != 0) {
+    db_printf(DB_DEBUG, "PPTPC_interfaceInput() pbuf_header fail\n");
+    return;
+  }
+
+  PPTPC_printHexDB( DB_DEBUG, p->payload, p->len); 
+
+  int shift = (uintptr_t)p->payload & 3;
+  if (shift != 0 && p->next == NULL && pbuf_header(p, shift) == 0) {
+    // A compressed header leaves the IPv4 header unaligned and lwIP reads
+    // its words directly. The outer headers left room in front of it, the
+    // packet moves back to the word boundary within its own pbuf.
+    memmove(p->payload, (uint8_t *)p->payload + shift, p->len - shift);
+    pbuf_realloc(p, p->tot_len - shift);
+    shift = 0;
+  }
+
+  if (shift != 0) {
+    // Chained or without headroom, it gets an aligned copy
+    struct pbuf *q = pbuf_alloc(PBUF_RAW, p->tot_len, PBUF_RAM);
+    if (q == NULL) {
+      db_printf(DB_DEBUG, "PPTPC_interfaceInput() pbuf_alloc fail\n");
+      return;
+    }
+    pbuf_copy_partial(p, q->payload, p->tot_len, 0);
+    p = q;
+  } else {
+    // Same pbuf goes up to lwIP; our reference is released by ip_input,
+    // the one GreReceived() holds is released when it returns.
+    pbuf_ref(p);
+  }
+  PPTPC_interfacePost(p);
+}
+
+// GRE -> ESP Stack, a VJ frame. Uncompressed TCP is restored in place, a
+// compressed one is rebuilt into a new pbuf.
+static void PPTPC_vjInput(struct GreSession *session, struct pbuf *p, uint16_t protocol, int headerLength) {
+  uint8_t comp[PPPVJ_COMP_MAX];
+  uint8_t header[PPPVJ_HEADER_MAX];
+  int frameLength = p->tot_len - headerLength;
+  int compLength;
+  int consumed;
+  int hl;
+  struct pbuf *q;
+
+  // A lost frame leaves the deltas out of step until the peer names a slot
+  if (session->stats.rxGaps != _vjRxGaps) {
+    _vjRxGaps = session->stats.rxGaps;
+    PPPVJ_toss(&_vjRx);
+  }
+
+  if (protocol == PPP_VJ_UNCOMP) {
+    if (!PPPVJ_uncompressTcp(&_vjRx, (uint8_t *)p->payload + headerLength, p->len - headerLength)) {
+      db_printf(DB_DEBUG, "PPTPC_vjInput() Bad uncompressed TCP frame\n");
+      return;
+    }
+    PPTPC_interfaceInput(p, headerLength);
+    return;
+  }
+
+  compLength = frameLength < PPPVJ_COMP_MAX ? frameLength : PPPVJ_COMP_MAX;
+  pbuf_copy_partial(p, comp, compLength, headerLength);
+  hl = PPPVJ_uncompress(&_vjRx, comp, compLength, frameLength, header, &consumed);
+  if (hl < 0) {
+    db_printf(DB_DEBUG, "PPTPC_vjInput() Compressed TCP frame dropped\n");
+    return;
+  }
+
+  q = pbuf_alloc(PBUF_RAW, hl + frameLength - consumed, PBUF_RAM);
+  if (q == NULL) {
+    db_printf(DB_DEBUG, "PPTPC_vjInput() pbuf_alloc fail\n");
+    return;
+  }
+  memcpy(q->payload, header, hl);
+  pbuf_copy_partial(p, (uint8_t *)q->payload + hl, frameLength - consumed, headerLength + consumed);
+  PPTPC_interfacePost(q);
+}
+
+// GRE -> ESP Stack, an MPPE frame. The pbuf is ours until we return, it is
+// decrypted in place and goes on as a frame of the protocol inside.
+static void PPTPC_mppeInput(struct GreSession *session, struct pbuf *p, int headerLength) {
+  uint32_t cycles = ESP.getCycleCount();
+  uint8_t *data;
+  int offset = headerLength + PPPMPPE_HEADER_LENGTH;
+  uint16_t protocol;
+  int ret;
+
+  if (p->len < offset + 2) {
+    db_printf(DB_DEBUG, "PPTPC_mppeInput() Short frame %d\n", p->len);
+    return;
+  }
+
+  data = (uint8_t *)p->payload + headerLength;
+  ret = PPPMPPE_decryptBegin(&_mppeRx, PV_get<PvBe16>(data));
+  if (ret != PPPMPPE_OK) {
+    // Stateful mode lost a frame, only a flushed one can follow
+    if (ret == PPPMPPE_RESYNC ||
+        (_mppeRx.discard && millis() - _ccpResetMs >= PPTPC_CCP_RESET_MS)) {
+      db_printf(DB_DEBUG, "PPTPC_mppeInput() Out of sync, Reset-Request\n");
+      PPTPC_ccpResetRequest();
+    }
+    return;
+  }
+
+  for (struct pbuf *q = p; q != nullptr; q = q->next) {
+    if (offset >= q->len) {
+      offset -= q->len;
+      continue;
+    }
+    PPPMPPE_rc4(&_mppeRx.rc4, (uint8_t *)q->payload + offset, (uint8_t *)q->payload + offset, q->len - offset);
+    offset = 0;
+  }
+  db_stageAdd(DB_STAGE_MPPE_RX, cycles, p->tot_len - headerLength);
+
+  pbuf_header(p, -(headerLength + PPPMPPE_HEADER_LENGTH));
+  data = (uint8_t *)p->payload;
+  if (data[0] & 0x01) {
+    protocol = data[0];
+    headerLength = 1;
+  } else {
+    protocol = PV_get<PvBe16>(data);
+    headerLength = 2;
+  }
+
+  if (protocol == 0x0021) {
+    PPTPC_interfaceInput(p, headerLength);
+  } else if ((protocol == PPP_VJ_COMP || protocol == PPP_VJ_UNCOMP) && _vjRxEnabled) {
+    PPTPC_vjInput(session, p, protocol, headerLength);
+  } else if (protocol == PPP_VJ_COMP || protocol == PPP_VJ_UNCOMP) {
+    db_printf(DB_DEBUG, "PPTPC_mppeInput() VJ frame dropped\n");
+  } else if (_mppeRx.stateful) {
+    // A lost flushed frame followed by a flag frame leaves us one key
+    // change behind, which no Reset-Request can repair. Start CCP over.
+    db_printf(DB_INFO, "PPTPC_mppeInput() Bad protocol 0x%04X, MPPE keys lost, renegotiating\n", protocol);
+    PPPFSM_lowerDown(&PPTPC_ccp);
+    PPPFSM_lowerUp(&PPTPC_ccp);
+  } else {
+    db_printf(DB_DEBUG, "PPTPC_mppeInput() Protocol 0x%04X dropped\n", protocol);
+  }
+}
+
+// GRE -> ESP Stack, a Deflate frame. It is inflated into a new pbuf three
+// bytes in, so that the IPv4 header behind the usual one byte protocol
+// field ends up word aligned.
+#define PPTPC_DEFLATE_RX_OFFSET 3
+
+static void PPTPC_deflateInput(struct GreSession *session, struct pbuf *p, int headerLength) {
+  uint32_t cycles = ESP.getCycleCount();
+  int length = p->tot_len - headerLength;
+  struct pbuf *linear = nullptr;
+  const uint8_t *data;
+  struct pbuf *q;
+  uint8_t *frame;
+  uint16_t protocol;
+  int n;
+
+  if (p->len < p->tot_len) {
+    linear = pbuf_alloc(PBUF_RAW, length, PBUF_RAM);
+    if (linear == nullptr) {
+      db_printf(DB_DEBUG, "PPTPC_deflateInput() pbuf alloc fail\n");
+      return;
+    }
+    pbuf_copy_partial(p, linear->payload, length, headerLength);
+    data = (const uint8_t *)linear->payload;
+  } else {
+    data = (const uint8_t *)p->payload + headerLength;
+  }
+
+  q = pbuf_alloc(PBUF_RAW, PPTPC_DEFLATE_RX_OFFSET + PPPDEF_FRAME_MAX, PBUF_RAM);
+  if (q == nullptr) {
+    // The frame is lost to the history as well
+    db_printf(DB_DEBUG, "PPTPC_deflateInput() pbuf alloc fail\n");
+    n = PPPDEF_RESYNC;
+    _deflateRx.discard = true;
+  } else {
+    frame = (uint8_t *)q->payload + PPTPC_DEFLATE_RX_OFFSET;
+    n = PPPDEF_decompress(&_deflateRx, data, length, frame, PPPDEF_FRAME_MAX);
+  }
+  if (linear != nullptr) {
+    pbuf_free(linear);
+  }
+  if (n < 1) {
+    if (q != nullptr) {
+      pbuf_free(q);
+    }
+    // VJ deltas of the dropped frame are lost with it
+    PPPVJ_toss(&_vjRx);
+    if (n == PPPDEF_RESYNC ||
+        (_deflateRx.discard && millis() - _ccpResetMs >= PPTPC_CCP_RESET_MS)) {
+      db_printf(DB_DEBUG, "PPTPC_deflateInput() Out of sync, Reset-Request\n");
+      PPTPC_ccpResetRequest();
+    }
+    return;
+  }
+  db_stageAdd(DB_STAGE_DEFLATE_RX, cycles, n);
+
+  pbuf_realloc(q, PPTPC_DEFLATE_RX_OFFSET + n);
+  pbuf_header(q, -PPTPC_DEFLATE_RX_OFFSET);
+  if (frame[0] & 0x01) {
+    protocol = frame[0];
+    headerLength = 1;
+  } else if (n >= 2) {
+    protocol = PV_get<PvBe16>(frame);
+    headerLength = 2;
+  } else {
+    protocol = 0;
+  }
+
+  if (protocol == 0x0021) {
+    PPTPC_interfaceInput(q, headerLength);
+  } else if ((protocol == PPP_VJ_COMP || protocol == PPP_VJ_UNCOMP) && _vjRxEnabled) {
+    PPTPC_vjInput(session, q, protocol, headerLength);
+  } else {
+    db_printf(DB_DEBUG, "PPTPC_deflateInput() Protocol 0x%04X dropped\n", protocol);
+  }
+  pbuf_free(q);
+}
+
+// A data frame the peer did not compress, Deflate takes it into its history
+static void PPTPC_deflateHistory(struct pbuf *p, uint16_t protocol, int headerLength) {
+  int offset = headerLength;
+
+  PPPDEF_incompressible(&_deflateRx, protocol);
+  for (struct pbuf *q = p; q != nullptr; q = q->next) {
+    if (offset >= q->len) {
+      offset -= q->len;
+      continue;
+    }
+    PPPDEF_history(&_deflateRx, (uint8_t *)q->payload + offset, q->len - offset);
+    offset = 0;
+  }
+}
+
+err_t ICACHE_FLASH_ATTR PPTPC_pptpLwipInit(struct netif *netif) {
+  db_printf(DB_DEBUG, "PPTPC_pptpLwipInit() Begin\n");
+  //NETIF_INIT_SNMP(netif, snmp_ifType_other, 0);
+  netif->name[0] = 'p';
+  netif->name[1] = 't';
+
+  netif->output = PPTPC_interfaceOutput;
+  netif->mtu = PPTPC_pppLinkMtu();
+  netif->flags = NETIF_FLAG_LINK_UP;
+
+  db_printf(DB_DEBUG, "PPTPC_pptpLwipInit() Success\n");
+  return 0;
+}
+
+static void ICACHE_FLASH_ATTR pptpInterfaceTask(os_event_t *e) {
+  uint32_t tail = _ifRingTail;
+  int count = 0;
+
+  db_printf(DB_DEBUG, "pptpInterfaceTask() Begin\n");
+  while (tail != _ifRingHead) {
+    struct pbuf *pb = _ifRing[tail & (PPTP_IF_RING_SIZE - 1)];
+    _ifRing[tail & (PPTP_IF_RING_SIZE - 1)] = NULL;
+    _ifRingTail = ++tail;
+
+    uint32_t cycles = ESP.getCycleCount();
+    uint16_t length = pb->tot_len;
+    if (pptpLwip_netif.input(pb, &pptpLwip_netif) != ERR_OK) {
+      db_printf(DB_DEBUG, "pptpInterfaceTask() pptpLwip_netif.input != OK\n");
+      pbuf_free(pb);
+    }
+    db_stageAdd(DB_STAGE_PPP_RX, cycles, length);
+    count++;
+  }
+
+  if (count > 0) {
+    _ifRingStats.packets += count;
+    _ifRingStats.batches++;
+  }
+  db_printf(DB_DEBUG, "pptpInterfaceTask() End, %d packets\n", count);
+}
+
+static void PPTPC_interfaceRepost(void *arg) {
+  _ifRingTimerArmed = false;
+  _ifRingKick = false;
+  pptpInterfaceTask(nullptr);
+}
+
+// The ring's task and timer, from PPTPC_init(): a server may send IPv4
+// before IPCP is up on our side
+static void PPTPC_interfaceTaskInit() {
+  if (_ifRingTaskAdded) {
+    return;
+  }
+  system_os_task(pptpInterfaceTask, PPTP_IF_TASK_PRIO, pptpInterfaceTaskQueue, PPTP_IF_TASK_QUEUE_SIZE);
+  os_timer_setfn(&_ifRingTimer, PPTPC_interfaceRepost, nullptr);
+  _ifRingTaskAdded = true;
+}
+
+const struct PptpRxRingStats *PPTPC_getRxRingStats() {
+  return &_ifRingStats;
+}
+
+bool PPTPC_pptpInterfaceInit() {
+
+  // IPCP may come up again on the same link, the netif is added only once
+  if (_pptpNetifAdded) {
+    pptpLwip_netif.mtu = PPTPC_pppLinkMtu();
+    netif_set_addr(&pptpLwip_netif, &localIP, &netmask, &remoteIP);
+    netif_set_up(&pptpLwip_netif);
+    return true;
+  }
+
+  PPTPC_interfaceTaskInit();
+  netif_add(&pptpLwip_netif, &localIP, &netmask, &remoteIP, NULL, PPTPC_pptpLwipInit, ip_input);
+  netif_set_up(&pptpLwip_netif);
+  _pptpNetifAdded = true;
+
+
+  return true;
+}
+
+#if PPTPC_MTU_PROBE
+// Binary search for the largest packet that reaches the server with DF set.
+// An echo reply means it fit, Fragmentation-Needed or silence means it did
+// not. The first probe is the minimum size, a server that does not answer
+// that leaves the default path MTU in place.
+#define PPTPC_MTU_PROBE_ID  0x5074
+
+static struct raw_pcb *_mtuProbePcb;
+static os_timer_t _mtuProbeTimer;
+static uint16_t _mtuProbeLow;
+static uint16_t _mtuProbeHigh;
+static uint16_t _mtuProbeSize;
+static uint16_t _mtuProbeSeq;
+static bool _mtuProbeBaseline;
+static bool _mtuProbeDone;
+
+static void PPTPC_mtuProbeFinish(uint16_t mtu) {
+  os_timer_disarm(&_mtuProbeTimer);
+  if (_mtuProbePcb != nullptr) {
+    raw_remove(_mtuProbePcb);
+    _mtuProbePcb = nullptr;
+  }
+  _mtuProbeDone = true;
+  _pathMtu = mtu;
+  db_printf(DB_INFO, "PPTPC_mtuProbeFinish() Path MTU %d\n", mtu);
+
+  // A link that came up during the probe picks the result up now, the MRU
+  // follows on the next negotiation
+  if (_pptpConnected) {
+    pptpLwip_netif.mtu = PPTPC_pppLinkMtu();
+  }
+}
+
+static void PPTPC_mtuProbeSend() {
+  struct pbuf *p;
+  uint8_t *b;
+  uint16_t sum;
+
+  os_timer_disarm(&_mtuProbeTimer);
+  os_timer_arm(&_mtuProbeTimer, PPTPC_MTU_PROBE_TIMEOUT_MS, false);
+
+  p = pbuf_alloc(PBUF_RAW, _mtuProbeSize, PBUF_RAM);
+  if (p == nullptr) {
+    db_printf(DB_DEBUG, "PPTPC_mtuProbeSend() pbuf_alloc fail\n");
+    return;
+  }
+  b = (uint8_t *)p->payload;
+  memset(b, 0, _mtuProbeSize);
+  _mtuProbeSeq++;
+
+  // IPv4 header with DF, the stack sends it as is
+  PV_set<PvIp4::versionIhl>(b, 0x45);
+  PV_set<PvIp4::totalLength>(b, _mtuProbeSize);
+  PV_set<PvIp4::id>(b, _mtuProbeSeq);
+  PV_set<PvIp4::fragment>(b, IP_DF);
+  PV_set<PvIp4::ttl>(b, 64);
+  PV_set<PvIp4::protocol>(b, IP_PROTO_ICMP);
+  memcpy(b + PvIp4::src::offset, &netif_default->ip_addr.addr, 4);
+  memcpy(b + PvIp4::dest::offset, &PPTPC_serverIP.addr, 4);
+  sum = inet_chksum(b, PvIp4::size);
+  PV_set<PvIp4::checksum>(b, ntohs(sum));
+
+  // ICMP Echo Request
+  uint8_t *icmp = b + PvIp4::size;
+  PV_set<PvIcmp::type>(icmp, 8);
+  PV_set<PvIcmp::id>(icmp, PPTPC_MTU_PROBE_ID);
+  PV_set<PvIcmp::seq>(icmp, _mtuProbeSeq);
+  sum = inet_chksum(icmp, _mtuProbeSize - PvIp4::size);
+  PV_set<PvIcmp::checksum>(icmp, ntohs(sum));
+
+  db_printf(DB_DEBUG, "PPTPC_mtuProbeSend() Probe %d bytes\n", _mtuProbeSize);
+  raw_sendto(_mtuProbePcb, p, &PPTPC_serverIP);
+  pbuf_free(p);
+}
+
+static void PPTPC_mtuProbeResult(bool fits, uint16_t nextHopMtu) {
+  if (!_mtuProbeBaseline) {
+    if (!fits) {
+      db_printf(DB_INFO, "PPTPC_mtuProbeResult() No echo reply from server\n");
+      PPTPC_mtuProbeFinish(_pathMtu);
+      return;
+    }
+    _mtuProbeBaseline = true;
+    _mtuProbeSize = _mtuProbeHigh;
+    PPTPC_mtuProbeSend();
+    return;
+  }
+
+  if (fits) {
+    _mtuProbeLow = _mtuProbeSize;
+  } else {
+    _mtuProbeHigh = _mtuProbeSize - 1;
+  }
+
+  if (_mtuProbeLow >= _mtuProbeHigh) {
+    PPTPC_mtuProbeFinish(_mtuProbeLow);
+    return;
+  }
+  if (!fits && nextHopMtu > _mtuProbeLow && nextHopMtu <= _mtuProbeHigh) {
+    // Routers that report their next-hop MTU save the search, check it
+    _mtuProbeHigh = nextHopMtu;
+    _mtuProbeSize = nextHopMtu;
+  } else {
+    _mtuProbeSize = (_mtuProbeLow + _mtuProbeHigh + 1) / 2;
+  }
+  PPTPC_mtuProbeSend();
+}
+
+static void PPTPC_mtuProbeTimeout(void *arg) {
+  PPTPC_mtuProbeResult(false, 0);
+}
+
+static bool PPTPC_mtuProbeMatch(const uint8_t *icmp) {
+  return PV_get<PvIcmp::id>(icmp) == PPTPC_MTU_PROBE_ID &&
+         PV_get<PvIcmp::seq>(icmp) == _mtuProbeSeq;
+}
+
+static uint8_t PPTPC_mtuProbeRecv(void *arg, struct raw_pcb *pcb, struct pbuf *p, const ip_addr_t *addr) {
+  uint8_t b[64];
+  int length = pbuf_copy_partial(p, b, sizeof(b), 0);
+  int hl;
+  uint8_t *icmp;
+
+  if (length < (int)PvIp4::size) {
+    return 0;
+  }
+  hl = PV_ip4HeaderLength(b);
+  if (length < hl + (int)PvIcmp::size) {
+    return 0;
+  }
+  icmp = b + hl;
+
+  if (PV_get<PvIcmp::type>(icmp) == 0 && addr->addr == PPTPC_serverIP.addr && PPTPC_mtuProbeMatch(icmp)) {
+    // Echo Reply
+    pbuf_free(p);
+    PPTPC_mtuProbeResult(true, 0);
+    return 1;
+  }
+
+  if (PV_get<PvIcmp::type>(icmp) == 3 && PV_get<PvIcmp::code>(icmp) == 4 &&
+      length >= hl + (int)(PvIcmp::size + PvIp4::size)) {
+    // Fragmentation Needed, carrying our request behind its own IP header
+    uint8_t *inner = icmp + PvIcmp::size;
+    int innerHl = PV_ip4HeaderLength(inner);
+    if (length >= hl + (int)PvIcmp::size + innerHl + (int)PvIcmp::size &&
+        PV_get<PvIp4::protocol>(inner) == IP_PROTO_ICMP &&
+        PV_get<PvIcmp::type>(inner + innerHl) == 8 && PPTPC_mtuProbeMatch(inner + innerHl)) {
+      uint16_t nextHopMtu = PV_get<PvIcmp::nextHopMtu>(icmp);
+      pbuf_free(p);
+      PPTPC_mtuProbeResult(false, nextHopMtu);
+      return 1;
+    }
+  }
+
+  // Everything else goes on to the stack
+  return 0;
+}
+
+static void PPTPC_mtuProbeStart() {
+  if (_mtuProbeDone || _mtuProbePcb != nullptr || netif_default == nullptr) {
+    return;
+  }
+  _mtuProbePcb = raw_new(IP_PROTO_ICMP);
+  if (_mtuProbePcb == nullptr) {
+    db_printf(DB_DEBUG, "PPTPC_mtuProbeStart() raw_new() fail\n");
+    return;
+  }
+  raw_setflags(_mtuProbePcb, RAW_FLAGS_HDRINCL);
+  raw_recv(_mtuProbePcb, PPTPC_mtuProbeRecv, nullptr);
+  raw_bind(_mtuProbePcb, IP_ADDR_ANY);
+  os_timer_setfn(&_mtuProbeTimer, PPTPC_mtuProbeTimeout, nullptr);
+
+  _mtuProbeLow = PPTPC_MTU_PROBE_MIN;
+  _mtuProbeHigh = PPTPC_PATH_MTU;
+  _mtuProbeSize = PPTPC_MTU_PROBE_MIN;
+  _mtuProbeBaseline = false;
+  PPTPC_mtuProbeSend();
+}
+#endif
+
+bool PPTPC_connect() {
+
+  db_printf(DB_DEBUG, "PPTPC_connect() Begin\n");
+  PPTPC_connectBegin();
+  _ctrlState = PPTPC_CTRL_CONNECTING;
+  _ctrlMsgLength = 0;
+  os_timer_disarm(&_ctrlTimer);
+  os_timer_setfn(&_ctrlTimer, PPTPC_controlTimeout, nullptr);
+
+  // The handshake continues from the callbacks: Start-Control-Connection,
+  // Outgoing-Call, Set-Link-Info, then PPP negotiation over GRE
+  _pptpClient.onConnect(&PPTPC_controlConnected);
+  _pptpClient.onDisconnect(&PPTPC_controlDisconnected);
+  _pptpClient.onData(&PPTPC_controlData);
+  _pptpClient.onError(&PPTPC_controlError);
+
+  if (PPTPC_serverIP.addr == 0) {
+    db_printf(DB_INFO, "PPTPC_connect() Server address unknown\n");
+    _pptpFailed = true;
+    return false;
+  }
+
+#if PPTPC_MTU_PROBE
+  // Runs next to the handshake, its result applies once it finishes
+  PPTPC_mtuProbeStart();
+#endif
+
+  if(!_pptpClient.connect(IPAddress(PPTPC_serverIP.addr), PPTPC_serverport)){
+    db_printf(DB_INFO, "PPTPC_connect() AsyncClient.connect() Fail\n");
+    _pptpFailed = true;
+    return false;
+  }
+  os_timer_arm(&_ctrlTimer, PPTPC_CTRL_TIMEOUT_MS, false);
+
+  db_printf(DB_DEBUG, "PPTPC_connect() Control connection started\n");
+  return true;
+}
+
+bool PPTPC_isConnected() {
+  return _pptpConnected;
+}
+
+bool PPTPC_isFailed() {
+  return _pptpFailed;
+}
 
+uint32_t PPTPC_getReconnectCount() {
+  return _reconnectCount;
+}
 
-  return true;
+// Drop the tunnel right away, the server only gets a Call-Clear-Request.
+// The netif stays registered and is only taken down, a reconnect just
+// readdresses it.
+void PPTPC_disconnect() {
+  db_printf(DB_DEBUG, "PPTPC_disconnect() Begin\n");
+  os_timer_disarm(&_ctrlTimer);
+  os_timer_disarm(&_echoTimer);
+  os_timer_disarm(&_pppPhaseTimer);
+  os_timer_disarm(&_lcpEchoTimer);
+
+  PPTPC_mpCloseLinks(true);
+  PPPFSM_lowerDown(&PPTPC_ccp);
+  PPPFSM_lowerDown(&PPTPC_ipcp);
+  PPPFSM_lowerDown(&PPTPC_lcp);
+  _pppPhase = PPTPC_PHASE_DEAD;
+  _pptpConnected = false;
+  if (_pptpNetifAdded) {
+    netif_set_down(&pptpLwip_netif);
+  }
+  GRE_close(GRE_defaultSession);
+
+  PPTPC_callClear(PPTPC_callId);
+  if (_ctrlState != PPTPC_CTRL_IDLE && _ctrlState != PPTPC_CTRL_CLOSED) {
+    _pptpClient.close(true);
+  }
+  _ctrlState = PPTPC_CTRL_CLOSED;
+  _pptpFailed = true;
 }
 
-bool PPTPC_connect() {
+void PPTPC_buildSetLinkInfoRequest(uint8_t *msg, uint16_t peerCallId){
+  PPTPC_buildControlHeader(msg, PvPptpSetLinkInfo::size, PPTP_SET_LINK_INFO);
+  PV_set<PvPptpSetLinkInfo::peerCallId>(msg, peerCallId);
+  PV_set<PvPptpSetLinkInfo::sendAccm>(msg, 0xffffffff);
+  PV_set<PvPptpSetLinkInfo::receiveAccm>(msg, 0xffffffff);
+  
+}
 
-  db_printf(DB_DEBUG, "PPTPC_connect() Begin\n");
-  if(!_syncClient.connect(PPTPC_servername, PPTPC_serverport)){
-    db_printf(DB_INFO, "PPTPC_connect() syncClient.connect() Fail\n");
-    return false;
+void PPTPC_buildOutGoingCallRequest(uint8_t *msg, uint16_t callId) {
+  static uint16_t callSerialNumber = 9;
+
+  PPTPC_buildControlHeader(msg, PvPptpOutCallRequest::size, PPTP_OUT_CALL_RQST);
+  PV_set<PvPptpOutCallRequest::callId>(msg, callId);
+  PV_set<PvPptpOutCallRequest::callSerialNumber>(msg, callSerialNumber++);
+  PV_set<PvPptpOutCallRequest::minimumBps>(msg, 300);
+  PV_set<PvPptpOutCallRequest::maximumBps>(msg, 1000000000UL);
+  PV_set<PvPptpOutCallRequest::bearerType>(msg, 3);
+  PV_set<PvPptpOutCallRequest::framingType>(msg, 3);
+  PV_set<PvPptpOutCallRequest::recvWindowSize>(msg, 64);
+  PV_set<PvPptpOutCallRequest::processingDelay>(msg, 0);
+  
+}
+
+void PPTPC_buildStartControlConnectionRequest(uint8_t *msg) {
+  PPTPC_buildControlHeader(msg, PvPptpStartControl::size, PPTP_START_CTRL_CONN_RQST);
+  PV_set<PvPptpStartControl::protocolVersion>(msg, 0x100); // 01.00
+  PV_set<PvPptpStartControl::framing>(msg, 1);
+  PV_set<PvPptpStartControl::bearer>(msg, 1);
+  PV_set<PvPptpStartControl::maximumChannels>(msg, 0);
+  PV_set<PvPptpStartControl::firmwareRevision>(msg, 0);
+  strcpy((char *)msg + PvPptpStartControl::vendor, "ESP8266-Sun89-Natthapol89.com");
+}
+
+// Largest control frame copied out of a chained pbuf
+#define PPTPC_CONTROL_FRAME_MAX 256
+
+// A frame of the bundle, from the first call or put together from MP
+// fragments
+static int PPTPC_receiveFrame(struct GreSession *session, struct pbuf *p, uint16_t protocol, int headerLength) {
+  uint8_t buff[PPTPC_CONTROL_FRAME_MAX];
+  uint8_t *data = (uint8_t *)p->payload;
+  int length = p->tot_len;
+
+  // With MPPE on, data only comes in 0x00fd frames. One in the clear was not
+  // sent by the server, whoever got its address, call ID and sequence number
+  // right (ppp_generic drops these the same way).
+  if ((_mppeRxEnabled || PPTPC_MPPE_REQUIRED) && protocol < 0x4000 && protocol != PPP_MPPE) {
+    db_printf(DB_DEBUG, "PPTPC_receiveFrame() Cleartext 0x%04X with MPPE on, drop\n", protocol);
+    _mppeRxCleartext++;
+    return 0;
   }
 
-  if (PPTPC_startControlConnection() != true) {
-    db_printf(DB_INFO, "PPTPC_connect() PPTPC_startControlConnection() Fail\n");
-    return false;
+  // PPP IPv4 Protocol, nearly all of the traffic: hand the pbuf itself to
+  // lwIP before anything else is looked at
+  if (protocol == 0x0021) {
+    if (_deflateRxEnabled) {
+      PPTPC_deflateHistory(p, protocol, headerLength);
+    }
+    PPTPC_interfaceInput(p, headerLength);
+    return 0;
   }
 
-  if (PPTPC_outGoingCall() != true) {
-    db_printf(DB_INFO, "PPTPC_connect() PPTPC_outGoingCall() Fail\n");
-    return false;
+  if ((protocol == PPP_VJ_COMP || protocol == PPP_VJ_UNCOMP) && _vjRxEnabled) {
+    if (_deflateRxEnabled) {
+      PPTPC_deflateHistory(p, protocol, headerLength);
+    }
+    PPTPC_vjInput(session, p, protocol, headerLength);
+    return 0;
   }
 
-  if (PPTPC_setLinkInfo() != true) {
-    db_printf(DB_INFO, "PPTPC_connect() PPTPC_setLinkInfo() Fail\n");
-    return false;
+  // Encrypted or compressed frames arriving before CCP is up are dropped
+  if (protocol == PPP_COMP) {
+    if (_mppeRxEnabled) {
+      PPTPC_mppeInput(session, p, headerLength);
+    } else if (_deflateRxEnabled) {
+      PPTPC_deflateInput(session, p, headerLength);
+    }
+    return 0;
   }
 
+  // Control frames are parsed in place, unless they are split over a chain
+  if (p->len == p->tot_len) {
+    return PPTPC_receiveControl(data, length);
+  }
 
-  // Begin GRE
-  if (GRE_init( PPTPC_servername, PPTPC_serverport) != true) {
-    db_printf(DB_INFO, "PPTPC_connect() GRE_init() Fail\n");
-    return false;
+  if (length > PPTPC_CONTROL_FRAME_MAX) {
+    db_printf(DB_DEBUG, "PPTPC_receiveCallback() Control frame too long %d\n", length);
+    return 2;
   }
-  GRE_callId = PPTPC_peerCallId;
-  GRE_protocolType = 0x880b;  // PPP
-  GRE_recvCallback = &PPTPC_receiveCallback;
 
-  if (PPTPC_pppLcpConfig() != true) {
-    db_printf(DB_INFO, "PPTPC_connect() PPTPC_pppLcpConfig() Fail\n");
-    return false;
+  pbuf_copy_partial(p, buff, length, 0);
+  return PPTPC_receiveControl(buff, length);
+}
+
+// A reassembled frame, protocol field first
+static void PPTPC_mpDeliver(struct pbuf *p) {
+  uint16_t protocol;
+  int headerLength;
+
+  // VJ deltas of lost fragments are lost with them
+  if (_mpRx.stats.rxLost + _mpRx.stats.rxDropped != _mpRxLost) {
+    _mpRxLost = _mpRx.stats.rxLost + _mpRx.stats.rxDropped;
+    PPPVJ_toss(&_vjRx);
   }
 
-  if (PPTPC_authenProtocol == 0xc023) {     // PAP Authen
-    if (PPTPC_pppPap() != true) {
-      db_printf(DB_INFO, "PPTPC_connect() PPTPC_pppPap() Fail\n");
-      return false;
+  headerLength = PPTPC_pppParseHeader((uint8_t *)p->payload, p->len, &protocol);
+  if (headerLength < 0) {
+    return;
+  }
+  PPTPC_receiveFrame(GRE_defaultSession, p, protocol, headerLength);
+}
+
+// MP fragments from any call of the bundle, 'link' 0 is the first one.
+// Whole frames in order go on in the pbuf they came in.
+static void PPTPC_mpInput(int link, struct pbuf *p, int headerLength) {
+  struct pbuf *q;
+
+  if (PPPMP_input(&_mpRx, link, p, headerLength) == PPPMP_WHOLE &&
+      pbuf_header(p, -(headerLength + PPPMP_HEADER_LENGTH)) == 0) {
+    PPTPC_mpDeliver(p);
+  }
+  while ((q = PPPMP_next(&_mpRx)) != nullptr) {
+    PPTPC_mpDeliver(q);
+    pbuf_free(q);
+  }
+}
+
+static int PPTPC_receiveCallback(struct GreSession *session, struct pbuf *p) {
+  uint16_t protocol;
+  int headerLength;
+
+  headerLength = PPTPC_pppParseHeader((uint8_t *)p->payload, p->len, &protocol);
+  if (headerLength < 0) {
+    return 2;
+  }
+
+  if (protocol == PPP_MP && _mpEnabled) {
+    PPTPC_mpInput(0, p, headerLength);
+    return 0;
+  }
+  return PPTPC_receiveFrame(session, p, protocol, headerLength);
+}
+
+static void PPTPC_papInput(uint8_t *data, int length) {
+  uint8_t code = PV_get<PvPppCp::code>(data);
+
+  db_printf(DB_DEBUG, "PPTPC_papInput() Code: 0x%02X, Identifier: 0x%02X, Length: %d\n",
+            code, PV_get<PvPppCp::identifier>(data), PV_get<PvPppCp::length>(data));
+  if (PV_get<PvPppCp::identifier>(data) != _papIdentifier) {
+    return;
+  }
+
+  // PAP Authen Ack
+  if (code == 0x02) {
+    PPTPC_pppAuthenticated();
+    return;
+  }
+
+  // PAP Authen Nack (user/pass fail)
+  if (code == 0x03) {
+    PPTPC_pppFail("PAP Login Fail (user/pass Wrong)");
+  }
+}
+
+// Answer the CHAP Challenge in 'data' on the call of 'session', false when
+// the algorithm is unknown
+static bool PPTPC_chapRespond(struct GreSession *session, MSCHAP_CTX *ctx, uint8_t chapMode, uint8_t *data) {
+  if (chapMode == CHAP_MD5) {
+    PPTPC_pppChapMd5(session, PV_get<PvPppCp::identifier>(data), data + PvChap::value, PV_get<PvChap::valueSize>(data));
+    return true;
+  }
+  if ((chapMode == CHAP_MSCHAP2) || (chapMode == CHAP_MSCHAP1)) {
+    MSCHAP_Init(ctx, chapMode == CHAP_MSCHAP2 ? 2 : 1, data + PvChap::value);
+    PPTPC_pppChapMsChap(session, ctx, PV_get<PvPppCp::identifier>(data));
+    return true;
+  }
+  return false;
+}
+
+static void PPTPC_chapInput(uint8_t *data, int length) {
+  uint8_t code = PV_get<PvPppCp::code>(data);
+
+  db_printf(DB_DEBUG, "PPTPC_chapInput() Code: 0x%02X, Identifier: 0x%02X, Length: %d\n",
+            code, PV_get<PvPppCp::identifier>(data), PV_get<PvPppCp::length>(data));
+
+  // Challenge, answered right away
+  if (code == 0x01) {
+    int valueSize = length > (int)PvChap::value ? PV_get<PvChap::valueSize>(data) : 0;
+    if (valueSize == 0 || valueSize > length - (int)PvChap::value) {
+      db_printf(DB_DEBUG, "PPTPC_chapInput() Bad CHAP challenge\n");
+      return;
     }
-  } else if (PPTPC_authenProtocol == 0xc223) {  // CHAP Authen
-    
-    // CHAP-MD5 Authen
-    if (PPTPC_authenChapMode == CHAP_MD5) {
-      if (PPTPC_pppChapMd5() != true) {
-        db_printf(DB_INFO, "PPTPC_connect() PPTPC_pppChapMd5() Fail\n");
-        return false;
-      }
-    } else if ((PPTPC_authenChapMode == CHAP_MSCHAP2) || (PPTPC_authenChapMode == CHAP_MSCHAP1)) {   // MS-CHAP Authen
-      if (PPTPC_pppChapMsChap() != true) {
-        db_printf(DB_INFO, "PPTPC_connect() PPTPC_pppChapMsChap() Fail\n");
-        return false;
-      }
-    } else {
-      db_printf(DB_INFO, "PPTPC_connect() PPTPC_pppChap() Unknown, Fail\n");
-      return false;
+
+    memcpy(PPTPC_chapChallenge, data + PvChap::value, valueSize);
+    PPTPC_chapIdentifier = PV_get<PvPppCp::identifier>(data);
+    PPTPC_chapChallengeSize = valueSize;
+
+    if (!PPTPC_chapRespond(GRE_defaultSession, &mschap_ctx, PPTPC_authenChapMode, data)) {
+      PPTPC_pppFail("CHAP algorithm Unknown");
+    }
+    return;
+  }
+
+  // Chap Success
+  if (code == 0x03) {
+    PPTPC_pppAuthenticated();
+    return;
+  }
+
+  // Chap Failure (May be User/Password incorrect)
+  if (code == 0x04) {
+    PPTPC_pppFail("CHAP Login Fail");
+  }
+}
+
+static void PPTPC_cbcpInput(uint8_t *data, int length) {
+  uint8_t code = PV_get<PvPppCp::code>(data);
+
+  db_printf(DB_DEBUG, "PPTPC_cbcpInput() Code: 0x%02X, Identifier: 0x%02X, Length: %d\n",
+            code, PV_get<PvPppCp::identifier>(data), PV_get<PvPppCp::length>(data));
+
+  // CBCP Request
+  if (code == 0x01) {
+    PV_set<PvPppCp::code>(data, 0x02); //CBCP Response
+    PPTPC_pppWriteControl(0xc029, data, length);
+    return;
+  }
+
+  // CBCP Ack
+  if (code == 0x03) {
+    PPTPC_pppNetwork();
+  }
+}
+
+// Control protocols we speak. Frames outside their phase are dropped (DEAD
+// takes them in any phase), a protocol whose 'running' flag is clear is
+// rejected like an unknown one. FSM protocols go straight to PPPFSM_input().
+struct PppProtocol {
+  uint16_t protocol;
+  uint8_t phase;
+  const bool *running;
+  struct PppFsm *fsm;
+  void (*input)(uint8_t *data, int length);
+};
+
+static const struct PppProtocol _pppProtocols[] = {
+  { 0xc021, PPTPC_PHASE_DEAD, nullptr, &PPTPC_lcp, nullptr },
+  { 0x8021, PPTPC_PHASE_NETWORK, nullptr, &PPTPC_ipcp, nullptr },
+  { PPP_CCP, PPTPC_PHASE_NETWORK, &_ccpStarted, &PPTPC_ccp, nullptr },
+  { 0xc023, PPTPC_PHASE_AUTHENTICATE, nullptr, nullptr, PPTPC_papInput },
+  { 0xc223, PPTPC_PHASE_AUTHENTICATE, nullptr, nullptr, PPTPC_chapInput },
+  { 0xc029, PPTPC_PHASE_CALLBACK, nullptr, nullptr, PPTPC_cbcpInput },
+};
+
+static int PPTPC_receiveControl(uint8_t *data, int length) {
+  const struct PppProtocol *entry = nullptr;
+  uint16_t protocol;
+  int headerLength;
+
+  headerLength = PPTPC_pppParseHeader(data, length, &protocol);
+  if (headerLength < 0 || length < headerLength + 4) {
+    db_printf(DB_DEBUG, "PPTPC_receiveControl() Short frame %d\n", length);
+    return 2;
+  }
+
+  data += headerLength;  //Skip ptp data
+  length -= headerLength;
+
+  for (unsigned i = 0; i < sizeof(_pppProtocols) / sizeof(_pppProtocols[0]); i++) {
+    if (_pppProtocols[i].protocol == protocol) {
+      entry = &_pppProtocols[i];
+      break;
     }
+  }
+
+  // Anything else (MPLSCP from Windows servers...) is not spoken here
+  if (entry == nullptr || (entry->running != nullptr && !*entry->running)) {
+    PPTPC_pppProtocolReject(&PPTPC_lcp, protocol, data, length);
+    return 0;
+  }
+
+  if (entry->phase != PPTPC_PHASE_DEAD && entry->phase != _pppPhase) {
+    db_printf(DB_DEBUG, "PPTPC_receiveControl() Protocol 0x%04X in phase %d, drop\n", protocol, _pppPhase);
+    return 0;
+  }
+
+  if (entry->fsm != nullptr) {
+    PPPFSM_input(entry->fsm, data, length);
   } else {
-    db_printf(DB_INFO, "PPTPC_connect() Fail Unknown Authen type 0x%04X\n", PPTPC_authenProtocol);
-    return false;
+    entry->input(data, length);
   }
+  return 0;
+}
 
-  if (PPTPC_pppCbcp() != true) {
-    db_printf(DB_INFO, "PPTPC_connect() PPTPC_pppCbcp() Fail\n");
-    return false;
+//////////////////////////////////////////////////////////////////////////////
+// Multilink: the other calls of the bundle. Each is an Outgoing-Call of its
+// own with a GRE session, LCP and authentication; IPCP and CCP only run on
+// the first call. The server puts a call in our bundle when it comes with
+// the same login and endpoint discriminator.
+
+#define PPTPC_MP_LINK_FAILED        5   // closed from the timer
+
+static void PPTPC_mpLinkClose(struct PptpMpLink *link, bool clearCall) {
+  uint8_t state = link->state;
+
+  if (state == PPTPC_MP_LINK_IDLE) {
+    return;
   }
 
-  if (PPTPC_pppIpcp() != true) {
-    db_printf(DB_INFO, "PPTPC_connect() PPTPC_pppIpcp Failed\n");
-    return false;
+  db_printf(DB_INFO, "PPTPC_mpLinkClose() Call %d leaves the bundle\n", link->callId);
+  link->state = PPTPC_MP_LINK_IDLE;
+  os_timer_disarm(&link->timer);
+  if (state == PPTPC_MP_LINK_JOINED) {
+    PPPMP_linkDown(&_mpRx, link->index);
+  }
+  if (state != PPTPC_MP_LINK_CALLING && link->lcp.state >= PPPFSM_CLOSING) {
+    PPPFSM_lowerDown(&link->lcp);
+  }
+  if (link->session != nullptr) {
+    GRE_close(link->session);
+    link->session = nullptr;
+  }
+  if (clearCall) {
+    PPTPC_callClear(link->callId);
   }
+}
 
-/*
-  if (PPTPC_pppMplscp() != true) {
-    db_printf(DB_INFO, "PPTPC_connect() PPTPC_pppMplscp Failed\n");
-    return false;
+static void PPTPC_mpCloseLinks(bool clearCalls) {
+  for (int i = 0; i < PPTPC_MP_LINKS - 1; i++) {
+    PPTPC_mpLinkClose(&_mpLinks[i], clearCalls);
   }
-*/
+}
 
-  // Begin to link pptp tunel to lwip
-  if (PPTPC_pptpInterfaceInit() != true) {
-    db_printf(DB_INFO, "PPTPC_connect() PPTPC_pptpInterfaceInit() Failed\n");
-    return false;
+// Give up on a call from its LCP automaton or its receive callback, the
+// timer closes it once they returned
+static void PPTPC_mpLinkAbort(struct PptpMpLink *link, const char *reason) {
+  if (link->state == PPTPC_MP_LINK_IDLE) {
+    return;
   }
- 
-  db_printf(DB_DEBUG, "PPTPC_connect() Success\n");
-  _pptpConnected = true;
-  return true;
+  db_printf(DB_INFO, "PPTPC_mpLinkAbort() Call %d: %s\n", link->callId, reason);
+  link->state = PPTPC_MP_LINK_FAILED;
+  os_timer_disarm(&link->timer);
+  os_timer_arm(&link->timer, 0, false);
 }
 
-void PPTPC_buildSetLinkInfoRequest(struct SetLinkInfo *req){
-  memset(req, 0, sizeof(struct SetLinkInfo));
-  req->length = htons (24);
-  req->pptpMessageType = htons(1);
-  req->magic = htonl(0x1a2b3c4d);
-  req->controlMessageType = htons(15);
-  req->peerCallId = htons(PPTPC_peerCallId);
-  req->sendAccm = htonl(0xffffffff);
-  req->receiveAccm = htonl(0xffffffff);
-  
+static void PPTPC_mpLinkTimeout(void *arg) {
+  struct PptpMpLink *link = (struct PptpMpLink *)arg;
+
+  if (link->state == PPTPC_MP_LINK_AUTHENTICATE && link->authenProtocol == 0xc023 &&
+      millis() - link->startMs < PPTPC_PHASE_TIMEOUT_MS) {
+    PPTPC_pppPap(link->session, ++link->papIdentifier);
+    os_timer_arm(&link->timer, PPTPC_PAP_RESTART_MS, false);
+    return;
+  }
+
+  if (link->state != PPTPC_MP_LINK_FAILED) {
+    db_printf(DB_INFO, "PPTPC_mpLinkTimeout() Call %d timeout in state %d\n", link->callId, link->state);
+  }
+  PPTPC_mpLinkClose(link, true);
 }
 
-void PPTPC_buildOutGoingCallRequest(struct OutGoingCallRequest *req) {
-  PPTPC_callId = random(0x10000); // 16 bit random
-  memset(req, 0, sizeof(struct OutGoingCallRequest));
-  req->length = htons (168);
-  req->pptpMessageType = htons(1);
-  req->magic = htonl(0x1a2b3c4d);
-  req->controlMessageType = htons(7);
-  req->callId = htons(PPTPC_callId);
-  req->callSerialNumber = htons(9);
-  req->minimumBps = htonl(300);
-  req->maximumBps = htonl(1000000000UL);
-  req->bearerType = htonl(3);
-  req->framingType = htonl(3);
-  req->recvWindowSize = htons(64);
-  req->processingDelay = htons(0);
-  
+static void PPTPC_mpLinkJoin(struct PptpMpLink *link) {
+  os_timer_disarm(&link->timer);
+  link->state = PPTPC_MP_LINK_JOINED;
+  db_printf(DB_INFO, "PPTPC_mpLinkJoin() Call %d joined the bundle\n", link->callId);
 }
 
-void PPTPC_buildStartControlConnectionRequest(struct StartControlConnection *req) {
-  memset(req, 0, sizeof(struct StartControlConnection));
-  req->length = htons (156);
-  req->pptpMessageType = htons(1);
-  req->magic = htonl(0x1a2b3c4d);
-  req->controlMessageType = htons(1);
-  req->protocolVersion = htons(0x100); // 01.00
-  req->framingCapabilities = htonl(1);
-  req->bearerCapabilities = htonl(1);
-  req->maximumChannel = htons(0);
-  req->firmwareRevision = htons(0);
-  strcpy(req->venderString, "ESP8266-Sun89-Natthapol89.com");
-}
-
-bool PPTPC_checkLcpRequest(uint8_t *lcpOptions, int length) {
-  uint8_t *p = lcpOptions;
-  uint8_t type;
-  uint8_t len;
-  uint8_t db;
-  uint16_t ds;
-  uint32_t dl;
+static struct PptpMpLink *PPTPC_mpLinkOf(struct GreSession *session) {
+  for (int i = 0; i < PPTPC_MP_LINKS - 1; i++) {
+    if (_mpLinks[i].state != PPTPC_MP_LINK_IDLE && _mpLinks[i].session == session) {
+      return &_mpLinks[i];
+    }
+  }
+  return nullptr;
+}
 
-  db_printf(DB_DEBUG, "PPTPC_checkLcpRequest() Begin\n");
-  
-  while(length > 0) {
-    type = *p;
-    len = *(p+1);
-    if (type == 0x01) {   // Type: Maximum MRU
-      if (len != 4) {
-        db_printf(DB_DEBUG, "PPTPC_checkLcpRequest() error MRU len != 4\n");
-        return false;
-      }
-      
-      ds = *(p + 3) | (*(p + 2) << 8);
-      db_printf(DB_DEBUG, "PPTPC_checkLcpRequest() Max MRU=%d\n", ds);
-      if (ds > 1450) {
-        db_printf(DB_DEBUG, "PPTPC_checkLcpRequest() error Max MRU > 1450\n");
-        return false;
-      }
-      
-    } else if (type == 0x03) {  // type: Authen protocol
-      ds = *(p + 3) | (*(p + 2) << 8);
-      if (ds == 0xc023) {         // PAP
-        db_printf(DB_DEBUG, "PPTPC_checkLcpRequest() Authen mode = PAP\n");
-        
-      } else if (ds == 0xc223) {  // CHAP  
-        PPTPC_authenChapMode = p[4];
-        if (p[4] == CHAP_MD5) {      // CHAP-MD5
-          db_printf(DB_DEBUG, "PPTPC_checkLcpRequest() Authen mode = CHAP-MD5\n");
-        
-        } else if (p[4] == CHAP_MSCHAP1) {  //MS-CHAP-1
-          db_printf(DB_DEBUG, "PPTPC_checkLcpRequest() Authen mode = MS-CHAP-1\n");
-
-        } else if (p[4] == CHAP_MSCHAP2) {  //MS-CHAP-2 
-          db_printf(DB_DEBUG, "PPTPC_checkLcpRequest() Authen mode = MS-CHAP-2\n");
-
-        } else {
-          db_printf(DB_DEBUG, "PPTPC_checkLcpRequest() Authen mode = CHAP (Fail)\n");
-          return false;
-        }
-      } else {
-        db_printf(DB_DEBUG, "PPTPC_checkLcpRequest() Authen mode = Unknown 0x%04X\n", ds);
+static int PPTPC_mpLinkOutput(struct PppFsm *f, uint8_t *frame, int length) {
+  struct PptpMpLink *link = (struct PptpMpLink *)f->arg;
+
+  if (link->session == nullptr) {
+    return -1;
+  }
+  return GRE_sessionWrite(link->session, frame, length);
+}
+
+static int PPTPC_mpLinkBuildOptions(struct PppFsm *f, uint8_t *buf, int size) {
+  struct PptpMpLink *link = (struct PptpMpLink *)f->arg;
+  int n = 0;
+
+  if (link->wantMru) {
+    buf[n++] = 0x01;  // Max Receive Unit
+    buf[n++] = 0x04;
+    PV_set<PvBe16>(&buf[n], _lcpMru);
+    n += 2;
+  }
+
+  if (link->wantMagic) {
+    buf[n++] = 0x05;  // Magic Number
+    buf[n++] = 0x06;
+    PV_set<PvBe32>(&buf[n], link->magic);
+    n += 4;
+  }
+
+  n += PPTPC_mpLcpOptions(&buf[n], true, _lcpWantEndpoint);
+  return n;
+}
+
+static uint8_t PPTPC_mpLinkCheckOptions(struct PppFsm *f, uint8_t *options, int *length) {
+  struct PptpMpLink *link = (struct PptpMpLink *)f->arg;
+  uint8_t nak[PPPFSM_OPTIONS_MAX];
+  uint8_t rej[PPPFSM_OPTIONS_MAX];
+  int nakLength = 0;
+  int rejLength = 0;
+  uint8_t *p = options;
+  int remain = *length;
+  uint16_t peerMru = PPTPC_LCP_DEFAULT_MRU;
+  uint16_t peerMrru = 0;
+  bool endpointMatch = _lcpPeerEndpointLength == 0;
+
+  link->authenProtocol = 0;
+
+  while (remain >= 2) {
+    uint8_t type = p[0];
+    uint8_t len = p[1];
+    if (len < 2 || len > remain) {
+      db_printf(DB_DEBUG, "PPTPC_mpLinkCheckOptions() Malformed option type=%d\n", type);
+      PPTPC_pppAddOption(rej, &rejLength, sizeof(rej), p, remain);
+      break;
+    }
+
+    if (type == 0x01 && len == 4) {
+      peerMru = PV_get<PvPppOption::value16>(p);
+      if (peerMru < PPTPC_LCP_MIN_MRU) {
+        uint8_t opt[4] = { 0x01, 0x04 };
+        PV_set<PvPppOption::value16>(opt, PPTPC_LCP_MIN_MRU);
+        PPTPC_pppAddOption(nak, &nakLength, sizeof(nak), opt, 4);
       }
 
-      PPTPC_authenProtocol = ds;
-      
-    } else if (type == 0x05) {  //type: Magic number
-      if (len != 6) {
-        db_printf(DB_DEBUG, "PPTPC_checkLcpRequest() Error Magic Number len != 6\n");
-        return false;
+    } else if ((type == 0x02 && len == 6) || (type == 0x05 && len == 6)) {
+      // ACCM and Magic Number
+
+    } else if (type == 0x03 && len >= 4) {
+      if (!PPTPC_lcpCheckAuth(p, &link->authenProtocol, &link->chapMode)) {
+        PPTPC_pppAddOption(nak, &nakLength, sizeof(nak), _lcpAuthNak, sizeof(_lcpAuthNak));
       }
 
-      dl = p[5] | (p[4] << 8) | (p[3] << 16) | (p[2] << 24);
-      db_printf(DB_DEBUG, "PPTPC_checkLcpRequest() Magic Number = 0x%X\n", dl);
-      
+    } else if ((type == 0x07 || type == 0x08) && len == 2) {
+      // PFC and ACFC, fragments go with the full header all the same
+
+    } else if (type == PPP_LCP_MRRU && len == 4) {
+      peerMrru = PV_get<PvPppOption::value16>(p);
+
+    } else if (type == PPP_LCP_ENDPOINT && len >= 3) {
+      endpointMatch = len - 2 == _lcpPeerEndpointLength &&
+                      memcmp(p + PvPppOption::value, _lcpPeerEndpoint, len - 2) == 0;
+
     } else {
-      db_printf(DB_DEBUG, "PPTPC_checkLcpRequest() Error Unknown option type =%d\n", type);
-      //return false;
+      db_printf(DB_DEBUG, "PPTPC_mpLinkCheckOptions() Reject option type=%d\n", type);
+      PPTPC_pppAddOption(rej, &rejLength, sizeof(rej), p, len);
     }
 
-    p = p + len;
-    length = length - len;
+    p += len;
+    remain -= len;
   }
 
-  db_printf(DB_DEBUG, "PPTPC_checkLcpRequest() Success\n");
-  return true;
+  if (rejLength > 0) {
+    memcpy(options, rej, rejLength);
+    *length = rejLength;
+    return PPP_CONFREJ;
+  }
+  if (nakLength > 0) {
+    memcpy(options, nak, nakLength);
+    *length = nakLength;
+    return PPP_CONFNAK;
+  }
+
+  link->peerMru = peerMru;
+  link->peerMrru = peerMrru;
+  link->peerEndpointMatch = endpointMatch;
+  return PPP_CONFACK;
 }
 
-static int PPTPC_receiveCallback(uint8_t *data, int length) {
-  struct PtpPacket *ptp;
-  struct PppLcpPacket *lcp;
-  struct PppPapPacket *pap;
-  uint8_t *lcpOptions;
-  int optionLength;
-  uint8_t buff0[30];
-  uint8_t *src = data;
-  ip_addr_t *ip;
-  
-  //Serial.println("Callback");
-  db_printf(DB_DEBUG, "PPTPC_receiveCallback() Begin\n");
+static void PPTPC_mpLinkNakOptions(struct PppFsm *f, uint8_t *options, int length) {
+  struct PptpMpLink *link = (struct PptpMpLink *)f->arg;
 
-  ptp = (struct PtpPacket *)data;
-  db_printf(DB_DEBUG, "PPTPC_receiveCallback() PTP Address: 0x%02X, Control: 0x%02X, Protocol: 0x%04X\n", ptp->address, ptp->control, ntohs(ptp->protocol));
+  while (length >= 2 && options[1] >= 2 && options[1] <= length) {
+    if (options[0] == 0x01) {
+      link->wantMru = false;
+    } else if (options[0] == 0x05) {
+      link->magic = os_random();
+    }
+    length -= options[1];
+    options += options[1];
+  }
+}
 
-  data += 4;  //Skip ptp data
+static void PPTPC_mpLinkRejectOptions(struct PppFsm *f, uint8_t *options, int length) {
+  struct PptpMpLink *link = (struct PptpMpLink *)f->arg;
 
-  // PPP LCP
-  if (ntohs(ptp->protocol) == 0xc021) {
-    lcp = (struct PppLcpPacket*)data;
-    optionLength = ntohs(lcp->length) - 4;
-    data +=4;
+  while (length >= 2 && options[1] >= 2 && options[1] <= length) {
+    if (options[0] == 0x01) {
+      link->wantMru = false;
+    } else if (options[0] == 0x05) {
+      link->wantMagic = false;
+    } else if (options[0] == PPP_LCP_MRRU || options[0] == PPP_LCP_ENDPOINT) {
+      PPTPC_mpLinkAbort(link, "Multilink rejected");
+    }
+    length -= options[1];
+    options += options[1];
+  }
+}
 
-    db_printf(DB_DEBUG, "LCP Code: 0x%02X, Identifier: 0x%02X, Length: %d\n", lcp-> code, lcp->identifier, ntohs(lcp->length));
-    
-    // LCP Configuration Request
-    if (lcp->code == 0x01) {
+static bool PPTPC_mpLinkExtCode(struct PppFsm *f, uint8_t code, uint8_t id, uint8_t *data, int length) {
+  struct PptpMpLink *link = (struct PptpMpLink *)f->arg;
 
-      if (PPTPC_checkLcpRequest(data, optionLength) == true) {
-        lcp->code = 0x02; //LCP Config Ack
-        lcpComplete = true;
-      } else {
-        db_printf(DB_DEBUG, "PPTPC_receiveCallback() ** Fail: LCP Option from server not support by client\n");
-        lcp->code = 0x03; //LCP Config Nack
-        
-      }
-      return 1; // tell parent to write gre answer
+  switch (code) {
+    case 0x09:  // Echo Request
+      PPTPC_lcpEchoAnswer(f, link->wantMagic ? link->magic : 0, id, data, length);
+      return true;
 
-    }
+    case 0x08:  // Protocol Reject
+    case 0x0a:  // Echo Reply
+    case 0x0b:  // Discard Request
+      return true;
+  }
+  return false;
+}
 
-    // LCP Echo Request
-    if (lcp->code == 0x09) {
-      lcp->code = 0x0a; //LCP echo reply
-      return 1; // tell parent to write gre answer
+static void PPTPC_mpLinkUp(struct PppFsm *f) {
+  struct PptpMpLink *link = (struct PptpMpLink *)f->arg;
 
-    }
+  if (link->state != PPTPC_MP_LINK_ESTABLISH) {
+    return;
+  }
+  if (link->peerMrru == 0 || !link->peerEndpointMatch) {
+    PPTPC_mpLinkAbort(link, "Call not in our bundle");
+    return;
   }
 
-  // PPP PAP
-  if (ntohs(ptp->protocol) == 0xc023) {
-    pap = (struct PppPapPacket*)data;
-    optionLength = ntohs(pap->length) - 4;
-    data +=4;
+  link->state = PPTPC_MP_LINK_AUTHENTICATE;
+  link->startMs = millis();
+  os_timer_disarm(&link->timer);
+  if (link->authenProtocol == 0xc023) {
+    PPTPC_pppPap(link->session, ++link->papIdentifier);
+    os_timer_arm(&link->timer, PPTPC_PAP_RESTART_MS, false);
+  } else if (link->authenProtocol == 0xc223) {
+    os_timer_arm(&link->timer, PPTPC_PHASE_TIMEOUT_MS, false);
+  } else {
+    PPTPC_mpLinkJoin(link);
+  }
+}
 
-    db_printf(DB_DEBUG, "PAP Code: 0x%02X, Identifier: 0x%02X, Length: %d\n", pap->code, pap->identifier, ntohs(pap->length));
-    
-    // PAP Authen Ack
-    if (pap->code == 0x02) {
-      papComplete = true;
-      papLoginState = true;
-      return 0;
-    }
+static void PPTPC_mpLinkDown(struct PppFsm *f) {
+  struct PptpMpLink *link = (struct PptpMpLink *)f->arg;
 
-    // PAP Authen Nack (user/pass fail)
-    if (pap->code == 0x03) {
-      papComplete = true;
-      papLoginState = false;
-      return 0;
-    }
+  if (link->state == PPTPC_MP_LINK_JOINED) {
+    PPPMP_linkDown(&_mpRx, link->index);
+  }
+  if (link->state == PPTPC_MP_LINK_JOINED || link->state == PPTPC_MP_LINK_AUTHENTICATE) {
+    os_timer_disarm(&link->timer);
+    link->state = PPTPC_MP_LINK_ESTABLISH;
   }
+}
+
+static void PPTPC_mpLinkFinished(struct PppFsm *f) {
+  PPTPC_mpLinkAbort((struct PptpMpLink *)f->arg, "LCP finished");
+}
 
-  // PPP CHAP
-  if (ntohs(ptp->protocol) == 0xc223) {
-    lcp = (struct PppLcpPacket*)data;
+static const struct PppFsmCallbacks _mpLinkCallbacks = {
+  PPTPC_mpLinkBuildOptions,
+  PPTPC_mpLinkCheckOptions,
+  PPTPC_mpLinkNakOptions,
+  PPTPC_mpLinkRejectOptions,
+  PPTPC_mpLinkExtCode,
+  PPTPC_mpLinkUp,
+  PPTPC_mpLinkDown,
+  PPTPC_mpLinkFinished,
+};
+
+static void PPTPC_mpLinkPapInput(struct PptpMpLink *link, uint8_t *data, int length) {
+  uint8_t code = PV_get<PvPppCp::code>(data);
+
+  if (PV_get<PvPppCp::identifier>(data) != link->papIdentifier) {
+    return;
+  }
+  if (code == 0x02) {
+    PPTPC_mpLinkJoin(link);
+  } else if (code == 0x03) {
+    PPTPC_mpLinkAbort(link, "PAP Login Fail");
+  }
+}
 
-    db_printf(DB_DEBUG, "PPTPC_receiveCallback() CHAP Code: 0x%02X, Identifier: 0x%02X, Length: %d\n", lcp-> code, lcp->identifier, ntohs(lcp->length));
+static void PPTPC_mpLinkChapInput(struct PptpMpLink *link, uint8_t *data, int length) {
+  uint8_t code = PV_get<PvPppCp::code>(data);
 
-    // Challenge
-    if (lcp->code == 0x01) {
+  if (code == 0x01) {
+    int valueSize = length > (int)PvChap::value ? PV_get<PvChap::valueSize>(data) : 0;
+    if (valueSize == 0 || valueSize > length - (int)PvChap::value) {
+      db_printf(DB_DEBUG, "PPTPC_mpLinkChapInput() Bad CHAP challenge\n");
+      return;
+    }
+    // The first call's MS-CHAP context holds the MPPE keys, keep it
+    if (!PPTPC_chapRespond(link->session, &_mpMschapCtx, link->chapMode, data)) {
+      PPTPC_mpLinkAbort(link, "CHAP algorithm Unknown");
+    }
+  } else if (code == 0x03) {
+    PPTPC_mpLinkJoin(link);
+  } else if (code == 0x04) {
+    PPTPC_mpLinkAbort(link, "CHAP Login Fail");
+  }
+}
 
-      memcpy(PPTPC_chapChallenge, data + 5, *(data +4));
-      PPTPC_chapIdentifier = *(data + 1);
-      PPTPC_chapChallengeSize = *(data +4);
+static int PPTPC_mpLinkReceive(struct GreSession *session, struct pbuf *p) {
+  uint8_t buff[PPTPC_CONTROL_FRAME_MAX];
+  struct PptpMpLink *link = PPTPC_mpLinkOf(session);
+  uint8_t *data = (uint8_t *)p->payload;
+  int length = p->tot_len;
+  uint16_t protocol;
+  int headerLength;
 
-      if (PPTPC_authenChapMode == CHAP_MSCHAP2) {
-        MSCHAP_Init(&mschap_ctx, 2, PPTPC_chapChallenge);
-      } else if (PPTPC_authenChapMode == CHAP_MSCHAP1) {
-        MSCHAP_Init(&mschap_ctx, 1, PPTPC_chapChallenge);
-      }
-      return 0; // tell parent to not write gre answer
+  if (link == nullptr || link->state == PPTPC_MP_LINK_FAILED) {
+    return 2;
+  }
+  headerLength = PPTPC_pppParseHeader(data, p->len, &protocol);
+  if (headerLength < 0) {
+    return 2;
+  }
+
+  if (protocol == PPP_MP) {
+    if (link->state == PPTPC_MP_LINK_JOINED && _mpEnabled) {
+      PPTPC_mpInput(link->index, p, headerLength);
     }
+    return 0;
+  }
 
-    // Chap Success
-    if (lcp->code == 0x03) {
-      PPTPC_chapAuthenStatus = true;
-      PPTPC_chapAuthenResponse = true;
-      return 0;
+  // Frames of the bundle may also come whole, without MP header
+  if (protocol != 0xc021 && protocol != 0xc023 && protocol != 0xc223) {
+    if (link->state == PPTPC_MP_LINK_JOINED) {
+      return PPTPC_receiveFrame(GRE_defaultSession, p, protocol, headerLength);
     }
+    return 0;
+  }
 
-    // Chap Failure (May be User/Password incorrect)
-    if (lcp->code == 0x04) {
-      PPTPC_chapAuthenStatus = false;
-      PPTPC_chapAuthenResponse = true;
-      return 0;
+  if (p->len != p->tot_len) {
+    if (length > PPTPC_CONTROL_FRAME_MAX) {
+      return 2;
     }
-    
+    pbuf_copy_partial(p, buff, length, 0);
+    data = buff;
   }
-  
-  // PPP CBCP
-  if (ntohs(ptp->protocol) == 0xc029) {
-    lcp = (struct PppLcpPacket*)data;
+  if (length < headerLength + 4) {
+    return 2;
+  }
+  data += headerLength;
+  length -= headerLength;
+
+  if (protocol == 0xc021) {
+    PPPFSM_input(&link->lcp, data, length);
+  } else if (link->state == PPTPC_MP_LINK_AUTHENTICATE && protocol == 0xc023) {
+    PPTPC_mpLinkPapInput(link, data, length);
+  } else if (link->state == PPTPC_MP_LINK_AUTHENTICATE) {
+    PPTPC_mpLinkChapInput(link, data, length);
+  }
+  return 0;
+}
+
+// A call ID none of our calls has, the closed ones aside
+static uint16_t PPTPC_mpNewCallId() {
+  uint16_t callId;
+  bool taken;
 
-    db_printf(DB_DEBUG, "PPTPC_receiveCallback() CBCP Code: 0x%02X, Identifier: 0x%02X, Length: %d\n", lcp-> code, lcp->identifier, ntohs(lcp->length));
+  do {
+    callId = random(0x10000);
+    taken = callId == PPTPC_callId;
+    for (int i = 0; i < PPTPC_MP_LINKS - 1; i++) {
+      taken |= _mpLinks[i].state != PPTPC_MP_LINK_IDLE && _mpLinks[i].callId == callId;
+    }
+  } while (taken);
+  return callId;
+}
 
-    // CBCP Request
-    if (lcp->code == 0x01) {
-      lcp->code = 0x02; //CBCP Response
-      return 1; // tell parent to write gre answer
+// The first call is up with Multilink on, ask for the others
+static void PPTPC_mpOpenLinks() {
+  for (int i = 0; i < PPTPC_MP_LINKS - 1; i++) {
+    struct PptpMpLink *link = &_mpLinks[i];
+    if (link->state != PPTPC_MP_LINK_IDLE) {
+      continue;
     }
 
-    // CBCP Ack
-    if (lcp->code == 0x03) {
-      cbcpComplete = true;
-      return 0; // tell parent to not write gre answer
+    link->callId = PPTPC_mpNewCallId();
+    link->session = nullptr;
+    link->state = PPTPC_MP_LINK_CALLING;
+    os_timer_disarm(&link->timer);
+    os_timer_setfn(&link->timer, PPTPC_mpLinkTimeout, link);
+    os_timer_arm(&link->timer, PPTPC_CTRL_TIMEOUT_MS, false);
+    if (PPTPC_outGoingCall(link->callId) != true) {
+      PPTPC_mpLinkClose(link, false);
     }
-    
   }
+}
 
-  // PPP MPLSCP
-  if (ntohs(ptp->protocol) == 0x8281) {
-    lcp = (struct PppLcpPacket*)data;
-
-    db_printf(DB_DEBUG, "PPTPC_receiveCallback() MPLSCP Code: 0x%02X, Identifier: 0x%02X, Length: %d\n", lcp-> code, lcp->identifier, ntohs(lcp->length));
+// Outgoing-Call-Reply for one of the calls above, false for another call
+static bool PPTPC_mpCallReply(uint8_t *msg) {
+  struct PptpMpLink *link = nullptr;
+  uint8_t info[PvPptpSetLinkInfo::size];
 
-    // MPLS Request
-    if (lcp->code == 0x01) {
-      mplsIdentifier = lcp->identifier;
-      return 0; // tell parent to not write gre answer
+  for (int i = 0; i < PPTPC_MP_LINKS - 1; i++) {
+    if (_mpLinks[i].state == PPTPC_MP_LINK_CALLING && _mpLinks[i].callId == PV_get<PvPptpOutCallReply::peerCallId>(msg)) {
+      link = &_mpLinks[i];
     }
-    
+  }
+  if (link == nullptr) {
+    return false;
   }
 
-  // PPP IPCP (Internet protocol Control Protocol)
-  if (ntohs(ptp->protocol) == 0x8021) {
-    lcp = (struct PppLcpPacket*)data;
-    uint8_t *opt = data + 4;
-
-    db_printf(DB_DEBUG, "PPTPC_receiveCallback() IPCP Code: 0x%02X, Identifier: 0x%02X, Length: %d\n", lcp-> code, lcp->identifier, ntohs(lcp->length));
-
-    // 0x01 IPCP Request (Server request to set own ip), 0x02 IPCP Ack
-    if (lcp->code == 0x01 || lcp->code == 0x02) {
-      optionLength = lcp->length;
-      while (optionLength > 0) {
-        if (*opt == 0x03) { // IP Address
-          if (lcp->code == 0x01) {  // assigned server ip
-            remoteIP.addr = *(uint32_t*)(opt + 2);
-            //printf("Remote IP Address: ");
-            //printIP(remoteIP);
-            //printf("\n");
-          }
-          if (lcp->code == 0x02) {  // assigned client ip
-            localIP.addr = *(uint32_t*)(opt + 2);
-            //printf("Local IP Address: ");
-            //printIP(localIP);
-            //printf("\n");
-          }
-          
-          break;
-        }
-        optionLength -= *(opt + 1);
-        opt += *(opt + 1);
-      }
-      lcp->code = 0x02; //IPCP Ack
-      return 1; // tell parent to write gre answer
-    }
+  if (PV_get<PvPptpOutCallReply::resultCode>(msg) != 1) {
+    db_printf(DB_INFO, "PPTPC_mpCallReply() Call %d refused, result %d\n", link->callId, PV_get<PvPptpOutCallReply::resultCode>(msg));
+    PPTPC_mpLinkClose(link, false);
+    return true;
+  }
+
+  link->peerCallId = PV_get<PvPptpOutCallReply::callId>(msg);
+  link->session = GRE_open(&PPTPC_serverIP, link->callId, link->peerCallId);
+  if (link->session == nullptr) {
+    PPTPC_mpLinkClose(link, true);
+    return true;
+  }
+  link->session->protocolType = 0x880b;  // PPP
+  link->session->recvCallback = &PPTPC_mpLinkReceive;
+  GRE_sessionSetPeerWindow(link->session, PV_get<PvPptpOutCallReply::recvWindowSize>(msg));
+
+  PPTPC_buildSetLinkInfoRequest(info, link->peerCallId);
+  PPTPC_controlWrite(info, sizeof(info));
+
+  db_printf(DB_DEBUG, "PPTPC_mpCallReply() Call %d/%d, LCP begins\n", link->callId, link->peerCallId);
+  os_timer_disarm(&link->timer);
+  link->state = PPTPC_MP_LINK_ESTABLISH;
+  link->wantMru = _lcpWantMru;
+  link->wantMagic = true;
+  link->magic = os_random();
+  link->peerMru = PPTPC_LCP_DEFAULT_MRU;
+  link->peerMrru = 0;
+  link->authenProtocol = 0;
+  PPPFSM_init(&link->lcp, "LCP+", 0xc021, &_mpLinkCallbacks, PPTPC_mpLinkOutput);
+  link->lcp.arg = link;
+  PPPFSM_open(&link->lcp);
+  PPPFSM_lowerUp(&link->lcp);
+  return true;
+}
 
-    // IPCP Nack, Server assigned IP to client
-    if (lcp->code == 0x03) {
-      lcp->code = 0x01; // new request
-      lcp->identifier = lcp->identifier + 1;  // increment ident
-      return 1; // tell parent to write gre answer
+// Call-Disconnect-Notify for one of the calls above, false for another call
+static bool PPTPC_mpCallDisconnect(uint16_t callId) {
+  for (int i = 0; i < PPTPC_MP_LINKS - 1; i++) {
+    struct PptpMpLink *link = &_mpLinks[i];
+    if (link->state != PPTPC_MP_LINK_IDLE && link->state != PPTPC_MP_LINK_CALLING &&
+        link->peerCallId == callId) {
+      db_printf(DB_INFO, "PPTPC_mpCallDisconnect() Call %d cleared by server\n", link->callId);
+      PPTPC_mpLinkClose(link, false);
+      return true;
     }
-    
   }
+  return false;
+}
 
-  // PPP IPv4 Protocol)
-  if (ntohs(ptp->protocol) == 0x0021) {
-    PPTPC_interfaceInput(data, length - 4);
-    return 0;
+int PPTPC_getMultilinkStats(struct PppMpStats *stats) {
+  int links = _mpEnabled ? 1 : 0;
+
+  *stats = _mpRx.stats;
+  stats->txFrames = _mpTxFrames;
+  stats->txFragments = _mpTxFragments;
+  for (int i = 0; i < PPTPC_MP_LINKS - 1; i++) {
+    if (_mpLinks[i].state == PPTPC_MP_LINK_JOINED) {
+      links++;
+    }
   }
-  
-  return 2;
+  return links;
 }
 
-static uint32_t handleTmSec;
-static uint32_t cntTmSec;
+// A failed or lost tunnel is torn down and set up again with backoff,
+// the device keeps running and serving the proxy meanwhile
 void PPTPC_handle() {
-  uint32_t sec = millis() / 1000;
-  if (sec < handleTmSec) {
-    handleTmSec = sec;
+  if (_pptpFailed == false) {
     return;
   }
 
-  if (sec - handleTmSec > 1) {
-    handleTmSec = sec;
-
-    if (!_syncClient.connected()) {
-      printf( "PPTPC_handle() PPTP Disconnected --> Reset...\n");
-      fflush(stdout);
-      ESP.reset();
+  if (_reconnectPending == false) {
+    PPTPC_disconnect();
+    _reconnectPending = true;
+    _reconnectAtMs = millis() + _reconnectDelayMs;
+    db_printf(DB_INFO, "PPTPC_handle() PPTP Disconnected --> Reconnect in %d ms\n", _reconnectDelayMs);
+    _reconnectDelayMs *= 2;
+    if (_reconnectDelayMs > PPTPC_RECONNECT_MAX_MS) {
+      _reconnectDelayMs = PPTPC_RECONNECT_MAX_MS;
     }
-    
-    cntTmSec++;
-    if (cntTmSec >= 10) {
-      cntTmSec = 0;
-      PPTPC_setLinkInfo();
-      db_printf(DB_DEBUG, "PPTPC_setLinkInfo() at Sec %d\n", handleTmSec);
+    return;
+  }
+
+  if ((int32_t)(millis() - _reconnectAtMs) < 0) {
+    return;
+  }
+
+  _reconnectPending = false;
+  _reconnectCount++;
+  PPTPC_reinit();
+
+  // Name resolved by PPTPC_init() is kept, unless it failed back then
+  if (PPTPC_serverIP.addr == 0) {
+    IPAddress ip;
+    if (WiFi.hostByName(PPTPC_servername, ip) == true) {
+      PPTPC_serverIP = ip;
     }
   }
-  
+
+  db_printf(DB_INFO, "PPTPC_handle() Reconnect attempt %d\n", _reconnectCount);
+  PPTPC_connect();
 }
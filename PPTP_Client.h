@@ -3,8 +3,9 @@
 
 //#include "Arduino.h"
 #include "ESPAsyncTCP.h"
-#include "SyncClient.h"
 #include "GRE.h"
+#include "PPP_Deflate.h"
+#include "PPP_Mp.h"
 
 extern "C"
 {
@@ -12,27 +13,6 @@ extern "C"
   #include <user_interface.h>
 }
 
-struct PtpPacket {
-  uint8_t address;
-  uint8_t control;
-  uint16_t protocol;
-};
-
-struct PppLcpPacket {
-  uint8_t code;
-  uint8_t identifier;
-  uint16_t length;
-};
-
-struct PppPapPacket {
-  uint8_t code;
-  uint8_t identifier;
-  uint16_t length;
-};
-
-
-
-
 struct StartControlConnection {
   uint16_t length;
   uint16_t pptpMessageType;
@@ -89,6 +69,71 @@ struct OutGoingCallReply {
 };
 
 
+// Fields every control message starts with
+struct PptpControlHeader {
+  uint16_t length;
+  uint16_t pptpMessageType;
+  uint32_t magic;
+  uint16_t controlMessageType;
+  uint16_t reserved0;
+};
+
+struct StopControlConnection {
+  uint16_t length;
+  uint16_t pptpMessageType;
+  uint32_t magic;
+  uint16_t controlMessageType;
+  uint16_t reserved0;
+  uint8_t reason;         // result code in the reply
+  uint8_t errorCode;
+  uint16_t reserved1;
+};
+
+struct EchoRequest {
+  uint16_t length;
+  uint16_t pptpMessageType;
+  uint32_t magic;
+  uint16_t controlMessageType;
+  uint16_t reserved0;
+  uint32_t identifier;
+};
+
+struct EchoReply {
+  uint16_t length;
+  uint16_t pptpMessageType;
+  uint32_t magic;
+  uint16_t controlMessageType;
+  uint16_t reserved0;
+  uint32_t identifier;
+  uint8_t resultCode;
+  uint8_t errorCode;
+  uint16_t reserved1;
+};
+
+struct CallDisconnectNotify {
+  uint16_t length;
+  uint16_t pptpMessageType;
+  uint32_t magic;
+  uint16_t controlMessageType;
+  uint16_t reserved0;
+  uint16_t callId;
+  uint8_t resultCode;
+  uint8_t errorCode;
+  uint16_t causeCode;
+  uint16_t reserved1;
+  char callStatistics[128];
+};
+
+struct CallClearRequest {
+  uint16_t length;
+  uint16_t pptpMessageType;
+  uint32_t magic;
+  uint16_t controlMessageType;
+  uint16_t reserved0;
+  uint16_t callId;
+  uint16_t reserved1;
+};
+
 struct SetLinkInfo {
   uint16_t length;
   uint16_t pptpMessageType;
@@ -101,11 +146,74 @@ struct SetLinkInfo {
   uint32_t receiveAccm;
 };
 
+#define PPTPC_LCP_RTT_BUCKETS   12
+
+struct LcpEchoStats {
+  uint32_t requests;
+  uint32_t replies;
+  uint32_t deadLinks;       // torn down for unanswered requests
+  uint32_t rttUs;
+  uint32_t srttUs;
+  // Bucket 0 is below 1 ms, bucket n from 2^(n-1) ms, the last one open
+  uint32_t rttHistogram[PPTPC_LCP_RTT_BUCKETS];
+};
+
+// Packets from the tunnel on their way to lwIP, since boot
+struct PptpRxRingStats {
+  uint32_t packets;
+  uint32_t batches;         // runs of the interface task
+  uint32_t drops;           // ring full
+  uint32_t highWater;       // most packets waiting at once
+};
+
+// Phases of a connect, in order. Each one ends at the event it is named
+// after, and takes the time since the end of the one before.
+#define PPTPC_CT_TCP            0   // control connection accepted
+#define PPTPC_CT_START_CONTROL  1   // Start-Control-Connection-Reply
+#define PPTPC_CT_CALL           2   // Outgoing-Call-Reply
+#define PPTPC_CT_LINK_INFO      3   // Set-Link-Info sent
+#define PPTPC_CT_GRE            4   // GRE call open
+#define PPTPC_CT_LCP            5   // LCP opened
+#define PPTPC_CT_AUTH           6   // login accepted
+#define PPTPC_CT_CBCP           7   // callback settled, 0 without one
+#define PPTPC_CT_IPCP           8   // IPCP opened
+#define PPTPC_CT_NETIF          9   // netif up, tunnel usable
+#define PPTPC_CT_PHASES         10
+// Connects kept
+#define PPTPC_CT_HISTORY        8
+
+struct PptpConnectTiming {
+  uint32_t attempt;         // PPTPC_connect() calls since boot, 1 is the first
+  uint32_t startMs;         // millis() at PPTPC_connect()
+  uint32_t phaseUs[PPTPC_CT_PHASES];
+  uint8_t phases;           // completed, PPTPC_CT_PHASES once the netif is up
+};
+
 void PPTPC_init(const char *server, int port, const char *user, const char *password);
 bool PPTPC_connect();
+bool PPTPC_isConnected();
+bool PPTPC_isFailed();
+void PPTPC_disconnect();
+uint32_t PPTPC_getReconnectCount();
 int PPTPC_writeData(uint8_t *data, int length);
+int PPTPC_writeDataPbuf(struct pbuf *p);
 //static int PPTPC_receiveCallback(uint8_t *data, int length);
 bool PPTPC_setLinkInfo();
+// Control channel round trip measured by the Echo keepalive
+uint32_t PPTPC_getEchoRttUs();
+uint32_t PPTPC_getEchoSrttUs();
+// LCP Echo keepalive over the tunnel, since boot
+const struct LcpEchoStats *PPTPC_getLcpEchoStats();
+// Deflate counters of each direction, since boot
+void PPTPC_getCompressionStats(struct PppDeflateStats *tx, struct PppDeflateStats *rx);
+// Data frames dropped for arriving unencrypted while MPPE was on, since boot
+uint32_t PPTPC_getMppeCleartextDrops();
+// Multilink counters since the bundle came up, returns the calls in it
+int PPTPC_getMultilinkStats(struct PppMpStats *stats);
+const struct PptpRxRingStats *PPTPC_getRxRingStats();
+// The last connects, newest first, at most 'size'. Returns their number.
+int PPTPC_getConnectTimings(struct PptpConnectTiming *timings, int size);
+const char *PPTPC_connectPhaseName(int phase);
 void PPTPC_handle();
 
 extern ip_addr_t localIP;
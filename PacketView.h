@@ -0,0 +1,293 @@
+#ifndef PacketView_h
+#define PacketView_h
+
+#include <stdint.h>
+
+// Header fields by offset and width, read and written a byte at a time in
+// network order. Received headers sit at any alignment in a pbuf or in the
+// control stream buffer, a cast to a struct loads whole words from there.
+//
+//   uint16_t port = PV_get<PvTcp::destPort>(tcp);
+//   PV_set<PvGre::callId>(header, s->peerCallId);
+
+template <unsigned Offset, unsigned Width>
+struct PvField {
+  static_assert(Width == 1 || Width == 2 || Width == 4, "PvField width is 1, 2 or 4 bytes");
+  static constexpr unsigned offset = Offset;
+  static constexpr unsigned width = Width;
+  static constexpr unsigned end = Offset + Width;
+};
+
+template <unsigned Width> struct PvCodec;
+
+template <> struct PvCodec<1> {
+  typedef uint8_t type;
+  static inline type get(const uint8_t *p) {
+    return p[0];
+  }
+  static inline void set(uint8_t *p, uint32_t v) {
+    p[0] = v;
+  }
+};
+
+template <> struct PvCodec<2> {
+  typedef uint16_t type;
+  static inline type get(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+  }
+  static inline void set(uint8_t *p, uint32_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+  }
+};
+
+template <> struct PvCodec<4> {
+  typedef uint32_t type;
+  static inline type get(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | (p[2] << 8) | p[3];
+  }
+  static inline void set(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+  }
+};
+
+template <typename F>
+inline typename PvCodec<F::width>::type PV_get(const void *header) {
+  return PvCodec<F::width>::get((const uint8_t *)header + F::offset);
+}
+
+template <typename F>
+inline void PV_set(void *header, uint32_t value) {
+  PvCodec<F::width>::set((uint8_t *)header + F::offset, value);
+}
+
+// A bare number, e.g. the optional GRE sequence and acknowledgment fields
+typedef PvField<0, 2> PvBe16;
+typedef PvField<0, 4> PvBe32;
+
+// IPv4 (RFC 791), options follow when the header is longer than 20 bytes
+struct PvIp4 {
+  typedef PvField<0, 1>   versionIhl;
+  typedef PvField<1, 1>   tos;
+  typedef PvField<2, 2>   totalLength;
+  typedef PvField<4, 2>   id;
+  typedef PvField<6, 2>   fragment;     // flags and offset
+  typedef PvField<8, 1>   ttl;
+  typedef PvField<9, 1>   protocol;
+  typedef PvField<10, 2>  checksum;
+  typedef PvField<12, 4>  src;
+  typedef PvField<16, 4>  dest;
+  static constexpr unsigned size = 20;
+};
+static_assert(PvIp4::size == 20 && PvIp4::dest::end == 20, "PvIp4 layout, RFC 791 3.1");
+
+inline unsigned PV_ip4HeaderLength(const void *ip) {
+  return (PV_get<PvIp4::versionIhl>(ip) & 0x0f) * 4;
+}
+
+// TCP (RFC 793)
+struct PvTcp {
+  typedef PvField<0, 2>   srcPort;
+  typedef PvField<2, 2>   destPort;
+  typedef PvField<4, 4>   seq;
+  typedef PvField<8, 4>   ack;
+  typedef PvField<12, 2>  offsetFlags;  // data offset, then the flags
+  typedef PvField<12, 1>  dataOffset;   // the two bytes of offsetFlags
+  typedef PvField<13, 1>  flags;
+  typedef PvField<14, 2>  window;
+  typedef PvField<16, 2>  checksum;
+  typedef PvField<18, 2>  urgent;
+  static constexpr unsigned size = 20;
+};
+static_assert(PvTcp::size == 20 && PvTcp::urgent::end == 20, "PvTcp layout, RFC 793 3.1");
+
+// ICMP (RFC 792), echo and destination unreachable
+struct PvIcmp {
+  typedef PvField<0, 1>   type;
+  typedef PvField<1, 1>   code;
+  typedef PvField<2, 2>   checksum;
+  typedef PvField<4, 2>   id;
+  typedef PvField<6, 2>   seq;
+  typedef PvField<6, 2>   nextHopMtu;   // Fragmentation Needed (RFC 1191)
+  static constexpr unsigned size = 8;
+};
+static_assert(PvIcmp::size == 8 && PvIcmp::seq::end == 8, "PvIcmp layout, RFC 792");
+
+// Enhanced GRE (RFC 2637 section 4.1). Sequence and acknowledgment number
+// follow, each when its flag is set.
+struct PvGre {
+  typedef PvField<0, 2>   flags;        // flags and version
+  typedef PvField<2, 2>   protocol;
+  typedef PvField<4, 2>   payloadLength;
+  typedef PvField<6, 2>   callId;
+  static constexpr unsigned size = 8;
+};
+static_assert(PvGre::size == 8 && PvGre::callId::end == 8, "PvGre layout, RFC 2637 4.1");
+
+// PPP frame header with address and control (RFC 1662), the form every
+// frame has before LCP agrees on compressing it
+struct PvPpp {
+  typedef PvField<0, 1>   address;
+  typedef PvField<1, 1>   control;
+  typedef PvField<2, 2>   protocol;
+  static constexpr unsigned size = 4;
+};
+static_assert(PvPpp::size == 4 && PvPpp::protocol::end == 4, "PvPpp layout, RFC 1662 3.1");
+
+// LCP, PAP, CHAP and the other control protocols of PPP (RFC 1661 5.)
+struct PvPppCp {
+  typedef PvField<0, 1>   code;
+  typedef PvField<1, 1>   identifier;
+  typedef PvField<2, 2>   length;
+  static constexpr unsigned size = 4;
+};
+static_assert(PvPppCp::size == 4 && PvPppCp::length::end == 4, "PvPppCp layout, RFC 1661 5.");
+
+// CHAP Challenge and Response (RFC 1994 4.1), the value and then the name
+// follow the value size
+struct PvChap {
+  typedef PvField<4, 1>   valueSize;
+  static constexpr unsigned value = 5;
+};
+static_assert(PvChap::valueSize::offset == 4 && PvChap::value == 5, "PvChap layout, RFC 1994 4.1");
+
+// Configuration option of LCP, IPCP or CCP (RFC 1661 6.), the value follows
+// type and length. MRU, MRRU, magic number and MPPE bits are one number.
+struct PvPppOption {
+  typedef PvField<0, 1>   type;
+  typedef PvField<1, 1>   length;
+  typedef PvField<2, 1>   value8;
+  typedef PvField<2, 2>   value16;
+  typedef PvField<2, 4>   value32;
+  static constexpr unsigned value = 2;
+};
+static_assert(PvPppOption::value == 2 && PvPppOption::value32::end == 6, "PvPppOption layout, RFC 1661 6.");
+
+// LCP Authentication-Protocol (RFC 1661 6.2), CHAP with its algorithm
+struct PvLcpAuth {
+  typedef PvField<2, 2>   protocol;
+  typedef PvField<4, 1>   algorithm;
+};
+
+// IPCP IP-Compression-Protocol for Van Jacobson (RFC 1332 4.)
+struct PvIpcpVj {
+  typedef PvField<2, 2>   protocol;
+  typedef PvField<4, 1>   maxSlotId;
+  typedef PvField<5, 1>   compSlotId;
+  static constexpr unsigned size = 6;
+};
+static_assert(PvIpcpVj::size == 6 && PvIpcpVj::compSlotId::end == 6, "PvIpcpVj layout, RFC 1332 4.");
+
+// CCP Deflate (RFC 1979 2.), window size and method in one byte
+struct PvCcpDeflate {
+  typedef PvField<2, 1>   windowMethod;
+  typedef PvField<3, 1>   check;
+  static constexpr unsigned size = 4;
+};
+static_assert(PvCcpDeflate::size == 4 && PvCcpDeflate::check::end == 4, "PvCcpDeflate layout, RFC 1979 2.");
+
+// PPTP control messages (RFC 2637 section 2), all begin with PvPptp
+struct PvPptp {
+  typedef PvField<0, 2>   length;
+  typedef PvField<2, 2>   messageType;
+  typedef PvField<4, 4>   magic;
+  typedef PvField<8, 2>   controlType;
+  static constexpr unsigned size = 12;
+};
+static_assert(PvPptp::size == 12 && PvPptp::controlType::end == 10, "PvPptp layout, RFC 2637 2.");
+
+struct PvPptpStartControl {
+  typedef PvField<12, 2>  protocolVersion;
+  typedef PvField<14, 1>  resultCode;
+  typedef PvField<15, 1>  errorCode;
+  typedef PvField<16, 4>  framing;
+  typedef PvField<20, 4>  bearer;
+  typedef PvField<24, 2>  maximumChannels;
+  typedef PvField<26, 2>  firmwareRevision;
+  static constexpr unsigned hostname = 28;
+  static constexpr unsigned vendor = 92;
+  static constexpr unsigned stringLength = 64;
+  static constexpr unsigned size = 156;
+};
+static_assert(PvPptpStartControl::size == 156 && PvPptpStartControl::firmwareRevision::end == 28 &&
+              PvPptpStartControl::vendor + 64 == 156, "PvPptpStartControl layout, RFC 2637 2.1");
+
+struct PvPptpStopControl {
+  typedef PvField<12, 1>  reason;       // result code in the reply
+  typedef PvField<13, 1>  errorCode;
+  static constexpr unsigned size = 16;
+};
+static_assert(PvPptpStopControl::size == 16 && PvPptpStopControl::errorCode::end == 14, "PvPptpStopControl layout, RFC 2637 2.3");
+
+struct PvPptpEcho {
+  typedef PvField<12, 4>  identifier;
+  typedef PvField<16, 1>  resultCode;   // reply only
+  typedef PvField<17, 1>  errorCode;
+  static constexpr unsigned requestSize = 16;
+  static constexpr unsigned replySize = 20;
+};
+static_assert(PvPptpEcho::requestSize == 16 && PvPptpEcho::replySize == 20 && PvPptpEcho::errorCode::end == 18,
+              "PvPptpEcho layout, RFC 2637 2.5");
+
+struct PvPptpOutCallRequest {
+  typedef PvField<12, 2>  callId;
+  typedef PvField<14, 2>  callSerialNumber;
+  typedef PvField<16, 4>  minimumBps;
+  typedef PvField<20, 4>  maximumBps;
+  typedef PvField<24, 4>  bearerType;
+  typedef PvField<28, 4>  framingType;
+  typedef PvField<32, 2>  recvWindowSize;
+  typedef PvField<34, 2>  processingDelay;
+  typedef PvField<36, 2>  phoneNumberLength;
+  static constexpr unsigned phoneNumber = 40;
+  static constexpr unsigned subAddress = 104;
+  static constexpr unsigned size = 168;
+};
+static_assert(PvPptpOutCallRequest::size == 168 && PvPptpOutCallRequest::phoneNumberLength::end == 38 &&
+              PvPptpOutCallRequest::subAddress + 64 == 168, "PvPptpOutCallRequest layout, RFC 2637 2.7");
+
+struct PvPptpOutCallReply {
+  typedef PvField<12, 2>  callId;
+  typedef PvField<14, 2>  peerCallId;
+  typedef PvField<16, 1>  resultCode;
+  typedef PvField<17, 1>  errorCode;
+  typedef PvField<18, 2>  causeCode;
+  typedef PvField<20, 4>  connectSpeed;
+  typedef PvField<24, 2>  recvWindowSize;
+  typedef PvField<26, 2>  processingDelay;
+  typedef PvField<28, 4>  phyChannelId;
+  static constexpr unsigned size = 32;
+};
+static_assert(PvPptpOutCallReply::size == 32 && PvPptpOutCallReply::phyChannelId::end == 32, "PvPptpOutCallReply layout, RFC 2637 2.8");
+
+struct PvPptpCallClear {
+  typedef PvField<12, 2>  callId;
+  static constexpr unsigned size = 16;
+};
+static_assert(PvPptpCallClear::size == 16 && PvPptpCallClear::callId::end == 14, "PvPptpCallClear layout, RFC 2637 2.11");
+
+struct PvPptpCallDisconnect {
+  typedef PvField<12, 2>  callId;
+  typedef PvField<14, 1>  resultCode;
+  typedef PvField<15, 1>  errorCode;
+  typedef PvField<16, 2>  causeCode;
+  static constexpr unsigned callStatistics = 20;
+  static constexpr unsigned headerSize = 20;  // statistics may be cut short
+  static constexpr unsigned size = 148;
+};
+static_assert(PvPptpCallDisconnect::size == 148 && PvPptpCallDisconnect::headerSize == 20 &&
+              PvPptpCallDisconnect::causeCode::end == 18 && PvPptpCallDisconnect::callStatistics + 128 == 148,
+              "PvPptpCallDisconnect layout, RFC 2637 2.12");
+
+struct PvPptpSetLinkInfo {
+  typedef PvField<12, 2>  peerCallId;
+  typedef PvField<16, 4>  sendAccm;
+  typedef PvField<20, 4>  receiveAccm;
+  static constexpr unsigned size = 24;
+};
+static_assert(PvPptpSetLinkInfo::size == 24 && PvPptpSetLinkInfo::receiveAccm::end == 24, "PvPptpSetLinkInfo layout, RFC 2637 2.15");
+
+#endif
@@ -1,5 +1,6 @@
 #include "TcpProxyServer.h"
 #include "DebugMsg.h"
+#include "PacketView.h"
 
 #include "Arduino.h"
 #include <ESP8266WiFi.h>
@@ -71,16 +72,11 @@ bool TCP_write(ip_addr_t *ip, pbuf *packetBuffer) {
   return true;
 }
 
-struct TcpPseudoHeader {
-  uint32_t src;
-  uint32_t dest;
-  uint8_t reserved;
-  uint8_t protocol;
-  uint16_t tcpLength;
-};
+// Source, destination, zero, protocol and TCP length (RFC 793 3.1)
+#define TCP_PSEUDO_HEADER_SIZE  12
 
 void fillChecksum(uint8_t * tcpPacket, ip_addr_t *srcIP, ip_addr_t *destIP, int length) {
-  struct TcpPseudoHeader pseudoHeader;
+  uint8_t pseudoHeader[TCP_PSEUDO_HEADER_SIZE];
   uint8_t *p = tcpPacket;
   uint32_t chksum;
   uint8_t *psum;
@@ -88,20 +84,19 @@ void fillChecksum(uint8_t * tcpPacket, ip_addr_t *srcIP, ip_addr_t *destIP, int
   
   db_printf(DB_DEBUG, "fillChecksum() Start\n");
 
-  memset(&pseudoHeader, 0, sizeof(struct TcpPseudoHeader));
-  
   // Clear Checksum
-  p[16] = 0;
-  p[17] = 0;
+  PV_set<PvTcp::checksum>(p, 0);
 
-  pseudoHeader.src = srcIP->addr;
-  pseudoHeader.dest = destIP->addr;
-  pseudoHeader.protocol = 6;  // TCP
-  pseudoHeader.tcpLength = htons(length);
+  // The addresses are in network order already
+  memcpy(&pseudoHeader[0], &srcIP->addr, 4);
+  memcpy(&pseudoHeader[4], &destIP->addr, 4);
+  pseudoHeader[8] = 0;
+  pseudoHeader[9] = 6;  // TCP
+  PV_set<PvBe16>(&pseudoHeader[10], length);
 
   chksum = 0;
-  psum = (uint8_t*)&pseudoHeader;
-  for (int i  =0; i < 12; i+=2) {
+  psum = pseudoHeader;
+  for (int i  =0; i < TCP_PSEUDO_HEADER_SIZE; i+=2) {
     uint16_t chunk = (psum[0] << 8) | psum[1];
     db_printf(DB_DEBUG, "fillChecksum() HDR Word = 0x%04X\n", chunk);
     chksum += chunk;
@@ -137,8 +132,7 @@ void fillChecksum(uint8_t * tcpPacket, ip_addr_t *srcIP, ip_addr_t *destIP, int
   chksum = ~chksum;
   finalsum = (uint16_t)chksum;
   db_printf(DB_DEBUG, "fillChecksum() Final Sum = 0x%04X\n", finalsum);
-  p[16] = finalsum >> 8;
-  p[17] = finalsum & 0xff;
+  PV_set<PvTcp::checksum>(p, finalsum);
   
   db_printf(DB_DEBUG, "fillChecksum() End\n");
 }
@@ -161,8 +155,8 @@ static uint8_t tcpReceivedStatic(void *tcp, raw_pcb *pcb, pbuf *packetBuffer, co
     return 0;
   }
 
-  // Save IPv4 header structure to read ttl value
-  struct ip_hdr * ip = (struct ip_hdr *)packetBuffer->payload;
+  // The IPv4 header, read through PacketView.h
+  uint8_t *ip = (uint8_t *)packetBuffer->payload;
   if(ip == nullptr)
   {
     // Not free the packet, and return zero. The packet will be matched against
@@ -180,9 +174,9 @@ static uint8_t tcpReceivedStatic(void *tcp, raw_pcb *pcb, pbuf *packetBuffer, co
   ip_addr_t tmp_ip;
 
   struct in_addr address;
-   /* copy IP addresses to aligned ip_addr_t */
-  ip_addr_copy(current_iphdr_dest, ip->dest);
-  ip_addr_copy(current_iphdr_src, ip->src);
+   /* copy IP addresses to aligned ip_addr_t, both stay in network order */
+  memcpy(&current_iphdr_dest.addr, ip + PvIp4::dest::offset, PvIp4::dest::width);
+  memcpy(&current_iphdr_src.addr, ip + PvIp4::src::offset, PvIp4::src::width);
     
   address.s_addr=current_iphdr_src.addr;
   db_printf(DB_DEBUG, "tcpReceivedStatic() Source Address: %s\n", inet_ntoa(address));
@@ -191,9 +185,15 @@ static uint8_t tcpReceivedStatic(void *tcp, raw_pcb *pcb, pbuf *packetBuffer, co
   db_printf(DB_DEBUG, "tcpReceivedStatic() Destinarion Address: %s\n", inet_ntoa(address));
 
   uint8_t *p = (uint8_t *)packetBuffer->payload;
-  uint16_t destPort = (p[22] << 8) | p[23];
-  uint16_t srcPort = (p[20] << 8) | p[21];
-  uint16_t tcpFlag = (p[32] << 8) | p[33];
+  int ipHeaderLength = PV_ip4HeaderLength(p);
+  if (packetBuffer->len < ipHeaderLength + PvTcp::size) {
+    db_printf(DB_DEBUG, "tcpReceivedStatic() Short packet %d\n", packetBuffer->len);
+    return 0;
+  }
+  uint8_t *tcpHeader = p + ipHeaderLength;
+  uint16_t destPort = PV_get<PvTcp::destPort>(tcpHeader);
+  uint16_t srcPort = PV_get<PvTcp::srcPort>(tcpHeader);
+  uint16_t tcpFlag = PV_get<PvTcp::offsetFlags>(tcpHeader);
   db_printf(DB_DEBUG, "tcpReceivedStatic() Source Port: %d\n", srcPort);
   db_printf(DB_DEBUG, "tcpReceivedStatic() Destination Port: %d\n", destPort);
   db_printf(DB_DEBUG, "tcpReceivedStatic() Packet Length Before: %d\n", packetBuffer->len);
@@ -209,7 +209,7 @@ static uint8_t tcpReceivedStatic(void *tcp, raw_pcb *pcb, pbuf *packetBuffer, co
 
   // Port  'reservedPort' reserve for Web setting
   if ((destPort != reservedPort) && (destPort != pptpPort) && (srcPort != pptpPort)) {
-    pbuf_header(packetBuffer, -PBUF_IP_HLEN);
+    pbuf_header(packetBuffer, -ipHeaderLength);
     db_printf(DB_DEBUG, "tcpReceivedStatic() Packet Length After: %d\n", packetBuffer->len);
     
     // Request From Client -> Forward to Destination server
@@ -20,6 +20,10 @@ struct DeviceStatus deviceStatus;
 uint8_t saveConfigFlag;
 bool devEmergencyMode;
 bool pptpStatus = false;
+bool wifiLost = false;
+uint32_t wifiLostMs;
+// Reboot only when WiFi does not come back by itself
+#define WIFI_LOST_REBOOT_MS   (5 * 60 * 1000)
 int debug = 1;
 uint32_t uptime_ms, uptime_sec;
 uint32_t ms;
@@ -88,13 +92,9 @@ void setup(){
     Serial.print("pptp connect return: ");
     Serial.println(pptpStatus);
     if (pptpStatus == true) {
-      Serial.println("PPTP Client Init OK");
-      deviceStatus.vpn_connect = true;
-      deviceStatus.vpn_local_ip.addr = localIP.addr;
-      deviceStatus.vpn_remote_ip.addr = remoteIP.addr;
+      Serial.println("PPTP Client Init OK, PPP negotiation started");
     } else {
-      Serial.println("PPTP Client Init Fail, Set restart in 60 Sec");
-      setRestartTimeout(60);
+      Serial.println("PPTP Client Init Fail, retry in background");
     }
   } else {
     Serial.println("Skip PPTP Client Init in Emergency Mode");
@@ -133,6 +133,39 @@ void handleUptime() {
     }
 
     deviceStatus.free_heap = ESP.getFreeHeap();
+    deviceStatus.vpn_rtt_us = GRE_getRttUs();
+    deviceStatus.vpn_rtt_var_us = GRE_getRttVarUs();
+    deviceStatus.vpn_ack_timeout_ms = GRE_getAckTimeoutMs();
+    deviceStatus.vpn_echo_rtt_us = PPTPC_getEchoSrttUs();
+    deviceStatus.vpn_reconnects = PPTPC_getReconnectCount();
+    struct PppDeflateStats compTx;
+    struct PppDeflateStats compRx;
+    PPTPC_getCompressionStats(&compTx, &compRx);
+    deviceStatus.vpn_comp_tx_bytes = compTx.bytes;
+    deviceStatus.vpn_comp_tx_wire = compTx.wireBytes;
+    deviceStatus.vpn_comp_rx_bytes = compRx.bytes;
+    deviceStatus.vpn_comp_rx_wire = compRx.wireBytes;
+    deviceStatus.vpn_link_rtt_us = PPTPC_getLcpEchoStats()->srttUs;
+    deviceStatus.vpn_link_dead = PPTPC_getLcpEchoStats()->deadLinks;
+    struct PppMpStats mp;
+    deviceStatus.vpn_mp_links = PPTPC_getMultilinkStats(&mp);
+    deviceStatus.vpn_mp_lost = mp.rxLost;
+    deviceStatus.vpn_rx_drops = PPTPC_getRxRingStats()->drops;
+    deviceStatus.vpn_rx_high_water = PPTPC_getRxRingStats()->highWater;
+    struct PptpConnectTiming ct;
+    if (PPTPC_getConnectTimings(&ct, 1) == 1) {
+      uint32_t us = 0;
+      deviceStatus.vpn_connect_slowest = PPTPC_CT_PHASES;
+      for (int i = 0; i < ct.phases; i++) {
+        us += ct.phaseUs[i];
+        if (deviceStatus.vpn_connect_slowest == PPTPC_CT_PHASES ||
+            ct.phaseUs[i] > ct.phaseUs[deviceStatus.vpn_connect_slowest]) {
+          deviceStatus.vpn_connect_slowest = i;
+        }
+      }
+      deviceStatus.vpn_connect_ms = us / 1000;
+      deviceStatus.vpn_connect_phases = ct.phases;
+    }
   }
 }
 
@@ -191,6 +224,16 @@ void handleDeviceConfig() {
   }
 }
 
+// PPP comes up (and reconnects) in the background after PPTPC_connect()
+void handlePptpStatus() {
+  if (PPTPC_isConnected() != deviceStatus.vpn_connect) {
+    deviceStatus.vpn_connect = PPTPC_isConnected();
+    deviceStatus.vpn_local_ip.addr = localIP.addr;
+    deviceStatus.vpn_remote_ip.addr = remoteIP.addr;
+    Serial.println(deviceStatus.vpn_connect ? "PPTP link up" : "PPTP link down");
+  }
+}
+
 void loop(){
 
   handleUptime();
@@ -198,8 +241,10 @@ void loop(){
   delay(50);  // delay 50ms
   
   if (devEmergencyMode == false) {
-    if (pptpStatus == true) // run only when pptp init success
+    if (wifiLost == false) { // tunnel is set up again only over a working WiFi
       PPTPC_handle();
+    }
+    handlePptpStatus();
   } else {
     if (millis() - ms > 5 * 60 * 1000) {    // uptime > 5 minute
       Serial.println("Maximum runtime in Emergency Mode is 5 Minute -> Reboot ESP");
@@ -224,8 +269,22 @@ void loop(){
   while (Serial.available() > 0) Serial.read();
 
   if ( (WiFi.status() != WL_CONNECTED) && (devEmergencyMode == false) ) {
-    Serial.println("WiFi Disconnected -> Reboot ESP");
-    ESP.reset();
+    if (wifiLost == false) {
+      Serial.println("WiFi Disconnected -> Tunnel down until it is back");
+      wifiLost = true;
+      wifiLostMs = millis();
+      deviceStatus.internet_connect = false;
+      PPTPC_disconnect();
+    }
+    if (millis() - wifiLostMs > WIFI_LOST_REBOOT_MS) {
+      Serial.println("WiFi Disconnected too long -> Reboot ESP");
+      ESP.reset();
+    }
+  } else if (wifiLost == true) {
+    Serial.println("WiFi Reconnected");
+    wifiLost = false;
+    deviceStatus.internet_connect = true;
+    deviceStatus.wifi_ip.addr = WiFi.localIP();
   }
 
   
@@ -0,0 +1,504 @@
+// Replays the GRE packets of a PPTP capture through GRE.cpp on the host and
+// reports what each stage of the packet path costs.
+//
+//   gre_bench [-c client-ip] [-r rounds] [-w window] capture.pcap
+//   gre_bench -g out.pcap [-n packets]
+//
+// The client defaults to the sender of the first GRE packet, -g writes a
+// synthetic capture to replay.
+//
+// Packets from the server go in through the raw PCB, the frames the client
+// sent go out through GRE_sessionWritePbuf(), on the capture's own timing.
+// Frames reach the sink as the PPP layer would get them; they are usually
+// MPPE encrypted with keys the capture does not have, so the PPP, MPPE and
+// Deflate stages are not driven from here.
+
+#include "HostShim.h"
+#include "ESP8266WiFi.h"
+#include "GRE.h"
+#include "DebugMsg.h"
+#include <chrono>
+#include <set>
+#include <string>
+#include <vector>
+
+#define GRE_BENCH_PROTOCOL  0x880b
+
+struct BenchPacket {
+  uint64_t us;
+  bool fromClient;
+  std::vector<uint8_t> ip;    // from the IPv4 header on
+};
+
+static std::vector<BenchPacket> _packets;
+static uint32_t _clientIP;
+static uint32_t _serverIP;
+static uint16_t _clientCallId;  // carried by packets to the client
+static uint16_t _serverCallId;  // carried by packets to the server
+
+static uint32_t _sinkFrames;
+static uint64_t _sinkBytes;
+static uint32_t _outData;
+static uint32_t _outAcks;
+
+static uint16_t be16(const uint8_t *b) {
+  return (b[0] << 8) | b[1];
+}
+
+static uint32_t be32(const uint8_t *b) {
+  return ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+static void putBe16(uint8_t *b, uint16_t v) {
+  b[0] = v >> 8;
+  b[1] = v;
+}
+
+static void putBe32(uint8_t *b, uint32_t v) {
+  b[0] = v >> 24;
+  b[1] = v >> 16;
+  b[2] = v >> 8;
+  b[3] = v;
+}
+
+static int greHeaderLength(const uint8_t *gre) {
+  return 8 + ((gre[0] & 0x10) ? 4 : 0) + ((gre[1] & 0x80) ? 4 : 0);
+}
+
+static const char *ipString(uint32_t ip) {
+  static char buf[16];
+  const uint8_t *b = (const uint8_t *)&ip;
+
+  snprintf(buf, sizeof(buf), "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+  return buf;
+}
+
+//
+// pcap
+//
+
+static uint32_t get32(const uint8_t *b, bool swap) {
+  uint32_t v;
+
+  memcpy(&v, b, 4);
+  return swap ? __builtin_bswap32(v) : v;
+}
+
+// The IPv4 packet of a frame, or null
+static const uint8_t *frameIp(uint32_t linkType, const uint8_t *f, size_t len, size_t *ipLen) {
+  size_t off;
+  uint16_t type;
+
+  switch (linkType) {
+    case 1:     // Ethernet
+      if (len < 14) {
+        return nullptr;
+      }
+      off = 12;
+      type = be16(f + off);
+      while (type == 0x8100 && len >= off + 6) {
+        off += 4;
+        type = be16(f + off);
+      }
+      off += 2;
+      break;
+    case 101:   // raw IP
+    case 228:   // raw IPv4
+      off = 0;
+      type = (len > 0 && (f[0] >> 4) == 4) ? 0x0800 : 0;
+      break;
+    case 113:   // Linux cooked
+      if (len < 16) {
+        return nullptr;
+      }
+      off = 16;
+      type = be16(f + 14);
+      break;
+    case 276:   // Linux cooked v2
+      if (len < 20) {
+        return nullptr;
+      }
+      off = 20;
+      type = be16(f);
+      break;
+    default:
+      return nullptr;
+  }
+  if (type != 0x0800 || len < off + 20) {
+    return nullptr;
+  }
+  *ipLen = len - off;
+  return f + off;
+}
+
+static bool readCapture(const char *path, uint32_t clientIP) {
+  FILE *f = fopen(path, "rb");
+  uint8_t h[24];
+  bool swap;
+  bool nanos;
+  uint32_t linkType;
+  uint64_t firstUs = 0;
+
+  if (f == nullptr) {
+    fprintf(stderr, "gre_bench: cannot open %s\n", path);
+    return false;
+  }
+  if (fread(h, 1, 24, f) != 24) {
+    fprintf(stderr, "gre_bench: %s is not a pcap file\n", path);
+    fclose(f);
+    return false;
+  }
+  uint32_t magic = get32(h, false);
+  swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+  nanos = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+  if (!swap && !nanos && magic != 0xa1b2c3d4) {
+    fprintf(stderr, "gre_bench: %s is not a pcap file (pcapng is not read)\n", path);
+    fclose(f);
+    return false;
+  }
+  linkType = get32(h + 20, swap) & 0xffff;
+
+  std::vector<uint8_t> frame;
+  uint8_t r[16];
+  while (fread(r, 1, 16, f) == 16) {
+    uint32_t caplen = get32(r + 8, swap);
+    uint64_t us = (uint64_t)get32(r, swap) * 1000000 + get32(r + 4, swap) / (nanos ? 1000 : 1);
+    size_t ipLen;
+
+    frame.resize(caplen);
+    if (fread(frame.data(), 1, caplen, f) != caplen) {
+      break;
+    }
+    const uint8_t *ip = frameIp(linkType, frame.data(), caplen, &ipLen);
+    if (ip == nullptr || (ip[0] >> 4) != 4 || ip[9] != IP_PROTO_GRE ||
+        (be16(ip + 6) & 0x3fff) != 0) {
+      continue;
+    }
+    size_t hl = (ip[0] & 0x0f) * 4;
+    size_t total = be16(ip + 2);
+    if (total > ipLen || total < hl + 8) {
+      continue;
+    }
+    const uint8_t *gre = ip + hl;
+    if ((gre[1] & 0x07) != 1 || be16(gre + 2) != GRE_BENCH_PROTOCOL || hl + greHeaderLength(gre) > total) {
+      continue;
+    }
+
+    uint32_t src, dst;
+    memcpy(&src, ip + 12, 4);
+    memcpy(&dst, ip + 16, 4);
+    if (clientIP == 0) {
+      clientIP = src;
+    }
+    if (src != clientIP && dst != clientIP) {
+      continue;
+    }
+    if (_packets.empty()) {
+      firstUs = us;
+      _clientIP = clientIP;
+      _serverIP = src == clientIP ? dst : src;
+    }
+    if ((src == clientIP ? dst : src) != _serverIP) {
+      continue;
+    }
+
+    BenchPacket p;
+    p.us = us >= firstUs ? us - firstUs : 0;
+    p.fromClient = src == clientIP;
+    p.ip.assign(ip, ip + total);
+    if (p.fromClient) {
+      _serverCallId = be16(gre + 6);
+    } else {
+      _clientCallId = be16(gre + 6);
+    }
+    _packets.push_back(p);
+  }
+  fclose(f);
+  return true;
+}
+
+// A PPTP call as seen at the client, 'count' data packets from both sides
+static bool writeSynthetic(const char *path, int count) {
+  FILE *f = fopen(path, "wb");
+  uint32_t clientSeq = 0;
+  uint32_t serverSeq = 0;
+  std::vector<std::vector<uint8_t>> frames;
+
+  if (f == nullptr) {
+    fprintf(stderr, "gre_bench: cannot create %s\n", path);
+    return false;
+  }
+  uint8_t h[24] = { 0 };
+  uint32_t v = 0xa1b2c3d4;
+  memcpy(h, &v, 4);
+  h[4] = 2;
+  h[6] = 4;
+  v = 65535;
+  memcpy(h + 16, &v, 4);
+  v = 1;
+  memcpy(h + 20, &v, 4);
+  fwrite(h, 1, 24, f);
+
+  srand(89);
+  for (int i = 0; i < count; i++) {
+    // A download: three frames in for every one out
+    bool fromClient = (i % 4) == 0;
+    int payload = fromClient ? 40 + rand() % 40 : 1000 + rand() % 400;
+    bool ack = fromClient ? serverSeq > 0 : clientSeq > 0;
+    int greLength = 12 + (ack ? 4 : 0);
+    int ipLength = 20 + greLength + payload;
+    std::vector<uint8_t> frame(14 + ipLength);
+    uint8_t *eth = frame.data();
+    uint8_t *ip = eth + 14;
+    uint8_t *gre = ip + 20;
+
+    memcpy(eth, "\x02\x00\x00\x00\x00\x01\x02\x00\x00\x00\x00\x02\x08\x00", 14);
+    ip[0] = 0x45;
+    putBe16(ip + 2, ipLength);
+    putBe16(ip + 4, i);
+    ip[8] = 64;
+    ip[9] = IP_PROTO_GRE;
+    memcpy(ip + 12, fromClient ? "\x0a\x00\x00\x02" : "\x0a\x00\x00\x01", 4);
+    memcpy(ip + 16, fromClient ? "\x0a\x00\x00\x01" : "\x0a\x00\x00\x02", 4);
+    putBe16(ip + 10, lwip_htons(inet_chksum(ip, 20)));
+    gre[0] = 0x30;
+    gre[1] = ack ? 0x81 : 0x01;
+    putBe16(gre + 2, GRE_BENCH_PROTOCOL);
+    putBe16(gre + 4, payload);
+    putBe16(gre + 6, fromClient ? 0x4e21 : 0x1389);
+    putBe32(gre + 8, fromClient ? clientSeq++ : serverSeq++);
+    if (ack) {
+      putBe32(gre + 12, fromClient ? serverSeq - 1 : clientSeq - 1);
+    }
+    for (int j = 0; j < payload; j++) {
+      gre[greLength + j] = rand();
+    }
+
+    frames.push_back(frame);
+  }
+
+  // Every 50th frame arrives one frame late
+  for (size_t i = 10; i + 1 < frames.size(); i += 50) {
+    std::swap(frames[i], frames[i + 1]);
+  }
+  for (size_t i = 0; i < frames.size(); i++) {
+    uint64_t us = 100 * i;
+    uint32_t r[4] = { (uint32_t)(us / 1000000), (uint32_t)(us % 1000000),
+                      (uint32_t)frames[i].size(), (uint32_t)frames[i].size() };
+    fwrite(r, 4, 4, f);
+    fwrite(frames[i].data(), 1, frames[i].size(), f);
+  }
+  fclose(f);
+  return true;
+}
+
+//
+// Replay
+//
+
+static int sink(struct GreSession *session, struct pbuf *p) {
+  _sinkFrames++;
+  _sinkBytes += p->tot_len;
+  return 0;
+}
+
+static void rawOutput(const uint8_t *packet, size_t len) {
+  const uint8_t *gre = packet + (packet[0] & 0x0f) * 4;
+
+  if (packet[9] != IP_PROTO_GRE) {
+    return;
+  }
+  if (gre[0] & 0x10) {
+    _outData++;
+  } else {
+    _outAcks++;
+  }
+}
+
+// An ack-only packet from the server, for everything sent so far
+static void serverAck(struct GreSession *s) {
+  uint8_t packet[20 + 12] = { 0x45 };
+
+  putBe16(packet + 2, sizeof(packet));
+  packet[8] = 64;
+  packet[9] = IP_PROTO_GRE;
+  memcpy(packet + 12, &_serverIP, 4);
+  memcpy(packet + 16, &_clientIP, 4);
+  packet[20] = 0x20;
+  packet[21] = 0x81;
+  putBe16(packet + 22, GRE_BENCH_PROTOCOL);
+  putBe16(packet + 26, _clientCallId);
+  putBe32(packet + 28, s->sequenceNumber - 1);
+  host_ipInput(packet, sizeof(packet));
+}
+
+static void usage() {
+  fprintf(stderr, "usage: gre_bench [-c client-ip] [-r rounds] [-w window] capture.pcap\n"
+                  "       gre_bench -g out.pcap [-n packets]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *client = nullptr;
+  const char *generate = nullptr;
+  const char *path = nullptr;
+  int rounds = 1;
+  int window = GRE_DEFAULT_PEER_WINDOW;
+  int count = 10000;
+  uint32_t clientIP = 0;
+
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    if (a == "-c" && i + 1 < argc) {
+      client = argv[++i];
+    } else if (a == "-r" && i + 1 < argc) {
+      rounds = atoi(argv[++i]);
+    } else if (a == "-w" && i + 1 < argc) {
+      window = atoi(argv[++i]);
+    } else if (a == "-g" && i + 1 < argc) {
+      generate = argv[++i];
+    } else if (a == "-n" && i + 1 < argc) {
+      count = atoi(argv[++i]);
+    } else if (a[0] != '-' && path == nullptr) {
+      path = argv[i];
+    } else {
+      usage();
+    }
+  }
+  if (generate != nullptr) {
+    return writeSynthetic(generate, count) ? 0 : 1;
+  }
+  if (path == nullptr || rounds < 1 || window < 1) {
+    usage();
+  }
+  if (client != nullptr) {
+    IPAddress ip;
+    if (!WiFi.hostByName(client, ip)) {
+      usage();
+    }
+    clientIP = ip;
+  }
+
+  if (!readCapture(path, clientIP)) {
+    return 1;
+  }
+  if (_packets.empty() || _clientCallId == 0 || _serverCallId == 0) {
+    fprintf(stderr, "gre_bench: no PPTP call in %s, GRE from both sides is needed\n", path);
+    return 1;
+  }
+
+  // Sequence numbers of each side, a round carries on after the last
+  std::set<uint32_t> serverSeqs;
+  uint32_t clientData = 0;
+  uint32_t minSeq = UINT32_MAX;
+  uint32_t maxSeq = 0;
+  for (const BenchPacket &p : _packets) {
+    const uint8_t *gre = p.ip.data() + (p.ip[0] & 0x0f) * 4;
+    if (!(gre[0] & 0x10)) {
+      continue;
+    }
+    if (p.fromClient) {
+      clientData++;
+    } else {
+      uint32_t seq = be32(gre + 8);
+      serverSeqs.insert(seq);
+      minSeq = seq < minSeq ? seq : minSeq;
+      maxSeq = seq > maxSeq ? seq : maxSeq;
+    }
+  }
+  uint32_t seqSpan = serverSeqs.empty() ? 0 : maxSeq - minSeq + 1;
+  uint64_t roundUs = _packets.back().us + 1000000;
+
+  printf("capture: %zu GRE packets, client %s call %u", _packets.size(), ipString(_clientIP), _clientCallId);
+  printf(", server %s call %u\n", ipString(_serverIP), _serverCallId);
+
+  db_setLevel(0);
+  host_setLocalIP(ipString(_clientIP));
+  host_setRawOutput(rawOutput);
+  ip_addr_t server;
+  server.addr = _serverIP;
+  if (!GRE_initAddr(&server, _clientCallId, _serverCallId)) {
+    fprintf(stderr, "gre_bench: GRE_initAddr() failed\n");
+    return 1;
+  }
+  struct GreSession *s = GRE_defaultSession;
+  GRE_setRecvCallback(sink);
+  GRE_setPeerWindow(window);
+  db_stageReset();
+
+  uint64_t start = host_nowUs();
+  auto wallStart = std::chrono::steady_clock::now();
+  uint32_t injectedAcks = 0;
+  for (int round = 0; round < rounds; round++) {
+    uint64_t base = start + round * roundUs;
+    for (const BenchPacket &bp : _packets) {
+      host_runTo(base + bp.us);
+      std::vector<uint8_t> ip = bp.ip;
+      uint8_t *gre = ip.data() + (ip[0] & 0x0f) * 4;
+      int greLength = greHeaderLength(gre);
+
+      if (!bp.fromClient) {
+        if (gre[0] & 0x10) {
+          putBe32(gre + 8, be32(gre + 8) + round * seqSpan);
+        }
+        // Acks are for our packets, not the ones in the capture
+        if (gre[1] & 0x80) {
+          putBe32(gre + greLength - 4, s->sequenceNumber - 1);
+        }
+        host_ipInput(ip.data(), ip.size());
+        continue;
+      }
+      if (!(gre[0] & 0x10)) {
+        continue;
+      }
+
+      // What the PPP layer handed over, sent from a buffer as lwIP makes it
+      int frameLength = ip.size() - (gre - ip.data()) - greLength;
+      struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, frameLength, PBUF_RAM);
+      if (p == nullptr) {
+        fprintf(stderr, "gre_bench: pbuf_alloc() failed\n");
+        return 1;
+      }
+      pbuf_take(p, gre + greLength, frameLength);
+      GRE_sessionWritePbuf(s, p, nullptr, 0);
+      pbuf_free(p);
+
+      // A capture with few acks from the server would stall the window
+      if (s->sequenceNumber - 1 - s->peerAckNumber >= (uint32_t)window / 2) {
+        serverAck(s);
+        injectedAcks++;
+      }
+    }
+  }
+  serverAck(s);
+  host_run(1000);
+  double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wallStart).count();
+
+  printf("replay: %d rounds, %.1f ms wall, %.1f s capture time\n", rounds, wallMs,
+         (host_nowUs() - start) / 1e6);
+  printf("%-10s %9s %11s %9s %11s %9s\n", "stage", "packets", "bytes", "ns/pkt", "pkt/s", "MB/s");
+  for (int i = 0; i < DB_STAGE_COUNT; i++) {
+    struct DbStageStats *st = &db_stageStats[i];
+    if (st->packets == 0) {
+      continue;
+    }
+    // The host cycle counter counts nanoseconds
+    printf("%-10s %9u %11u %9.0f %11.0f %9.1f\n", db_stageName(i), st->packets, st->bytes,
+           (double)st->cycles / st->packets, st->packets * 1e9 / (st->cycles ? st->cycles : 1),
+           st->bytes * 1e3 / (st->cycles ? st->cycles : 1));
+  }
+
+  struct GreStats *gs = &s->stats;
+  printf("gre: rx %u reordered %u duplicates %u gaps %u, tx %u queued %u stalls %u, "
+         "acks piggybacked %u standalone %u (%u from the server injected)\n",
+         gs->rxPackets, gs->rxReordered, gs->rxDuplicates, gs->rxGaps, gs->txPackets,
+         gs->txQueued, gs->txWindowStalls, gs->txAcksPiggybacked, gs->txAcksStandalone, injectedAcks);
+
+  uint32_t wantIn = serverSeqs.size() * rounds;
+  uint32_t wantOut = clientData * rounds;
+  GRE_close(s);
+  bool ok = _sinkFrames == wantIn && _outData == wantOut && host_livePbufs() == 0;
+  printf("frames in %u of %u (%llu bytes), out %u of %u, pbufs left %d: %s\n", _sinkFrames, wantIn,
+         (unsigned long long)_sinkBytes, _outData, wantOut, host_livePbufs(), ok ? "ok" : "MISMATCH");
+  return ok ? 0 : 1;
+}
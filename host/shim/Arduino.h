@@ -0,0 +1,67 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// Stand-in for the ESP8266 Arduino core, only what the sketch sources use.
+// millis() and micros() follow the virtual clock of HostShim.h, the cycle
+// counter follows real time so per-stage costs are measured for real.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+
+extern "C" {
+  #include "lwip/raw.h"
+  #include "user_interface.h"
+}
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RAM_ATTR
+#define IRAM_ATTR
+
+typedef uint8_t byte;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+class Stream {
+ public:
+  size_t print(const char *s);
+  size_t println(const char *s);
+  size_t printf(const char *format, ...);
+};
+extern Stream Serial;
+
+class IPAddress {
+ public:
+  IPAddress() : _address(0) {}
+  IPAddress(uint32_t address) : _address(address) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+    : _address(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) {}
+  IPAddress(const ip_addr_t &address) : _address(address.addr) {}
+  operator uint32_t() const { return _address; }
+  operator ip_addr_t() const { ip_addr_t a; a.addr = _address; return a; }
+  uint8_t operator[](int index) const { return (_address >> (index * 8)) & 0xff; }
+
+ private:
+  uint32_t _address;          // network byte order, as lwIP keeps it
+};
+
+class EspClass {
+ public:
+  // Nanoseconds of real time, as cycles of a nominal 1000 MHz CPU
+  uint32_t getCycleCount();
+  uint32_t getFreeHeap() { return 0; }
+};
+extern EspClass ESP;
+
+#endif
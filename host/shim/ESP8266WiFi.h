@@ -0,0 +1,14 @@
+#ifndef HOST_ESP8266WIFI_H
+#define HOST_ESP8266WIFI_H
+
+#include "Arduino.h"
+
+class WiFiClass {
+ public:
+  // Dotted quads, or names given to host_addHost()
+  int hostByName(const char *name, IPAddress &result);
+  IPAddress localIP();
+};
+extern WiFiClass WiFi;
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef HOST_ESPASYNCTCP_H
+#define HOST_ESPASYNCTCP_H
+
+// AsyncClient over an in-memory transport. The far end is a HostTcpPeer
+// (HostShim.h), data and events reach either side from the event loop,
+// never from inside the call that caused them.
+
+#include "Arduino.h"
+#include <functional>
+
+class AsyncClient;
+class HostTcpPeer;
+
+typedef std::function<void(void *, AsyncClient *)> AcConnectHandler;
+typedef std::function<void(void *, AsyncClient *, size_t len, uint32_t time)> AcAckHandler;
+typedef std::function<void(void *, AsyncClient *, int8_t error)> AcErrorHandler;
+typedef std::function<void(void *, AsyncClient *, void *data, size_t len)> AcDataHandler;
+typedef std::function<void(void *, AsyncClient *, uint32_t time)> AcTimeoutHandler;
+
+class AsyncClient {
+ public:
+  AsyncClient();
+  ~AsyncClient();
+
+  bool connect(IPAddress ip, uint16_t port);
+  bool connect(const char *host, uint16_t port);
+  void close(bool now = false);
+  void abort();
+  bool connected();
+  bool disconnected();
+  bool canSend();
+  size_t space();
+  size_t add(const char *data, size_t size);
+  bool send();
+  size_t write(const char *data, size_t size);
+  void setNoDelay(bool nodelay) {}
+  void setRxTimeout(uint32_t timeout) {}
+
+  void onConnect(AcConnectHandler cb, void *arg = 0);
+  void onDisconnect(AcConnectHandler cb, void *arg = 0);
+  void onAck(AcAckHandler cb, void *arg = 0);
+  void onError(AcErrorHandler cb, void *arg = 0);
+  void onData(AcDataHandler cb, void *arg = 0);
+  void onTimeout(AcTimeoutHandler cb, void *arg = 0);
+
+  static const char *errorToString(int8_t error);
+
+  // Host side, called by the event loop
+  void hostConnected();
+  void hostData(const uint8_t *data, size_t len);
+  void hostClosed(int8_t error);
+
+ private:
+  enum { CLOSED, CONNECTING, CONNECTED } _state;
+  HostTcpPeer *_peer;
+  uint32_t _generation;       // a reconnect drops events of the old connection
+  AcConnectHandler _connectCb;
+  void *_connectArg;
+  AcConnectHandler _discardCb;
+  void *_discardArg;
+  AcErrorHandler _errorCb;
+  void *_errorArg;
+  AcDataHandler _dataCb;
+  void *_dataArg;
+};
+
+#endif
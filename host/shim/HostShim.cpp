@@ -0,0 +1,1105 @@
+#include "HostShim.h"
+#include "ESP8266WiFi.h"
+#include "md5.h"
+#include "lwip/inet.h"
+#include <chrono>
+#include <deque>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+Stream Serial;
+EspClass ESP;
+WiFiClass WiFi;
+
+void host_fatal(const char *format, ...) {
+  va_list args;
+
+  fflush(stdout);
+  fprintf(stderr, "host: ");
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fprintf(stderr, "\n");
+  exit(2);
+}
+
+//
+// Event loop
+//
+
+static uint64_t _nowUs = 1000000;
+static uint64_t _eventSeq;
+static std::multimap<std::pair<uint64_t, uint64_t>, std::function<void()>> _events;
+
+struct HostTask {
+  os_task_t task;
+  uint8_t qlen;
+  std::deque<os_event_t> queue;
+};
+static HostTask _tasks[USER_TASK_PRIO_MAX];
+
+static os_timer_t *_timerList;
+static int _timersArmed;
+
+uint64_t host_nowUs() {
+  return _nowUs;
+}
+
+void host_schedule(uint32_t delayUs, std::function<void()> fn) {
+  _events.insert(std::make_pair(std::make_pair(_nowUs + delayUs, _eventSeq++), fn));
+}
+
+static bool host_runTasks() {
+  bool ran = false;
+
+  for (;;) {
+    int prio;
+    for (prio = USER_TASK_PRIO_MAX - 1; prio >= 0; prio--) {
+      if (!_tasks[prio].queue.empty()) {
+        break;
+      }
+    }
+    if (prio < 0) {
+      return ran;
+    }
+    os_event_t e = _tasks[prio].queue.front();
+    _tasks[prio].queue.pop_front();
+    _tasks[prio].task(&e);
+    ran = true;
+  }
+}
+
+static uint64_t host_timerDueUs(const os_timer_t *t) {
+  return (uint64_t)t->timer_expire * 1000;
+}
+
+static void host_timerUnlink(os_timer_t *ptimer) {
+  for (os_timer_t **pp = &_timerList; *pp != nullptr; pp = &(*pp)->timer_next) {
+    if (*pp == ptimer) {
+      *pp = ptimer->timer_next;
+      ptimer->timer_next = nullptr;
+      _timersArmed--;
+      return;
+    }
+  }
+}
+
+static bool host_timerArmed(const os_timer_t *ptimer) {
+  int n = 0;
+
+  for (os_timer_t *t = _timerList; t != nullptr; t = t->timer_next) {
+    if (t == ptimer) {
+      return true;
+    }
+    n++;
+  }
+  // The SDK list breaks the same way when an armed timer is cleared
+  if (n != _timersArmed) {
+    host_fatal("timer list lost %d armed timers, os_timer_t cleared while armed?", _timersArmed - n);
+  }
+  return false;
+}
+
+static void host_timerInsert(os_timer_t *ptimer, uint32_t expireMs) {
+  os_timer_t **pp = &_timerList;
+
+  ptimer->timer_expire = expireMs;
+  while (*pp != nullptr && (*pp)->timer_expire <= expireMs) {
+    pp = &(*pp)->timer_next;
+  }
+  ptimer->timer_next = *pp;
+  *pp = ptimer;
+  _timersArmed++;
+}
+
+static bool host_runTimers() {
+  bool ran = false;
+
+  while (_timerList != nullptr && host_timerDueUs(_timerList) <= _nowUs) {
+    os_timer_t *t = _timerList;
+    host_timerUnlink(t);
+    if (t->timer_period != 0) {
+      host_timerInsert(t, t->timer_expire + t->timer_period);
+    }
+    t->timer_func(t->timer_arg);
+    ran = true;
+  }
+  return ran;
+}
+
+static bool host_runEvents() {
+  bool ran = false;
+
+  while (!_events.empty() && _events.begin()->first.first <= _nowUs) {
+    std::function<void()> fn = _events.begin()->second;
+    _events.erase(_events.begin());
+    fn();
+    ran = true;
+    host_runTasks();
+  }
+  return ran;
+}
+
+static void host_step() {
+  bool ran;
+
+  do {
+    ran = host_runTasks();
+    ran |= host_runTimers();
+    ran |= host_runEvents();
+  } while (ran);
+}
+
+static uint64_t host_nextDueUs() {
+  uint64_t next = UINT64_MAX;
+
+  if (_timerList != nullptr) {
+    next = host_timerDueUs(_timerList);
+  }
+  if (!_events.empty() && _events.begin()->first.first < next) {
+    next = _events.begin()->first.first;
+  }
+  return next;
+}
+
+void host_runTo(uint64_t us) {
+  host_step();
+  for (;;) {
+    uint64_t next = host_nextDueUs();
+    if (next > us) {
+      break;
+    }
+    if (next > _nowUs) {
+      _nowUs = next;
+    }
+    host_step();
+  }
+  if (us > _nowUs) {
+    _nowUs = us;
+  }
+  host_step();
+}
+
+void host_run(uint32_t ms) {
+  host_runTo(_nowUs + (uint64_t)ms * 1000);
+}
+
+bool host_runUntil(std::function<bool()> done, uint32_t maxMs) {
+  uint64_t end = _nowUs + (uint64_t)maxMs * 1000;
+
+  host_step();
+  while (!done()) {
+    uint64_t next = host_nextDueUs();
+    if (next > end) {
+      _nowUs = end;
+      return done();
+    }
+    if (next > _nowUs) {
+      _nowUs = next;
+    }
+    host_step();
+  }
+  return true;
+}
+
+//
+// SDK
+//
+
+void os_timer_setfn(os_timer_t *ptimer, os_timer_func_t *pfunction, void *parg) {
+  if (host_timerArmed(ptimer)) {
+    host_fatal("os_timer_setfn() on an armed timer");
+  }
+  ptimer->timer_func = pfunction;
+  ptimer->timer_arg = parg;
+  ptimer->timer_period = 0;
+  ptimer->timer_next = nullptr;
+}
+
+void os_timer_arm_us(os_timer_t *ptimer, uint32_t microseconds, bool repeat_flag) {
+  uint32_t ms = (microseconds + 999) / 1000;
+
+  if (ptimer->timer_func == nullptr) {
+    host_fatal("os_timer_arm() on a timer without os_timer_setfn()");
+  }
+  if (host_timerArmed(ptimer)) {
+    host_timerUnlink(ptimer);
+  }
+  ptimer->timer_period = repeat_flag ? (ms != 0 ? ms : 1) : 0;
+  host_timerInsert(ptimer, (uint32_t)((_nowUs + 999) / 1000) + ms);
+}
+
+void os_timer_arm(os_timer_t *ptimer, uint32_t milliseconds, bool repeat_flag) {
+  os_timer_arm_us(ptimer, milliseconds * 1000, repeat_flag);
+}
+
+void os_timer_disarm(os_timer_t *ptimer) {
+  if (host_timerArmed(ptimer)) {
+    host_timerUnlink(ptimer);
+  }
+}
+
+bool system_os_task(os_task_t task, uint8_t prio, os_event_t *queue, uint8_t qlen) {
+  if (prio >= USER_TASK_PRIO_MAX || task == nullptr || queue == nullptr || qlen == 0) {
+    return false;
+  }
+  _tasks[prio].task = task;
+  _tasks[prio].qlen = qlen;
+  return true;
+}
+
+bool system_os_post(uint8_t prio, os_signal_t sig, os_param_t par) {
+  if (prio >= USER_TASK_PRIO_MAX) {
+    return false;
+  }
+  if (_tasks[prio].task == nullptr) {
+    host_fatal("system_os_post() to priority %d, no task registered", prio);
+  }
+  if (_tasks[prio].queue.size() >= _tasks[prio].qlen) {
+    return false;
+  }
+  os_event_t e;
+  e.sig = sig;
+  e.par = par;
+  _tasks[prio].queue.push_back(e);
+  return true;
+}
+
+uint32_t system_get_time(void) {
+  return (uint32_t)_nowUs;
+}
+
+static std::mt19937 _random(89);
+
+void host_setRandomSeed(uint32_t seed) {
+  _random.seed(seed);
+}
+
+unsigned long os_random(void) {
+  return _random();
+}
+
+bool wifi_get_macaddr(uint8_t if_index, uint8_t *macaddr) {
+  static const uint8_t mac[6] = { 0x5c, 0xcf, 0x7f, 0x00, 0x00, 0x01 };
+
+  memcpy(macaddr, mac, 6);
+  macaddr[5] += if_index;
+  return true;
+}
+
+//
+// Arduino
+//
+
+// Both wrap at 32 bits as on the ESP8266
+unsigned long millis() {
+  return (uint32_t)(_nowUs / 1000);
+}
+
+unsigned long micros() {
+  return (uint32_t)_nowUs;
+}
+
+void delay(unsigned long ms) {
+  host_run(ms);
+}
+
+void yield() {
+}
+
+long random(long howbig) {
+  if (howbig <= 0) {
+    return 0;
+  }
+  return (long)(_random() % (unsigned long)howbig);
+}
+
+long random(long howsmall, long howbig) {
+  if (howsmall >= howbig) {
+    return howsmall;
+  }
+  return howsmall + random(howbig - howsmall);
+}
+
+void randomSeed(unsigned long seed) {
+  _random.seed(seed);
+}
+
+size_t Stream::print(const char *s) {
+  return fwrite(s, 1, strlen(s), stdout);
+}
+
+size_t Stream::println(const char *s) {
+  return print(s) + print("\n");
+}
+
+size_t Stream::printf(const char *format, ...) {
+  va_list args;
+  int n;
+
+  va_start(args, format);
+  n = vprintf(format, args);
+  va_end(args);
+  return n < 0 ? 0 : n;
+}
+
+uint32_t EspClass::getCycleCount() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint32_t _localIP = 0x0200000a;     // 10.0.0.2
+static std::map<std::string, uint32_t> _hosts;
+
+// Dotted quad to network byte order
+static bool host_parseIP(const char *s, uint32_t *ip) {
+  unsigned a, b, c, d;
+  char end;
+
+  if (sscanf(s, "%u.%u.%u.%u%c", &a, &b, &c, &d, &end) != 4 || a > 255 || b > 255 || c > 255 || d > 255) {
+    return false;
+  }
+  *ip = a | (b << 8) | (c << 16) | ((uint32_t)d << 24);
+  return true;
+}
+
+void host_addHost(const char *name, const char *ip) {
+  uint32_t a;
+
+  if (!host_parseIP(ip, &a)) {
+    host_fatal("host_addHost() bad address %s", ip);
+  }
+  _hosts[name] = a;
+}
+
+int WiFiClass::hostByName(const char *name, IPAddress &result) {
+  uint32_t a;
+
+  if (host_parseIP(name, &a)) {
+    result = IPAddress(a);
+    return 1;
+  }
+  auto it = _hosts.find(name);
+  if (it == _hosts.end()) {
+    return 0;
+  }
+  result = IPAddress(it->second);
+  return 1;
+}
+
+IPAddress WiFiClass::localIP() {
+  return IPAddress(_localIP);
+}
+
+//
+// lwIP
+//
+
+static int _livePbufs;
+
+struct HostPbuf {
+  struct pbuf p;
+  uint8_t *data;              // start of the data area, headroom included
+};
+
+int host_livePbufs() {
+  return _livePbufs;
+}
+
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type) {
+  size_t offset = ((size_t)layer + 3) & ~(size_t)3;
+  bool hasData = type != PBUF_REF && type != PBUF_ROM;
+  HostPbuf *h = (HostPbuf *)calloc(1, sizeof(HostPbuf) + (hasData ? offset + length + 4 : 0));
+
+  if (h == nullptr) {
+    return nullptr;
+  }
+  if (hasData) {
+    // Like lwIP, the payload is word aligned after the layer's headroom
+    h->data = (uint8_t *)(((uintptr_t)(h + 1) + 3) & ~(uintptr_t)3);
+    h->p.payload = h->data + offset;
+  }
+  h->p.len = length;
+  h->p.tot_len = length;
+  h->p.type = type;
+  h->p.ref = 1;
+  _livePbufs++;
+  return &h->p;
+}
+
+u8_t pbuf_free(struct pbuf *p) {
+  u8_t count = 0;
+
+  while (p != nullptr) {
+    if (p->ref == 0) {
+      host_fatal("pbuf_free() on a freed pbuf");
+    }
+    if (--p->ref != 0) {
+      break;
+    }
+    struct pbuf *next = p->next;
+    free(p);
+    _livePbufs--;
+    count++;
+    p = next;
+  }
+  return count;
+}
+
+void pbuf_ref(struct pbuf *p) {
+  if (p != nullptr) {
+    p->ref++;
+  }
+}
+
+u8_t pbuf_header(struct pbuf *p, s16_t header_size_increment) {
+  if (p == nullptr || header_size_increment == 0) {
+    return 0;
+  }
+  if (header_size_increment < 0) {
+    if (-header_size_increment > p->len) {
+      return 1;
+    }
+  } else if (p->type == PBUF_REF || p->type == PBUF_ROM) {
+    return 1;
+  } else if ((uint8_t *)p->payload - header_size_increment < ((HostPbuf *)p)->data) {
+    return 1;
+  }
+  p->payload = (uint8_t *)p->payload - header_size_increment;
+  p->len += header_size_increment;
+  p->tot_len += header_size_increment;
+  return 0;
+}
+
+void pbuf_realloc(struct pbuf *p, u16_t new_len) {
+  struct pbuf *q = p;
+  u16_t rem = new_len;
+  int grow = (int)new_len - (int)p->tot_len;
+
+  if (new_len >= p->tot_len) {
+    return;
+  }
+  while (rem > q->len) {
+    rem -= q->len;
+    q->tot_len += grow;
+    q = q->next;
+  }
+  q->len = rem;
+  q->tot_len = rem;
+  if (q->next != nullptr) {
+    pbuf_free(q->next);
+  }
+  q->next = nullptr;
+}
+
+void pbuf_cat(struct pbuf *head, struct pbuf *tail) {
+  struct pbuf *p;
+
+  for (p = head; p->next != nullptr; p = p->next) {
+    p->tot_len += tail->tot_len;
+  }
+  p->tot_len += tail->tot_len;
+  p->next = tail;
+}
+
+void pbuf_chain(struct pbuf *head, struct pbuf *tail) {
+  pbuf_cat(head, tail);
+  pbuf_ref(tail);
+}
+
+struct pbuf *pbuf_dechain(struct pbuf *p) {
+  struct pbuf *q = p->next;
+
+  if (q == nullptr) {
+    return nullptr;
+  }
+  q->tot_len = p->tot_len - p->len;
+  p->next = nullptr;
+  p->tot_len = p->len;
+  return pbuf_free(q) > 0 ? nullptr : q;
+}
+
+u8_t pbuf_clen(const struct pbuf *p) {
+  u8_t n = 0;
+
+  for (; p != nullptr; p = p->next) {
+    n++;
+  }
+  return n;
+}
+
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset) {
+  uint8_t *out = (uint8_t *)dataptr;
+  u16_t copied = 0;
+
+  for (; p != nullptr && len != 0; p = p->next) {
+    if (offset >= p->len) {
+      offset -= p->len;
+      continue;
+    }
+    u16_t n = p->len - offset;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(out + copied, (uint8_t *)p->payload + offset, n);
+    copied += n;
+    len -= n;
+    offset = 0;
+  }
+  return copied;
+}
+
+err_t pbuf_take(struct pbuf *buf, const void *dataptr, u16_t len) {
+  const uint8_t *in = (const uint8_t *)dataptr;
+
+  if (buf == nullptr || buf->tot_len < len) {
+    return ERR_ARG;
+  }
+  for (struct pbuf *q = buf; q != nullptr && len != 0; q = q->next) {
+    u16_t n = q->len < len ? q->len : len;
+    memcpy(q->payload, in, n);
+    in += n;
+    len -= n;
+  }
+  return ERR_OK;
+}
+
+err_t pbuf_copy(struct pbuf *p_to, const struct pbuf *p_from) {
+  std::vector<uint8_t> b(p_from->tot_len);
+
+  if (p_to->tot_len < p_from->tot_len) {
+    return ERR_ARG;
+  }
+  pbuf_copy_partial(p_from, b.data(), p_from->tot_len, 0);
+  return pbuf_take(p_to, b.data(), p_from->tot_len);
+}
+
+u8_t pbuf_get_at(const struct pbuf *p, u16_t offset) {
+  u8_t b = 0;
+
+  pbuf_copy_partial(p, &b, 1, offset);
+  return b;
+}
+
+void pbuf_put_at(struct pbuf *p, u16_t offset, u8_t data) {
+  for (; p != nullptr; p = p->next) {
+    if (offset < p->len) {
+      ((uint8_t *)p->payload)[offset] = data;
+      return;
+    }
+    offset -= p->len;
+  }
+}
+
+u16_t lwip_htons(u16_t x) {
+  return (u16_t)((x >> 8) | (x << 8));
+}
+
+u32_t lwip_htonl(u32_t x) {
+  return __builtin_bswap32(x);
+}
+
+u16_t inet_chksum(const void *dataptr, u16_t len) {
+  const uint8_t *b = (const uint8_t *)dataptr;
+  uint32_t sum = 0;
+
+  for (; len > 1; len -= 2, b += 2) {
+    sum += (b[0] << 8) | b[1];
+  }
+  if (len != 0) {
+    sum += b[0] << 8;
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return lwip_htons((u16_t)~sum);
+}
+
+char *inet_ntoa(struct in_addr addr) {
+  static char buf[16];
+  const uint8_t *b = (const uint8_t *)&addr.s_addr;
+
+  snprintf(buf, sizeof(buf), "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+  return buf;
+}
+
+static HostPacketFn _rawOutput;
+static std::function<void(struct netif *, const uint8_t *, size_t)> _stackInput;
+static struct raw_pcb *_rawPcbs;
+static uint16_t _ipId;
+
+struct netif *netif_list;
+struct netif *netif_default;
+static struct netif _wifiNetif;
+
+void host_setLocalIP(const char *ip) {
+  if (!host_parseIP(ip, &_localIP)) {
+    host_fatal("host_setLocalIP() bad address %s", ip);
+  }
+  _wifiNetif.ip_addr.addr = _localIP;
+}
+
+void host_setRawOutput(HostPacketFn fn) {
+  _rawOutput = fn;
+}
+
+void host_setStackInput(std::function<void(struct netif *, const uint8_t *, size_t)> fn) {
+  _stackInput = fn;
+}
+
+struct raw_pcb *raw_new(u8_t proto) {
+  struct raw_pcb *pcb = (struct raw_pcb *)calloc(1, sizeof(struct raw_pcb));
+
+  if (pcb == nullptr) {
+    return nullptr;
+  }
+  pcb->protocol = proto;
+  pcb->next = _rawPcbs;
+  _rawPcbs = pcb;
+  return pcb;
+}
+
+void raw_remove(struct raw_pcb *pcb) {
+  for (struct raw_pcb **pp = &_rawPcbs; *pp != nullptr; pp = &(*pp)->next) {
+    if (*pp == pcb) {
+      *pp = pcb->next;
+      free(pcb);
+      return;
+    }
+  }
+}
+
+err_t raw_bind(struct raw_pcb *pcb, const ip_addr_t *ipaddr) {
+  pcb->local_ip.addr = ipaddr != nullptr ? ipaddr->addr : 0;
+  return ERR_OK;
+}
+
+void raw_recv(struct raw_pcb *pcb, raw_recv_fn recv, void *recv_arg) {
+  pcb->recv = recv;
+  pcb->recv_arg = recv_arg;
+}
+
+err_t raw_sendto(struct raw_pcb *pcb, struct pbuf *p, const ip_addr_t *ipaddr) {
+  std::vector<uint8_t> packet;
+  size_t offset = 0;
+
+  if (!(pcb->flags & RAW_FLAGS_HDRINCL)) {
+    uint8_t *h;
+    uint16_t sum;
+    offset = IP_HLEN;
+    packet.resize(IP_HLEN + p->tot_len);
+    h = packet.data();
+    h[0] = 0x45;
+    h[2] = (uint8_t)(packet.size() >> 8);
+    h[3] = (uint8_t)packet.size();
+    h[4] = (uint8_t)(_ipId >> 8);
+    h[5] = (uint8_t)_ipId++;
+    h[8] = 255;
+    h[9] = pcb->protocol;
+    memcpy(h + 12, pcb->local_ip.addr != 0 ? &pcb->local_ip.addr : &_localIP, 4);
+    memcpy(h + 16, &ipaddr->addr, 4);
+    sum = inet_chksum(h, IP_HLEN);
+    memcpy(h + 10, &sum, 2);
+  } else {
+    packet.resize(p->tot_len);
+  }
+  pbuf_copy_partial(p, packet.data() + offset, p->tot_len, 0);
+  if (_rawOutput) {
+    _rawOutput(packet.data(), packet.size());
+  }
+  return ERR_OK;
+}
+
+// raw_input() and the rest of the stack, takes p
+static void host_deliver(struct pbuf *p, struct netif *inp) {
+  const uint8_t *h = (const uint8_t *)p->payload;
+  ip_addr_t src;
+  ip_addr_t dest;
+
+  if (p->len < IP_HLEN) {
+    pbuf_free(p);
+    return;
+  }
+  memcpy(&src.addr, h + 12, 4);
+  memcpy(&dest.addr, h + 16, 4);
+  for (struct raw_pcb *pcb = _rawPcbs; pcb != nullptr; pcb = pcb->next) {
+    if (pcb->protocol != h[9] || pcb->recv == nullptr ||
+        (pcb->local_ip.addr != 0 && pcb->local_ip.addr != dest.addr)) {
+      continue;
+    }
+    if (pcb->recv(pcb->recv_arg, pcb, p, &src) != 0) {
+      return;
+    }
+  }
+  if (_stackInput) {
+    std::vector<uint8_t> packet(p->tot_len);
+    pbuf_copy_partial(p, packet.data(), p->tot_len, 0);
+    _stackInput(inp, packet.data(), packet.size());
+  }
+  pbuf_free(p);
+}
+
+err_t ip_input(struct pbuf *p, struct netif *inp) {
+  host_deliver(p, inp);
+  return ERR_OK;
+}
+
+void host_ipInput(const uint8_t *packet, size_t len) {
+  struct pbuf *p = pbuf_alloc(PBUF_LINK, (u16_t)len, PBUF_RAM);
+
+  if (p == nullptr) {
+    return;
+  }
+  memcpy(p->payload, packet, len);
+  host_deliver(p, nullptr);
+}
+
+err_t host_netifOutput(struct netif *netif, const uint8_t *packet, size_t len) {
+  struct pbuf *p;
+  ip4_addr_t dest;
+  err_t err;
+
+  if (!(netif->flags & NETIF_FLAG_UP) || netif->output == nullptr) {
+    return ERR_RTE;
+  }
+  // As ip_output() hands it over, link headroom in front of the IPv4 header
+  p = pbuf_alloc(PBUF_LINK, (u16_t)len, PBUF_RAM);
+  if (p == nullptr) {
+    return ERR_MEM;
+  }
+  memcpy(p->payload, packet, len);
+  memcpy(&dest.addr, packet + 16, 4);
+  err = netif->output(netif, p, &dest);
+  pbuf_free(p);
+  return err;
+}
+
+struct netif *netif_add(struct netif *netif, const ip4_addr_t *ipaddr, const ip4_addr_t *netmask,
+                        const ip4_addr_t *gw, void *state, netif_init_fn init, netif_input_fn input) {
+  memset(netif, 0, sizeof(*netif));
+  netif->state = state;
+  netif->input = input;
+  netif_set_addr(netif, ipaddr, netmask, gw);
+  if (init != nullptr && init(netif) != ERR_OK) {
+    return nullptr;
+  }
+  netif->next = netif_list;
+  netif_list = netif;
+  return netif;
+}
+
+void netif_remove(struct netif *netif) {
+  for (struct netif **pp = &netif_list; *pp != nullptr; pp = &(*pp)->next) {
+    if (*pp == netif) {
+      *pp = netif->next;
+      break;
+    }
+  }
+  if (netif_default == netif) {
+    netif_default = nullptr;
+  }
+}
+
+void netif_set_addr(struct netif *netif, const ip4_addr_t *ipaddr, const ip4_addr_t *netmask,
+                    const ip4_addr_t *gw) {
+  netif->ip_addr.addr = ipaddr != nullptr ? ipaddr->addr : 0;
+  netif->netmask.addr = netmask != nullptr ? netmask->addr : 0;
+  netif->gw.addr = gw != nullptr ? gw->addr : 0;
+}
+
+void netif_set_up(struct netif *netif) {
+  netif->flags |= NETIF_FLAG_UP;
+}
+
+void netif_set_down(struct netif *netif) {
+  netif->flags &= ~NETIF_FLAG_UP;
+}
+
+void netif_set_link_up(struct netif *netif) {
+  netif->flags |= NETIF_FLAG_LINK_UP;
+}
+
+void netif_set_link_down(struct netif *netif) {
+  netif->flags &= ~NETIF_FLAG_LINK_UP;
+}
+
+// The station interface, raw PCBs send through it
+static err_t host_wifiOutput(struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr) {
+  std::vector<uint8_t> packet(p->tot_len);
+
+  pbuf_copy_partial(p, packet.data(), p->tot_len, 0);
+  if (_rawOutput) {
+    _rawOutput(packet.data(), packet.size());
+  }
+  return ERR_OK;
+}
+
+static err_t host_wifiInit(struct netif *netif) {
+  netif->name[0] = 's';
+  netif->name[1] = 't';
+  netif->output = host_wifiOutput;
+  netif->mtu = 1500;
+  netif->flags = NETIF_FLAG_UP | NETIF_FLAG_LINK_UP | NETIF_FLAG_BROADCAST;
+  return ERR_OK;
+}
+
+static struct netif *host_wifiNetif() {
+  if (netif_default == nullptr) {
+    ip4_addr_t ip;
+    ip4_addr_t mask;
+    ip.addr = _localIP;
+    mask.addr = 0x00ffffff;
+    netif_add(&_wifiNetif, &ip, &mask, nullptr, nullptr, host_wifiInit, ip_input);
+    netif_default = &_wifiNetif;
+  }
+  return netif_default;
+}
+
+static struct HostWifiSetup {
+  HostWifiSetup() { host_wifiNetif(); }
+} _wifiSetup;
+
+//
+// AsyncClient over memory
+//
+
+static std::function<HostTcpPeer *(IPAddress, uint16_t)> _tcpListener;
+static uint32_t _tcpDelayUs = 500;
+static size_t _tcpSegment = 1460;
+
+// Events are dropped for clients destroyed or reconnected since
+static std::map<AsyncClient *, uint32_t> &host_clients() {
+  static std::map<AsyncClient *, uint32_t> clients;
+  return clients;
+}
+
+static void host_tcpLater(AsyncClient *client, uint32_t generation, std::function<void()> fn) {
+  host_schedule(_tcpDelayUs, [client, generation, fn]() {
+    auto it = host_clients().find(client);
+    if (it != host_clients().end() && it->second == generation) {
+      fn();
+    }
+  });
+}
+
+void host_setTcpListener(std::function<HostTcpPeer *(IPAddress ip, uint16_t port)> accept) {
+  _tcpListener = accept;
+}
+
+void host_setTcpDelay(uint32_t us) {
+  _tcpDelayUs = us;
+}
+
+void host_setTcpSegment(size_t size) {
+  _tcpSegment = size != 0 ? size : 1;
+}
+
+void host_tcpSend(AsyncClient *client, const uint8_t *data, size_t len) {
+  auto it = host_clients().find(client);
+
+  if (it == host_clients().end()) {
+    return;
+  }
+  for (size_t off = 0; off < len; off += _tcpSegment) {
+    size_t n = len - off < _tcpSegment ? len - off : _tcpSegment;
+    std::vector<uint8_t> segment(data + off, data + off + n);
+    host_tcpLater(client, it->second, [client, segment]() {
+      client->hostData(segment.data(), segment.size());
+    });
+  }
+}
+
+void host_tcpClose(AsyncClient *client) {
+  auto it = host_clients().find(client);
+
+  if (it == host_clients().end()) {
+    return;
+  }
+  host_tcpLater(client, it->second, [client]() { client->hostClosed(0); });
+}
+
+AsyncClient::AsyncClient()
+  : _state(CLOSED), _peer(nullptr), _generation(0), _connectArg(nullptr), _discardArg(nullptr),
+    _errorArg(nullptr), _dataArg(nullptr) {
+  host_clients()[this] = _generation;
+}
+
+AsyncClient::~AsyncClient() {
+  host_clients().erase(this);
+}
+
+bool AsyncClient::connect(IPAddress ip, uint16_t port) {
+  if (_state != CLOSED) {
+    return false;
+  }
+  _generation++;
+  host_clients()[this] = _generation;
+  _peer = _tcpListener ? _tcpListener(ip, port) : nullptr;
+  _state = CONNECTING;
+  if (_peer == nullptr) {
+    host_tcpLater(this, _generation, [this]() {
+      _state = CLOSED;
+      if (_errorCb) {
+        _errorCb(_errorArg, this, ERR_CONN);
+      }
+      if (_discardCb) {
+        _discardCb(_discardArg, this);
+      }
+    });
+    return true;
+  }
+  host_tcpLater(this, _generation, [this]() { hostConnected(); });
+  return true;
+}
+
+bool AsyncClient::connect(const char *host, uint16_t port) {
+  IPAddress ip;
+
+  if (!WiFi.hostByName(host, ip)) {
+    return false;
+  }
+  return connect(ip, port);
+}
+
+void AsyncClient::close(bool now) {
+  HostTcpPeer *peer = _peer;
+
+  if (_state == CLOSED) {
+    return;
+  }
+  _state = CLOSED;
+  _peer = nullptr;
+  _generation++;
+  host_clients()[this] = _generation;
+  if (peer != nullptr) {
+    host_schedule(_tcpDelayUs, [this, peer]() {
+      if (host_clients().count(this) != 0) {
+        peer->disconnected(this);
+      }
+    });
+  }
+  host_tcpLater(this, _generation, [this]() {
+    if (_discardCb) {
+      _discardCb(_discardArg, this);
+    }
+  });
+}
+
+void AsyncClient::abort() {
+  close(true);
+}
+
+bool AsyncClient::connected() {
+  return _state == CONNECTED;
+}
+
+bool AsyncClient::disconnected() {
+  return _state == CLOSED;
+}
+
+bool AsyncClient::canSend() {
+  return _state == CONNECTED;
+}
+
+size_t AsyncClient::space() {
+  return _state == CONNECTED ? 5840 : 0;
+}
+
+size_t AsyncClient::add(const char *data, size_t size) {
+  return write(data, size);
+}
+
+bool AsyncClient::send() {
+  return _state == CONNECTED;
+}
+
+size_t AsyncClient::write(const char *data, size_t size) {
+  HostTcpPeer *peer = _peer;
+
+  if (_state != CONNECTED || peer == nullptr) {
+    return 0;
+  }
+  for (size_t off = 0; off < size; off += _tcpSegment) {
+    size_t n = size - off < _tcpSegment ? size - off : _tcpSegment;
+    std::vector<uint8_t> segment(data + off, data + off + n);
+    host_tcpLater(this, _generation, [this, peer, segment]() {
+      peer->received(this, segment.data(), segment.size());
+    });
+  }
+  return size;
+}
+
+void AsyncClient::onConnect(AcConnectHandler cb, void *arg) {
+  _connectCb = cb;
+  _connectArg = arg;
+}
+
+void AsyncClient::onDisconnect(AcConnectHandler cb, void *arg) {
+  _discardCb = cb;
+  _discardArg = arg;
+}
+
+void AsyncClient::onAck(AcAckHandler cb, void *arg) {
+}
+
+void AsyncClient::onError(AcErrorHandler cb, void *arg) {
+  _errorCb = cb;
+  _errorArg = arg;
+}
+
+void AsyncClient::onData(AcDataHandler cb, void *arg) {
+  _dataCb = cb;
+  _dataArg = arg;
+}
+
+void AsyncClient::onTimeout(AcTimeoutHandler cb, void *arg) {
+}
+
+const char *AsyncClient::errorToString(int8_t error) {
+  switch (error) {
+    case ERR_OK: return "OK";
+    case ERR_MEM: return "Out of memory error";
+    case ERR_BUF: return "Buffer error";
+    case ERR_RTE: return "Routing problem";
+    case ERR_VAL: return "Illegal value";
+    case ERR_CONN: return "Not connected";
+    case ERR_IF: return "Low-level netif error";
+    case ERR_ARG: return "Illegal argument";
+    default: return "UNKNOWN";
+  }
+}
+
+void AsyncClient::hostConnected() {
+  _state = CONNECTED;
+  if (_peer != nullptr) {
+    _peer->connected(this);
+  }
+  if (_connectCb) {
+    _connectCb(_connectArg, this);
+  }
+}
+
+void AsyncClient::hostData(const uint8_t *data, size_t len) {
+  if (_state == CONNECTED && _dataCb) {
+    _dataCb(_dataArg, this, (void *)data, len);
+  }
+}
+
+void AsyncClient::hostClosed(int8_t error) {
+  if (_state == CLOSED) {
+    return;
+  }
+  _state = CLOSED;
+  _peer = nullptr;
+  _generation++;
+  host_clients()[this] = _generation;
+  if (error != ERR_OK && _errorCb) {
+    _errorCb(_errorArg, this, error);
+  }
+  if (_discardCb) {
+    _discardCb(_discardArg, this);
+  }
+}
@@ -0,0 +1,67 @@
+#ifndef HOST_SHIM_H
+#define HOST_SHIM_H
+
+// Host side of the shims: the event loop that stands in for the SDK task
+// loop, the network on the far side of the raw PCBs and netifs, and the
+// far end of every AsyncClient.
+//
+// Time is virtual. It only moves inside host_run()/host_runUntil(), which
+// run posted tasks first and then jump to the next timer or scheduled event.
+// Everything runs on the calling thread, as everything on the ESP8266 runs
+// on the SDK task.
+
+#include "Arduino.h"
+#include "ESPAsyncTCP.h"
+#include "lwip/netif.h"
+#include <functional>
+
+// Virtual clock, starts at one second
+uint64_t host_nowUs();
+// Moves the clock to 'us' (not backwards) running whatever falls due
+void host_runTo(uint64_t us);
+void host_run(uint32_t ms);
+// Runs until done() holds, checked after each step, or maxMs pass
+bool host_runUntil(std::function<bool()> done, uint32_t maxMs);
+void host_schedule(uint32_t delayUs, std::function<void()> fn);
+
+// Packets in network byte order from the IPv4 header on
+typedef std::function<void(const uint8_t *packet, size_t len)> HostPacketFn;
+
+void host_setLocalIP(const char *ip);
+// Gets every packet raw_sendto() puts on the wire
+void host_setRawOutput(HostPacketFn fn);
+// Gets the packets no raw PCB ate, as the rest of lwIP would. 'inp' is the
+// netif they came in on, null for the WiFi side.
+void host_setStackInput(std::function<void(struct netif *inp, const uint8_t *packet, size_t len)> fn);
+// A packet from the WiFi side, to the raw PCBs and then the stack
+void host_ipInput(const uint8_t *packet, size_t len);
+// Routes a packet out through 'netif', as ip_output() would
+err_t host_netifOutput(struct netif *netif, const uint8_t *packet, size_t len);
+// pbufs allocated and not yet freed
+int host_livePbufs();
+
+// Names for WiFi.hostByName()
+void host_addHost(const char *name, const char *ip);
+void host_setRandomSeed(uint32_t seed);
+
+// Far end of an AsyncClient
+class HostTcpPeer {
+ public:
+  virtual ~HostTcpPeer() {}
+  virtual void connected(AsyncClient *client) {}
+  virtual void received(AsyncClient *client, const uint8_t *data, size_t len) = 0;
+  virtual void disconnected(AsyncClient *client) {}
+};
+
+// Picks the peer for a connect(), null refuses it
+void host_setTcpListener(std::function<HostTcpPeer *(IPAddress ip, uint16_t port)> accept);
+// One way delay of the in-memory TCP, and the largest segment it delivers
+void host_setTcpDelay(uint32_t us);
+void host_setTcpSegment(size_t size);
+void host_tcpSend(AsyncClient *client, const uint8_t *data, size_t len);
+void host_tcpClose(AsyncClient *client);
+
+// Prints the message and exits, for misuse the SDK would not survive
+void host_fatal(const char *format, ...) __attribute__((noreturn, format(printf, 1, 2)));
+
+#endif
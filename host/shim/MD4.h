@@ -0,0 +1,2 @@
+// md4.c includes its header by this name
+#include "../../md4.h"
@@ -0,0 +1,28 @@
+#ifndef HOST_LWIP_ARCH_H
+#define HOST_LWIP_ARCH_H
+
+// Stand-in for the parts of lwIP 2 the sketch uses, enough to build and run
+// it on a PC. Layouts and return codes follow lwIP, the implementation is in
+// HostShim.cpp.
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t  u8_t;
+typedef int8_t   s8_t;
+typedef uint16_t u16_t;
+typedef int16_t  s16_t;
+typedef uint32_t u32_t;
+typedef int32_t  s32_t;
+
+typedef s8_t err_t;
+#define ERR_OK    0
+#define ERR_MEM   -1
+#define ERR_BUF   -2
+#define ERR_RTE   -4
+#define ERR_VAL   -6
+#define ERR_CONN  -11
+#define ERR_IF    -12
+#define ERR_ARG   -16
+
+#endif
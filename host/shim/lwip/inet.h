@@ -0,0 +1,20 @@
+#ifndef HOST_LWIP_INET_H
+#define HOST_LWIP_INET_H
+
+#include "lwip/ip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct in_addr {
+  u32_t s_addr;
+};
+
+char *inet_ntoa(struct in_addr addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
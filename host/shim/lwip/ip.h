@@ -0,0 +1,63 @@
+#ifndef HOST_LWIP_IP_H
+#define HOST_LWIP_IP_H
+
+#include "lwip/pbuf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Addresses are kept in network byte order, as in lwIP
+typedef struct ip4_addr {
+  u32_t addr;
+} ip4_addr_t;
+typedef ip4_addr_t ip_addr_t;
+typedef ip4_addr_t ip4_addr_p_t;
+
+#define IP_ADDR_ANY             ((ip_addr_t *)0)
+#define ip_addr_copy(dest, src) ((dest).addr = (src).addr)
+#define ip_addr_cmp(a, b)       ((a)->addr == (b)->addr)
+#define ip4_addr_set_u32(a, v)  ((a)->addr = (v))
+#define ip4_addr_get_u32(a)     ((a)->addr)
+#define ip_addr_get_ip4_u32(a)  ((a)->addr)
+#define ip_2_ip4(a)             (a)
+
+#define IP_HLEN         20
+#define IP_PROTO_ICMP   1
+#define IP_PROTO_TCP    6
+#define IP_PROTO_UDP    17
+#define IP_DF           0x4000
+
+struct ip_hdr {
+  u8_t _v_hl;
+  u8_t _tos;
+  u16_t _len;
+  u16_t _id;
+  u16_t _offset;
+  u8_t _ttl;
+  u8_t _proto;
+  u16_t _chksum;
+  ip4_addr_p_t src;
+  ip4_addr_p_t dest;
+};
+#define IPH_HL(hdr)     ((hdr)->_v_hl & 0x0f)
+#define IPH_PROTO(hdr)  ((hdr)->_proto)
+
+u16_t lwip_htons(u16_t x);
+u32_t lwip_htonl(u32_t x);
+#define htons(x) lwip_htons(x)
+#define ntohs(x) lwip_htons(x)
+#define htonl(x) lwip_htonl(x)
+#define ntohl(x) lwip_htonl(x)
+
+// Internet checksum of 'len' bytes, in network byte order
+u16_t inet_chksum(const void *dataptr, u16_t len);
+
+struct netif;
+err_t ip_input(struct pbuf *p, struct netif *inp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef HOST_LWIP_NETIF_H
+#define HOST_LWIP_NETIF_H
+
+#include "lwip/ip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct netif;
+typedef err_t (*netif_init_fn)(struct netif *netif);
+typedef err_t (*netif_input_fn)(struct pbuf *p, struct netif *inp);
+typedef err_t (*netif_output_fn)(struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr);
+
+#define NETIF_FLAG_UP         0x01
+#define NETIF_FLAG_BROADCAST  0x02
+#define NETIF_FLAG_LINK_UP    0x04
+
+struct netif {
+  struct netif *next;
+  ip_addr_t ip_addr;
+  ip_addr_t netmask;
+  ip_addr_t gw;
+  netif_input_fn input;
+  netif_output_fn output;
+  void *state;
+  u16_t mtu;
+  u8_t flags;
+  char name[2];
+  u8_t num;
+};
+
+extern struct netif *netif_list;
+extern struct netif *netif_default;
+
+struct netif *netif_add(struct netif *netif, const ip4_addr_t *ipaddr, const ip4_addr_t *netmask,
+                        const ip4_addr_t *gw, void *state, netif_init_fn init, netif_input_fn input);
+void netif_remove(struct netif *netif);
+void netif_set_addr(struct netif *netif, const ip4_addr_t *ipaddr, const ip4_addr_t *netmask,
+                    const ip4_addr_t *gw);
+void netif_set_up(struct netif *netif);
+void netif_set_down(struct netif *netif);
+void netif_set_link_up(struct netif *netif);
+void netif_set_link_down(struct netif *netif);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef HOST_LWIP_PBUF_H
+#define HOST_LWIP_PBUF_H
+
+#include "lwip/arch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Headroom of each layer, lwIP 2 defaults with a 14 byte Ethernet header
+#define PBUF_LINK_HLEN        14
+#define PBUF_IP_HLEN          20
+#define PBUF_TRANSPORT_HLEN   20
+
+typedef enum {
+  PBUF_TRANSPORT = PBUF_LINK_HLEN + PBUF_IP_HLEN + PBUF_TRANSPORT_HLEN,
+  PBUF_IP = PBUF_LINK_HLEN + PBUF_IP_HLEN,
+  PBUF_LINK = PBUF_LINK_HLEN,
+  PBUF_RAW_TX = PBUF_LINK_HLEN,
+  PBUF_RAW = 0
+} pbuf_layer;
+
+typedef enum {
+  PBUF_RAM,
+  PBUF_ROM,
+  PBUF_REF,
+  PBUF_POOL
+} pbuf_type;
+
+struct pbuf {
+  struct pbuf *next;
+  void *payload;
+  u16_t tot_len;
+  u16_t len;
+  u8_t type;
+  u8_t flags;
+  u16_t ref;
+};
+
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type);
+u8_t pbuf_free(struct pbuf *p);
+void pbuf_ref(struct pbuf *p);
+u8_t pbuf_header(struct pbuf *p, s16_t header_size_increment);
+void pbuf_realloc(struct pbuf *p, u16_t new_len);
+void pbuf_cat(struct pbuf *head, struct pbuf *tail);
+void pbuf_chain(struct pbuf *head, struct pbuf *tail);
+struct pbuf *pbuf_dechain(struct pbuf *p);
+u8_t pbuf_clen(const struct pbuf *p);
+err_t pbuf_copy(struct pbuf *p_to, const struct pbuf *p_from);
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset);
+err_t pbuf_take(struct pbuf *buf, const void *dataptr, u16_t len);
+u8_t pbuf_get_at(const struct pbuf *p, u16_t offset);
+void pbuf_put_at(struct pbuf *p, u16_t offset, u8_t data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef HOST_LWIP_RAW_H
+#define HOST_LWIP_RAW_H
+
+#include "lwip/netif.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct raw_pcb;
+// Gets the packet from its IPv4 header on. Non-zero means it was eaten (and
+// freed), zero passes it on to the next PCB and then to the stack.
+typedef u8_t (*raw_recv_fn)(void *arg, struct raw_pcb *pcb, struct pbuf *p, const ip_addr_t *addr);
+
+#define RAW_FLAGS_HDRINCL 0x02
+
+struct raw_pcb {
+  struct raw_pcb *next;
+  ip_addr_t local_ip;
+  u8_t protocol;
+  u8_t flags;
+  raw_recv_fn recv;
+  void *recv_arg;
+};
+
+struct raw_pcb *raw_new(u8_t proto);
+void raw_remove(struct raw_pcb *pcb);
+err_t raw_bind(struct raw_pcb *pcb, const ip_addr_t *ipaddr);
+void raw_recv(struct raw_pcb *pcb, raw_recv_fn recv, void *recv_arg);
+// Sends p with an IPv4 header in front, unless RAW_FLAGS_HDRINCL is set.
+// p stays with the caller.
+err_t raw_sendto(struct raw_pcb *pcb, struct pbuf *p, const ip_addr_t *ipaddr);
+#define raw_setflags(pcb, f)  ((pcb)->flags = (u8_t)(f))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
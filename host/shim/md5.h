@@ -0,0 +1,26 @@
+#ifndef HOST_MD5_H
+#define HOST_MD5_H
+
+// MD5 of the ESP8266 ROM (RFC 1321), implemented in md5.c
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  uint32_t state[4];
+  uint32_t count[2];
+  uint8_t buffer[64];
+} md5_context_t;
+
+void MD5Init(md5_context_t *context);
+void MD5Update(md5_context_t *context, const uint8_t *buf, const uint16_t len);
+void MD5Final(uint8_t digest[16], md5_context_t *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
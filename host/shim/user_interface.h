@@ -0,0 +1,59 @@
+#ifndef HOST_USER_INTERFACE_H
+#define HOST_USER_INTERFACE_H
+
+// Stand-in for the ESP8266 NONOS SDK calls the sketch uses. Timers and
+// tasks run from the host event loop (HostShim.h) on a virtual clock.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void os_timer_func_t(void *timer_arg);
+
+// Same fields as ETSTimer, armed timers are linked through timer_next
+typedef struct _ETSTIMER_ {
+  struct _ETSTIMER_ *timer_next;
+  uint32_t timer_expire;
+  uint32_t timer_period;
+  os_timer_func_t *timer_func;
+  void *timer_arg;
+} os_timer_t;
+
+void os_timer_setfn(os_timer_t *ptimer, os_timer_func_t *pfunction, void *parg);
+void os_timer_arm(os_timer_t *ptimer, uint32_t milliseconds, bool repeat_flag);
+void os_timer_arm_us(os_timer_t *ptimer, uint32_t microseconds, bool repeat_flag);
+void os_timer_disarm(os_timer_t *ptimer);
+
+typedef uint32_t os_signal_t;
+typedef uint32_t os_param_t;
+
+typedef struct {
+  os_signal_t sig;
+  os_param_t par;
+} os_event_t;
+
+typedef void (*os_task_t)(os_event_t *e);
+
+#define USER_TASK_PRIO_0    0
+#define USER_TASK_PRIO_1    1
+#define USER_TASK_PRIO_2    2
+#define USER_TASK_PRIO_MAX  3
+
+bool system_os_task(os_task_t task, uint8_t prio, os_event_t *queue, uint8_t qlen);
+bool system_os_post(uint8_t prio, os_signal_t sig, os_param_t par);
+
+uint32_t system_get_time(void);
+unsigned long os_random(void);
+
+#define STATION_IF  0x00
+#define SOFTAP_IF   0x01
+bool wifi_get_macaddr(uint8_t if_index, uint8_t *macaddr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,998 @@
+// Stand-in PPTP server for the host tests, see PptpServer.h
+
+#include "PptpServer.h"
+#include "ESP8266WiFi.h"
+#include "GRE.h"
+#include "PacketView.h"
+#include "md5.h"
+
+// MSCHAP.cpp, RFC 2759 section 8 (version 2) and RFC 2433 appendix A (1)
+int GenerateNTResponse(uint8_t AuthenticatorChallenge[16], uint8_t PeerChallenge[16], char *UserName,
+                       char *Password, uint8_t Response[24], uint8_t mschapVersion);
+int GenerateAuthenticatorResponse(char *PasswordASCII, uint8_t NtResponse[24], uint8_t PeerChallenge[16],
+                                  uint8_t AuthenticatorChallenge[16], char *UserName, uint8_t *AuthenticatorResponse);
+
+#define PPTPS_PROTOCOL        0x880b
+#define PPTPS_MAGIC_COOKIE    0x1a2b3c4d
+
+// Control message types (RFC 2637 section 2)
+#define PPTPS_SCCRQ   1
+#define PPTPS_SCCRP   2
+#define PPTPS_STOPRQ  3
+#define PPTPS_STOPRP  4
+#define PPTPS_ECHORQ  5
+#define PPTPS_ECHORP  6
+#define PPTPS_OCRQ    7
+#define PPTPS_OCRP    8
+#define PPTPS_CCRQ    12
+#define PPTPS_CDN     13
+#define PPTPS_SLI     15
+
+// Algorithms of the CHAP option (RFC 1994, RFC 2433, RFC 2759)
+static const uint8_t _chapAlgorithm[] = { 0, 0, 0x05, 0x80, 0x81 };
+
+static const char _serverName[] = "stand-in";
+
+static uint32_t ipOf(const std::string &s) {
+  IPAddress ip;
+
+  if (!WiFi.hostByName(s.c_str(), ip)) {
+    host_fatal("PptpServer: bad address %s", s.c_str());
+  }
+  return ip;
+}
+
+PptpServer::PptpServer(const char *ip)
+    : _ip(ipOf(ip)), _stats(), _random(1723), _client(nullptr), _nextCallId(0x4000), _callActive(false),
+      _generation(0), _dataLeft(0), _dataSize(0) {
+  _config.user = "user";
+  _config.password = "password";
+  _config.auth = PPTPS_AUTH_MSCHAP2;
+  _config.callback = false;
+  _config.vj = true;
+  _config.address = "10.0.0.1";
+  _config.peerAddress = "10.0.0.2";
+  _config.recvWindow = 64;
+  _config.ackDelayUs = 1000;
+  _config.up = PptpLinkConfig();
+  _config.down = PptpLinkConfig();
+  _callConfig = _config;
+  _up = Link();
+  _down = Link();
+  _up.stats = &_stats.up;
+  _down.stats = &_stats.down;
+  memset(&_lcp, 0, sizeof(_lcp));
+  memset(&_ipcp, 0, sizeof(_ipcp));
+
+  host_setRawOutput([this](const uint8_t *packet, size_t len) { clientPacket(packet, len); });
+}
+
+void PptpServer::configure(const PptpServerConfig &config) {
+  _config = config;
+  setLink(config.up, config.down);
+}
+
+void PptpServer::setLink(const PptpLinkConfig &up, const PptpLinkConfig &down) {
+  _config.up = up;
+  _config.down = down;
+  _up.config = up;
+  _down.config = down;
+}
+
+void PptpServer::sendData(uint32_t count, int size) {
+  _dataLeft += count;
+  _dataSize = size;
+  greFlush();
+}
+
+// Runs fn after 'us', unless the call ended or restarted in between
+void PptpServer::later(uint32_t us, void (PptpServer::*fn)()) {
+  uint32_t generation = _generation;
+
+  host_schedule(us, [this, generation, fn]() {
+    if (generation == _generation && _callActive) {
+      (this->*fn)();
+    }
+  });
+}
+
+//
+// Control connection
+//
+
+void PptpServer::connected(AsyncClient *client) {
+  _client = client;
+  _ctrlBuf.clear();
+}
+
+void PptpServer::disconnected(AsyncClient *client) {
+  if (client != _client) {
+    return;
+  }
+  callStop();
+  _client = nullptr;
+  _ctrlBuf.clear();
+}
+
+void PptpServer::received(AsyncClient *client, const uint8_t *data, size_t len) {
+  _ctrlBuf.insert(_ctrlBuf.end(), data, data + len);
+  while (_ctrlBuf.size() >= PvPptp::size) {
+    uint16_t length = PV_get<PvPptp::length>(_ctrlBuf.data());
+    if (length < PvPptp::size) {
+      host_fatal("PptpServer: control message of %u bytes", length);
+    }
+    if (_ctrlBuf.size() < length) {
+      break;
+    }
+    std::vector<uint8_t> msg(_ctrlBuf.begin(), _ctrlBuf.begin() + length);
+    _ctrlBuf.erase(_ctrlBuf.begin(), _ctrlBuf.begin() + length);
+    controlDispatch(msg.data(), length);
+  }
+}
+
+void PptpServer::controlHeader(uint8_t *msg, int length, uint16_t type) {
+  memset(msg, 0, length);
+  PV_set<PvPptp::length>(msg, length);
+  PV_set<PvPptp::messageType>(msg, 1);
+  PV_set<PvPptp::magic>(msg, PPTPS_MAGIC_COOKIE);
+  PV_set<PvPptp::controlType>(msg, type);
+}
+
+void PptpServer::controlSend(const uint8_t *msg, int length) {
+  if (_client != nullptr) {
+    host_tcpSend(_client, msg, length);
+  }
+}
+
+// Lengths are checked against RFC 2637, a client that sends less is broken
+static int controlMinLength(uint16_t type) {
+  switch (type) {
+    case PPTPS_SCCRQ:   return PvPptpStartControl::size;
+    case PPTPS_STOPRQ:  return PvPptpStopControl::size;
+    case PPTPS_ECHORQ:  return PvPptpEcho::requestSize;
+    case PPTPS_ECHORP:  return PvPptpEcho::replySize;
+    case PPTPS_OCRQ:    return PvPptpOutCallRequest::size;
+    case PPTPS_CCRQ:    return PvPptpCallClear::size;
+    case PPTPS_SLI:     return PvPptpSetLinkInfo::size;
+  }
+  return PvPptp::size;
+}
+
+void PptpServer::controlDispatch(const uint8_t *msg, int length) {
+  uint16_t type = PV_get<PvPptp::controlType>(msg);
+
+  if (PV_get<PvPptp::messageType>(msg) != 1 || PV_get<PvPptp::magic>(msg) != PPTPS_MAGIC_COOKIE) {
+    host_fatal("PptpServer: bad control message header");
+  }
+  if (length < controlMinLength(type)) {
+    host_fatal("PptpServer: control message %u too short, %d bytes", type, length);
+  }
+
+  switch (type) {
+    case PPTPS_SCCRQ: {
+      uint8_t reply[PvPptpStartControl::size];
+      controlHeader(reply, sizeof(reply), PPTPS_SCCRP);
+      PV_set<PvPptpStartControl::protocolVersion>(reply, 0x0100);
+      PV_set<PvPptpStartControl::resultCode>(reply, 1);
+      PV_set<PvPptpStartControl::framing>(reply, 3);
+      PV_set<PvPptpStartControl::bearer>(reply, 3);
+      PV_set<PvPptpStartControl::firmwareRevision>(reply, 1);
+      strcpy((char *)&reply[PvPptpStartControl::hostname], _serverName);
+      strcpy((char *)&reply[PvPptpStartControl::vendor], "host test");
+      controlSend(reply, sizeof(reply));
+      break;
+    }
+
+    case PPTPS_OCRQ: {
+      uint8_t reply[PvPptpOutCallReply::size];
+      callStart(PV_get<PvPptpOutCallRequest::callId>(msg), PV_get<PvPptpOutCallRequest::recvWindowSize>(msg));
+      controlHeader(reply, sizeof(reply), PPTPS_OCRP);
+      PV_set<PvPptpOutCallReply::callId>(reply, _callId);
+      PV_set<PvPptpOutCallReply::peerCallId>(reply, _peerCallId);
+      PV_set<PvPptpOutCallReply::resultCode>(reply, 1);
+      PV_set<PvPptpOutCallReply::connectSpeed>(reply, 100000000);
+      PV_set<PvPptpOutCallReply::recvWindowSize>(reply, _callConfig.recvWindow);
+      controlSend(reply, sizeof(reply));
+      break;
+    }
+
+    case PPTPS_SLI:
+      if (PV_get<PvPptpSetLinkInfo::peerCallId>(msg) != _callId) {
+        host_fatal("PptpServer: Set-Link-Info for call %u", PV_get<PvPptpSetLinkInfo::peerCallId>(msg));
+      }
+      break;
+
+    case PPTPS_ECHORQ: {
+      uint8_t reply[PvPptpEcho::replySize];
+      controlHeader(reply, sizeof(reply), PPTPS_ECHORP);
+      PV_set<PvPptpEcho::identifier>(reply, PV_get<PvPptpEcho::identifier>(msg));
+      PV_set<PvPptpEcho::resultCode>(reply, 1);
+      controlSend(reply, sizeof(reply));
+      _stats.controlEchoes++;
+      break;
+    }
+
+    case PPTPS_CCRQ: {
+      uint8_t reply[PvPptpCallDisconnect::size];
+      controlHeader(reply, sizeof(reply), PPTPS_CDN);
+      PV_set<PvPptpCallDisconnect::callId>(reply, _callId);
+      PV_set<PvPptpCallDisconnect::resultCode>(reply, 3);   // Admin Shutdown
+      controlSend(reply, sizeof(reply));
+      callStop();
+      break;
+    }
+
+    case PPTPS_STOPRQ: {
+      uint8_t reply[PvPptpStopControl::size];
+      controlHeader(reply, sizeof(reply), PPTPS_STOPRP);
+      PV_set<PvPptpStopControl::reason>(reply, 1);
+      controlSend(reply, sizeof(reply));
+      callStop();
+      break;
+    }
+
+    case PPTPS_ECHORP:
+      break;
+
+    default:
+      host_fatal("PptpServer: unexpected control message %u", type);
+  }
+}
+
+void PptpServer::callStart(uint16_t peerCallId, uint16_t peerWindow) {
+  callStop();
+  _callConfig = _config;
+  _callActive = true;
+  _stats.calls++;
+  _callId = _nextCallId++;
+  _peerCallId = peerCallId;
+  _peerWindow = peerWindow != 0 ? peerWindow : 1;
+  _clientIp = 0;
+  _up.count = 0;
+  _down.count = 0;
+
+  _txSeq = 0;
+  _peerAck = 0xffffffff;
+  _peerAckUs = host_nowUs();
+  _stallArmed = false;
+  _txQueue.clear();
+  _rxStarted = false;
+  _rxSeq = 0;
+  _rxAcked = 0;
+  _ackArmed = false;
+  _ipId = 0;
+
+  _magic = _random();
+  _wantPfc = true;
+  _wantAcfc = true;
+  _peerCallback = false;
+  _authenticated = false;
+  _cbcpDone = false;
+  _chapId = _random();
+  _chapChallengeSize = 0;
+  _cbcpId = _random();
+  _address = ipOf(_callConfig.address);
+  _peerAddress = ipOf(_callConfig.peerAddress);
+
+  static const struct PppFsmCallbacks lcpCallbacks = {
+    lcpBuildOptions, lcpCheckOptions, lcpRejectOptions, lcpRejectOptions, lcpExtCode, lcpUp, lcpDown, nullptr
+  };
+  static const struct PppFsmCallbacks ipcpCallbacks = {
+    ipcpBuildOptions, ipcpCheckOptions, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr
+  };
+  PPPFSM_init(&_lcp, "server LCP", 0xc021, &lcpCallbacks, fsmOutput);
+  PPPFSM_init(&_ipcp, "server IPCP", 0x8021, &ipcpCallbacks, fsmOutput);
+  _lcp.arg = this;
+  _ipcp.arg = this;
+}
+
+void PptpServer::callStop() {
+  if (!_callActive) {
+    return;
+  }
+  _callActive = false;
+  _generation++;
+  PPPFSM_init(&_lcp, "server LCP", 0xc021, _lcp.cb, fsmOutput);
+  PPPFSM_init(&_ipcp, "server IPCP", 0x8021, _ipcp.cb, fsmOutput);
+  _txQueue.clear();
+  _dataLeft = 0;
+}
+
+//
+// Link and GRE
+//
+
+// Everything the client puts on the wire, GRE to us goes over the link
+void PptpServer::clientPacket(const uint8_t *packet, size_t len) {
+  if (len < PvIp4::size || PV_get<PvIp4::protocol>(packet) != IP_PROTO_GRE ||
+      memcmp(packet + PvIp4::dest::offset, &_ip, 4) != 0) {
+    return;
+  }
+  linkSend(_up, packet, len, false);
+}
+
+// An IPv4 frame inside a GRE packet, for the loss counts
+static bool greCarriesData(const uint8_t *packet, size_t len) {
+  const uint8_t *gre = packet + PV_ip4HeaderLength(packet);
+  int hl = PvGre::size + ((gre[0] & 0x10) ? 4 : 0) + ((gre[1] & 0x80) ? 4 : 0);
+  const uint8_t *ppp = gre + hl;
+  int pppLength = PV_get<PvGre::payloadLength>(gre);
+
+  if (!(gre[0] & 0x10) || pppLength < 2) {
+    return false;
+  }
+  if (ppp[0] == 0xff && ppp[1] == 0x03) {
+    ppp += 2;
+  }
+  return ppp[0] == 0x21 || (ppp[0] == 0x00 && ppp[1] == 0x21);
+}
+
+void PptpServer::linkSend(Link &link, const uint8_t *packet, size_t len, bool toClient) {
+  uint32_t index = link.count++;
+  uint64_t now = host_nowUs();
+
+  link.stats->packets++;
+  if (link.config.drop.count(index) != 0 ||
+      (link.config.lossPpm != 0 && _random() % 1000000 < link.config.lossPpm)) {
+    link.stats->dropped++;
+    if (greCarriesData(packet, len)) {
+      link.stats->dataDropped++;
+    }
+    return;
+  }
+
+  // Packets queue for the wire, then take the delay
+  uint64_t start = link.freeUs > now ? link.freeUs : now;
+  uint64_t wire = link.config.rateKbps != 0 ? (uint64_t)len * 8000 / link.config.rateKbps : 0;
+  link.freeUs = start + wire;
+  uint64_t arrive = link.freeUs + link.config.delayUs;
+
+  std::vector<uint8_t> copy(packet, packet + len);
+  host_schedule(arrive - now, [this, copy, toClient]() {
+    if (toClient) {
+      host_ipInput(copy.data(), copy.size());
+    } else {
+      greInput(copy.data(), copy.size());
+    }
+  });
+}
+
+void PptpServer::greInput(const uint8_t *packet, size_t len) {
+  const uint8_t *gre = packet + PV_ip4HeaderLength(packet);
+  const uint8_t *end = packet + len;
+  uint16_t flags = PV_get<PvGre::flags>(gre);
+  int hl = PvGre::size;
+
+  if (!_callActive || gre + PvGre::size > end) {
+    return;
+  }
+  if ((flags & 0x2007) != 0x2001 || PV_get<PvGre::protocol>(gre) != PPTPS_PROTOCOL) {
+    host_fatal("PptpServer: not enhanced GRE, flags 0x%04x", flags);
+  }
+  if (PV_get<PvGre::callId>(gre) != _callId) {
+    return;
+  }
+  memcpy(&_clientIp, packet + PvIp4::src::offset, 4);
+
+  uint32_t seq = 0;
+  if (flags & 0x1000) {
+    seq = PV_get<PvBe32>(gre + hl);
+    hl += 4;
+  }
+  if (flags & 0x0080) {
+    uint32_t ack = PV_get<PvBe32>(gre + hl);
+    hl += 4;
+    if ((int32_t)(ack - _peerAck) > 0 && (int32_t)(ack - _txSeq) < 0) {
+      _peerAck = ack;
+      _peerAckUs = host_nowUs();
+    }
+  }
+  int length = PV_get<PvGre::payloadLength>(gre);
+  if (gre + hl + length > end) {
+    host_fatal("PptpServer: GRE payload of %d bytes cut short", length);
+  }
+
+  if (flags & 0x1000) {
+    if (!_rxStarted || (int32_t)(seq - _rxSeq) > 0) {
+      _rxSeq = seq;
+    }
+    if (!_rxStarted) {
+      _rxAcked = seq - 1;
+    }
+    _rxStarted = true;
+    greArmAck();
+
+    // Passive LCP, started by the first frame of the client
+    if (_lcp.state == PPPFSM_INITIAL) {
+      PPPFSM_lowerUp(&_lcp);
+      PPPFSM_open(&_lcp);
+    }
+    std::vector<uint8_t> frame(gre + hl, gre + hl + length);
+    pppInput(frame.data(), length);
+  }
+  greFlush();
+}
+
+// A frame with the next sequence number, or a bare ack without one
+void PptpServer::greOutput(const uint8_t *frame, int length) {
+  uint8_t packet[PvIp4::size + PvGre::size + 8 + PPTPS_FRAME_MAX];
+  uint8_t *gre = packet + PvIp4::size;
+  int hl = PvGre::size;
+  uint16_t flags = 0x2001;
+
+  if (length > PPTPS_FRAME_MAX) {
+    host_fatal("PptpServer: frame of %d bytes", length);
+  }
+  if (frame != nullptr) {
+    flags |= 0x1000;
+    PV_set<PvBe32>(gre + hl, _txSeq++);
+    hl += 4;
+  }
+  if (_rxStarted) {
+    flags |= 0x0080;
+    PV_set<PvBe32>(gre + hl, _rxSeq);
+    hl += 4;
+    _rxAcked = _rxSeq;
+  }
+  PV_set<PvGre::flags>(gre, flags);
+  PV_set<PvGre::protocol>(gre, PPTPS_PROTOCOL);
+  PV_set<PvGre::payloadLength>(gre, frame != nullptr ? length : 0);
+  PV_set<PvGre::callId>(gre, _peerCallId);
+  if (frame != nullptr) {
+    memcpy(gre + hl, frame, length);
+  } else {
+    length = 0;
+  }
+
+  int total = PvIp4::size + hl + length;
+  memset(packet, 0, PvIp4::size);
+  PV_set<PvIp4::versionIhl>(packet, 0x45);
+  PV_set<PvIp4::totalLength>(packet, total);
+  PV_set<PvIp4::id>(packet, _ipId++);
+  PV_set<PvIp4::ttl>(packet, 64);
+  PV_set<PvIp4::protocol>(packet, IP_PROTO_GRE);
+  memcpy(packet + PvIp4::src::offset, &_ip, 4);
+  memcpy(packet + PvIp4::dest::offset, &_clientIp, 4);
+  uint16_t sum = inet_chksum(packet, PvIp4::size);
+  memcpy(packet + PvIp4::checksum::offset, &sum, 2);
+
+  linkSend(_down, packet, total, true);
+}
+
+// Sends what the window of the client takes, queued frames first
+void PptpServer::greFlush() {
+  if (!_callActive || _clientIp == 0) {
+    return;
+  }
+  while (_txSeq - _peerAck - 1 < _peerWindow) {
+    if (_txQueue.empty()) {
+      if (_dataLeft == 0 || !ipcpOpened()) {
+        break;
+      }
+      // A UDP datagram to the discard port of the client
+      std::vector<uint8_t> frame(4 + _dataSize);
+      uint8_t *ip = frame.data() + 4;
+      memcpy(frame.data(), "\xff\x03\x00\x21", 4);
+      PV_set<PvIp4::versionIhl>(ip, 0x45);
+      PV_set<PvIp4::totalLength>(ip, _dataSize);
+      PV_set<PvIp4::id>(ip, _stats.txData);
+      PV_set<PvIp4::ttl>(ip, 64);
+      PV_set<PvIp4::protocol>(ip, IP_PROTO_UDP);
+      memcpy(ip + PvIp4::src::offset, &_address, 4);
+      memcpy(ip + PvIp4::dest::offset, &_peerAddress, 4);
+      uint16_t sum = inet_chksum(ip, PvIp4::size);
+      memcpy(ip + PvIp4::checksum::offset, &sum, 2);
+      PV_set<PvBe16>(ip + 20, 9);
+      PV_set<PvBe16>(ip + 22, 9);
+      PV_set<PvBe16>(ip + 24, _dataSize - 20);
+      _txQueue.push_back(frame);
+      _dataLeft--;
+      _stats.txData++;
+    }
+    greOutput(_txQueue.front().data(), _txQueue.front().size());
+    _txQueue.pop_front();
+  }
+  if (!_txQueue.empty() || (_dataLeft != 0 && ipcpOpened())) {
+    greArmStall();
+  }
+}
+
+void PptpServer::greArmAck() {
+  if (_ackArmed) {
+    return;
+  }
+  _ackArmed = true;
+  uint32_t generation = _generation;
+  host_schedule(_callConfig.ackDelayUs, [this, generation]() {
+    if (generation != _generation) {
+      return;
+    }
+    _ackArmed = false;
+    if (_callActive && _rxSeq != _rxAcked) {
+      greOutput(nullptr, 0);
+    }
+  });
+}
+
+// The window opens again when the client stops acking, as GRE.cpp does
+void PptpServer::greArmStall() {
+  if (_stallArmed) {
+    return;
+  }
+  _stallArmed = true;
+  uint32_t generation = _generation;
+  host_schedule(PPTPS_WINDOW_STALL_US, [this, generation]() {
+    if (generation != _generation) {
+      return;
+    }
+    _stallArmed = false;
+    if (host_nowUs() - _peerAckUs >= PPTPS_WINDOW_STALL_US && _txSeq - _peerAck - 1 >= _peerWindow) {
+      _stats.windowStalls++;
+      _peerAck = _txSeq - 1;
+      _peerAckUs = host_nowUs();
+    }
+    greFlush();
+  });
+}
+
+//
+// PPP
+//
+
+void PptpServer::pppQueue(const uint8_t *frame, int length) {
+  _txQueue.push_back(std::vector<uint8_t>(frame, frame + length));
+  greFlush();
+}
+
+void PptpServer::pppSend(uint16_t protocol, uint8_t code, uint8_t id, const uint8_t *data, int length) {
+  std::vector<uint8_t> frame(PvPpp::size + PvPppCp::size + length);
+  uint8_t *cp = frame.data() + PvPpp::size;
+
+  PV_set<PvPpp::address>(frame.data(), 0xff);
+  PV_set<PvPpp::control>(frame.data(), 0x03);
+  PV_set<PvPpp::protocol>(frame.data(), protocol);
+  PV_set<PvPppCp::code>(cp, code);
+  PV_set<PvPppCp::identifier>(cp, id);
+  PV_set<PvPppCp::length>(cp, PvPppCp::size + length);
+  if (length > 0) {
+    memcpy(cp + PvPppCp::size, data, length);
+  }
+  pppQueue(frame.data(), frame.size());
+}
+
+void PptpServer::pppInput(uint8_t *frame, int length) {
+  int off = 0;
+  uint16_t protocol;
+
+  if (length >= 2 && frame[0] == 0xff && frame[1] == 0x03) {
+    off = 2;
+  }
+  if (length < off + 1) {
+    return;
+  }
+  protocol = frame[off++];
+  if (!(protocol & 1)) {
+    if (length < off + 1) {
+      return;
+    }
+    protocol = (protocol << 8) | frame[off++];
+  }
+  uint8_t *data = frame + off;
+  length -= off;
+
+  // The client only sends IPv4 once IPCP is up, VJ frames are IPv4 too
+  if (protocol == 0x0021 || protocol == 0x002d || protocol == 0x002f) {
+    if (_ipcp.state != PPPFSM_OPENED) {
+      host_fatal("PptpServer: IPv4 frame before IPCP is open");
+    }
+    _stats.rxData++;
+    _stats.rxDataBytes += length;
+    return;
+  }
+  if (length < (int)PvPppCp::size) {
+    return;
+  }
+
+  switch (protocol) {
+    case 0xc021:
+      PPPFSM_input(&_lcp, data, length);
+      return;
+    case 0x8021:
+      if (_ipcp.state != PPPFSM_INITIAL) {
+        PPPFSM_input(&_ipcp, data, length);
+      }
+      return;
+    case 0xc023:
+      papInput(data, length);
+      return;
+    case 0xc223:
+      chapInput(data, length);
+      return;
+    case 0xc029:
+      cbcpInput(data, length);
+      return;
+  }
+
+  // CCP and the rest, rejected with the start of the packet
+  if (_lcp.state == PPPFSM_OPENED) {
+    uint8_t reject[2 + 64];
+    int n = length < 64 ? length : 64;
+    PV_set<PvBe16>(reject, protocol);
+    memcpy(reject + 2, data, n);
+    _stats.protocolRejects++;
+    pppSend(0xc021, 0x08, ++_lcp.id, reject, 2 + n);
+  }
+}
+
+void PptpServer::authResult(bool ok) {
+  if (!ok) {
+    _stats.authFail++;
+    PPPFSM_close(&_lcp);
+    return;
+  }
+  if (_authenticated) {
+    return;
+  }
+  _authenticated = true;
+  _stats.authOk++;
+  if (_peerCallback) {
+    cbcpRequest();
+  } else {
+    network();
+  }
+}
+
+void PptpServer::papInput(const uint8_t *data, int length) {
+  const uint8_t *p = data + PvPppCp::size;
+  const uint8_t *end = data + length;
+  uint8_t id = PV_get<PvPppCp::identifier>(data);
+
+  if (PV_get<PvPppCp::code>(data) != 1 || _callConfig.auth != PPTPS_AUTH_PAP || _lcp.state != PPPFSM_OPENED) {
+    return;
+  }
+  if (p >= end || p + 1 + p[0] >= end || p + 1 + p[0] + 1 + p[1 + p[0]] > end) {
+    host_fatal("PptpServer: malformed PAP Authenticate-Request");
+  }
+  std::string user((const char *)p + 1, p[0]);
+  p += 1 + p[0];
+  std::string password((const char *)p + 1, p[0]);
+
+  bool ok = user == _callConfig.user && password == _callConfig.password;
+  uint8_t message = 0;
+  pppSend(0xc023, ok ? 2 : 3, id, &message, 1);
+  authResult(ok);
+}
+
+void PptpServer::chapChallenge(bool repeat) {
+  uint8_t value[1 + 16 + sizeof(_serverName)];
+
+  if (_authenticated) {
+    return;
+  }
+  if (!repeat) {
+    _chapId++;
+    _chapChallengeSize = _callConfig.auth == PPTPS_AUTH_MSCHAP1 ? 8 : 16;
+    for (int i = 0; i < _chapChallengeSize; i++) {
+      _chapChallenge[i] = _random();
+    }
+  }
+  value[0] = _chapChallengeSize;
+  memcpy(value + 1, _chapChallenge, _chapChallengeSize);
+  memcpy(value + 1 + _chapChallengeSize, _serverName, strlen(_serverName));
+  _stats.challenges++;
+  pppSend(0xc223, 1, _chapId, value, 1 + _chapChallengeSize + strlen(_serverName));
+  later(PPTPS_RESTART_US, &PptpServer::restart);
+}
+
+bool PptpServer::chapCheck(const uint8_t *value, int valueSize, const std::string &name) {
+  char user[256];
+  char password[256];
+  uint8_t challenge[16] = { 0 };
+  uint8_t peerChallenge[16] = { 0 };
+  uint8_t nt[24];
+
+  if (name != _callConfig.user) {
+    return false;
+  }
+  snprintf(user, sizeof(user), "%s", _callConfig.user.c_str());
+  snprintf(password, sizeof(password), "%s", _callConfig.password.c_str());
+  memcpy(challenge, _chapChallenge, _chapChallengeSize);
+
+  switch (_callConfig.auth) {
+    case PPTPS_AUTH_CHAP_MD5: {
+      // RFC 1994 section 4.1: MD5 of identifier, secret and challenge
+      md5_context_t ctx;
+      uint8_t digest[16];
+      MD5Init(&ctx);
+      MD5Update(&ctx, &_chapId, 1);
+      MD5Update(&ctx, (const uint8_t *)password, strlen(password));
+      MD5Update(&ctx, _chapChallenge, _chapChallengeSize);
+      MD5Final(digest, &ctx);
+      return valueSize == 16 && memcmp(value, digest, 16) == 0;
+    }
+
+    case PPTPS_AUTH_MSCHAP1:
+      // RFC 2433 section 3: LM response, NT response, use-NT flag
+      if (valueSize != 49 || value[48] != 1) {
+        return false;
+      }
+      GenerateNTResponse(challenge, peerChallenge, user, password, nt, 1);
+      return memcmp(value + 24, nt, 24) == 0;
+
+    case PPTPS_AUTH_MSCHAP2: {
+      // RFC 2759 section 4: peer challenge, 8 reserved, NT response, flags
+      static const uint8_t zero[8] = { 0 };
+      if (valueSize != 49 || memcmp(value + 16, zero, 8) != 0 || value[48] != 0) {
+        return false;
+      }
+      memcpy(peerChallenge, value, 16);
+      GenerateNTResponse(challenge, peerChallenge, user, password, nt, 2);
+      return memcmp(value + 24, nt, 24) == 0;
+    }
+  }
+  return false;
+}
+
+void PptpServer::chapInput(const uint8_t *data, int length) {
+  uint8_t id = PV_get<PvPppCp::identifier>(data);
+  int valueSize;
+
+  if (PV_get<PvPppCp::code>(data) != 2 || _chapChallengeSize == 0 || id != _chapId) {
+    return;
+  }
+  valueSize = length > (int)PvChap::value ? PV_get<PvChap::valueSize>(data) : 0;
+  if (valueSize == 0 || (int)PvChap::value + valueSize > length) {
+    host_fatal("PptpServer: malformed CHAP Response");
+  }
+  const uint8_t *value = data + PvChap::value;
+  std::string name((const char *)value + valueSize, length - PvChap::value - valueSize);
+  bool ok = chapCheck(value, valueSize, name);
+
+  std::string message;
+  if (ok && _callConfig.auth == PPTPS_AUTH_MSCHAP2) {
+    // RFC 2759 section 5: the authenticator response proves the server
+    // knows the password too
+    uint8_t response[43];
+    uint8_t challenge[16];
+    uint8_t peerChallenge[16];
+    uint8_t nt[24];
+    char user[256];
+    char password[256];
+    snprintf(user, sizeof(user), "%s", _callConfig.user.c_str());
+    snprintf(password, sizeof(password), "%s", _callConfig.password.c_str());
+    memcpy(challenge, _chapChallenge, 16);
+    memcpy(peerChallenge, value, 16);
+    memcpy(nt, value + 24, 24);
+    GenerateAuthenticatorResponse(password, nt, peerChallenge, challenge, user, response);
+    message = std::string((const char *)response, 42) + " M=Welcome";
+  } else if (ok) {
+    message = "Welcome";
+  } else if (_callConfig.auth == PPTPS_AUTH_CHAP_MD5) {
+    message = "Access denied";
+  } else {
+    message = "E=691 R=0 V=3";
+  }
+  pppSend(0xc223, ok ? 3 : 4, id, (const uint8_t *)message.data(), message.size());
+  authResult(ok);
+}
+
+// Callback Control Protocol (draft-ietf-pppext-callback-cp-02), only ever
+// "no callback"
+void PptpServer::cbcpRequest() {
+  static const uint8_t noCallback[2] = { 0x01, 0x02 };
+
+  if (_cbcpDone) {
+    return;
+  }
+  _stats.cbcpRequests++;
+  pppSend(0xc029, 1, _cbcpId, noCallback, sizeof(noCallback));
+  later(PPTPS_RESTART_US, &PptpServer::restart);
+}
+
+void PptpServer::cbcpInput(const uint8_t *data, int length) {
+  uint8_t id = PV_get<PvPppCp::identifier>(data);
+
+  if (PV_get<PvPppCp::code>(data) != 2 || !_authenticated || !_peerCallback || id != _cbcpId) {
+    return;
+  }
+  pppSend(0xc029, 3, id, data + PvPppCp::size, length - PvPppCp::size);
+  if (!_cbcpDone) {
+    _cbcpDone = true;
+    network();
+  }
+}
+
+// Repeats what the client did not answer
+void PptpServer::restart() {
+  if (_lcp.state != PPPFSM_OPENED) {
+    return;
+  }
+  if (!_authenticated && _chapChallengeSize != 0) {
+    chapChallenge(true);
+  } else if (_authenticated && _peerCallback && !_cbcpDone) {
+    cbcpRequest();
+  }
+}
+
+void PptpServer::network() {
+  PPPFSM_lowerUp(&_ipcp);
+  PPPFSM_open(&_ipcp);
+}
+
+int PptpServer::fsmOutput(struct PppFsm *f, uint8_t *frame, int length) {
+  PptpServer *s = (PptpServer *)f->arg;
+
+  s->pppQueue(frame, length);
+  return length;
+}
+
+int PptpServer::lcpBuildOptions(struct PppFsm *f, uint8_t *buf, int size) {
+  PptpServer *s = (PptpServer *)f->arg;
+  int n = 0;
+
+  buf[n++] = 0x05;
+  buf[n++] = 6;
+  PV_set<PvBe32>(&buf[n], s->_magic);
+  n += 4;
+  if (s->_callConfig.auth == PPTPS_AUTH_PAP) {
+    memcpy(&buf[n], "\x03\x04\xc0\x23", 4);
+    n += 4;
+  } else if (s->_callConfig.auth != PPTPS_AUTH_NONE) {
+    memcpy(&buf[n], "\x03\x05\xc2\x23", 4);
+    buf[n + 4] = _chapAlgorithm[s->_callConfig.auth];
+    n += 5;
+  }
+  if (s->_wantPfc) {
+    buf[n++] = 0x07;
+    buf[n++] = 2;
+  }
+  if (s->_wantAcfc) {
+    buf[n++] = 0x08;
+    buf[n++] = 2;
+  }
+  return n;
+}
+
+uint8_t PptpServer::lcpCheckOptions(struct PppFsm *f, uint8_t *options, int *length) {
+  PptpServer *s = (PptpServer *)f->arg;
+  uint8_t rej[PPPFSM_OPTIONS_MAX];
+  int rejLength = 0;
+  bool callback = false;
+
+  for (int off = 0; off + 2 <= *length; ) {
+    uint8_t *p = options + off;
+    uint8_t type = p[0];
+    uint8_t len = p[1];
+    if (len < 2 || off + len > *length) {
+      host_fatal("PptpServer: malformed LCP option %d", type);
+    }
+    bool ok = (type == 0x01 && len == 4) || (type == 0x05 && len == 6) ||
+              (type == 0x07 && len == 2) || (type == 0x08 && len == 2);
+    if (type == 0x0d && s->_callConfig.callback) {
+      ok = true;
+      callback = true;
+    }
+    if (!ok) {
+      memcpy(rej + rejLength, p, len);
+      rejLength += len;
+    }
+    off += len;
+  }
+
+  if (rejLength > 0) {
+    memcpy(options, rej, rejLength);
+    *length = rejLength;
+    return PPP_CONFREJ;
+  }
+  s->_peerCallback = callback;
+  return PPP_CONFACK;
+}
+
+void PptpServer::lcpRejectOptions(struct PppFsm *f, uint8_t *options, int length) {
+  PptpServer *s = (PptpServer *)f->arg;
+
+  for (int off = 0; off + 2 <= length && options[off + 1] >= 2; off += options[off + 1]) {
+    if (options[off] == 0x03) {
+      host_fatal("PptpServer: client refused authentication");
+    } else if (options[off] == 0x07) {
+      s->_wantPfc = false;
+    } else if (options[off] == 0x08) {
+      s->_wantAcfc = false;
+    }
+  }
+}
+
+bool PptpServer::lcpExtCode(struct PppFsm *f, uint8_t code, uint8_t id, uint8_t *data, int length) {
+  PptpServer *s = (PptpServer *)f->arg;
+
+  switch (code) {
+    case 0x08:  // Protocol-Reject
+    case 0x0a:  // Echo-Reply
+    case 0x0b:  // Discard-Request
+      return true;
+    case 0x09:  // Echo-Request
+      if (f->state == PPPFSM_OPENED && length >= 4) {
+        std::vector<uint8_t> reply(data, data + length);
+        PV_set<PvBe32>(reply.data(), s->_magic);
+        s->_stats.lcpEchoes++;
+        s->pppSend(0xc021, 0x0a, id, reply.data(), length);
+      }
+      return true;
+  }
+  return false;
+}
+
+void PptpServer::lcpUp(struct PppFsm *f) {
+  PptpServer *s = (PptpServer *)f->arg;
+
+  switch (s->_callConfig.auth) {
+    case PPTPS_AUTH_NONE:
+      s->authResult(true);
+      break;
+    case PPTPS_AUTH_PAP:
+      break;
+    default:
+      s->chapChallenge(false);
+      break;
+  }
+}
+
+void PptpServer::lcpDown(struct PppFsm *f) {
+  PptpServer *s = (PptpServer *)f->arg;
+
+  PPPFSM_lowerDown(&s->_ipcp);
+  s->_authenticated = false;
+  s->_cbcpDone = false;
+  s->_chapChallengeSize = 0;
+}
+
+int PptpServer::ipcpBuildOptions(struct PppFsm *f, uint8_t *buf, int size) {
+  PptpServer *s = (PptpServer *)f->arg;
+
+  buf[0] = 0x03;
+  buf[1] = 6;
+  memcpy(&buf[2], &s->_address, 4);
+  return 6;
+}
+
+uint8_t PptpServer::ipcpCheckOptions(struct PppFsm *f, uint8_t *options, int *length) {
+  PptpServer *s = (PptpServer *)f->arg;
+  uint8_t nak[PPPFSM_OPTIONS_MAX];
+  uint8_t rej[PPPFSM_OPTIONS_MAX];
+  int nakLength = 0;
+  int rejLength = 0;
+
+  for (int off = 0; off + 2 <= *length; ) {
+    uint8_t *p = options + off;
+    uint8_t len = p[1];
+    if (len < 2 || off + len > *length) {
+      host_fatal("PptpServer: malformed IPCP option %d", p[0]);
+    }
+    if (p[0] == 0x03 && len == 6) {
+      // Whatever the client asks for, it gets the configured address
+      if (memcmp(p + 2, &s->_peerAddress, 4) != 0) {
+        nak[nakLength] = 0x03;
+        nak[nakLength + 1] = 6;
+        memcpy(&nak[nakLength + 2], &s->_peerAddress, 4);
+        nakLength += 6;
+      }
+    } else if (!(p[0] == 0x02 && len == PvIpcpVj::size && PV_get<PvIpcpVj::protocol>(p) == 0x002d &&
+                 s->_callConfig.vj)) {
+      memcpy(rej + rejLength, p, len);
+      rejLength += len;
+    }
+    off += len;
+  }
+
+  if (rejLength > 0) {
+    memcpy(options, rej, rejLength);
+    *length = rejLength;
+    return PPP_CONFREJ;
+  }
+  if (nakLength > 0) {
+    memcpy(options, nak, nakLength);
+    *length = nakLength;
+    return PPP_CONFNAK;
+  }
+  return PPP_CONFACK;
+}
@@ -0,0 +1,204 @@
+#ifndef PPTP_SERVER_H
+#define PPTP_SERVER_H
+
+// Stand-in for the far end of a PPTP tunnel, for host tests of
+// PPTP_Client.cpp. It answers calls on the in-memory TCP of the shim and
+// speaks enhanced GRE through the raw PCB path, over a link of set delay,
+// rate and loss each way.
+//
+// LCP and IPCP run on PPP_Fsm.cpp as the client's do. Authentication is
+// PAP, CHAP-MD5, MS-CHAPv1 or MS-CHAPv2, optionally followed by CBCP with
+// "no callback". CCP and anything else is Protocol-Rejected, so MPPE and
+// Deflate stay off. LCP is passive: the server waits for the first frame of
+// the client before it sends its own request.
+
+#include "HostShim.h"
+#include "PPP_Fsm.h"
+#include <deque>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#define PPTPS_AUTH_NONE       0
+#define PPTPS_AUTH_PAP        1
+#define PPTPS_AUTH_CHAP_MD5   2
+#define PPTPS_AUTH_MSCHAP1    3
+#define PPTPS_AUTH_MSCHAP2    4
+
+// A challenge or CBCP request is repeated after this long without answer,
+// and the send window opens again after this long without an ack
+#define PPTPS_RESTART_US      1000000
+#define PPTPS_WINDOW_STALL_US 1000000
+
+// Largest PPP frame carried
+#define PPTPS_FRAME_MAX       1600
+
+// One direction of the link
+struct PptpLinkConfig {
+  uint32_t delayUs;
+  uint32_t rateKbps;          // 0 for no limit
+  uint32_t lossPpm;           // random loss, parts per million
+  std::set<uint32_t> drop;    // GRE packets to lose, counted from 0 per call
+};
+
+struct PptpLinkStats {
+  uint32_t packets;           // handed to the link
+  uint32_t dropped;
+  uint32_t dataDropped;       // of those, IPv4 frames
+};
+
+struct PptpServerConfig {
+  std::string user;
+  std::string password;
+  int auth;
+  bool callback;              // ack the Callback option and run CBCP
+  bool vj;                    // ack VJ compression asked for by the client
+  std::string address;        // PPP address of the server
+  std::string peerAddress;    // handed to the client
+  uint16_t recvWindow;
+  uint32_t ackDelayUs;
+  PptpLinkConfig up;          // client to server
+  PptpLinkConfig down;        // server to client
+};
+
+struct PptpServerStats {
+  uint32_t calls;
+  uint32_t authOk;
+  uint32_t authFail;
+  uint32_t challenges;        // CHAP challenges sent, repeats included
+  uint32_t cbcpRequests;
+  uint32_t lcpEchoes;
+  uint32_t controlEchoes;
+  uint32_t protocolRejects;
+  uint32_t rxData;            // IPv4 frames from the client
+  uint64_t rxDataBytes;
+  uint32_t txData;            // IPv4 frames to the client
+  uint32_t windowStalls;
+  PptpLinkStats up;
+  PptpLinkStats down;
+};
+
+class PptpServer : public HostTcpPeer {
+ public:
+  // 'ip' is the address the client dials
+  explicit PptpServer(const char *ip);
+
+  // Takes effect with the next call, the link settings right away
+  void configure(const PptpServerConfig &config);
+  void setLink(const PptpLinkConfig &up, const PptpLinkConfig &down);
+  const PptpServerConfig &config() const { return _config; }
+
+  // Queues 'count' UDP datagrams of 'size' bytes to the client, sent as the
+  // window of the client allows once IPCP is open
+  void sendData(uint32_t count, int size);
+  uint32_t dataPending() const { return _dataLeft; }
+  bool ipcpOpened() const { return _ipcp.state == PPPFSM_OPENED; }
+  bool authenticated() const { return _authenticated; }
+
+  PptpServerStats &stats() { return _stats; }
+
+  // HostTcpPeer
+  void connected(AsyncClient *client) override;
+  void received(AsyncClient *client, const uint8_t *data, size_t len) override;
+  void disconnected(AsyncClient *client) override;
+
+ private:
+  struct Link {
+    PptpLinkConfig config;
+    PptpLinkStats *stats;
+    uint32_t count;           // GRE packets of this call
+    uint64_t freeUs;          // the last packet is on the wire until then
+  };
+
+  // Control connection
+  void controlDispatch(const uint8_t *msg, int length);
+  void controlHeader(uint8_t *msg, int length, uint16_t type);
+  void controlSend(const uint8_t *msg, int length);
+  void callStart(uint16_t peerCallId, uint16_t peerWindow);
+  void callStop();
+
+  // Link and GRE
+  void clientPacket(const uint8_t *packet, size_t len);
+  void linkSend(Link &link, const uint8_t *packet, size_t len, bool toClient);
+  void greInput(const uint8_t *packet, size_t len);
+  void greOutput(const uint8_t *frame, int length);
+  void greFlush();
+  void greArmAck();
+  void greArmStall();
+
+  // PPP
+  void pppInput(uint8_t *frame, int length);
+  void pppQueue(const uint8_t *frame, int length);
+  void pppSend(uint16_t protocol, uint8_t code, uint8_t id, const uint8_t *data, int length);
+  void papInput(const uint8_t *data, int length);
+  void chapInput(const uint8_t *data, int length);
+  void chapChallenge(bool repeat);
+  bool chapCheck(const uint8_t *value, int valueSize, const std::string &name);
+  void cbcpInput(const uint8_t *data, int length);
+  void cbcpRequest();
+  void authResult(bool ok);
+  void network();
+  void later(uint32_t us, void (PptpServer::*fn)());
+  void restart();
+
+  static int fsmOutput(struct PppFsm *f, uint8_t *frame, int length);
+  static int lcpBuildOptions(struct PppFsm *f, uint8_t *buf, int size);
+  static uint8_t lcpCheckOptions(struct PppFsm *f, uint8_t *options, int *length);
+  static void lcpRejectOptions(struct PppFsm *f, uint8_t *options, int length);
+  static bool lcpExtCode(struct PppFsm *f, uint8_t code, uint8_t id, uint8_t *data, int length);
+  static void lcpUp(struct PppFsm *f);
+  static void lcpDown(struct PppFsm *f);
+  static int ipcpBuildOptions(struct PppFsm *f, uint8_t *buf, int size);
+  static uint8_t ipcpCheckOptions(struct PppFsm *f, uint8_t *options, int *length);
+
+  uint32_t _ip;
+  PptpServerConfig _config;
+  PptpServerConfig _callConfig;   // the configuration of the call up now
+  PptpServerStats _stats;
+  std::mt19937 _random;
+
+  AsyncClient *_client;
+  std::vector<uint8_t> _ctrlBuf;
+  uint16_t _nextCallId;
+
+  bool _callActive;
+  uint32_t _generation;           // stale timers of an old call do nothing
+  uint32_t _clientIp;             // WiFi address of the client, from its GRE
+  uint16_t _callId;               // carried by packets to us
+  uint16_t _peerCallId;           // carried by packets to the client
+  Link _up;
+  Link _down;
+
+  uint16_t _peerWindow;
+  uint32_t _txSeq;                // next one to send
+  uint32_t _peerAck;              // highest one the client acknowledged
+  uint64_t _peerAckUs;
+  bool _stallArmed;
+  std::deque<std::vector<uint8_t>> _txQueue;
+  bool _rxStarted;
+  uint32_t _rxSeq;                // highest one received
+  uint32_t _rxAcked;              // last one acknowledged
+  bool _ackArmed;
+  uint16_t _ipId;
+
+  struct PppFsm _lcp;
+  struct PppFsm _ipcp;
+  uint32_t _magic;
+  bool _wantPfc;
+  bool _wantAcfc;
+  bool _peerCallback;
+  bool _authenticated;
+  bool _cbcpDone;
+  uint8_t _chapId;
+  uint8_t _chapChallenge[16];
+  int _chapChallengeSize;
+  uint8_t _cbcpId;
+  uint32_t _address;
+  uint32_t _peerAddress;
+
+  uint32_t _dataLeft;
+  int _dataSize;
+};
+
+#endif
@@ -0,0 +1,389 @@
+// End-to-end tests of PPTP_Client.cpp against the stand-in server of
+// PptpServer.cpp: connects with each login method, prints how long every
+// phase of the connect took, then measures the tunnel throughput each way
+// over links of set delay and loss. Times are virtual, the wall clock only
+// shows what the host spent.
+//
+//   pptp_test [-v] [-n packets]
+//
+// -v prints the debug messages of the client, -n sets the datagrams per
+// throughput run. Exits 1 when a check fails.
+
+#include "HostShim.h"
+#include "PptpServer.h"
+#include "PPTP_Client.h"
+#include "ESP8266WiFi.h"
+#include "DebugMsg.h"
+#include <chrono>
+#include <stdarg.h>
+
+#define TEST_SERVER       "192.0.2.1"
+#define TEST_CLIENT       "192.0.2.100"
+#define TEST_PORT         1723
+#define TEST_CONNECT_MS   30000
+#define TEST_RATE_KBPS    20000
+
+extern struct netif pptpLwip_netif;
+
+// MSCHAP.cpp
+int GenerateNTResponse(uint8_t AuthenticatorChallenge[16], uint8_t PeerChallenge[16], char *UserName,
+                       char *Password, uint8_t Response[24], uint8_t mschapVersion);
+int GenerateAuthenticatorResponse(char *PasswordASCII, uint8_t NtResponse[24], uint8_t PeerChallenge[16],
+                                  uint8_t AuthenticatorChallenge[16], char *UserName, uint8_t *AuthenticatorResponse);
+
+static PptpServer *_server;
+static int _failures;
+
+// Datagrams that came out of the tunnel into the stack
+static uint32_t _stackPackets;
+static uint64_t _stackBytes;
+static uint64_t _stackLastUs;
+
+static void check(bool ok, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void check(bool ok, const char *format, ...) {
+  va_list ap;
+
+  if (ok) {
+    return;
+  }
+  _failures++;
+  printf("FAIL: ");
+  va_start(ap, format);
+  vprintf(format, ap);
+  va_end(ap);
+  printf("\n");
+}
+
+static const char *authName(int auth) {
+  static const char *names[] = { "none", "pap", "chap-md5", "mschap1", "mschap2" };
+  return names[auth];
+}
+
+static PptpLinkConfig link(uint32_t delayMs, uint32_t lossPpm) {
+  PptpLinkConfig l;
+
+  l.delayUs = delayMs * 1000;
+  l.rateKbps = TEST_RATE_KBPS;
+  l.lossPpm = lossPpm;
+  return l;
+}
+
+static PptpServerConfig serverConfig(int auth, uint32_t delayMs) {
+  PptpServerConfig c = _server->config();
+
+  c.user = "esp";
+  c.password = "tunnel-secret";
+  c.auth = auth;
+  c.callback = false;
+  c.vj = true;
+  c.up = link(delayMs, 0);
+  c.down = link(delayMs, 0);
+  return c;
+}
+
+static uint32_t ipOf(const std::string &s) {
+  IPAddress ip;
+
+  WiFi.hostByName(s.c_str(), ip);
+  return ip;
+}
+
+// Connects with the password given, the server checks against its own
+static bool connect(const PptpServerConfig &config, const char *password) {
+  _server->configure(config);
+  host_setTcpDelay(config.up.delayUs);
+  PPTPC_init(TEST_SERVER, TEST_PORT, config.user.c_str(), password);
+  PPTPC_connect();
+  host_runUntil([]() { return PPTPC_isConnected() || PPTPC_isFailed(); }, TEST_CONNECT_MS);
+  return PPTPC_isConnected();
+}
+
+static void disconnect() {
+  PPTPC_disconnect();
+  host_run(1000);
+}
+
+static void printTimingHeader() {
+  printf("%-24s", "connect, ms");
+  for (int i = 0; i < PPTPC_CT_PHASES; i++) {
+    printf(" %*s", i == PPTPC_CT_START_CONTROL ? 13 : 7, PPTPC_connectPhaseName(i));
+  }
+  printf(" %7s\n", "total");
+}
+
+// The phases of the last connect, returns the time of 'phase'
+static uint32_t printTiming(const char *name, int phase) {
+  struct PptpConnectTiming t;
+  uint32_t total = 0;
+
+  if (PPTPC_getConnectTimings(&t, 1) != 1) {
+    check(false, "%s: no connect timing", name);
+    return 0;
+  }
+  printf("%-24s", name);
+  for (int i = 0; i < PPTPC_CT_PHASES; i++) {
+    int width = i == PPTPC_CT_START_CONTROL ? 13 : 7;
+    if (i < t.phases) {
+      printf(" %*.1f", width, t.phaseUs[i] / 1000.0);
+      total += t.phaseUs[i];
+    } else {
+      printf(" %*s", width, "-");
+    }
+  }
+  printf(" %7.1f\n", total / 1000.0);
+  return phase < t.phases ? t.phaseUs[phase] : 0;
+}
+
+//
+// Handshake
+//
+
+static void testLogin(const char *name, const PptpServerConfig &config) {
+  uint32_t authOk = _server->stats().authOk;
+
+  bool ok = connect(config, config.password.c_str());
+  check(ok, "%s: not connected", name);
+  printTiming(name, 0);
+  if (ok) {
+    struct PptpConnectTiming t;
+    PPTPC_getConnectTimings(&t, 1);
+    check(t.phases == PPTPC_CT_PHASES, "%s: %d phases timed", name, t.phases);
+    check(localIP.addr == ipOf(config.peerAddress), "%s: local address not the one handed out", name);
+    check(remoteIP.addr == ipOf(config.address), "%s: remote address not the server's", name);
+    check(pptpLwip_netif.ip_addr.addr == localIP.addr, "%s: netif not readdressed", name);
+    check(_server->stats().authOk == authOk + 1, "%s: server saw no login", name);
+    check(_server->ipcpOpened(), "%s: server IPCP not open", name);
+    if (config.callback) {
+      check(t.phaseUs[PPTPC_CT_CBCP] > 0, "%s: no time in CBCP", name);
+    }
+  }
+  disconnect();
+}
+
+static void testWrongPassword(int auth) {
+  char name[32];
+  uint32_t authFail = _server->stats().authFail;
+
+  snprintf(name, sizeof(name), "%s wrong password", authName(auth));
+  bool ok = connect(serverConfig(auth, 5), "not-the-password");
+  printTiming(name, 0);
+  check(!ok && PPTPC_isFailed(), "%s: connected", name);
+  check(_server->stats().authFail == authFail + 1, "%s: server did not refuse the login", name);
+  disconnect();
+}
+
+// A lost LCP request costs one restart of the automaton
+static void testLostRequest(const char *name, bool up) {
+  PptpServerConfig config = serverConfig(PPTPS_AUTH_MSCHAP2, 5);
+
+  (up ? config.up : config.down).drop.insert(0);
+  bool ok = connect(config, config.password.c_str());
+  uint32_t lcpUs = printTiming(name, PPTPC_CT_LCP);
+  check(ok, "%s: not connected", name);
+  check(lcpUs >= PPPFSM_RESTART_MS * 1000, "%s: LCP took %u us, less than a restart", name, lcpUs);
+  check(_server->stats().up.dropped + _server->stats().down.dropped > 0, "%s: nothing dropped", name);
+  disconnect();
+}
+
+// RFC 2759 section 9.2, RFC 2433 appendix B.2: the algorithms the server
+// checks logins with, against the published values
+static void testMsChapVectors() {
+  uint8_t authChallenge[16] = { 0x5B, 0x5D, 0x7C, 0x7D, 0x7B, 0x3F, 0x2F, 0x3E,
+                                0x3C, 0x2C, 0x60, 0x21, 0x32, 0x26, 0x26, 0x28 };
+  uint8_t peerChallenge[16] = { 0x21, 0x40, 0x23, 0x24, 0x25, 0x5E, 0x26, 0x2A,
+                                0x28, 0x29, 0x5F, 0x2B, 0x3A, 0x33, 0x7C, 0x7E };
+  static const uint8_t ntResponse2[24] = { 0x82, 0x30, 0x9E, 0xCD, 0x8D, 0x70, 0x8B, 0x5E,
+                                           0xA0, 0x8F, 0xAA, 0x39, 0x81, 0xCD, 0x83, 0x54,
+                                           0x42, 0x33, 0x11, 0x4A, 0x3D, 0x85, 0xD6, 0xDF };
+  uint8_t challenge1[16] = { 0x10, 0x2D, 0xB5, 0xDF, 0x08, 0x5D, 0x30, 0x41 };
+  static const uint8_t ntResponse1[24] = { 0x4E, 0x9D, 0x3C, 0x8F, 0x9C, 0xFD, 0x38, 0x5D,
+                                           0x5B, 0xF4, 0xD3, 0x24, 0x67, 0x91, 0x95, 0x6C,
+                                           0xA4, 0xC3, 0x51, 0xAB, 0x40, 0x9A, 0x3D, 0x61 };
+  char user[] = "User";
+  char password[] = "clientPass";
+  char password1[] = "MyPw";
+  uint8_t nt[24];
+  uint8_t response[43];
+
+  GenerateNTResponse(authChallenge, peerChallenge, user, password, nt, 2);
+  check(memcmp(nt, ntResponse2, 24) == 0, "MS-CHAPv2 NT-Response of RFC 2759");
+  GenerateAuthenticatorResponse(password, nt, peerChallenge, authChallenge, user, response);
+  check(memcmp(response, "S=407A5589115FD0D6209F510FE9C04566932CDA56", 42) == 0,
+        "MS-CHAPv2 authenticator response of RFC 2759");
+  GenerateNTResponse(challenge1, peerChallenge, user, password1, nt, 1);
+  check(memcmp(nt, ntResponse1, 24) == 0, "MS-CHAPv1 NT response of RFC 2433");
+}
+
+//
+// Throughput
+//
+
+static void stackInput(struct netif *inp, const uint8_t *packet, size_t len) {
+  if (inp != &pptpLwip_netif) {
+    return;
+  }
+  _stackPackets++;
+  _stackBytes += len;
+  _stackLastUs = host_nowUs();
+}
+
+// A UDP datagram from the client to the discard port of the server side
+static void clientDatagram(uint8_t *ip, int size, uint16_t id) {
+  memset(ip, 0, size);
+  ip[0] = 0x45;
+  ip[2] = size >> 8;
+  ip[3] = size;
+  ip[4] = id >> 8;
+  ip[5] = id;
+  ip[8] = 64;
+  ip[9] = IP_PROTO_UDP;
+  memcpy(ip + 12, &localIP.addr, 4);
+  memcpy(ip + 16, &remoteIP.addr, 4);
+  uint16_t sum = inet_chksum(ip, 20);
+  memcpy(ip + 10, &sum, 2);
+  ip[21] = 9;
+  ip[23] = 9;
+  ip[24] = (size - 20) >> 8;
+  ip[25] = size - 20;
+}
+
+static void printRate(const char *name, const char *way, uint32_t sent, uint32_t got, uint32_t lost,
+                      uint64_t bytes, uint64_t us, double wallMs) {
+  printf("%-24s %-4s %6u %6u %6u %9.2f %9.0f %9.1f\n", name, way, sent, got, lost,
+         us != 0 ? bytes * 8.0 / us : 0.0, us / 1000.0, wallMs);
+}
+
+static void testThroughput(uint32_t delayMs, uint32_t lossPpm, uint32_t count) {
+  PptpServerConfig config = serverConfig(PPTPS_AUTH_MSCHAP2, delayMs);
+  char name[32];
+
+  snprintf(name, sizeof(name), "%u ms, %.1f%% loss", delayMs, lossPpm / 10000.0);
+  if (!connect(config, config.password.c_str())) {
+    check(false, "%s: not connected", name);
+    disconnect();
+    return;
+  }
+  _server->setLink(link(delayMs, lossPpm), link(delayMs, lossPpm));
+  int size = pptpLwip_netif.mtu;
+  PptpServerStats &ss = _server->stats();
+
+  // Client to server, as fast as the GRE window lets the datagrams out
+  uint32_t rxData = ss.rxData;
+  uint64_t rxBytes = ss.rxDataBytes;
+  uint32_t dropped = ss.up.dataDropped;
+  uint32_t txDropped = GRE_defaultSession->stats.txDropped;
+  std::vector<uint8_t> packet(size);
+  uint64_t start = host_nowUs();
+  auto wallStart = std::chrono::steady_clock::now();
+  uint32_t sent = 0;
+  while (sent < count && PPTPC_isConnected()) {
+    if (!host_runUntil([]() { return GRE_defaultSession->txQueueCount < GRE_TX_QUEUE_SIZE; }, 10000)) {
+      break;
+    }
+    clientDatagram(packet.data(), size, sent);
+    if (host_netifOutput(&pptpLwip_netif, packet.data(), size) != ERR_OK) {
+      break;
+    }
+    sent++;
+  }
+  uint32_t lost = ss.up.dataDropped - dropped + GRE_defaultSession->stats.txDropped - txDropped;
+  host_runUntil([&]() { return ss.rxData - rxData + lost >= sent; }, 10000);
+  uint64_t us = host_nowUs() - start;
+  double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wallStart).count();
+  uint32_t got = ss.rxData - rxData;
+  printRate(name, "up", sent, got, lost, ss.rxDataBytes - rxBytes, us, wallMs);
+  check(sent == count, "%s: sent %u of %u", name, sent, count);
+  check(got + lost == sent, "%s: up %u arrived, %u lost of %u", name, got, lost, sent);
+
+  // Server to client
+  uint32_t stackPackets = _stackPackets;
+  uint64_t stackBytes = _stackBytes;
+  uint32_t txData = ss.txData;
+  dropped = ss.down.dataDropped;
+  start = host_nowUs();
+  wallStart = std::chrono::steady_clock::now();
+  _server->sendData(count, size);
+  host_runUntil([&]() {
+    return _server->dataPending() == 0 && _stackPackets - stackPackets + ss.down.dataDropped - dropped >= count;
+  }, 60000);
+  // Late datagrams would show up here
+  uint64_t lastUs = _stackLastUs;
+  host_run(1000);
+  wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wallStart).count();
+  got = _stackPackets - stackPackets;
+  lost = ss.down.dataDropped - dropped;
+  sent = ss.txData - txData;
+  printRate(name, "down", sent, got, lost, _stackBytes - stackBytes, lastUs > start ? lastUs - start : 0, wallMs);
+  check(sent == count, "%s: server sent %u of %u", name, sent, count);
+  check(got + lost == sent, "%s: down %u arrived, %u lost of %u", name, got, lost, sent);
+  check(PPTPC_getRxRingStats()->drops == 0, "%s: RX ring dropped %u", name, PPTPC_getRxRingStats()->drops);
+
+  disconnect();
+}
+
+static void usage() {
+  fprintf(stderr, "usage: pptp_test [-v] [-n packets]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  uint32_t count = 2000;
+  bool verbose = false;
+
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    if (a == "-v") {
+      verbose = true;
+    } else if (a == "-n" && i + 1 < argc) {
+      count = atoi(argv[++i]);
+    } else {
+      usage();
+    }
+  }
+  if (count == 0) {
+    usage();
+  }
+
+  db_setLevel(verbose ? DB_DEBUG : 0);
+  host_setLocalIP(TEST_CLIENT);
+  _server = new PptpServer(TEST_SERVER);
+  host_setTcpListener([](IPAddress ip, uint16_t port) -> HostTcpPeer * {
+    return ip == IPAddress(ipOf(TEST_SERVER)) && port == TEST_PORT ? _server : nullptr;
+  });
+  host_setStackInput(stackInput);
+
+  testMsChapVectors();
+
+  printTimingHeader();
+  for (int auth = PPTPS_AUTH_PAP; auth <= PPTPS_AUTH_MSCHAP2; auth++) {
+    testLogin(authName(auth), serverConfig(auth, 5));
+  }
+  PptpServerConfig config = serverConfig(PPTPS_AUTH_MSCHAP2, 5);
+  config.callback = true;
+  testLogin("mschap2 callback", config);
+  config = serverConfig(PPTPS_AUTH_MSCHAP2, 50);
+  config.peerAddress = "10.0.0.77";
+  testLogin("mschap2 50 ms", config);
+  config = serverConfig(PPTPS_AUTH_PAP, 5);
+  config.vj = false;
+  testLogin("pap no vj", config);
+  testLostRequest("lost client LCP req", true);
+  testLostRequest("lost server LCP req", false);
+  for (int auth = PPTPS_AUTH_PAP; auth <= PPTPS_AUTH_MSCHAP2; auth++) {
+    testWrongPassword(auth);
+  }
+
+  printf("\n%-24s %-4s %6s %6s %6s %9s %9s %9s\n", "throughput", "way", "sent", "got", "lost",
+         "Mbit/s", "ms", "wall ms");
+  testThroughput(5, 0, count);
+  testThroughput(5, 10000, count);
+  testThroughput(50, 0, count);
+  testThroughput(50, 10000, count);
+  testThroughput(5, 50000, count);
+
+  host_run(5000);
+  check(host_livePbufs() == 0, "%d pbufs left", host_livePbufs());
+  printf("pptp_test: %s\n", _failures == 0 ? "ok" : "FAILED");
+  return _failures == 0 ? 0 : 1;
+}